@@ -0,0 +1,165 @@
+#include "Action.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+namespace {
+
+class CommandAction : public Action {
+public:
+    CommandAction(const CommandTemplate& command, uint32_t timeoutMs, CommandExecutor& executor,
+                  LatencyMetrics* metrics)
+        : m_command(command), m_timeoutMs(timeoutMs), m_executor(executor), m_metrics(metrics) {}
+
+    const char* Name() const override { return "command"; }
+
+    void Run(const CardActionEvent& event, EventArena& arena) override {
+        uint64_t start = LatencyNow();
+#ifdef _WIN32
+        int length = MultiByteToWideChar(CP_ACP, 0, event.reader, -1, NULL, 0);
+        wchar_t* readerName = arena.Allocate<wchar_t>(length > 0 ? length : 1);
+        readerName[0] = L'\0';
+        MultiByteToWideChar(CP_ACP, 0, event.reader, -1, readerName, length);
+#else
+        const CommandChar* readerName = event.reader;
+#endif
+
+        TemplateValues values;
+        values.responses = event.responses;
+        values.responseCount = event.responseCount;
+        values.variables = event.variables;
+        values.variableCount = event.variableCount;
+        values.atr.data = event.atr.data;
+        values.atr.length = event.atr.length;
+        values.reader = readerName;
+        values.timestamp = event.timestamp;
+        values.sequence = event.sequence;
+
+        size_t commandLength;
+        const CommandChar* commandLine = m_command.Expand(values, arena, commandLength);
+        if (m_metrics) {
+            m_metrics->Record(STAGE_EXPAND, start);
+        }
+        m_executor.Submit(commandLine, commandLength, m_timeoutMs);
+    }
+
+private:
+    CommandTemplate m_command;
+    uint32_t m_timeoutMs;
+    CommandExecutor& m_executor;
+    LatencyMetrics* m_metrics;
+};
+
+#ifdef _WIN32
+typedef HMODULE LibraryHandle;
+
+LibraryHandle OpenLibrary(const CommandString& path, std::string& error) {
+    // Resolve the plugin's own dependencies next to it rather than next to the exe
+    HMODULE module = LoadLibraryEx(path.c_str(), NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+    if (!module) {
+        char message[256] = "";
+        FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, GetLastError(),
+                       0, message, sizeof(message), NULL);
+        error = message;
+        while (!error.empty() && (error.back() == '\n' || error.back() == '\r' || error.back() == '.')) {
+            error.pop_back();
+        }
+    }
+    return module;
+}
+
+void* FindSymbol(LibraryHandle library, const char* name) {
+    return (void*)GetProcAddress(library, name);
+}
+
+void CloseLibrary(LibraryHandle library) {
+    FreeLibrary(library);
+}
+#else
+typedef void* LibraryHandle;
+
+LibraryHandle OpenLibrary(const CommandString& path, std::string& error) {
+    void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        const char* message = dlerror();
+        error = message ? message : "cannot load library";
+    }
+    return library;
+}
+
+void* FindSymbol(LibraryHandle library, const char* name) {
+    return dlsym(library, name);
+}
+
+void CloseLibrary(LibraryHandle library) {
+    dlclose(library);
+}
+#endif
+
+class PluginAction : public Action {
+public:
+    PluginAction(LibraryHandle library, const CardActionPlugin* plugin, void* instance)
+        : m_library(library), m_plugin(plugin), m_instance(instance) {}
+
+    ~PluginAction() override {
+        if (CARDACTION_HAS_FIELD(m_plugin, CardActionPlugin, destroy) && m_plugin->destroy) {
+            m_plugin->destroy(m_instance);
+        }
+        CloseLibrary(m_library);
+    }
+
+    const char* Name() const override {
+        bool named = CARDACTION_HAS_FIELD(m_plugin, CardActionPlugin, name) && m_plugin->name;
+        return named ? m_plugin->name : "plugin";
+    }
+
+    void Run(const CardActionEvent& event, EventArena&) override {
+        // A failing plugin only affects its own action
+        m_plugin->handleEvent(m_instance, &event);
+    }
+
+private:
+    LibraryHandle m_library;
+    const CardActionPlugin* m_plugin;
+    void* m_instance;
+};
+
+} // namespace
+
+std::unique_ptr<Action> CreateCommandAction(const CommandTemplate& command, uint32_t timeoutMs,
+                                            CommandExecutor& executor, LatencyMetrics* metrics) {
+    return std::unique_ptr<Action>(new CommandAction(command, timeoutMs, executor, metrics));
+}
+
+std::unique_ptr<Action> LoadPluginAction(const CommandString& path, const std::string& options,
+                                         std::string& error) {
+    LibraryHandle library = OpenLibrary(path, error);
+    if (!library) {
+        return std::unique_ptr<Action>();
+    }
+
+    CardActionGetPluginFn getPlugin = (CardActionGetPluginFn)FindSymbol(library, CARDACTION_PLUGIN_ENTRY);
+    const CardActionPlugin* plugin = getPlugin ? getPlugin(CARDACTION_PLUGIN_API_VERSION) : NULL;
+    if (!getPlugin) {
+        error = "library does not export " CARDACTION_PLUGIN_ENTRY;
+    } else if (!plugin || plugin->apiVersion != CARDACTION_PLUGIN_API_VERSION) {
+        error = "plugin does not support API version " + std::to_string(CARDACTION_PLUGIN_API_VERSION);
+    } else if (!CARDACTION_HAS_FIELD(plugin, CardActionPlugin, handleEvent) || !plugin->handleEvent) {
+        error = "plugin has no event handler";
+    } else {
+        void* instance = NULL;
+        int result = CARDACTION_HAS_FIELD(plugin, CardActionPlugin, create) && plugin->create ?
+                     plugin->create(options.c_str(), &instance) : 0;
+        if (result == 0) {
+            return std::unique_ptr<Action>(new PluginAction(library, plugin, instance));
+        }
+        error = "plugin initialization failed with code " + std::to_string(result);
+    }
+
+    CloseLibrary(library);
+    return std::unique_ptr<Action>();
+}
@@ -0,0 +1,38 @@
+#ifndef ACTION_H
+#define ACTION_H
+
+#include <memory>
+#include <string>
+#include "CardActionPlugin.h"
+#include "CommandExecutor.h"
+#include "CommandTemplate.h"
+#include "EventArena.h"
+#include "LatencyMetrics.h"
+
+// Something run for a card event: an external command or an in-process
+// plugin. Actions are created at startup and shared by the worker threads,
+// so Run may be called concurrently for different readers.
+class Action {
+public:
+    virtual ~Action() {}
+
+    virtual const char* Name() const = 0;
+
+    // arena is the calling worker's scratch memory, released after the event
+    virtual void Run(const CardActionEvent& event, EventArena& arena) = 0;
+};
+
+// Expand command for each event and queue it on executor, to be killed
+// after timeoutMs (0 for no limit). On Windows the command line goes to
+// CreateProcess, elsewhere to /bin/sh -c. metrics, if not NULL, records how
+// long expanding takes. executor must outlive the action.
+std::unique_ptr<Action> CreateCommandAction(const CommandTemplate& command, uint32_t timeoutMs,
+                                            CommandExecutor& executor, LatencyMetrics* metrics);
+
+// Load a plugin library and create an instance with options. Returns NULL
+// with a description in error if the library cannot be loaded, does not
+// export CardActionGetPlugin or refuses this API version.
+std::unique_ptr<Action> LoadPluginAction(const CommandString& path, const std::string& options,
+                                         std::string& error);
+
+#endif // ACTION_H
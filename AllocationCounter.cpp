@@ -0,0 +1,154 @@
+#include "AllocationCounter.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Kept out of the executables' own sources so the compiler does not inline
+// these into their callers and then pair a malloc it can see with a delete
+// it cannot.
+
+static std::atomic<uint64_t> g_allocations(0);
+static thread_local bool t_uncounted = false;
+
+uint64_t AllocationCount() {
+    return g_allocations.load();
+}
+
+void SetAllocationsCounted(bool counted) {
+    t_uncounted = !counted;
+}
+
+static void* Allocate(size_t size) noexcept {
+    if (!t_uncounted) {
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) {
+    void* block = Allocate(size);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](size_t size) {
+    void* block = Allocate(size);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return Allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return Allocate(size);
+}
+
+void operator delete(void* block) noexcept {
+    free(block);
+}
+
+void operator delete[](void* block) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    free(block);
+}
+
+void operator delete[](void* block, size_t) noexcept {
+    free(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept {
+    free(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept {
+    free(block);
+}
+
+// The aligned forms exist when the compiler supports over-aligned new
+// (C++17, or -faligned-new); the build's C++14 does not use them otherwise
+#ifdef __cpp_aligned_new
+
+static void* AllocateAligned(size_t size, std::align_val_t alignment) noexcept {
+    if (!t_uncounted) {
+        g_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+#ifdef _WIN32
+    return _aligned_malloc(size ? size : 1, (size_t)alignment);
+#else
+    void* block = NULL;
+    size_t align = (size_t)alignment < sizeof(void*) ? sizeof(void*) : (size_t)alignment;
+    return posix_memalign(&block, align, size ? size : 1) == 0 ? block : NULL;
+#endif
+}
+
+static void FreeAligned(void* block) noexcept {
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* block = AllocateAligned(size, alignment);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    void* block = AllocateAligned(size, alignment);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return AllocateAligned(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return AllocateAligned(size, alignment);
+}
+
+void operator delete(void* block, std::align_val_t) noexcept {
+    FreeAligned(block);
+}
+
+void operator delete[](void* block, std::align_val_t) noexcept {
+    FreeAligned(block);
+}
+
+void operator delete(void* block, size_t, std::align_val_t) noexcept {
+    FreeAligned(block);
+}
+
+void operator delete[](void* block, size_t, std::align_val_t) noexcept {
+    FreeAligned(block);
+}
+
+void operator delete(void* block, std::align_val_t, const std::nothrow_t&) noexcept {
+    FreeAligned(block);
+}
+
+void operator delete[](void* block, std::align_val_t, const std::nothrow_t&) noexcept {
+    FreeAligned(block);
+}
+
+#endif
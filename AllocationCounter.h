@@ -0,0 +1,17 @@
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+#include <stdint.h>
+
+// Counts heap allocations for the checks and benchmarks that bound them.
+// AllocationCounter.cpp replaces every form of the global operator new and
+// delete, so it is linked only into those executables, never the core.
+
+// Allocations so far by threads that are counted
+uint64_t AllocationCount();
+
+// Stop or resume counting the calling thread's allocations, e.g. for a
+// thread that drives the code being measured
+void SetAllocationsCounted(bool counted);
+
+#endif // ALLOCATIONCOUNTER_H
@@ -0,0 +1,421 @@
+#include "ApduScript.h"
+#include "ApduTransport.h"
+#include "HexCodec.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <sstream>
+
+namespace {
+
+// Check the ISO 7816-4 APDU cases: header only, header + Le,
+// header + Lc + data, header + Lc + data + Le, with short or extended lengths
+bool CheckStructure(const uint8_t* apdu, size_t length, std::string& error) {
+    ApduLayout layout;
+    if (ParseApdu(apdu, length, layout)) {
+        return true;
+    }
+    if (length < 4) {
+        error = "shorter than a 4 byte header";
+        return false;
+    }
+    std::ostringstream message;
+    if (!layout.extended) {
+        message << "Lc is " << layout.lc << " but " << (length - 5) << " bytes follow it";
+    } else if (length < 7) {
+        message << "extended length needs 2 bytes after the 0 byte";
+    } else {
+        message << "extended Lc is " << layout.lc << " but " << (length - 7) << " bytes follow it";
+    }
+    error = message.str();
+    return false;
+}
+
+const uint32_t STOP = 0xFFFFFFFF;               // Branch target that ends the script
+const uint32_t VARIABLE_SLOT = 0x80000000;      // Slot of a variable until the APDUs are counted
+
+bool IsKeyword(const std::string& word) {
+    return word == "as" || word == "expect" || word == "else" || word == "if" || word == "goto" ||
+           word == "exit";
+}
+
+// Labels and variables: a letter or underscore, then letters, digits and
+// underscores. Variables must not shadow the other command placeholders.
+bool IsName(const std::string& word) {
+    if (word.empty() || !(isalpha((unsigned char)word[0]) || word[0] == '_') || IsKeyword(word)) {
+        return false;
+    }
+    for (char c : word) {
+        if (!isalnum((unsigned char)c) && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IsReserved(const std::string& name) {
+    return name == "atr" || name == "reader" || name == "timestamp" || name == "sequence";
+}
+
+// Split an item into words at whitespace; "=" and "!=" are words of their own
+void SplitWords(const std::string& item, std::vector<std::string>& words) {
+    words.clear();
+    std::string word;
+    for (size_t i = 0; i <= item.size(); i++) {
+        char c = i < item.size() ? item[i] : ' ';
+        bool equals = c == '=' || (c == '!' && i + 1 < item.size() && item[i + 1] == '=');
+        if (isspace((unsigned char)c) || equals) {
+            if (!word.empty()) {
+                words.push_back(word);
+                word.clear();
+            }
+            if (equals) {
+                words.push_back(c == '=' ? "=" : "!=");
+                i += c == '!' ? 1 : 0;
+            }
+        } else {
+            word += c;
+        }
+    }
+}
+
+// Parse a status word pattern of 4 hex digits, each of which may be x
+bool ParsePattern(const std::string& word, uint16_t& value, uint16_t& mask) {
+    if (word.size() != 4) {
+        return false;
+    }
+    value = 0;
+    mask = 0;
+    for (char c : word) {
+        value <<= 4;
+        mask <<= 4;
+        if (c == 'x' || c == 'X') {
+            continue;
+        }
+        if (!isxdigit((unsigned char)c)) {
+            return false;
+        }
+        char digit[2] = { c, '\0' };
+        value |= (uint16_t)strtoul(digit, NULL, 16);
+        mask |= 0xF;
+    }
+    return true;
+}
+
+} // namespace
+
+bool ApduScript::Compile(const std::string& list, std::string& error) {
+    m_bytes.clear();
+    m_spans.clear();
+    m_program.clear();
+    m_patterns.clear();
+    m_variables.clear();
+    m_plain = true;
+
+    // Jumps are resolved once every label is known
+    struct Fixup {
+        size_t instruction;
+        std::string label;
+        std::string item;
+    };
+    std::vector<Fixup> fixups;
+    std::map<std::string, uint32_t> labels;
+
+    auto fail = [&](const std::string& problem) {
+        error = problem;
+        m_bytes.clear();
+        m_spans.clear();
+        m_program.clear();
+        m_patterns.clear();
+        m_variables.clear();
+        return false;
+    };
+    auto emit = [this](Opcode opcode, uint32_t slot) -> Instruction& {
+        Instruction instruction = {};
+        instruction.opcode = (uint8_t)opcode;
+        instruction.slot = slot;
+        instruction.target = STOP;
+        m_program.push_back(instruction);
+        return m_program.back();
+    };
+
+    // Branch target: "exit" or a label
+    auto target = [&](const std::string& word, const std::string& item) {
+        if (word != "exit") {
+            m_program.back().target = 0;
+            fixups.push_back(Fixup{ m_program.size() - 1, word, item });
+        }
+        m_plain = false;
+    };
+
+    // Response reference: n, name, optionally followed by :sw, :data or :a..b
+    auto reference = [&](const std::string& word, Instruction& instruction) {
+        size_t colon = word.find(':');
+        std::string base = word.substr(0, colon);
+        std::string spec = colon == std::string::npos ? std::string() : word.substr(colon + 1);
+        if (!base.empty() && isdigit((unsigned char)base[0])) {
+            char* endPointer;
+            unsigned long number = strtoul(base.c_str(), &endPointer, 10);
+            if (*endPointer != '\0' || number == 0 || number > m_spans.size()) {
+                return false;
+            }
+            instruction.slot = (uint32_t)number - 1;
+        } else {
+            size_t variable = 0;
+            while (variable < m_variables.size() && m_variables[variable] != base) {
+                variable++;
+            }
+            if (variable == m_variables.size()) {
+                return false;
+            }
+            instruction.slot = VARIABLE_SLOT | (uint32_t)variable;
+        }
+
+        if (colon == std::string::npos) {
+            instruction.range = RANGE_ALL;
+        } else if (spec == "sw") {
+            instruction.range = RANGE_STATUS_WORD;
+        } else if (spec == "data") {
+            instruction.range = RANGE_DATA;
+        } else {
+            size_t dots = spec.find("..");
+            if (dots == std::string::npos) {
+                return false;
+            }
+            std::string from = spec.substr(0, dots);
+            std::string to = spec.substr(dots + 2);
+            for (char c : from + to) {
+                if (!isdigit((unsigned char)c)) {
+                    return false;
+                }
+            }
+            instruction.range = RANGE_SLICE;
+            instruction.begin = from.empty() ? 0 : (uint32_t)strtoul(from.c_str(), NULL, 10);
+            instruction.end = to.empty() ? 0xFFFFFFFF : (uint32_t)strtoul(to.c_str(), NULL, 10);
+            if (instruction.end < instruction.begin) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    size_t index = 0;
+    size_t start = 0;
+    std::vector<std::string> words;
+    std::string hex;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string item = list.substr(start, end - start);
+        item.erase(0, item.find_first_not_of(" \t\r\n"));
+        item.erase(item.find_last_not_of(" \t\r\n") + 1);
+        start = end + 1;
+        std::string context = "'" + item + "': ";
+
+        // Labels name the next instruction
+        SplitWords(item, words);
+        size_t w = 0;
+        while (w < words.size() && words[w].size() > 1 && words[w].back() == ':' &&
+               IsName(words[w].substr(0, words[w].size() - 1))) {
+            std::string label = words[w].substr(0, words[w].size() - 1);
+            if (labels.count(label)) {
+                return fail(context + "label " + label + " is defined twice");
+            }
+            labels[label] = (uint32_t)m_program.size();
+            w++;
+        }
+
+        // Skip empty entries such as a trailing comma
+        if (w == words.size()) {
+            continue;
+        }
+
+        if (words[w] == "exit") {
+            if (w + 1 != words.size()) {
+                return fail(context + "unexpected '" + words[w + 1] + "'");
+            }
+            emit(OP_EXIT, 0);
+            m_plain = false;
+            continue;
+        }
+        if (words[w] == "goto") {
+            if (w + 2 != words.size() || !IsName(words[w + 1])) {
+                return fail(context + "expected goto <label>");
+            }
+            emit(OP_JUMP, 0);
+            target(words[w + 1], item);
+            continue;
+        }
+        if (words[w] == "if") {
+            // if <reference> = <hex> goto <label>|exit
+            Instruction& instruction = emit(OP_COMPARE, 0);
+            bool valid = w + 5 <= words.size() && (words[w + 2] == "=" || words[w + 2] == "!=");
+            if (valid && !reference(words[w + 1], instruction)) {
+                return fail(context + "'" + words[w + 1] + "' is not an earlier response or variable");
+            }
+            std::string constant = valid ? words[w + 3] : std::string();
+            size_t offset = m_bytes.size();
+            m_bytes.resize(offset + constant.size() / 2);
+            valid = valid && !constant.empty() && HexDecode(constant.data(), constant.size(), m_bytes.data() + offset);
+            valid = valid && ((words[w + 4] == "goto" && w + 6 == words.size() && IsName(words[w + 5])) ||
+                              (words[w + 4] == "exit" && w + 5 == words.size()));
+            if (!valid) {
+                return fail(context + "expected if <response> = <hex> goto <label> (or != and exit)");
+            }
+            instruction.negate = words[w + 2] == "!=";
+            instruction.operand = (uint32_t)offset;
+            instruction.count = (uint32_t)(constant.size() / 2);
+            target(words[w + 4] == "exit" ? words[w + 4] : words[w + 5], item);
+            continue;
+        }
+
+        // An APDU: its hex digits, possibly split by whitespace, then
+        // "as <variable>" and "expect <patterns> [else <label>]"
+        index++;
+        std::ostringstream prefix;
+        prefix << "APDU " << index << ": ";
+        hex.clear();
+        while (w < words.size() && !IsKeyword(words[w])) {
+            hex += words[w++];
+        }
+
+        Span span;
+        span.offset = (uint32_t)m_bytes.size();
+        span.length = (uint32_t)(hex.size() / 2);
+        m_bytes.resize(m_bytes.size() + span.length);
+        std::string problem;
+        size_t errorOffset;
+        if (hex.empty()) {
+            problem = "no hex digits";
+        } else if (!HexDecode(hex.data(), hex.size(), m_bytes.data() + span.offset, &errorOffset)) {
+            if (errorOffset == hex.size()) {
+                problem = "odd number of hex digits";
+            } else {
+                problem = std::string("invalid character '") + hex[errorOffset] + "'";
+            }
+        } else {
+            CheckStructure(m_bytes.data() + span.offset, span.length, problem);
+        }
+        if (!problem.empty()) {
+            return fail(prefix.str() + problem);
+        }
+        m_spans.push_back(span);
+        uint32_t slot = (uint32_t)(m_spans.size() - 1);
+        emit(OP_SEND, slot);
+
+        while (w < words.size()) {
+            const std::string& keyword = words[w];
+            if (keyword == "as") {
+                if (w + 1 == words.size() || !IsName(words[w + 1]) || IsReserved(words[w + 1])) {
+                    return fail(prefix.str() + "expected a variable name after as");
+                }
+                size_t variable = 0;
+                while (variable < m_variables.size() && m_variables[variable] != words[w + 1]) {
+                    variable++;
+                }
+                if (variable == m_variables.size()) {
+                    m_variables.push_back(words[w + 1]);
+                }
+                emit(OP_STORE, slot).operand = VARIABLE_SLOT | (uint32_t)variable;
+                w += 2;
+            } else if (keyword == "expect" && w + 1 < words.size()) {
+                Instruction& instruction = emit(OP_EXPECT, slot);
+                instruction.operand = (uint32_t)m_patterns.size();
+                std::string patterns = words[w + 1];
+                size_t position = 0;
+                while (position <= patterns.size()) {
+                    size_t bar = patterns.find('|', position);
+                    if (bar == std::string::npos) {
+                        bar = patterns.size();
+                    }
+                    Pattern pattern;
+                    if (!ParsePattern(patterns.substr(position, bar - position), pattern.value, pattern.mask)) {
+                        return fail(prefix.str() + "expected status words such as 9000|61xx after expect");
+                    }
+                    m_patterns.push_back(pattern);
+                    position = bar + 1;
+                }
+                instruction.count = (uint32_t)(m_patterns.size() - instruction.operand);
+                m_plain = false;
+                w += 2;
+                if (w + 1 < words.size() && words[w] == "else") {
+                    if (words[w + 1] != "exit" && !IsName(words[w + 1])) {
+                        return fail(prefix.str() + "expected a label or exit after else");
+                    }
+                    target(words[w + 1], item);
+                    w += 2;
+                }
+            } else {
+                return fail(prefix.str() + "unexpected '" + keyword + "'");
+            }
+        }
+    }
+
+    // Resolve the jumps, which may only go forward
+    for (const Fixup& fixup : fixups) {
+        auto label = labels.find(fixup.label);
+        if (label == labels.end()) {
+            return fail("'" + fixup.item + "': label " + fixup.label + " is not defined");
+        }
+        if (label->second <= fixup.instruction) {
+            return fail("'" + fixup.item + "': label " + fixup.label + " is not after it; jumps only go forward");
+        }
+        m_program[fixup.instruction].target = label->second;
+    }
+
+    // Variables follow the APDU responses
+    for (Instruction& instruction : m_program) {
+        if (instruction.slot & VARIABLE_SLOT) {
+            instruction.slot = (uint32_t)m_spans.size() + (instruction.slot & ~VARIABLE_SLOT);
+        }
+        if (instruction.opcode == OP_STORE) {
+            instruction.operand = (uint32_t)m_spans.size() + (instruction.operand & ~VARIABLE_SLOT);
+        }
+    }
+
+    m_bytes.shrink_to_fit();
+    m_spans.shrink_to_fit();
+    m_program.shrink_to_fit();
+    return true;
+}
+
+bool ApduScript::StatusMatches(const Instruction& instruction, const ByteSpan& response) const {
+    if (response.length < 2) {
+        return false;
+    }
+    uint16_t sw = (uint16_t)((response.data[response.length - 2] << 8) | response.data[response.length - 1]);
+    for (uint32_t i = 0; i < instruction.count; i++) {
+        const Pattern& pattern = m_patterns[instruction.operand + i];
+        if ((sw & pattern.mask) == pattern.value) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Compare the referenced bytes with the constant, clamping the range to the
+// response like the command placeholders do
+bool ApduScript::BytesEqual(const Instruction& instruction, const ByteSpan& response) const {
+    size_t begin = 0;
+    size_t end = response.length;
+    switch (instruction.range) {
+        case RANGE_STATUS_WORD:
+            begin = end < 2 ? end : end - 2;
+            break;
+        case RANGE_DATA:
+            end = end < 2 ? 0 : end - 2;
+            break;
+        case RANGE_SLICE:
+            begin = instruction.begin < end ? instruction.begin : end;
+            end = instruction.end < end ? instruction.end : end;
+            break;
+        default:
+            break;
+    }
+    return end - begin == instruction.count &&
+           (instruction.count == 0 || memcmp(response.data + begin, m_bytes.data() + instruction.operand,
+                                             instruction.count) == 0);
+}
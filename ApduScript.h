@@ -0,0 +1,137 @@
+#ifndef APDUSCRIPT_H
+#define APDUSCRIPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "EventArena.h"
+
+// An APDU script compiled once from the configuration. All command bytes
+// live in one buffer and each APDU is an offset/length span into it, so
+// sending the script needs no parsing or allocation. A small program
+// decides which APDUs are sent:
+//
+//   00A4040007A0000000031010              send an APDU
+//   00A4... expect 9000|61xx              stop unless the status word matches
+//   00A4... expect 9000 else other        ... or continue at label other
+//   80CA9F7F00 as cplc                    also keep the response as {cplc}
+//   other: 00A4...                        label the item
+//   if 1:sw = 6A82 goto other             branch on response bytes (= or !=)
+//   if cplc:0..2 != 9F7F exit             ... or stop
+//   goto done, exit                       jump or stop
+//
+// Items are separated by commas. References to responses take the forms of
+// the command placeholders: n, n:sw, n:data and n:a..b, or a variable name
+// instead of n. Jumps only go forward, so a script sends each APDU at most
+// once and always ends. A plain list sends every APDU in order.
+class ApduScript {
+public:
+    // Compile a comma separated list of hex APDUs and statements
+    // ("00A4040000,80CA9F7F00"). Whitespace between hex digits is ignored. On
+    // error the script is left empty and error names the offending item.
+    bool Compile(const std::string& list, std::string& error);
+
+    bool Empty() const { return m_spans.empty(); }
+    size_t Count() const { return m_spans.size(); }
+    const uint8_t* Command(size_t index) const { return m_bytes.data() + m_spans[index].offset; }
+    size_t Length(size_t index) const { return m_spans[index].length; }
+
+    // Variables set with "as", in order of first use. Their responses
+    // follow the Count() APDU responses.
+    const std::vector<std::string>& Variables() const { return m_variables; }
+    size_t Slots() const { return m_spans.size() + m_variables.size(); }
+
+    // True if the script always sends every APDU, in order
+    bool Plain() const { return m_plain; }
+
+    // Run the program. send(index, response) is called for each APDU to
+    // send and sets response, which starts out as the entry for that APDU
+    // in responses. responses must have Slots() entries; those for APDUs
+    // that are skipped are left as they are. A variable shares the bytes of
+    // the response it was set from.
+    template <typename Send>
+    void Run(Send&& send, ByteSpan* responses) const;
+
+private:
+    enum Opcode {
+        OP_SEND,        // Send APDU slot
+        OP_STORE,       // Copy response slot to variable operand
+        OP_EXPECT,      // Continue at target unless the status word matches a pattern
+        OP_COMPARE,     // Continue at target if the bytes equal the constant (or differ, with negate)
+        OP_JUMP,        // Continue at target
+        OP_EXIT         // Stop
+    };
+
+    enum Range {
+        RANGE_ALL,
+        RANGE_STATUS_WORD,
+        RANGE_DATA,
+        RANGE_SLICE
+    };
+
+    struct Span {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    struct Instruction {
+        uint8_t opcode;
+        uint8_t range;      // OP_COMPARE: which bytes of the response
+        uint8_t negate;     // OP_COMPARE: branch when the bytes differ
+        uint32_t slot;      // Response the instruction works on
+        uint32_t target;    // Next instruction when branching; past the end to stop
+        uint32_t operand;   // OP_EXPECT: first pattern; OP_COMPARE: constant offset; OP_STORE: variable slot
+        uint32_t count;     // OP_EXPECT: patterns; OP_COMPARE: constant length
+        uint32_t begin;     // RANGE_SLICE bounds
+        uint32_t end;
+    };
+
+    // Status word pattern; bits outside mask are ignored
+    struct Pattern {
+        uint16_t value;
+        uint16_t mask;
+    };
+
+    bool StatusMatches(const Instruction& instruction, const ByteSpan& response) const;
+    bool BytesEqual(const Instruction& instruction, const ByteSpan& response) const;
+
+    std::vector<uint8_t> m_bytes;           // APDUs, then the constants compared with
+    std::vector<Span> m_spans;
+    std::vector<Instruction> m_program;
+    std::vector<Pattern> m_patterns;
+    std::vector<std::string> m_variables;
+    bool m_plain = true;
+};
+
+template <typename Send>
+void ApduScript::Run(Send&& send, ByteSpan* responses) const {
+    size_t pc = 0;
+    while (pc < m_program.size()) {
+        const Instruction& instruction = m_program[pc];
+        switch (instruction.opcode) {
+            case OP_SEND:
+                send((size_t)instruction.slot, responses[instruction.slot]);
+                pc++;
+                break;
+            case OP_STORE:
+                responses[instruction.operand] = responses[instruction.slot];
+                pc++;
+                break;
+            case OP_EXPECT:
+                pc = StatusMatches(instruction, responses[instruction.slot]) ? pc + 1 : instruction.target;
+                break;
+            case OP_COMPARE:
+                pc = BytesEqual(instruction, responses[instruction.slot]) != (instruction.negate != 0) ?
+                     instruction.target : pc + 1;
+                break;
+            case OP_JUMP:
+                pc = instruction.target;
+                break;
+            default:
+                return;
+        }
+    }
+}
+
+#endif // APDUSCRIPT_H
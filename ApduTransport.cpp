@@ -0,0 +1,177 @@
+#include "ApduTransport.h"
+
+namespace {
+
+const size_t MAX_SHORT_RESPONSE = 256;
+const size_t MAX_EXTENDED_RESPONSE = 65536;
+
+// Upper bound on the exchanges for one command, so a card that keeps
+// answering 61xx cannot hold a worker forever. Enough for 64 KB of data in
+// 256 byte GET RESPONSE chunks.
+const unsigned MAX_EXCHANGES = 260;
+
+const uint8_t INS_GET_RESPONSE = 0xC0;
+
+// Replace or add the Le of apdu, in the form the APDU already uses
+void SetLe(std::vector<uint8_t>& apdu, uint8_t le) {
+    ApduLayout layout;
+    if (!ParseApdu(apdu.data(), apdu.size(), layout)) {
+        return;
+    }
+    if (layout.extended) {
+        // An extended Le of 0 means 65536, so 6C00 becomes 0100
+        if (layout.hasLe) {
+            apdu.resize(apdu.size() - 2);
+        }
+        apdu.push_back(le ? 0x00 : 0x01);
+        apdu.push_back(le);
+    } else {
+        if (layout.hasLe) {
+            apdu.pop_back();
+        }
+        apdu.push_back(le);
+    }
+}
+
+} // namespace
+
+bool ParseApdu(const uint8_t* apdu, size_t length, ApduLayout& layout) {
+    layout.extended = false;
+    layout.lc = 0;
+    layout.hasLe = false;
+    layout.le = 0;
+    if (length < 4) {
+        return false;
+    }
+    if (length == 4) {
+        return true;
+    }
+    if (length == 5) {
+        layout.hasLe = true;
+        layout.le = apdu[4] ? apdu[4] : MAX_SHORT_RESPONSE;
+        return true;
+    }
+
+    // Short Lc, optionally followed by a short Le
+    if (apdu[4] != 0) {
+        layout.lc = apdu[4];
+        if (length == 6 + layout.lc) {
+            layout.hasLe = true;
+            layout.le = apdu[length - 1] ? apdu[length - 1] : MAX_SHORT_RESPONSE;
+            return true;
+        }
+        return length == 5 + layout.lc;
+    }
+
+    // Extended: a zero byte, then a 2 byte Le or a 2 byte Lc, the data and
+    // an optional 2 byte Le
+    layout.extended = true;
+    if (length < 7) {
+        return false;
+    }
+    size_t value = ((size_t)apdu[5] << 8) | apdu[6];
+    if (length == 7) {
+        layout.hasLe = true;
+        layout.le = value ? value : MAX_EXTENDED_RESPONSE;
+        return true;
+    }
+    layout.lc = value;
+    if (layout.lc == 0) {
+        return false;
+    }
+    if (length == 9 + layout.lc) {
+        value = ((size_t)apdu[length - 2] << 8) | apdu[length - 1];
+        layout.hasLe = true;
+        layout.le = value ? value : MAX_EXTENDED_RESPONSE;
+        return true;
+    }
+    return length == 7 + layout.lc;
+}
+
+CardResult ApduTransport::Transmit(CardBackend& backend, CardHandle card, uint32_t protocol,
+                                   const uint8_t* command, size_t length, ByteSpan& response) {
+    response.data = NULL;
+    response.length = 0;
+    m_response.clear();
+    m_exchanges = 0;
+
+    // Extended commands may get up to 64 KB back in one exchange. Anything
+    // else gets at most 256 bytes at a time.
+    ApduLayout layout;
+    size_t expected = ParseApdu(command, length, layout) && layout.extended ?
+                      MAX_EXTENDED_RESPONSE : MAX_SHORT_RESPONSE;
+
+    // GET RESPONSE uses the command's class, without the chaining bit, for
+    // interindustry classes and the basic class for proprietary ones
+    uint8_t cla = command[0] & 0x80 ? 0x00 : (uint8_t)(command[0] & ~0x10);
+
+    const uint8_t* current = command;
+    size_t currentLength = length;
+    bool corrected = false;     // current already has the Le the card asked for
+    for (;;) {
+        size_t received = 0;
+        CardResult result = Exchange(backend, card, protocol, current, currentLength, expected, received);
+        if (result != CARD_S_SUCCESS) {
+            return result;
+        }
+        if (received < 2) {
+            // Not a valid response; pass it on as it is
+            m_response.insert(m_response.end(), m_recv.begin(), m_recv.begin() + received);
+            break;
+        }
+        uint8_t sw1 = m_recv[received - 2];
+        uint8_t sw2 = m_recv[received - 1];
+        bool more = m_exchanges < MAX_EXCHANGES;
+
+        // Wrong Le: send the same command again with the length the card has
+        if (sw1 == 0x6C && !corrected && more) {
+            if (current != m_retry.data()) {
+                m_retry.assign(current, current + currentLength);
+            }
+            SetLe(m_retry, sw2);
+            current = m_retry.data();
+            currentLength = m_retry.size();
+            expected = sw2 ? sw2 : MAX_SHORT_RESPONSE;
+            corrected = true;
+            continue;
+        }
+
+        m_response.insert(m_response.end(), m_recv.begin(), m_recv.begin() + (received - 2));
+
+        // More data waiting: fetch the next part
+        if (sw1 == 0x61 && more) {
+            m_retry.assign(5, 0);
+            m_retry[0] = cla;
+            m_retry[1] = INS_GET_RESPONSE;
+            m_retry[4] = sw2;
+            current = m_retry.data();
+            currentLength = m_retry.size();
+            expected = sw2 ? sw2 : MAX_SHORT_RESPONSE;
+            corrected = false;
+            continue;
+        }
+
+        m_response.push_back(sw1);
+        m_response.push_back(sw2);
+        break;
+    }
+    response.data = m_response.data();
+    response.length = m_response.size();
+    return CARD_S_SUCCESS;
+}
+
+// One exchange with the card, with room for expected bytes of data and the
+// status word
+CardResult ApduTransport::Exchange(CardBackend& backend, CardHandle card, uint32_t protocol,
+                                   const uint8_t* command, size_t length, size_t expected, size_t& received) {
+    if (m_recv.size() < expected + 2) {
+        m_recv.resize(expected + 2);
+    }
+    received = m_recv.size();
+    m_exchanges++;
+    CardResult result = backend.Transmit(card, protocol, command, length, m_recv.data(), &received);
+    if (result != CARD_S_SUCCESS) {
+        received = 0;
+    }
+    return result;
+}
@@ -0,0 +1,56 @@
+#ifndef APDUTRANSPORT_H
+#define APDUTRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "CardBackend.h"
+#include "EventArena.h"
+
+// Layout of a command APDU, ISO 7816-4 cases 1 to 4 in short or extended
+// form. Extended APDUs have a zero byte after the header and 2 byte lengths.
+struct ApduLayout {
+    bool extended;
+    size_t lc;          // Length of the command data, 0 for cases 1 and 2
+    bool hasLe;         // Cases 2 and 4
+    size_t le;          // Expected response data; 256 or 65536 when Le is 0
+};
+
+// Check apdu against the four cases. Returns false if the lengths in it do
+// not match its size.
+bool ParseApdu(const uint8_t* apdu, size_t length, ApduLayout& layout);
+
+// Sends command APDUs and returns complete responses. The receive buffer is
+// sized for the largest response the command allows, so extended responses
+// are not truncated. Status words that ask for another exchange are handled
+// here rather than by the caller:
+//
+//   61xx  more data is waiting: GET RESPONSE for xx bytes and append it
+//   6Cxx  wrong Le: send the command again with Le = xx
+//
+// so the caller sees the concatenated data and the final status word. The
+// buffers are kept between calls, so a steady stream of APDUs allocates
+// nothing; use one transport per thread.
+class ApduTransport {
+public:
+    ApduTransport() : m_exchanges(0) {}
+
+    // Send command to card. response points into the transport and stays
+    // valid until the next Transmit; it is empty on failure.
+    CardResult Transmit(CardBackend& backend, CardHandle card, uint32_t protocol,
+                        const uint8_t* command, size_t length, ByteSpan& response);
+
+    // Card exchanges made by the last Transmit
+    unsigned Exchanges() const { return m_exchanges; }
+
+private:
+    CardResult Exchange(CardBackend& backend, CardHandle card, uint32_t protocol,
+                        const uint8_t* command, size_t length, size_t expected, size_t& received);
+
+    std::vector<uint8_t> m_recv;
+    std::vector<uint8_t> m_response;    // Response being assembled
+    std::vector<uint8_t> m_retry;       // Command resent with a corrected Le
+    unsigned m_exchanges;
+};
+
+#endif // APDUTRANSPORT_H
@@ -0,0 +1,622 @@
+#include "AuditJournal.h"
+#include "LatencyMetrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char SEGMENT_SUFFIX[] = ".journal";
+const size_t SEGMENT_DIGITS = 8;
+const size_t MIN_RECORD_LIMIT = 256;
+const uint64_t FLUSH_INTERVAL_NS = 1000000000ull;
+const uint32_t IDLE_WAIT_MS = 1000;
+
+uint64_t NowMilliseconds() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+size_t Padded(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// CRC-32 (IEEE), the checksum of zip and PNG
+struct CrcTable {
+    uint32_t entries[256];
+
+    CrcTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+const CrcTable g_crcTable;
+
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc = g_crcTable.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t RecordChecksum(const uint8_t* record, size_t size) {
+    static const uint8_t zero[4] = { 0, 0, 0, 0 };
+    size_t field = offsetof(JournalRecordHeader, checksum);
+    uint32_t crc = Crc32(0, record, field);
+    crc = Crc32(crc, zero, sizeof(zero));
+    return Crc32(crc, record + field + 4, size - field - 4);
+}
+
+// Split a segment file name into the journal path and its number
+bool ParseSegmentName(const std::string& name, const std::string& base, uint64_t& number) {
+    size_t suffix = sizeof(SEGMENT_SUFFIX) - 1;
+    if (name.size() != base.size() + 1 + SEGMENT_DIGITS + suffix ||
+        name.compare(0, base.size(), base) != 0 || name[base.size()] != '.' ||
+        name.compare(name.size() - suffix, suffix, SEGMENT_SUFFIX) != 0) {
+        return false;
+    }
+    number = 0;
+    for (size_t i = 0; i < SEGMENT_DIGITS; ++i) {
+        char c = name[base.size() + 1 + i];
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        number = number * 10 + (uint64_t)(c - '0');
+    }
+    return true;
+}
+
+std::string SegmentName(const std::string& path, uint64_t number) {
+    char digits[32];
+    snprintf(digits, sizeof(digits), ".%08llu", (unsigned long long)number);
+    return path + digits + SEGMENT_SUFFIX;
+}
+
+// Directory and file name parts of a journal path
+void SplitPath(const std::string& path, std::string& directory, std::string& base) {
+    size_t slash = path.find_last_of("/\\");
+    if (slash == std::string::npos) {
+        directory = "";
+        base = path;
+    } else {
+        directory = path.substr(0, slash + 1);
+        base = path.substr(slash + 1);
+    }
+}
+
+} // namespace
+
+std::vector<std::string> ListJournalSegments(const std::string& path) {
+    std::string directory, base;
+    SplitPath(path, directory, base);
+
+    std::vector<std::pair<uint64_t, std::string>> found;
+    uint64_t number;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((path + ".*" + SEGMENT_SUFFIX).c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (ParseSegmentName(data.cFileName, base, number)) {
+                found.push_back(std::make_pair(number, directory + data.cFileName));
+            }
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR* dir = opendir(directory.empty() ? "." : directory.c_str());
+    if (dir) {
+        while (struct dirent* entry = readdir(dir)) {
+            if (ParseSegmentName(entry->d_name, base, number)) {
+                found.push_back(std::make_pair(number, directory + entry->d_name));
+            }
+        }
+        closedir(dir);
+    }
+#endif
+
+    std::sort(found.begin(), found.end());
+    std::vector<std::string> segments;
+    for (const auto& segment : found) {
+        segments.push_back(segment.second);
+    }
+    return segments;
+}
+
+AuditJournal::AuditJournal() : m_head(0), m_sleeping(false), m_records(0), m_dropped(0), m_segment(0) {
+}
+
+AuditJournal::~AuditJournal() {
+    Stop();
+}
+
+bool AuditJournal::Start(const std::string& path, const JournalOptions& options, std::string& error) {
+    Stop();
+    m_path = path;
+    m_options = options;
+    m_options.recordLimit = Padded(std::max(m_options.recordLimit, MIN_RECORD_LIMIT));
+    m_options.segmentSize = std::max(m_options.segmentSize,
+                                     (uint64_t)(sizeof(JournalSegmentHeader) + m_options.recordLimit));
+    size_t slots = 1;
+    while (slots < m_options.queueLength) {
+        slots <<= 1;
+    }
+    m_options.queueLength = slots;
+
+    // Number the segment after the highest one, so earlier runs are kept
+    std::string directory, base;
+    SplitPath(path, directory, base);
+    std::vector<std::string> segments = ListJournalSegments(path);
+    uint64_t last = 0;
+    if (!segments.empty()) {
+        ParseSegmentName(segments.back().substr(directory.size()), base, last);
+    }
+    m_segment = last + 1;
+    if (!OpenSegment(error)) {
+        return false;
+    }
+
+    m_slots.reset(new Slot[slots]);
+    for (size_t i = 0; i < slots; ++i) {
+        m_slots[i].sequence = i;
+        m_slots[i].size = 0;
+    }
+    m_slotData.reset(new uint8_t[slots * m_options.recordLimit]);
+    m_mask = slots - 1;
+    m_head = 0;
+    m_tail = 0;
+    m_records = 0;
+    m_dropped = 0;
+    m_reportedDrops = 0;
+    m_stopping = false;
+    m_lastFlush = LatencyNow();
+    m_writer = std::thread(&AuditJournal::Run, this);
+    return true;
+}
+
+void AuditJournal::Stop() {
+    if (!m_writer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    m_writer.join();
+    CloseSegment();
+}
+
+void AuditJournal::Append(const CardActionEvent& event) {
+    if (!m_slots) {
+        return;
+    }
+
+    // Claim a slot
+    uint64_t position = m_head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &m_slots[position & m_mask];
+        uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        int64_t difference = (int64_t)(sequence - position);
+        if (difference == 0) {
+            if (m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            ++m_dropped;
+            return;
+        } else {
+            position = m_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Lay the record out in the slot. Whatever does not fit is left out:
+    // responses from the first that does not fit, then the end of the
+    // reader name.
+    size_t limit = m_options.recordLimit;
+    uint8_t* record = &m_slotData[(position & m_mask) * limit];
+    JournalRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_RECORD_MAGIC;
+    header.type = (uint8_t)event.type;
+    header.atrLength = (uint8_t)std::min(event.atr.length, (size_t)255);
+    header.sequence = event.sequence;
+    header.timestamp = event.timestamp;
+    header.dispatchTime = event.dispatchTime;
+    header.suppressed = event.suppressed;
+
+    size_t responseCount = std::min(event.responseCount, (limit - sizeof(header)) / 8);
+    size_t fixed = sizeof(header) + responseCount * 4 + header.atrLength;
+    size_t readerLength = std::min(strlen(event.reader), std::min(limit - fixed, (size_t)0xFFFF));
+    header.readerLength = (uint16_t)readerLength;
+    header.responseCount = (uint16_t)responseCount;
+
+    uint32_t* lengths = (uint32_t*)(record + sizeof(header));
+    uint8_t* p = record + fixed - header.atrLength;
+    memcpy(p, event.reader, readerLength);
+    p += readerLength;
+    memcpy(p, event.atr.data, header.atrLength);
+    p += header.atrLength;
+    size_t room = limit - (size_t)(p - record);
+    for (size_t i = 0; i < responseCount; ++i) {
+        size_t length = event.responses[i].length;
+        if (length > room || (header.flags & JOURNAL_TRUNCATED)) {
+            header.flags |= JOURNAL_TRUNCATED;
+            length = 0;
+        }
+        lengths[i] = (uint32_t)length;
+        memcpy(p, event.responses[i].data, length);
+        p += length;
+        room -= length;
+    }
+    if (responseCount < event.responseCount) {
+        header.flags |= JOURNAL_TRUNCATED;
+    }
+
+    size_t size = Padded((size_t)(p - record));
+    memset(p, 0, size - (size_t)(p - record));
+    header.size = (uint32_t)size;
+    memcpy(record, &header, sizeof(header));
+    ((JournalRecordHeader*)record)->checksum = RecordChecksum(record, size);
+    slot->size = (uint32_t)size;
+
+    // Publish it, then wake the writer if it has run out of records. The
+    // fence pairs with the writer's between setting m_sleeping and looking
+    // at the ring again, so one of the two sees the other.
+    slot->sequence.store(position + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wake.notify_one();
+    }
+}
+
+void AuditJournal::Run() {
+    uint8_t gap[sizeof(JournalRecordHeader)];
+    for (;;) {
+        Slot& slot = m_slots[m_tail & m_mask];
+        if (slot.sequence.load(std::memory_order_acquire) == m_tail + 1) {
+            Write(&m_slotData[(m_tail & m_mask) * m_options.recordLimit], slot.size);
+            slot.sequence.store(m_tail + m_mask + 1, std::memory_order_release);
+            ++m_tail;
+            continue;
+        }
+
+        // The ring is empty: note events dropped since the last gap
+        uint64_t dropped = m_dropped.load();
+        if (dropped != m_reportedDrops && m_view) {
+            JournalRecordHeader header;
+            memset(&header, 0, sizeof(header));
+            header.magic = JOURNAL_RECORD_MAGIC;
+            header.size = sizeof(header);
+            header.type = JOURNAL_GAP;
+            header.timestamp = NowMilliseconds();
+            header.suppressed = (uint32_t)std::min(dropped - m_reportedDrops, (uint64_t)UINT32_MAX);
+            memcpy(gap, &header, sizeof(header));
+            ((JournalRecordHeader*)gap)->checksum = RecordChecksum(gap, sizeof(gap));
+            Write(gap, sizeof(gap));
+            m_reportedDrops = dropped;
+        }
+
+        if (m_offset != m_flushed && LatencyNow() - m_lastFlush >= FLUSH_INTERVAL_NS) {
+            Flush();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_stopping) {
+            break;
+        }
+        m_sleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (slot.sequence.load(std::memory_order_acquire) != m_tail + 1) {
+            m_wake.wait_for(lock, std::chrono::milliseconds(m_offset != m_flushed ? 100 : IDLE_WAIT_MS));
+        }
+        m_sleeping = false;
+    }
+}
+
+bool AuditJournal::Write(const uint8_t* record, size_t size) {
+    std::string error;
+    if (m_view && m_offset + size > m_options.segmentSize) {
+        CloseSegment();
+        ++m_segment;
+    }
+    if (!m_view && !OpenSegment(error)) {
+        // Retried with the next record; until then records are lost
+        ++m_dropped;
+        return false;
+    }
+
+    // Widen the segment's time range first, so a reader skipping segments
+    // by their range never misses a record that made it to disk
+    JournalSegmentHeader* segment = (JournalSegmentHeader*)m_view;
+    uint64_t timestamp = ((const JournalRecordHeader*)record)->timestamp;
+    if (segment->minTimestamp == 0 || timestamp < segment->minTimestamp) {
+        segment->minTimestamp = timestamp;
+    }
+    if (timestamp > segment->maxTimestamp) {
+        segment->maxTimestamp = timestamp;
+    }
+
+    // Copy the header last, so a reader of the live segment does not see
+    // the record before its contents
+    uint8_t* target = m_view + m_offset;
+    memcpy(target + sizeof(JournalRecordHeader), record + sizeof(JournalRecordHeader),
+           size - sizeof(JournalRecordHeader));
+    memcpy(target, record, sizeof(JournalRecordHeader));
+    m_offset += size;
+    ++m_records;
+    return true;
+}
+
+bool AuditJournal::OpenSegment(std::string& error) {
+    std::string name = SegmentName(m_path, m_segment);
+    uint64_t size = m_options.segmentSize;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                              CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = "cannot create " + name;
+        return false;
+    }
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    HANDLE mapping = NULL;
+    if (SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file)) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+    }
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size) : NULL;
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+    if (!view) {
+        CloseHandle(file);
+        DeleteFileA(name.c_str());
+        error = "cannot allocate " + name;
+        return false;
+    }
+    m_file = (intptr_t)file;
+#else
+    int file = open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (file < 0) {
+        error = "cannot create " + name;
+        return false;
+    }
+    // Allocate the blocks now, so a full disk shows up here and not as a
+    // fault while writing to the mapping
+#ifdef __linux__
+    int result = posix_fallocate(file, 0, (off_t)size);
+#else
+    int result = ftruncate(file, (off_t)size);
+#endif
+    void* view = result == 0 ? mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0)
+                             : MAP_FAILED;
+    if (view == MAP_FAILED) {
+        close(file);
+        unlink(name.c_str());
+        error = "cannot allocate " + name;
+        return false;
+    }
+    m_file = file;
+#endif
+    m_view = (uint8_t*)view;
+
+    JournalSegmentHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_SEGMENT_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.headerSize = sizeof(header);
+    header.segment = m_segment;
+    header.created = NowMilliseconds();
+    memcpy(m_view, &header, sizeof(header));
+    m_offset = sizeof(header);
+    m_flushed = 0;
+
+    // Delete the oldest segments past the number to keep
+    if (m_options.keepSegments > 0) {
+        std::vector<std::string> segments = ListJournalSegments(m_path);
+        for (size_t i = 0; i + m_options.keepSegments < segments.size(); ++i) {
+#ifdef _WIN32
+            DeleteFileA(segments[i].c_str());
+#else
+            unlink(segments[i].c_str());
+#endif
+        }
+    }
+    return true;
+}
+
+void AuditJournal::CloseSegment() {
+    if (!m_view) {
+        return;
+    }
+    // Flush, then cut the file to the records written. The cut is best
+    // effort: readers stop at the first zeroed record header anyway.
+#ifdef _WIN32
+    FlushViewOfFile(m_view, (SIZE_T)m_offset);
+    UnmapViewOfFile(m_view);
+    HANDLE file = (HANDLE)m_file;
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)m_offset;
+    if (SetFilePointerEx(file, end, NULL, FILE_BEGIN)) {
+        SetEndOfFile(file);
+    }
+    FlushFileBuffers(file);
+    CloseHandle(file);
+#else
+    msync(m_view, (size_t)m_offset, MS_SYNC);
+    munmap(m_view, (size_t)m_options.segmentSize);
+    if (ftruncate((int)m_file, (off_t)m_offset) != 0) {
+        // Left at full size
+    }
+    close((int)m_file);
+#endif
+    m_view = NULL;
+    m_file = -1;
+}
+
+void AuditJournal::Flush() {
+    // Start the write-back of the records since the last flush and of the
+    // header; the first page of the range may have been flushed before
+#ifdef _WIN32
+    FlushViewOfFile(m_view, (SIZE_T)m_offset);
+#else
+    static const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = m_flushed & ~(page - 1);
+    msync(m_view, (size_t)page, MS_ASYNC);
+    if (start < m_offset) {
+        msync(m_view + start, (size_t)(m_offset - start), MS_ASYNC);
+    }
+#endif
+    m_flushed = m_offset;
+    m_lastFlush = LatencyNow();
+}
+
+JournalReader::JournalReader() {
+}
+
+JournalReader::~JournalReader() {
+    Close();
+}
+
+bool JournalReader::Open(const std::string& path, std::string& error) {
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = "cannot open " + path;
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(JournalSegmentHeader)) {
+        CloseHandle(file);
+        error = path + " is not a journal segment";
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        error = "cannot map " + path;
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        error = "cannot map " + path;
+        return false;
+    }
+    m_data = (const uint8_t*)view;
+    m_size = (uint64_t)size.QuadPart;
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        error = "cannot open " + path;
+        return false;
+    }
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size < (off_t)sizeof(JournalSegmentHeader)) {
+        close(file);
+        error = path + " is not a journal segment";
+        return false;
+    }
+    void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (view == MAP_FAILED) {
+        error = "cannot map " + path;
+        return false;
+    }
+    madvise(view, (size_t)info.st_size, MADV_SEQUENTIAL);
+    m_data = (const uint8_t*)view;
+    m_size = (uint64_t)info.st_size;
+#endif
+
+    const JournalSegmentHeader& header = Header();
+    if (memcmp(header.magic, JOURNAL_SEGMENT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != JOURNAL_VERSION || header.headerSize < sizeof(header) ||
+        header.headerSize % 8 != 0 || header.headerSize > m_size) {
+        Close();
+        error = path + " is not a journal segment";
+        return false;
+    }
+    m_offset = header.headerSize;
+    return true;
+}
+
+void JournalReader::Close() {
+    if (m_data) {
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        munmap((void*)m_data, (size_t)m_size);
+#endif
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_offset = 0;
+    m_damaged = false;
+}
+
+bool JournalReader::Next(JournalEntry& entry) {
+    if (!m_data || m_damaged || m_size - m_offset < sizeof(JournalRecordHeader)) {
+        return false;
+    }
+    const JournalRecordHeader* header = (const JournalRecordHeader*)(m_data + m_offset);
+    if (header->magic == 0) {
+        return false;
+    }
+
+    // Check the layout, so the entry's pointers stay inside the record
+    uint64_t size = header->size;
+    uint64_t fixed = sizeof(JournalRecordHeader) + (uint64_t)header->responseCount * 4 +
+                     header->readerLength + header->atrLength;
+    if (header->magic != JOURNAL_RECORD_MAGIC || size % 8 != 0 || size > m_size - m_offset || fixed > size) {
+        m_damaged = true;
+        return false;
+    }
+    const uint32_t* lengths = (const uint32_t*)(header + 1);
+    uint64_t responses = 0;
+    for (uint16_t i = 0; i < header->responseCount; ++i) {
+        responses += lengths[i];
+    }
+    if (responses > size - fixed) {
+        m_damaged = true;
+        return false;
+    }
+
+    const uint8_t* p = (const uint8_t*)(lengths + header->responseCount);
+    entry.header = header;
+    entry.responseLengths = lengths;
+    entry.reader = (const char*)p;
+    p += header->readerLength;
+    entry.atr.data = p;
+    entry.atr.length = header->atrLength;
+    entry.responses = p + header->atrLength;
+    entry.offset = m_offset;
+    m_offset += size;
+    return true;
+}
+
+bool JournalReader::Verify(const JournalEntry& entry) const {
+    return RecordChecksum((const uint8_t*)entry.header, entry.header->size) == entry.header->checksum;
+}
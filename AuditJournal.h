@@ -0,0 +1,191 @@
+#ifndef AUDITJOURNAL_H
+#define AUDITJOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CardActionPlugin.h"
+#include "EventArena.h"
+
+// Audit trail of every card event, kept in segment files named
+// <path>.<number>.journal with 8 digit numbers counting up from 1. A segment
+// is a JournalSegmentHeader followed by records and then zeros. Every record
+// starts with a JournalRecordHeader, followed by:
+//
+//   uint32 response lengths     responseCount of them
+//   reader                      readerLength bytes, not terminated
+//   ATR                         atrLength bytes
+//   responses                   raw, including SW1 SW2, one per APDU
+//   zeros                       up to the record size, a multiple of 8
+//
+// Fields are little-endian, as laid out in memory on the hosts CardAction
+// runs on. The checksum is the CRC-32 of the whole record with the checksum
+// field taken as zero, so a record torn by a crash is detected and where a
+// segment's records end is always known.
+const char JOURNAL_SEGMENT_MAGIC[8] = { 'C', 'A', 'J', 'O', 'U', 'R', 'N', 'L' };
+const uint32_t JOURNAL_VERSION = 1;
+const uint32_t JOURNAL_RECORD_MAGIC = 0x5243414A;  // "JACR"
+
+// Record types; the event types match CARDACTION_EVENT_*
+const uint8_t JOURNAL_INSERTED = 1;
+const uint8_t JOURNAL_REMOVED  = 2;
+const uint8_t JOURNAL_GAP      = 3;     // suppressed events were lost because the journal fell behind
+
+// Record flags
+const uint8_t JOURNAL_TRUNCATED = 0x01; // Responses past the record limit are stored empty
+
+struct JournalSegmentHeader {
+    char magic[8];              // JOURNAL_SEGMENT_MAGIC
+    uint32_t version;           // JOURNAL_VERSION
+    uint32_t headerSize;        // Offset of the first record
+    uint64_t segment;           // Number in the file name
+    uint64_t created;           // Milliseconds since the Unix epoch
+    uint64_t minTimestamp;      // Range of the record timestamps, kept up to date
+    uint64_t maxTimestamp;      // as records are written; both 0 while empty
+};
+
+struct JournalRecordHeader {
+    uint32_t magic;             // JOURNAL_RECORD_MAGIC; 0 past the last record
+    uint32_t size;              // Whole record
+    uint32_t checksum;
+    uint8_t type;               // JOURNAL_*
+    uint8_t flags;
+    uint8_t atrLength;
+    uint8_t reserved;
+    uint64_t sequence;          // Event number
+    uint64_t timestamp;         // Milliseconds since the Unix epoch; time written for gaps
+    uint64_t dispatchTime;      // End of the debounce window
+    uint32_t suppressed;        // Raw transitions folded into the event, or events lost for gaps
+    uint16_t readerLength;
+    uint16_t responseCount;
+};
+
+static_assert(sizeof(JournalSegmentHeader) == 48, "journal segment header layout");
+static_assert(sizeof(JournalRecordHeader) == 48, "journal record header layout");
+
+struct JournalOptions {
+    uint64_t segmentSize = 64ull << 20;     // Bytes per segment file, allocated up front
+    unsigned keepSegments = 16;             // Older segments are deleted; 0 keeps them all
+    size_t recordLimit = 4096;              // Largest record; longer responses are left out
+    size_t queueLength = 1024;              // Records waiting for the writer, a power of two
+};
+
+// Writes card events to the journal. Append encodes the event into a slot of
+// a fixed ring and returns; a single writer thread copies the records into
+// the mapped segment, so worker threads never wait for the disk or for each
+// other. Slots are claimed with a compare-and-swap and published with a
+// per-slot sequence number, without a lock. When the ring is full the event
+// is dropped and the writer records a gap instead.
+//
+// Each run starts a new segment after the highest numbered one found. A
+// segment that fills up is cut to the size used and the next one started.
+// The mapping is flushed to disk about once a second and on Stop.
+class AuditJournal {
+public:
+    AuditJournal();
+    ~AuditJournal();
+
+    // Start writing segments at path, a file name prefix
+    bool Start(const std::string& path, const JournalOptions& options, std::string& error);
+
+    // Write the records still queued and close the segment
+    void Stop();
+
+    // Queue a card event. Safe to call from any thread; never blocks.
+    void Append(const CardActionEvent& event);
+
+    uint64_t Records() const { return m_records; }      // Written, gaps included
+    uint64_t Dropped() const { return m_dropped; }      // Lost because the ring was full
+    uint64_t Segment() const { return m_segment; }      // Number of the current segment
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        uint32_t size;
+    };
+
+    void Run();
+    bool Write(const uint8_t* record, size_t size);
+    bool OpenSegment(std::string& error);
+    void CloseSegment();
+    void Flush();
+
+    std::string m_path;
+    JournalOptions m_options;
+
+    // The ring. A slot is free for the writer position it holds and full
+    // for that position plus one.
+    std::unique_ptr<Slot[]> m_slots;
+    std::unique_ptr<uint8_t[]> m_slotData;  // recordLimit bytes per slot
+    size_t m_mask = 0;
+    std::atomic<uint64_t> m_head;           // Next slot to claim
+    uint64_t m_tail = 0;                    // Next slot to write, writer only
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::atomic<bool> m_sleeping;           // Writer is waiting for records
+    bool m_stopping = false;
+    std::thread m_writer;
+
+    // Current segment, writer only
+    intptr_t m_file = -1;                   // Kept open to cut the file to size
+    uint8_t* m_view = NULL;
+    uint64_t m_offset = 0;                  // End of the records
+    uint64_t m_flushed = 0;                 // Records before this offset have been flushed
+    uint64_t m_lastFlush = 0;               // LatencyNow() of the last flush
+
+    std::atomic<uint64_t> m_records;
+    std::atomic<uint64_t> m_dropped;
+    uint64_t m_reportedDrops = 0;           // Dropped events already covered by gap records
+    std::atomic<uint64_t> m_segment;
+};
+
+// A record read back from a segment. The pointers point into the segment
+// and are valid while it stays open.
+struct JournalEntry {
+    const JournalRecordHeader* header;
+    const char* reader;                 // header->readerLength bytes, not terminated
+    ByteSpan atr;
+    const uint32_t* responseLengths;    // header->responseCount of them
+    const uint8_t* responses;           // The responses, one after the other
+    uint64_t offset;                    // Of the record in the segment
+};
+
+// Reads the records of one segment, mapped read-only. Safe to use on the
+// segment being written.
+class JournalReader {
+public:
+    JournalReader();
+    ~JournalReader();
+
+    bool Open(const std::string& path, std::string& error);
+    void Close();
+
+    const JournalSegmentHeader& Header() const { return *(const JournalSegmentHeader*)m_data; }
+
+    // Next record, or false past the last one or at a damaged one. The
+    // checksum is only checked by Verify, so a filter can skip records
+    // cheaply; a record with a bad layout ends the segment either way.
+    bool Next(JournalEntry& entry);
+    bool Verify(const JournalEntry& entry) const;
+
+    // Set when Next stopped at a record whose layout is damaged
+    bool Damaged() const { return m_damaged; }
+
+private:
+    const uint8_t* m_data = NULL;
+    uint64_t m_size = 0;
+    uint64_t m_offset = 0;
+    bool m_damaged = false;
+};
+
+// The segment files of the journal at path, in order
+std::vector<std::string> ListJournalSegments(const std::string& path);
+
+#endif // AUDITJOURNAL_H
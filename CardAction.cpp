@@ -1,29 +1,18 @@
 #include <windows.h>
-#include <winscard.h>
 #include <shellapi.h>
 #include <commctrl.h>
 #include <process.h>
 #include <string>
-#include <vector>
-#include <sstream>
-#include <iomanip>
-#include <regex>
+#include <map>
 #include "resource.h"
-
-// Configuration settings
-struct Config {
-    std::vector<std::string> insertAPDUs;
-    std::wstring insertCommand;
-    std::wstring removeCommand;
-};
+#include "CardService.h"
 
 // Global variables
 HWND g_hwnd = NULL;
 NOTIFYICONDATA g_nid = {};
-HANDLE g_cardMonitorThread = NULL;
-bool g_running = true;
-Config g_config;
-SCARDCONTEXT g_hContext = 0; // Global SCARDCONTEXT
+HANDLE g_configWatcherThread = NULL;
+HANDLE g_configWatcherStop = NULL; // Signalled to end the watcher thread
+CardService g_service; // The engine and everything it feeds; counters read by the UI
 
 // ID values for tray icon menu
 #define IDM_EXIT 1001
@@ -31,173 +20,72 @@ SCARDCONTEXT g_hContext = 0; // Global SCARDCONTEXT
 
 // Window messages
 #define WM_TRAYICON (WM_USER + 1)
-#define WM_CARD_INSERTED (WM_USER + 2)
-#define WM_CARD_REMOVED (WM_USER + 3)
+#define WM_CARD_STATE (WM_USER + 2)
 #define WM_READER_CHANGE (WM_USER + 4)
+#define WM_CONFIG_RELOADED (WM_USER + 5)
 
-// Reader state structure
+// Reader state shown in the tray
 struct ReaderInfo {
-    std::wstring name;
+    std::shared_ptr<const RegisteredReader> reader;
     bool hasCard;
 };
 
-std::vector<ReaderInfo> g_readers;
+// Posted to the window with WM_READER_CHANGE when readers are attached or
+// detached. The window procedure takes ownership.
+struct ReaderChange {
+    ReaderList added;
+    ReaderList removed;
+};
+
+std::map<ReaderId, ReaderInfo> g_readers; // Owned by the UI thread, in order of attachment
 
 // Forward declarations
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
-unsigned __stdcall CardMonitorThreadProc(void* pArg);
-void LoadConfiguration();
-void ExecuteCommand(const std::wstring& command);
+unsigned __stdcall ConfigWatcherThreadProc(void* pArg);
+std::wstring GetIniPath();
 void UpdateTrayMenu();
-void RefreshReaderList();
+std::wstring FormatLatency(uint64_t nanoseconds);
 
-// Function to convert hex string to byte array
-std::vector<BYTE> HexStringToBytes(const std::string& hex) {
-    std::vector<BYTE> bytes;
-    
-    for (size_t i = 0; i < hex.length(); i += 2) {
-        if (i + 1 < hex.length()) {
-            std::string byteString = hex.substr(i, 2);
-            BYTE byte = (BYTE)strtol(byteString.c_str(), NULL, 16);
-            bytes.push_back(byte);
-        }
-    }
-    
-    return bytes;
+// Function to convert an ANSI string to a wide string
+std::wstring AnsiToWide(const std::string& ansi) {
+    int len = MultiByteToWideChar(CP_ACP, 0, ansi.c_str(), -1, NULL, 0);
+    std::wstring wide(len, 0);
+    MultiByteToWideChar(CP_ACP, 0, ansi.c_str(), -1, &wide[0], len);
+    wide.resize(len - 1);  // Remove null terminator
+    return wide;
 }
 
-// Function to convert byte array to hex string
-std::string BytesToHexString(const BYTE* bytes, DWORD length) {
-    std::stringstream ss;
-    ss << std::hex << std::setfill('0');
-    
-    for (DWORD i = 0; i < length; i++) {
-        ss << std::setw(2) << static_cast<int>(bytes[i]);
-    }
-    
-    return ss.str();
+// Function to convert a wide string to an ANSI string
+std::string WideToAnsi(const std::wstring& wide) {
+    int len = WideCharToMultiByte(CP_ACP, 0, wide.c_str(), -1, NULL, 0, NULL, NULL);
+    std::string ansi(len, 0);
+    WideCharToMultiByte(CP_ACP, 0, wide.c_str(), -1, &ansi[0], len, NULL, NULL);
+    ansi.resize(len - 1);  // Remove null terminator
+    return ansi;
 }
 
-// Send APDUs to card and return responses
-std::vector<std::string> SendAPDUs(int readerIndex) {
-    std::vector<std::string> responses;
-    
-    // Check if reader index is valid
-    if (readerIndex < 0 || readerIndex >= g_readers.size()) {
-        return responses;
-    }
-    
-    // If no APDUs to send, return empty responses
-    if (g_config.insertAPDUs.empty()) {
-        return responses;
-    }
-    
-    // Get reader name as ANSI string for SCardConnect
-    std::string readerNameA;
-    std::wstring readerNameW = g_readers[readerIndex].name;
-    int len = WideCharToMultiByte(CP_ACP, 0, readerNameW.c_str(), -1, NULL, 0, NULL, NULL);
-    readerNameA.resize(len);
-    WideCharToMultiByte(CP_ACP, 0, readerNameW.c_str(), -1, &readerNameA[0], len, NULL, NULL);
-    
-    // Connect to card
-    SCARDHANDLE hCard;
-    DWORD dwActiveProtocol;
-    LONG status = SCardConnectA(g_hContext, readerNameA.c_str(), SCARD_SHARE_EXCLUSIVE,
-                          SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
-                          &hCard, &dwActiveProtocol);
-    
-    if (status != SCARD_S_SUCCESS) {
-        return responses;
-    }
-    
-    // Determine protocol string based on active protocol
-    LPCSCARD_IO_REQUEST pioSendPci;
-    switch (dwActiveProtocol) {
-        case SCARD_PROTOCOL_T0:
-            pioSendPci = SCARD_PCI_T0;
-            break;
-        case SCARD_PROTOCOL_T1:
-            pioSendPci = SCARD_PCI_T1;
-            break;
-        default:
-            pioSendPci = SCARD_PCI_RAW;
-            break;
-    }
-    
-    // Send each APDU and collect responses
-    for (const auto& apduHex : g_config.insertAPDUs) {
-        std::vector<BYTE> apduBytes = HexStringToBytes(apduHex);
-        
-        if (apduBytes.empty()) {
-            responses.push_back("");
-            continue;
-        }
-        
-        BYTE recvBuffer[256];
-        DWORD recvLength = sizeof(recvBuffer);
-        
-        status = SCardTransmit(hCard, 
-                               pioSendPci,
-                               apduBytes.data(), 
-                               (DWORD)apduBytes.size(), 
-                               NULL, 
-                               recvBuffer, 
-                               &recvLength);
-        
-        if (status == SCARD_S_SUCCESS && recvLength > 0) {
-            responses.push_back(BytesToHexString(recvBuffer, recvLength));
-        } else {
-            responses.push_back("");
-        }
-    }
-    
-    // Disconnect from card
-    SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-    
-    return responses;
+// The service's messages are UTF-8, as the INI file is read
+std::wstring Utf8ToWide(const std::string& utf8) {
+    int len = MultiByteToWideChar(CP_UTF8, 0, utf8.c_str(), -1, NULL, 0);
+    std::wstring wide(len, 0);
+    MultiByteToWideChar(CP_UTF8, 0, utf8.c_str(), -1, &wide[0], len);
+    wide.resize(len - 1);  // Remove null terminator
+    return wide;
 }
 
-// Process command with response placeholders
-std::wstring ProcessCommand(const std::wstring& command, const std::vector<std::string>& responses) {
-    std::wstring result = command;
-    
-    // Look for patterns like {1}, {2}, etc. and replace with corresponding response
-    std::wregex pattern(L"\\{([0-9]+)\\}");
-    std::wstring processed;
-    std::wstring::const_iterator start = result.begin();
-    std::wstring::const_iterator end = result.end();
-    std::wsmatch matches;
-    
-    // Search and replace all occurrences
-    while (std::regex_search(start, end, matches, pattern)) {
-        // Append everything up to the match
-        processed.append(start, matches[0].first);
-        
-        // Get index from {n} pattern
-        int index = std::stoi(matches[1].str());
-        
-        // Check if index is valid (1-based index in the pattern, but 0-based in the array)
-        if (index > 0 && index <= responses.size()) {
-            // Convert ANSI response to wide string
-            std::string response = responses[index-1];
-            int len = MultiByteToWideChar(CP_ACP, 0, response.c_str(), -1, NULL, 0);
-            std::wstring wideResponse(len, 0);
-            MultiByteToWideChar(CP_ACP, 0, response.c_str(), -1, &wideResponse[0], len);
-            wideResponse.resize(len-1);  // Remove null terminator
-            
-            processed += wideResponse;
-        } else {
-            // Keep original placeholder if index is invalid
-            processed += matches[0].str();
-        }
-        
-        // Move to the end of the current match
-        start = matches[0].second;
+// Tell the window whether a reader holds a card
+void PostCardState(ReaderId reader, bool hasCard) {
+    PostMessage(g_hwnd, WM_CARD_STATE, (WPARAM)reader, hasCard ? 1 : 0);
+}
+
+// Tell the window about attached and detached readers
+void ReportReaderChange(const ReaderList& added, const ReaderList& removed) {
+    ReaderChange* change = new ReaderChange();
+    change->added = added;
+    change->removed = removed;
+    if (!PostMessage(g_hwnd, WM_READER_CHANGE, 0, (LPARAM)change)) {
+        delete change;
     }
-    
-    // Append any remaining part of the string
-    processed.append(start, end);
-    return processed;
 }
 
 // Entry point
@@ -205,13 +93,6 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     // Initialize COM for shell API
     CoInitialize(NULL);
     
-    // Establish global context
-    LONG status = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &g_hContext);
-    if (status != SCARD_S_SUCCESS) {
-        MessageBox(NULL, L"Failed to establish smart card context!", L"Error", MB_ICONEXCLAMATION | MB_OK);
-        return 1;
-    }
-    
     // Register window class
     WNDCLASSEX wc = {};
     wc.cbSize = sizeof(WNDCLASSEX);
@@ -250,11 +131,25 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     
     Shell_NotifyIcon(NIM_ADD, &g_nid);
     
-    // Load configuration
-    LoadConfiguration();
+    // Start the service. The UI thread needs no context: reader and card
+    // state come from the engine.
+    CardEngine::Sinks sinks;
+    sinks.readers = ReportReaderChange;
+    sinks.state = PostCardState;
+    std::string error;
+    if (!g_service.Start(WideToAnsi(GetIniPath()), sinks, error)) {
+        MessageBox(NULL, Utf8ToWide(error).c_str(), L"Configuration error", MB_ICONEXCLAMATION | MB_OK);
+        Shell_NotifyIcon(NIM_DELETE, &g_nid);
+        CoUninitialize();
+        return 1;
+    }
+    if (!g_service.StartMetrics(error)) {
+        MessageBox(NULL, Utf8ToWide(error).c_str(), L"Configuration error", MB_ICONEXCLAMATION | MB_OK);
+    }
     
-    // Start card monitor thread
-    g_cardMonitorThread = (HANDLE)_beginthreadex(NULL, 0, CardMonitorThreadProc, NULL, 0, NULL);
+    // Watch the INI file for changes
+    g_configWatcherStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_configWatcherThread = (HANDLE)_beginthreadex(NULL, 0, ConfigWatcherThreadProc, NULL, 0, NULL);
     
     // Message loop
     MSG msg;
@@ -264,14 +159,15 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     }
     
     // Cleanup
-    g_running = false;
-    if (g_cardMonitorThread) {
-        WaitForSingleObject(g_cardMonitorThread, INFINITE);
-        CloseHandle(g_cardMonitorThread);
+    if (g_configWatcherThread) {
+        SetEvent(g_configWatcherStop);
+        WaitForSingleObject(g_configWatcherThread, INFINITE);
+        CloseHandle(g_configWatcherThread);
     }
+    CloseHandle(g_configWatcherStop);
     
-    // Release global context
-    SCardReleaseContext(g_hContext);
+    // Stop the engine and unload plugins
+    g_service.Stop();
     
     Shell_NotifyIcon(NIM_DELETE, &g_nid);
     CoUninitialize();
@@ -291,8 +187,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 
                 // Add reader items
                 int menuIndex = 0;
-                for (const auto& reader : g_readers) {
-                    std::wstring menuText = reader.name;
+                for (const auto& entry : g_readers) {
+                    const ReaderInfo& reader = entry.second;
+                    std::wstring menuText = reader.reader->wideName;
                     if (reader.hasCard) {
                         menuText += L" [Card present]";
                     }
@@ -300,10 +197,44 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                                IDM_FIRST_READER + menuIndex, menuText.c_str());
                 }
                 
-                // Add separator and exit option
-                if (!g_readers.empty()) {
-                    InsertMenu(hMenu, menuIndex++, MF_BYPOSITION | MF_SEPARATOR, 0, NULL);
+                // Add event counters, separator and exit option
+                const EventDebouncer& debouncer = g_service.Engine().Debouncer();
+                std::wstring counters = L"Events: " + std::to_wstring(debouncer.EmittedEvents()) +
+                                        L" (" + std::to_wstring(debouncer.SuppressedTransitions()) +
+                                        L" suppressed)";
+                InsertMenu(hMenu, menuIndex++, MF_BYPOSITION | MF_STRING | MF_DISABLED, 0, counters.c_str());
+                const CommandExecutor& executor = g_service.Executor();
+                std::wstring commands = L"Commands: " + std::to_wstring(executor.Running()) + L" running, " +
+                                        std::to_wstring(executor.QueueDepth()) + L" queued, " +
+                                        std::to_wstring(executor.Dropped()) + L" dropped";
+                InsertMenu(hMenu, menuIndex++, MF_BYPOSITION | MF_STRING | MF_DISABLED, 0, commands.c_str());
+                CommandFailure failure;
+                if (executor.LastFailure(failure)) {
+                    std::wstring text = L"Last failure: " + (failure.timedOut ? std::wstring(L"timed out") :
+                                        failure.exitCode < 0 ? std::wstring(L"not started") :
+                                        L"exit code " + std::to_wstring(failure.exitCode));
+                    std::string firstLine = failure.output.substr(0, failure.output.find_first_of("\r\n"));
+                    if (!firstLine.empty()) {
+                        text += L", " + AnsiToWide(firstLine.substr(0, 80));
+                    }
+                    InsertMenu(hMenu, menuIndex++, MF_BYPOSITION | MF_STRING | MF_DISABLED, 0, text.c_str());
+                }
+                std::shared_ptr<const ServiceConfig> config = g_service.Config();
+                if (config->responseCache) {
+                    std::wstring counters = L"Cache: " + std::to_wstring(config->responseCache->Hits()) +
+                                            L" hits, " + std::to_wstring(config->responseCache->Misses()) +
+                                            L" misses";
+                    InsertMenu(hMenu, menuIndex++, MF_BYPOSITION | MF_STRING | MF_DISABLED, 0, counters.c_str());
                 }
+                uint64_t ready, firstEvent;
+                if (g_service.Startup().Elapsed(STARTUP_READY, ready)) {
+                    std::wstring startup = L"Startup: ready in " + FormatLatency(ready);
+                    if (g_service.Startup().Elapsed(STARTUP_FIRST_EVENT, firstEvent)) {
+                        startup += L", first event after " + FormatLatency(firstEvent);
+                    }
+                    InsertMenu(hMenu, menuIndex++, MF_BYPOSITION | MF_STRING | MF_DISABLED, 0, startup.c_str());
+                }
+                InsertMenu(hMenu, menuIndex++, MF_BYPOSITION | MF_SEPARATOR, 0, NULL);
                 InsertMenu(hMenu, menuIndex, MF_BYPOSITION | MF_STRING, IDM_EXIT, L"Exit");
                 
                 // Display menu
@@ -320,40 +251,47 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             }
             break;
             
-        case WM_CARD_INSERTED:
+        case WM_CARD_STATE:
             {
-                int readerIndex = (int)wParam;
-                if (readerIndex >= 0 && readerIndex < g_readers.size()) {
-                    g_readers[readerIndex].hasCard = true;
-                    
-                    // Send APDUs and process command with responses
-                    std::vector<std::string> responses = SendAPDUs(readerIndex);
-                    std::wstring command = ProcessCommand(g_config.insertCommand, responses);
-                    
-                    // Execute the processed command
-                    ExecuteCommand(command);
+                // Update reader state if the reader still exists
+                auto it = g_readers.find((ReaderId)wParam);
+                if (it != g_readers.end()) {
+                    it->second.hasCard = lParam != 0;
                     UpdateTrayMenu();
                 }
             }
             break;
             
-        case WM_CARD_REMOVED:
+        case WM_READER_CHANGE:
             {
-                int readerIndex = (int)wParam;
-                // Execute command regardless of reader list size
-                ExecuteCommand(g_config.removeCommand);
-                
-                // Update reader state if the reader still exists
-                if (readerIndex >= 0 && readerIndex < g_readers.size()) {
-                    g_readers[readerIndex].hasCard = false;
+                std::unique_ptr<ReaderChange> change((ReaderChange*)lParam);
+                for (const auto& reader : change->removed) {
+                    g_readers.erase(reader->id);
+                }
+                for (const auto& reader : change->added) {
+                    ReaderInfo info;
+                    info.reader = reader;
+                    info.hasCard = false;
+                    g_readers[reader->id] = info;
                 }
                 UpdateTrayMenu();
             }
             break;
             
-        case WM_READER_CHANGE:
-            RefreshReaderList();
-            UpdateTrayMenu();
+        case WM_CONFIG_RELOADED:
+            {
+                // Show the outcome of a reload as a balloon notification
+                std::unique_ptr<std::string> message((std::string*)lParam);
+                g_nid.uFlags |= NIF_INFO;
+                g_nid.dwInfoFlags = wParam ? NIIF_INFO : NIIF_ERROR;
+                wcscpy_s(g_nid.szInfoTitle, wParam ? L"Configuration reloaded" : L"Configuration error");
+                wcsncpy_s(g_nid.szInfo, Utf8ToWide(*message).c_str(), 255);
+                g_nid.szInfo[255] = L'\0';
+                Shell_NotifyIcon(NIM_MODIFY, &g_nid);
+                
+                // Later tooltip updates must not show the balloon again
+                g_nid.uFlags &= ~NIF_INFO;
+            }
             break;
             
         case WM_DESTROY:
@@ -367,144 +305,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
     return 0;
 }
 
-// Card monitor thread
-unsigned __stdcall CardMonitorThreadProc(void* pArg) {
-    // No need to establish context here anymore
-    
-    // Get initial list of readers
-    RefreshReaderList();
-    
-    // Main monitoring loop
-    while (g_running) {
-        // Get current list of readers
-        LPSTR mszReaders = NULL;
-        DWORD cchReaders = SCARD_AUTOALLOCATE;
-        
-        LONG status = SCardListReadersA(g_hContext, NULL, (LPSTR)&mszReaders, &cchReaders);
-        if (status != SCARD_S_SUCCESS) {
-            if (status == SCARD_E_NO_READERS_AVAILABLE) {
-                // Wait for a reader to be connected
-                SCARD_READERSTATE rgReaderStates[1];
-                // Convert ANSI string to wide string for SCARD_READERSTATE
-                const char* pnpNotification = "\\\\?PnP?\\Notification";
-                int len = MultiByteToWideChar(CP_ACP, 0, pnpNotification, -1, NULL, 0);
-                wchar_t* widePnpNotification = new wchar_t[len];
-                MultiByteToWideChar(CP_ACP, 0, pnpNotification, -1, widePnpNotification, len);
-                
-                rgReaderStates[0].szReader = (LPCWSTR)widePnpNotification;
-                rgReaderStates[0].dwCurrentState = SCARD_STATE_UNAWARE;
-                
-                status = SCardGetStatusChange(g_hContext, INFINITE, rgReaderStates, 1);
-                delete[] widePnpNotification;
-                
-                if (status == SCARD_S_SUCCESS) {
-                    PostMessage(g_hwnd, WM_READER_CHANGE, 0, 0);
-                }
-                continue;
-            }
-            Sleep(1000);  // Wait and retry
-            continue;
-        }
-        
-        // Count readers
-        size_t readerCount = 0;
-        LPSTR pReader = mszReaders;
-        while (*pReader != '\0') {
-            readerCount++;
-            pReader += strlen(pReader) + 1;
-        }
-        
-        // Prepare state array
-        SCARD_READERSTATE* rgReaderStates = new SCARD_READERSTATE[readerCount + 1];
-        ZeroMemory(rgReaderStates, sizeof(SCARD_READERSTATE) * (readerCount + 1));
-        
-        // Set up reader states
-        // Convert ANSI string to wide string for SCARD_READERSTATE
-        const char* pnpNotification = "\\\\?PnP?\\Notification";
-        int len = MultiByteToWideChar(CP_ACP, 0, pnpNotification, -1, NULL, 0);
-        wchar_t* widePnpNotification = new wchar_t[len];
-        MultiByteToWideChar(CP_ACP, 0, pnpNotification, -1, widePnpNotification, len);
-        
-        rgReaderStates[0].szReader = (LPCWSTR)widePnpNotification;
-        rgReaderStates[0].dwCurrentState = SCARD_STATE_UNAWARE;
-        
-        // Allocate array to store wide reader names
-        wchar_t** wideReaderNames = new wchar_t*[readerCount];
-        
-        pReader = mszReaders;
-        for (size_t i = 0; i < readerCount; i++) {
-            // Convert reader name to wide string
-            len = MultiByteToWideChar(CP_ACP, 0, pReader, -1, NULL, 0);
-            wideReaderNames[i] = new wchar_t[len];
-            MultiByteToWideChar(CP_ACP, 0, pReader, -1, wideReaderNames[i], len);
-            
-            rgReaderStates[i + 1].szReader = (LPCWSTR)wideReaderNames[i];
-            rgReaderStates[i + 1].dwCurrentState = SCARD_STATE_UNAWARE;
-            pReader += strlen(pReader) + 1;
-        }
-        
-        // Get initial state
-        status = SCardGetStatusChange(g_hContext, 0, rgReaderStates, (DWORD)readerCount + 1);
-        if (status != SCARD_S_SUCCESS) {
-            // Cleanup allocated memory
-            delete[] widePnpNotification;
-            for (size_t i = 0; i < readerCount; i++) {
-                delete[] wideReaderNames[i];
-            }
-            delete[] wideReaderNames;
-            delete[] rgReaderStates;
-            SCardFreeMemory(g_hContext, mszReaders);
-            Sleep(1000);
-            continue;
-        }
-        
-        // Update current state
-        for (size_t i = 0; i < readerCount + 1; i++) {
-            rgReaderStates[i].dwCurrentState = rgReaderStates[i].dwEventState;
-        }
-        
-        // Wait for status change
-        status = SCardGetStatusChange(g_hContext, 1000, rgReaderStates, (DWORD)readerCount + 1);
-        
-        // Check for events
-        if (status == SCARD_S_SUCCESS) {
-            // Check for reader change
-            if (rgReaderStates[0].dwEventState & SCARD_STATE_CHANGED) {
-                PostMessage(g_hwnd, WM_READER_CHANGE, 0, 0);
-            }
-            
-            // Check for card events
-            for (size_t i = 1; i <= readerCount; i++) {
-                if (rgReaderStates[i].dwEventState & SCARD_STATE_CHANGED) {
-                    
-                    if (rgReaderStates[i].dwCurrentState - rgReaderStates[i].dwEventState == SCARD_STATE_INUSE) {
-                        // Card inserted
-                        PostMessage(g_hwnd, WM_CARD_INSERTED, (WPARAM)(i - 1), 0);
-                    }
-                    else if ((rgReaderStates[i].dwEventState & SCARD_STATE_EMPTY) || (rgReaderStates[i].dwEventState & SCARD_STATE_UNAVAILABLE)) {
-                        // Card removed
-                        PostMessage(g_hwnd, WM_CARD_REMOVED, (WPARAM)(i - 1), 0);
-                    }
-                }
-            }
-        }
-        
-        // Cleanup allocated memory
-        delete[] widePnpNotification;
-        for (size_t i = 0; i < readerCount; i++) {
-            delete[] wideReaderNames[i];
-        }
-        delete[] wideReaderNames;
-        delete[] rgReaderStates;
-        SCardFreeMemory(g_hContext, mszReaders);
-    }
-    
-    // No need to release context here anymore
-    return 0;
-}
-
-// Load configuration from INI file
-void LoadConfiguration() {
+// Path of the INI file: the executable's path with .exe replaced by .ini
+std::wstring GetIniPath() {
     wchar_t iniPath[MAX_PATH];
     GetModuleFileName(NULL, iniPath, MAX_PATH);
     
@@ -513,67 +315,69 @@ void LoadConfiguration() {
     if (dot) {
         wcscpy_s(dot, 5, L".ini");
     }
+    return iniPath;
+}
+
+// Configuration watcher thread. Reloads the configuration whenever the INI
+// file is written and reports the outcome to the window.
+unsigned __stdcall ConfigWatcherThreadProc(void* pArg) {
+    std::wstring iniPath = GetIniPath();
+    std::wstring directory = iniPath.substr(0, iniPath.find_last_of(L"\\/") + 1);
+    
+    // Editors often save by renaming a temporary file, so watch names too
+    HANDLE change = FindFirstChangeNotification(directory.c_str(), FALSE,
+                                                FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (change == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
     
-    wchar_t buffer[1024];
-    
-    // Clear existing config
-    g_config.insertAPDUs.clear();
-    
-    // Load insert command
-    GetPrivateProfileString(L"OnInsert", L"Command", L"", buffer, sizeof(buffer)/sizeof(wchar_t), iniPath);
-    g_config.insertCommand = buffer;
-    
-    // Load insert APDUs
-    GetPrivateProfileString(L"OnInsert", L"APDUs", L"", buffer, sizeof(buffer)/sizeof(wchar_t), iniPath);
-    if (buffer[0] != L'\0') {
-        std::wstring wApduList = buffer;
+    WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+    GetFileAttributesEx(iniPath.c_str(), GetFileExInfoStandard, &attributes);
+    FILETIME lastWrite = attributes.ftLastWriteTime;
+    
+    HANDLE handles[2] = { g_configWatcherStop, change };
+    while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+        // Wait until the directory has been quiet for a moment, as a save
+        // can take several writes
+        DWORD wait;
+        do {
+            FindNextChangeNotification(change);
+            wait = WaitForMultipleObjects(2, handles, FALSE, 250);
+        } while (wait == WAIT_OBJECT_0 + 1);
+        if (wait == WAIT_OBJECT_0) {
+            break;
+        }
         
-        // Convert wide string to ANSI for easier manipulation
-        int len = WideCharToMultiByte(CP_ACP, 0, wApduList.c_str(), -1, NULL, 0, NULL, NULL);
-        std::string apduList(len, 0);
-        WideCharToMultiByte(CP_ACP, 0, wApduList.c_str(), -1, &apduList[0], len, NULL, NULL);
+        // Ignore other files in the directory and a file that is missing
+        // halfway through a save
+        if (!GetFileAttributesEx(iniPath.c_str(), GetFileExInfoStandard, &attributes) ||
+            CompareFileTime(&attributes.ftLastWriteTime, &lastWrite) == 0) {
+            continue;
+        }
+        lastWrite = attributes.ftLastWriteTime;
         
-        // Split by comma
-        std::string apdu;
-        std::stringstream apduStream(apduList);
-        while (std::getline(apduStream, apdu, ',')) {
-            // Remove whitespace
-            apdu.erase(std::remove_if(apdu.begin(), apdu.end(), ::isspace), apdu.end());
-            if (!apdu.empty()) {
-                g_config.insertAPDUs.push_back(apdu);
-            }
+        std::string* message = new std::string();
+        bool reloaded = g_service.Reload(*message);
+        if (!PostMessage(g_hwnd, WM_CONFIG_RELOADED, reloaded ? 1 : 0, (LPARAM)message)) {
+            delete message;
         }
     }
     
-    // Load remove command
-    GetPrivateProfileString(L"OnRemove", L"Command", L"", buffer, sizeof(buffer)/sizeof(wchar_t), iniPath);
-    g_config.removeCommand = buffer;
-    
-    // Set defaults if not configured
-    if (g_config.insertCommand.empty()) {
-        g_config.insertCommand = L"cmd.exe /c echo Card inserted > %TEMP%\\card_inserted.txt";
-    }
-    
-    if (g_config.removeCommand.empty()) {
-        g_config.removeCommand = L"cmd.exe /c echo Card removed > %TEMP%\\card_removed.txt";
-    }
+    FindCloseChangeNotification(change);
+    return 0;
 }
 
-// Execute a command
-void ExecuteCommand(const std::wstring& command) {
-    STARTUPINFO si = {};
-    PROCESS_INFORMATION pi = {};
-    si.cb = sizeof(si);
-    
-    // Create a non-const copy of the command
-    wchar_t* cmdLine = _wcsdup(command.c_str());
-    
-    if (CreateProcess(NULL, cmdLine, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
+// Format a duration in nanoseconds for the tray
+std::wstring FormatLatency(uint64_t nanoseconds) {
+    wchar_t text[32];
+    if (nanoseconds < 1000000) {
+        swprintf(text, 32, L"%u us", (unsigned)(nanoseconds / 1000));
+    } else if (nanoseconds < 10000000000ULL) {
+        swprintf(text, 32, L"%.1f ms", (double)nanoseconds / 1e6);
+    } else {
+        swprintf(text, 32, L"%.1f s", (double)nanoseconds / 1e9);
     }
-    
-    free(cmdLine);
+    return text;
 }
 
 // Update tray icon
@@ -582,9 +386,17 @@ void UpdateTrayMenu() {
     std::wstring tooltip = L"Card Action Monitor\n";
     tooltip += std::to_wstring(g_readers.size()) + L" reader(s)";
     
-    for (const auto& reader : g_readers) {
-        if (reader.hasCard) {
-            tooltip += L"\n" + reader.name + L": Card present";
+    // Time from a transition to its actions, ahead of the readers so it
+    // survives truncation
+    const LatencyHistogram& total = g_service.Latency().Stage(STAGE_TOTAL);
+    if (total.Count() > 0) {
+        tooltip += L"\nLatency p50 " + FormatLatency(total.Percentile(0.5)) +
+                   L", p99 " + FormatLatency(total.Percentile(0.99));
+    }
+    
+    for (const auto& entry : g_readers) {
+        if (entry.second.hasCard) {
+            tooltip += L"\n" + entry.second.reader->wideName + L": Card present";
         }
     }
     
@@ -594,50 +406,3 @@ void UpdateTrayMenu() {
     
     Shell_NotifyIcon(NIM_MODIFY, &g_nid);
 }
-
-// Refresh the list of readers
-void RefreshReaderList() {
-    g_readers.clear();
-    
-    // Get reader list
-    LPSTR mszReaders = NULL;
-    DWORD cchReaders = SCARD_AUTOALLOCATE;
-    
-    LONG status = SCardListReadersA(g_hContext, NULL, (LPSTR)&mszReaders, &cchReaders);
-    if (status != SCARD_S_SUCCESS) {
-        return;
-    }
-    
-    // Process reader list
-    LPSTR pReader = mszReaders;
-    while (*pReader != '\0') {
-        // Convert reader name to wide string
-        int len = MultiByteToWideChar(CP_ACP, 0, pReader, -1, NULL, 0);
-        std::wstring readerName(len, 0);
-        MultiByteToWideChar(CP_ACP, 0, pReader, -1, &readerName[0], len);
-        readerName.resize(len - 1);  // Remove null terminator
-        
-        // Check if card is present
-        SCARDHANDLE hCard;
-        DWORD dwActiveProtocol;
-        bool hasCard = (SCardConnectA(g_hContext, pReader, SCARD_SHARE_SHARED, 
-                                     SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
-                                     &hCard, &dwActiveProtocol) == SCARD_S_SUCCESS);
-        
-        if (hasCard) {
-            SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-        }
-        
-        // Add to reader list
-        ReaderInfo info;
-        info.name = readerName;
-        info.hasCard = hasCard;
-        g_readers.push_back(info);
-        
-        // Move to next reader
-        pReader += strlen(pReader) + 1;
-    }
-    
-    // Cleanup
-    SCardFreeMemory(g_hContext, mszReaders);
-}
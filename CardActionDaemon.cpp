@@ -0,0 +1,305 @@
+// Runs CardAction without the tray: the card event engine and its actions,
+// with the event stream, audit journal and metrics, configured from
+// CardAction.ini like the tray application. It needs no window, message
+// loop or desktop session, so it suits servers and thin clients.
+//
+// Usage: CardActionDaemon [--config PATH] [--service]
+//
+// Without --config, CardAction.ini is read from the directory of the
+// executable on Windows and from the working directory elsewhere. It runs
+// in the foreground and logs to stderr, as systemd and other supervisors
+// expect. SIGINT and SIGTERM, or Ctrl+C on Windows, stop it; SIGHUP reloads
+// the configuration, as does saving the file. --service runs it under the
+// Windows service control manager: stopping the service stops it and
+// "sc control <name> paramchange" reloads the configuration.
+//
+// The exit status is 1 if it could not start and 2 for bad arguments.
+#include "CardService.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#endif
+
+namespace {
+
+struct Options {
+    std::string config;
+    bool service = false;
+};
+
+// Requests from signal, console and service handlers to the main loop
+std::mutex g_mutex;
+std::condition_variable g_wake;
+bool g_stop = false;
+bool g_reload = false;
+
+void Log(const char* format, ...) {
+    char time[32];
+    time_t now = ::time(NULL);
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &local);
+
+    char message[1024];
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(message, sizeof(message), format, arguments);
+    va_end(arguments);
+    fprintf(stderr, "%s %s\n", time, message);
+}
+
+void RequestStop() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_stop = true;
+    g_wake.notify_all();
+}
+
+void RequestReload() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_reload = true;
+    g_wake.notify_all();
+}
+
+void ReportReaderChange(const ReaderList& added, const ReaderList& removed) {
+    for (const auto& reader : removed) {
+        Log("reader detached: %s", reader->name.c_str());
+    }
+    for (const auto& reader : added) {
+        Log("reader attached: %s", reader->name.c_str());
+    }
+}
+
+// Identifies a version of the INI file: its modification time and size
+struct FileStamp {
+    long long modified = 0;
+    long long size = -1;
+
+    bool operator==(const FileStamp& other) const { return modified == other.modified && size == other.size; }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+FileStamp Stamp(const std::string& path) {
+    FileStamp stamp;
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0) {
+        stamp.modified = (long long)info.st_mtime;
+        stamp.size = (long long)info.st_size;
+    }
+    return stamp;
+}
+
+// Run the service until asked to stop. ready, if set, is called once the
+// engine is running.
+int Run(const std::string& iniPath, void (*ready)()) {
+    CardService service;
+    CardEngine::Sinks sinks;
+    sinks.readers = ReportReaderChange;
+    sinks.state = [](ReaderId, bool) {};
+    sinks.ready = [&service]() { Log("startup: %s", service.Startup().Describe().c_str()); };
+    std::string error;
+    if (!service.Start(iniPath, sinks, error)) {
+        Log("cannot start: %s", error.c_str());
+        return 1;
+    }
+    if (!service.StartMetrics(error)) {
+        Log("%s", error.c_str());
+    }
+    std::shared_ptr<const ServiceConfig> config = service.Config();
+    Log("started with %s, %zu rules, %s backend", iniPath.c_str(), config->rules.size(), config->backend.c_str());
+    config.reset();
+    if (ready) {
+        ready();
+    }
+
+    // Reload when asked to, or when the file has stopped changing for a
+    // second, as a save can take several writes. The startup trace is logged
+    // when the readers are watched and again after the first card event.
+    FileStamp loaded = Stamp(iniPath);
+    FileStamp seen = loaded;
+    bool firstEventLogged = false;
+    std::unique_lock<std::mutex> lock(g_mutex);
+    while (!g_stop) {
+        uint64_t firstEvent;
+        if (!firstEventLogged && service.Startup().Elapsed(STARTUP_FIRST_EVENT, firstEvent)) {
+            Log("startup: %s", service.Startup().Describe().c_str());
+            firstEventLogged = true;
+        }
+        g_wake.wait_for(lock, std::chrono::seconds(1), []() { return g_stop || g_reload; });
+        if (g_stop) {
+            break;
+        }
+        FileStamp current = Stamp(iniPath);
+        bool changed = current != seen;
+        seen = current;
+        if (!g_reload && (changed || current.size < 0 || current == loaded)) {
+            continue;
+        }
+        g_reload = false;
+        loaded = current;
+        lock.unlock();
+        std::string message;
+        bool reloaded = service.Reload(message);
+        Log("%s%s", reloaded ? "configuration reloaded: " : "configuration not reloaded: ", message.c_str());
+        lock.lock();
+    }
+    lock.unlock();
+
+    service.Stop();
+    Log("stopped");
+    return 0;
+}
+
+#ifdef _WIN32
+std::string g_iniPath;
+SERVICE_STATUS_HANDLE g_statusHandle = NULL;
+SERVICE_STATUS g_status = {};
+
+void SetServiceState(DWORD state) {
+    g_status.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+    g_status.dwCurrentState = state;
+    g_status.dwControlsAccepted = state == SERVICE_RUNNING ?
+        SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_PARAMCHANGE : 0;
+    g_status.dwWaitHint = state == SERVICE_RUNNING || state == SERVICE_STOPPED ? 0 : 10000;
+    SetServiceStatus(g_statusHandle, &g_status);
+}
+
+DWORD WINAPI ServiceControl(DWORD control, DWORD, LPVOID, LPVOID) {
+    switch (control) {
+        case SERVICE_CONTROL_STOP:
+        case SERVICE_CONTROL_SHUTDOWN:
+            SetServiceState(SERVICE_STOP_PENDING);
+            RequestStop();
+            return NO_ERROR;
+        case SERVICE_CONTROL_PARAMCHANGE:
+            RequestReload();
+            return NO_ERROR;
+        case SERVICE_CONTROL_INTERROGATE:
+            return NO_ERROR;
+        default:
+            return ERROR_CALL_NOT_IMPLEMENTED;
+    }
+}
+
+void WINAPI ServiceMain(DWORD, LPSTR*) {
+    g_statusHandle = RegisterServiceCtrlHandlerExA("", ServiceControl, NULL);
+    if (!g_statusHandle) {
+        return;
+    }
+    SetServiceState(SERVICE_START_PENDING);
+    int status = Run(g_iniPath, []() { SetServiceState(SERVICE_RUNNING); });
+    if (status != 0) {
+        g_status.dwWin32ExitCode = ERROR_SERVICE_SPECIFIC_ERROR;
+        g_status.dwServiceSpecificExitCode = (DWORD)status;
+    }
+    SetServiceState(SERVICE_STOPPED);
+}
+
+BOOL WINAPI ConsoleControl(DWORD) {
+    RequestStop();
+    return TRUE;
+}
+
+std::string DefaultIniPath() {
+    char path[MAX_PATH];
+    DWORD length = GetModuleFileNameA(NULL, path, MAX_PATH);
+    std::string directory(path, length);
+    directory.erase(directory.find_last_of("\\/") + 1);
+    return directory + "CardAction.ini";
+}
+#else
+std::string DefaultIniPath() {
+    return "CardAction.ini";
+}
+#endif
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg == "--service") {
+            options.service = true;
+        } else if (!value) {
+            return false;
+        } else if (arg == "--config") {
+            options.config = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    if (options.config.empty()) {
+        options.config = DefaultIniPath();
+    }
+#ifdef _WIN32
+    return true;
+#else
+    return !options.service;
+#endif
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: CardActionDaemon [--config PATH]%s\n",
+#ifdef _WIN32
+                " [--service]"
+#else
+                ""
+#endif
+        );
+        return 2;
+    }
+
+#ifdef _WIN32
+    if (options.service) {
+        g_iniPath = options.config;
+        SERVICE_TABLE_ENTRYA services[] = { { (LPSTR)"", ServiceMain }, { NULL, NULL } };
+        if (!StartServiceCtrlDispatcherA(services)) {
+            fprintf(stderr, "--service only works when started by the service control manager\n");
+            return 1;
+        }
+        return (int)g_status.dwServiceSpecificExitCode;
+    }
+    SetConsoleCtrlHandler(ConsoleControl, TRUE);
+    return Run(options.config, NULL);
+#else
+    // Take the signals on a thread of their own. They are blocked before any
+    // other thread starts, so every thread inherits the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    std::thread([signals]() {
+        for (;;) {
+            int signal;
+            if (sigwait(&signals, &signal) != 0) {
+                continue;
+            }
+            if (signal == SIGHUP) {
+                RequestReload();
+            } else {
+                RequestStop();
+            }
+        }
+    }).detach();
+    return Run(options.config, NULL);
+#endif
+}
@@ -0,0 +1,96 @@
+#ifndef CARDACTIONPLUGIN_H
+#define CARDACTIONPLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface for in-process action plugins. A plugin is a DLL (a shared
+// object on Linux) that exports CardActionGetPlugin. CardAction loads it once
+// at startup and calls it directly for each card event it is configured for.
+//
+// Structures only ever grow at the end and carry their size, so plugins built
+// against an older version of this header keep working. A plugin that reads a
+// field added later checks the size first. The API version only changes for
+// incompatible changes.
+
+#define CARDACTION_PLUGIN_API_VERSION 1
+#define CARDACTION_PLUGIN_ENTRY "CardActionGetPlugin"
+
+#ifdef _WIN32
+#define CARDACTION_CALL __cdecl
+#define CARDACTION_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define CARDACTION_CALL
+#define CARDACTION_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct CardActionBytes {
+    const uint8_t* data;
+    size_t length;
+} CardActionBytes;
+
+#define CARDACTION_EVENT_INSERTED 1
+#define CARDACTION_EVENT_REMOVED  2
+
+// A card event. Pointers are only valid for the duration of the call.
+typedef struct CardActionEvent {
+    uint32_t size;                      // sizeof(CardActionEvent) in the host
+    uint32_t type;                      // CARDACTION_EVENT_*
+    const char* reader;                 // Reader name as reported by PC/SC
+    CardActionBytes atr;                // Empty on removal
+    const CardActionBytes* responses;   // Raw APDU responses, including SW1 SW2, one per APDU;
+    size_t responseCount;               // empty for APDUs not sent
+    uint64_t timestamp;                 // Milliseconds since the Unix epoch
+    uint64_t sequence;                  // Monotonic event number, starting at 1
+    uint64_t dispatchTime;              // End of the debounce window, same clock as timestamp
+    uint32_t suppressed;                // Raw transitions folded into this event
+
+    // Send an APDU to the card in the event's transaction, on the host's
+    // connection. Set for insert events only and only usable during
+    // handleEvent. Returns 0 or a PC/SC error. *responseLength is the size of
+    // response on entry and the bytes received, including SW1 SW2, on return;
+    // if it is too small the call returns SCARD_E_INSUFFICIENT_BUFFER with the
+    // size needed. 61xx and 6Cxx are handled by the host.
+    int32_t (CARDACTION_CALL *transmit)(const struct CardActionEvent* event, const uint8_t* command,
+                                        size_t commandLength, uint8_t* response, size_t* responseLength);
+    void* session;                      // Host data for transmit
+
+    // Later additions; check CARDACTION_HAS_FIELD(event, CardActionEvent, variableCount)
+    const CardActionBytes* variables;   // Responses kept with "as" in the APDU script, in
+    size_t variableCount;               // order of first use; empty for variables not set
+} CardActionEvent;
+
+// Whether a structure passed in by the other side, which may have been built
+// against an older version of this header, has field
+#define CARDACTION_HAS_FIELD(object, type, field) \
+    ((object)->size >= offsetof(type, field) + sizeof(((type*)0)->field))
+
+// Returned by the plugin. All functions return 0 on success.
+typedef struct CardActionPlugin {
+    uint32_t size;                      // sizeof(CardActionPlugin) in the plugin
+    uint32_t apiVersion;                // CARDACTION_PLUGIN_API_VERSION
+    const char* name;
+
+    // Create an instance from the Options value of the plugin section
+    int (CARDACTION_CALL *create)(const char* options, void** instance);
+
+    // Handle a card event. Called on worker threads: events for one reader
+    // arrive in order, events for different readers may arrive concurrently.
+    int (CARDACTION_CALL *handleEvent)(void* instance, const CardActionEvent* event);
+
+    void (CARDACTION_CALL *destroy)(void* instance);
+} CardActionPlugin;
+
+// Signature of CardActionGetPlugin. Return NULL if the host version is not
+// supported.
+typedef const CardActionPlugin* (CARDACTION_CALL *CardActionGetPluginFn)(uint32_t hostApiVersion);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CARDACTIONPLUGIN_H
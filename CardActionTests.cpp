@@ -0,0 +1,1108 @@
+// Behaviour checks for the portable core, run by ctest. Everything runs in
+// process against the simulated backend, so no reader or PC/SC service is
+// needed.
+//
+// Usage: CardActionTests [test name...]
+//
+// Without names every test runs. The exit status is 1 if a check failed.
+#include "AllocationCounter.h"
+#include "ApduScript.h"
+#include "ApduTransport.h"
+#include "AuditJournal.h"
+#include "CardEngine.h"
+#include "CardMonitor.h"
+#include "CardService.h"
+#include "CardTrace.h"
+#include "HexCodec.h"
+#include "SessionManager.h"
+#include "ResponseCache.h"
+#include "SimulatedBackend.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+int g_failures = 0;
+
+#define CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+bool Check(bool passed, const char* condition, const char* file, int line) {
+    if (!passed) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+        g_failures++;
+    }
+    return passed;
+}
+
+// Wait up to a few seconds for condition, polling
+template <typename Condition>
+bool WaitFor(Condition condition) {
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+    while (!condition()) {
+        if (Clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+typedef std::vector<uint8_t> Bytes;
+
+Bytes Hex(const char* text) {
+    Bytes bytes;
+    for (size_t i = 0; text[i] && text[i + 1]; i += 2) {
+        bytes.push_back((uint8_t)strtoul(std::string(text + i, 2).c_str(), NULL, 16));
+    }
+    return bytes;
+}
+
+Bytes ToBytes(const ByteSpan& span) {
+    return span.data ? Bytes(span.data, span.data + span.length) : Bytes();
+}
+
+CommandString Native(const char* text) {
+    CommandString native;
+    for (const char* c = text; *c; c++) {
+        native += (CommandChar)*c;
+    }
+    return native;
+}
+
+SimulatedCard TestCard() {
+    SimulatedCard card;
+    card.atr = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00, 0x03, 0x06 };
+    return card;
+}
+
+// Collects what a CardMonitor reports
+class MonitorProbe {
+public:
+    CardMonitor::Sinks Sinks() {
+        CardMonitor::Sinks sinks;
+        sinks.event = [this](const DebouncedEvent& event, ReaderId) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_events.push_back(event);
+        };
+        sinks.readers = [](const ReaderList&, const ReaderList&) {};
+        sinks.state = [this](ReaderId, bool) { m_learned++; };
+        sinks.ready = [this]() { m_ready = true; };
+        return sinks;
+    }
+
+    std::vector<DebouncedEvent> Events() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_events;
+    }
+
+    size_t EventCount() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_events.size();
+    }
+
+    bool Ready() const { return m_ready; }
+    size_t Learned() const { return m_learned; }
+
+private:
+    std::mutex m_mutex;
+    std::vector<DebouncedEvent> m_events;
+    std::atomic<size_t> m_learned{0};
+    std::atomic<bool> m_ready{false};
+};
+
+// A simulated backend that counts the waits that returned a change
+class CountingBackend : public SimulatedBackend {
+public:
+    CardResult GetStatusChange(CardContext context, uint32_t timeoutMs,
+                               CardReaderState* states, size_t count) override {
+        CardResult status = SimulatedBackend::GetStatusChange(context, timeoutMs, states, count);
+        if (status == CARD_S_SUCCESS) {
+            m_changes++;
+        }
+        return status;
+    }
+
+    uint64_t Changes() const { return m_changes; }
+
+private:
+    std::atomic<uint64_t> m_changes{0};
+};
+
+// Inserts and removals come out as events in order, with the card's ATR
+void TestMonitorEvents() {
+    SimulatedBackend backend;
+    backend.AddReader("Reader A");
+    SimulatedCard card = TestCard();
+    MonitorProbe probe;
+    CardMonitor monitor(backend, 0, 0, std::map<std::string, uint32_t>(), probe.Sinks());
+    CHECK(monitor.Start() == CARD_S_SUCCESS);
+    CHECK(WaitFor([&] { return probe.Ready(); }));
+
+    // An ATR that would not fit CardReaderState::atr is refused
+    SimulatedCard oversized = card;
+    oversized.atr.resize(CARD_MAX_ATR_SIZE + 1);
+    CHECK(!backend.InsertCard("Reader A", oversized) && !backend.AddReader("Reader B", &oversized));
+
+    backend.InsertCard("Reader A", card);
+    CHECK(WaitFor([&] { return probe.EventCount() == 1; }));
+    backend.RemoveCard("Reader A");
+    CHECK(WaitFor([&] { return probe.EventCount() == 2; }));
+    monitor.Stop();
+
+    std::vector<DebouncedEvent> events = probe.Events();
+    if (CHECK(events.size() == 2)) {
+        CHECK(events[0].inserted && events[0].reader == "Reader A" && events[0].atr == card.atr);
+        CHECK(!events[1].inserted && events[1].sequence > events[0].sequence);
+    }
+}
+
+// A card swapped for another between two waits shows only as a moved
+// event counter, and is reported as a removal and an insertion
+void TestMonitorCardSwap() {
+    SimulatedBackend backend;
+    backend.AddReader("Reader A");
+    SimulatedCard card = TestCard();
+    SimulatedCard other = TestCard();
+    other.atr.back() ^= 0xFF;
+    MonitorProbe probe;
+    CardMonitor monitor(backend, 0, 0, std::map<std::string, uint32_t>(), probe.Sinks());
+    CHECK(monitor.Start() == CARD_S_SUCCESS);
+    CHECK(WaitFor([&] { return probe.Ready(); }));
+
+    backend.InsertCard("Reader A", card);
+    CHECK(WaitFor([&] { return probe.EventCount() == 1; }));
+    backend.InsertCard("Reader A", other);
+    CHECK(WaitFor([&] { return probe.EventCount() == 3; }));
+    backend.InsertCard("Reader A", other);
+    CHECK(WaitFor([&] { return probe.EventCount() == 5; }));
+    monitor.Stop();
+
+    std::vector<DebouncedEvent> events = probe.Events();
+    if (CHECK(events.size() == 5)) {
+        CHECK(!events[1].inserted && events[2].inserted && events[2].atr == other.atr);
+        CHECK(!events[3].inserted && events[4].inserted && events[4].atr == other.atr);
+    }
+}
+
+// A card present at startup is learned, not reported as an insertion
+void TestMonitorInitialState() {
+    SimulatedBackend backend;
+    SimulatedCard card = TestCard();
+    backend.AddReader("Reader A", &card);
+    backend.AddReader("Reader B");
+    MonitorProbe probe;
+    CardMonitor monitor(backend, 0, 0, std::map<std::string, uint32_t>(), probe.Sinks());
+    CHECK(monitor.Start() == CARD_S_SUCCESS);
+    CHECK(WaitFor([&] { return probe.Ready(); }));
+    CHECK(probe.Learned() == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(probe.EventCount() == 0);
+    monitor.Stop();
+}
+
+// Waits that return a change without a card event, here a connection
+// coming and going, do not allocate in the monitor
+void TestMonitorSteadyStateAllocations() {
+    CountingBackend backend;
+    SimulatedCard card = TestCard();
+    backend.AddReader("Reader A", &card);
+    MonitorProbe probe;
+    CardMonitor monitor(backend, 0, 0, std::map<std::string, uint32_t>(), probe.Sinks());
+    CHECK(monitor.Start() == CARD_S_SUCCESS);
+    CHECK(WaitFor([&] { return probe.Ready(); }));
+
+    CardContext context = 0;
+    CHECK(backend.EstablishContext(&context) == CARD_S_SUCCESS);
+    auto cycle = [&]() {
+        uint64_t changes = backend.Changes();
+        CardHandle handle = 0;
+        uint32_t protocol = 0;
+        CHECK(backend.Connect(context, "Reader A", CARD_SHARE_SHARED, CARD_PROTOCOL_T1, &handle, &protocol) ==
+              CARD_S_SUCCESS);
+        CHECK(WaitFor([&] { return backend.Changes() > changes; }));
+        changes = backend.Changes();
+        CHECK(backend.Disconnect(handle, CARD_LEAVE_CARD) == CARD_S_SUCCESS);
+        CHECK(WaitFor([&] { return backend.Changes() > changes; }));
+    };
+    cycle();   // First use
+
+    uint64_t before = AllocationCount();
+    for (int i = 0; i < 100; i++) {
+        cycle();
+    }
+    uint64_t allocations = AllocationCount() - before;
+    backend.ReleaseContext(context);
+    monitor.Stop();
+    if (!CHECK(allocations == 0)) {
+        fprintf(stderr, "  %llu allocations in 200 monitor iterations\n", (unsigned long long)allocations);
+    }
+    CHECK(probe.EventCount() == 0);
+}
+
+// A simulated backend that is slow to return a change, which widens the
+// window for the monitor to move readers between a wait and its report
+class SlowWakeBackend : public SimulatedBackend {
+public:
+    CardResult GetStatusChange(CardContext context, uint32_t timeoutMs,
+                               CardReaderState* states, size_t count) override {
+        CardResult status = SimulatedBackend::GetStatusChange(context, timeoutMs, states, count);
+        if (status == CARD_S_SUCCESS) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return status;
+    }
+};
+
+// Readers moved between shards by hot-plugs report each transition of their
+// card once, whichever shard saw it
+void TestMonitorRebalanceWhileFlapping() {
+    const char* const flapping[] = { "Reader A", "Reader B", "Reader C" };
+    const size_t count = sizeof(flapping) / sizeof(flapping[0]);
+    SlowWakeBackend backend;
+    for (size_t i = 0; i < count; i++) {
+        backend.AddReader(flapping[i]);
+    }
+    SimulatedCard card = TestCard();
+    MonitorProbe probe;
+    CardMonitor monitor(backend, count, 0, std::map<std::string, uint32_t>(), probe.Sinks());
+    CHECK(monitor.Start() == CARD_S_SUCCESS);
+    CHECK(WaitFor([&] { return probe.Ready(); }));
+
+    // Toggle the cards while a spare reader comes and goes. With it the
+    // readers need a second shard and the last one moves there; without it
+    // that shard is retired and the reader moves back.
+    bool present[count] = {};
+    bool spare = false;
+    for (int i = 0; i < 600; i++) {
+        size_t index = i % count;
+        present[index] = !present[index];
+        if (present[index]) {
+            backend.InsertCard(flapping[index], card);
+        } else {
+            backend.RemoveCard(flapping[index]);
+        }
+        if (i % 4 == 0) {
+            spare = !spare;
+            if (spare) {
+                backend.AddReader("Spare");
+            } else {
+                backend.RemoveReader("Spare");
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(300));
+    }
+
+    // A quick toggle may be missed, but a reader never reports the same
+    // transition twice and ends up reporting where its card is
+    auto settled = [&]() {
+        std::vector<DebouncedEvent> events = probe.Events();
+        for (size_t i = 0; i < count; i++) {
+            bool last = false;
+            for (const auto& event : events) {
+                if (event.reader == flapping[i]) {
+                    last = event.inserted;
+                }
+            }
+            if (last != present[i]) {
+                return false;
+            }
+        }
+        return true;
+    };
+    CHECK(WaitFor(settled));
+    monitor.Stop();
+
+    std::vector<DebouncedEvent> events = probe.Events();
+    for (size_t i = 0; i < count; i++) {
+        bool inserted = false;
+        size_t repeats = 0;
+        for (const auto& event : events) {
+            if (event.reader == flapping[i]) {
+                repeats += event.inserted == inserted ? 1 : 0;
+                inserted = event.inserted;
+            }
+        }
+        if (!CHECK(repeats == 0)) {
+            fprintf(stderr, "  %s reported %zu transitions twice\n", flapping[i], repeats);
+        }
+    }
+}
+
+// Expand command with two APDU responses and fixed event values
+CommandString ExpandTemplate(const char* command, HexCase hexCase = HEX_LOWER) {
+    static const uint8_t first[] = { 0x6A, 0x82 };
+    static const uint8_t second[] = { 0x01, 0xAB, 0x03, 0x04, 0x90, 0x00 };
+    static const uint8_t atr[] = { 0x3B, 0x8F };
+    ByteSpan responses[] = { { first, sizeof(first) }, { second, sizeof(second) } };
+    CommandString reader = Native("Reader A");
+    TemplateValues values = {};
+    values.responses = responses;
+    values.responseCount = 2;
+    values.atr.data = atr;
+    values.atr.length = sizeof(atr);
+    values.reader = reader.c_str();
+    values.timestamp = 1706702400123ull;
+    values.sequence = 42;
+
+    CommandTemplate compiled;
+    std::string error;
+    if (!CHECK(compiled.Compile(Native(command), 2, error, hexCase))) {
+        fprintf(stderr, "  %s: %s\n", command, error.c_str());
+        return CommandString();
+    }
+    CommandString out;
+    compiled.Expand(values, out);
+
+    // Expanding into an arena gives the same
+    EventArena arena;
+    size_t length;
+    const CommandChar* line = compiled.Expand(values, arena, length);
+    CHECK(CommandString(line, length) == out && line[length] == 0);
+    return out;
+}
+
+// Every kernel the CPU has encodes in both cases and decodes either case,
+// and finds the first bad character wherever it is: inside the 32 and 64
+// character blocks of the SIMD kernels or in the tails they leave to the
+// narrower ones
+void TestHexKernels() {
+    const char* kernels[] = { "scalar", "sse2", "avx2" };
+    const char bad[] = { '/', ':', '@', 'G', '`', 'g', ' ', '\0', (char)0xC6, (char)0xE6 };
+    const std::string active = HexKernelName();
+    Bytes bytes(150);
+    for (size_t i = 0; i < bytes.size(); i++) {
+        bytes[i] = (uint8_t)(i * 37 + 11);
+    }
+
+    for (const char* kernel : kernels) {
+        if (!HexSelectKernel(kernel)) {
+            printf("skip   hex kernel %s, not supported by this CPU\n", kernel);
+            continue;
+        }
+        CHECK(strcmp(HexKernelName(), kernel) == 0);
+        for (size_t length = 0; length <= bytes.size(); length++) {
+            std::string lower(2 * length, '\0'), upper(2 * length, '\0');
+            std::string expectLower, expectUpper;
+            char digits[3];
+            for (size_t i = 0; i < length; i++) {
+                snprintf(digits, sizeof(digits), "%02x", bytes[i]);
+                expectLower += digits;
+                snprintf(digits, sizeof(digits), "%02X", bytes[i]);
+                expectUpper += digits;
+            }
+            HexEncode(bytes.data(), length, &lower[0], HEX_LOWER);
+            HexEncode(bytes.data(), length, &upper[0], HEX_UPPER);
+            if (!CHECK(lower == expectLower && upper == expectUpper)) {
+                fprintf(stderr, "  %s, %zu bytes\n", kernel, length);
+                continue;
+            }
+
+            // Mixed case decodes too
+            std::string mixed = lower;
+            for (size_t i = 0; i < mixed.size(); i += 3) {
+                mixed[i] = upper[i];
+            }
+            Bytes decoded(length + 1, 0xEE);
+            size_t errorOffset = 0;
+            CHECK(HexDecode(mixed.data(), mixed.size(), decoded.data(), &errorOffset) &&
+                  std::equal(bytes.begin(), bytes.begin() + length, decoded.begin()) &&
+                  decoded[length] == 0xEE);
+
+            // An odd length fails at its end
+            if (length > 0) {
+                CHECK(!HexDecode(upper.data(), upper.size() - 1, decoded.data(), &errorOffset) &&
+                      errorOffset == upper.size() - 1);
+            }
+        }
+
+        // 150 bytes is 300 characters: four 64 character blocks and a tail
+        // of 44, or nine 32 character blocks and a tail of 12
+        std::string hex(2 * bytes.size(), '\0');
+        HexEncode(bytes.data(), bytes.size(), &hex[0], HEX_UPPER);
+        Bytes decoded(bytes.size());
+        for (size_t position = 0; position < hex.size(); position++) {
+            for (char c : bad) {
+                std::string damaged = hex;
+                damaged[position] = c;
+                size_t errorOffset = 0;
+                bool failed = !HexDecode(damaged.data(), damaged.size(), decoded.data(), &errorOffset) &&
+                              errorOffset == position;
+                // Cut to an odd length, a bad last character is reported as
+                // the odd length, which is checked after the pairs
+                size_t odd = damaged.size() - 1;
+                size_t oddOffset = 0;
+                bool oddFailed = !HexDecode(damaged.data(), odd, decoded.data(), &oddOffset) &&
+                                 oddOffset == (position < odd - 1 ? position : odd);
+                if (!CHECK(failed && oddFailed)) {
+                    fprintf(stderr, "  %s, 0x%02X at %zu: error at %zu, odd length error at %zu\n",
+                            kernel, (uint8_t)c, position, errorOffset, oddOffset);
+                }
+            }
+        }
+    }
+    HexSelectKernel(active.c_str());
+}
+
+// Every placeholder form, literal braces and load-time errors
+void TestTemplateExpansion() {
+    CHECK(ExpandTemplate("run {2} {1:sw} {2:data}") == Native("run 01ab03049000 6a82 01ab0304"));
+    CHECK(ExpandTemplate("{2:1..3}|{2:..1}|{2:4..}|{2:5..99}|{2:9..}") == Native("ab03|01|9000|00|"));
+    CHECK(ExpandTemplate("{2}", HEX_UPPER) == Native("01AB03049000"));
+    CHECK(ExpandTemplate("{reader} {atr} {sequence}") == Native("Reader A 3b8f 42"));
+    CHECK(ExpandTemplate("{timestamp}") == Native("2024-01-31T12:00:00.123Z"));
+    CHECK(ExpandTemplate("{} {x} {{1}} {1x} {reader") == Native("{} {x} {6a82} {1x} {reader"));
+
+    CommandTemplate compiled;
+    std::string error;
+    CHECK(!compiled.Compile(Native("{3}"), 2, error) && error.find("3") != std::string::npos);
+    CHECK(!compiled.Compile(Native("{0}"), 2, error));
+    CHECK(!compiled.Compile(Native("{1:3..2}"), 2, error));
+    CHECK(!compiled.Compile(Native("{1:a..b}"), 2, error));
+    CHECK(!compiled.Compile(Native("{1:what}"), 2, error));
+    CHECK(!compiled.Compile(Native("{1:\xC3\xA9}"), 2, error) && error == "invalid placeholder {1:??}");
+    CHECK(compiled.Compile(Native("plain"), 0, error) && !compiled.Empty());
+}
+
+// The four ISO 7816-4 cases, short and extended, and lengths that do not fit
+void TestApduParse() {
+    struct Case {
+        const char* apdu;
+        bool valid;
+        bool extended;
+        size_t lc;
+        bool hasLe;
+        size_t le;
+    };
+    const Case cases[] = {
+        { "00A40400", true, false, 0, false, 0 },                   // Case 1
+        { "00B0000010", true, false, 0, true, 16 },                 // Case 2
+        { "00B0000000", true, false, 0, true, 256 },
+        { "00A4040002AAAA", true, false, 2, false, 0 },             // Case 3
+        { "00A4040002AAAA00", true, false, 2, true, 256 },          // Case 4
+        { "00B00000000400", true, true, 0, true, 1024 },            // Extended case 2
+        { "00B00000000000", true, true, 0, true, 65536 },
+        { "00A40400000002AAAA", true, true, 2, false, 0 },          // Extended case 3
+        { "00A40400000002AAAA0000", true, true, 2, true, 65536 },   // Extended case 4
+        { "00A404", false, false, 0, false, 0 },
+        { "00A4040003AAAA", false, false, 0, false, 0 },
+        { "00A4040002AAAA0000", false, false, 0, false, 0 },
+        { "00A404000000", false, false, 0, false, 0 },
+        { "00A40400000000AA", false, false, 0, false, 0 },
+        { "00A40400000003AAAA", false, false, 0, false, 0 },
+    };
+    for (const Case& test : cases) {
+        Bytes apdu = Hex(test.apdu);
+        ApduLayout layout;
+        bool valid = ParseApdu(apdu.data(), apdu.size(), layout);
+        bool matches = valid == test.valid;
+        if (valid && test.valid) {
+            matches = layout.extended == test.extended && layout.lc == test.lc && layout.hasLe == test.hasLe &&
+                      layout.le == test.le;
+        }
+        if (!CHECK(matches)) {
+            fprintf(stderr, "  %s\n", test.apdu);
+        }
+    }
+}
+
+// 61xx is followed by GET RESPONSE and 6Cxx by a resend, and the caller
+// gets the whole response with the final status word
+void TestTransportChaining() {
+    SimulatedBackend backend;
+    SimulatedCard card = TestCard();
+    card.responses[Hex("00B0000000")] = Hex("6C04");
+    card.responses[Hex("00B0000004")] = Hex("010203049000");
+    card.responses[Hex("80CA9F7F00")] = Hex("01026103");
+    card.responses[Hex("00C0000003")] = Hex("0304056102");
+    card.responses[Hex("00C0000002")] = Hex("06079000");
+    card.responses[Hex("10CA000000")] = Hex("6101");
+    card.responses[Hex("00C0000001")] = Hex("AA6101");
+    card.responses[Hex("00B00000000000")] = Bytes(300, 0x5A);
+    card.responses[Hex("00B00000000000")].push_back(0x90);
+    card.responses[Hex("00B00000000000")].push_back(0x00);
+    backend.AddReader("Reader A", &card);
+
+    CardContext context = 0;
+    CardHandle handle = 0;
+    uint32_t protocol = 0;
+    CHECK(backend.EstablishContext(&context) == CARD_S_SUCCESS);
+    CHECK(backend.Connect(context, "Reader A", CARD_SHARE_SHARED, CARD_PROTOCOL_T1, &handle, &protocol) ==
+          CARD_S_SUCCESS);
+    ApduTransport transport;
+    auto transmit = [&](const char* command) {
+        Bytes apdu = Hex(command);
+        ByteSpan response = { NULL, 0 };
+        CHECK(transport.Transmit(backend, handle, protocol, apdu.data(), apdu.size(), response) == CARD_S_SUCCESS);
+        return ToBytes(response);
+    };
+
+    CHECK(transmit("00B0000000") == Hex("010203049000") && transport.Exchanges() == 2);
+    // Proprietary class: GET RESPONSE in the basic class, twice
+    CHECK(transmit("80CA9F7F00") == Hex("010203040506079000") && transport.Exchanges() == 3);
+    CHECK(transmit("00B00000000000").size() == 302 && transport.Exchanges() == 1);
+
+    // A card that never stops asking for GET RESPONSE is cut off
+    Bytes endless = transmit("10CA000000");
+    CHECK(transport.Exchanges() == 260 && endless.size() == 259 + 2);
+    CHECK(endless[endless.size() - 2] == 0x61);
+
+    backend.Disconnect(handle, CARD_LEAVE_CARD);
+    backend.ReleaseContext(context);
+}
+
+// CRC-32 (IEEE) computed bit by bit, to check the journal's table version
+uint32_t ReferenceCrc32(const uint8_t* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+Bytes ReadFile(const std::string& path) {
+    Bytes contents;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file) {
+        uint8_t buffer[4096];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            contents.insert(contents.end(), buffer, buffer + read);
+        }
+        fclose(file);
+    }
+    return contents;
+}
+
+void WriteFile(const std::string& path, const Bytes& contents) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file) {
+        fwrite(contents.data(), 1, contents.size(), file);
+        fclose(file);
+    }
+}
+
+// Read every record of the segment at path. Returns the offsets of the
+// records read and sets verified to how many had a good checksum.
+std::vector<uint64_t> ReadJournal(const std::string& path, size_t& verified, bool& damaged) {
+    std::vector<uint64_t> offsets;
+    verified = 0;
+    JournalReader reader;
+    std::string error;
+    damaged = !reader.Open(path, error);
+    JournalEntry entry;
+    while (!damaged && reader.Next(entry)) {
+        offsets.push_back(entry.offset);
+        verified += reader.Verify(entry) ? 1 : 0;
+    }
+    damaged = damaged || reader.Damaged();
+    return offsets;
+}
+
+// Records read back as written, with an IEEE CRC-32; a changed byte fails
+// the checksum and a record cut short ends the segment
+void TestJournalRecords() {
+    const std::string path = "CardActionTests-journal";
+    for (const std::string& segment : ListJournalSegments(path)) {
+        remove(segment.c_str());
+    }
+    AuditJournal journal;
+    JournalOptions options;
+    options.segmentSize = 1 << 16;
+    options.recordLimit = 256;
+    std::string error;
+    if (!CHECK(journal.Start(path, options, error))) {
+        fprintf(stderr, "  %s\n", error.c_str());
+        return;
+    }
+    Bytes atr = TestCard().atr;
+    Bytes small = Hex("01029000");
+    Bytes large(300, 0x5A);
+    CardActionBytes responses[] = { { small.data(), small.size() }, { large.data(), large.size() } };
+    CardActionEvent event = {};
+    event.size = sizeof(event);
+    event.type = CARDACTION_EVENT_INSERTED;
+    event.reader = "Reader A";
+    event.atr.data = atr.data();
+    event.atr.length = atr.size();
+    event.responses = responses;
+    event.responseCount = 1;
+    event.sequence = 1;
+    journal.Append(event);
+    event.responseCount = 2;            // Too large for the record limit
+    event.sequence = 2;
+    journal.Append(event);
+    event.type = CARDACTION_EVENT_REMOVED;
+    event.atr.length = 0;
+    event.responseCount = 0;
+    event.sequence = 3;
+    journal.Append(event);
+    journal.Stop();
+    CHECK(journal.Records() == 3 && journal.Dropped() == 0);
+
+    std::vector<std::string> segments = ListJournalSegments(path);
+    if (!CHECK(segments.size() == 1)) {
+        return;
+    }
+    JournalReader reader;
+    CHECK(reader.Open(segments[0], error));
+    JournalEntry entry;
+    std::vector<uint64_t> offsets;
+    while (reader.Next(entry)) {
+        const JournalRecordHeader& header = *entry.header;
+        CHECK(reader.Verify(entry));
+        Bytes record((const uint8_t*)entry.header, (const uint8_t*)entry.header + header.size);
+        std::fill_n(record.begin() + offsetof(JournalRecordHeader, checksum), 4, 0);
+        CHECK(ReferenceCrc32(record.data(), record.size()) == header.checksum);
+        CHECK(std::string(entry.reader, header.readerLength) == "Reader A");
+        offsets.push_back(entry.offset);
+        if (header.sequence == 1) {
+            CHECK(header.type == JOURNAL_INSERTED && header.flags == 0 && ToBytes(entry.atr) == atr);
+            CHECK(header.responseCount == 1 && entry.responseLengths[0] == small.size() &&
+                  Bytes(entry.responses, entry.responses + small.size()) == small);
+        } else if (header.sequence == 2) {
+            CHECK(header.flags == JOURNAL_TRUNCATED && header.responseCount == 2);
+            CHECK(entry.responseLengths[0] == small.size() && entry.responseLengths[1] == 0);
+        } else {
+            CHECK(header.type == JOURNAL_REMOVED && header.atrLength == 0 && header.responseCount == 0);
+        }
+    }
+    CHECK(offsets.size() == 3 && !reader.Damaged());
+    reader.Close();
+
+    // A changed byte in the second record fails only its checksum
+    Bytes contents = ReadFile(segments[0]);
+    const std::string torn = "CardActionTests-torn.journal";
+    size_t verified;
+    bool damaged;
+    if (!CHECK(offsets.size() == 3 && contents.size() > offsets[2])) {
+        return;
+    }
+    Bytes changed = contents;
+    changed[offsets[2] - 1] ^= 0x01;
+    WriteFile(torn, changed);
+    CHECK(ReadJournal(torn, verified, damaged).size() == 3 && verified == 2 && !damaged);
+
+    // A record whose header was written but not the rest of it
+    Bytes cut(contents.begin(), contents.begin() + offsets[2] + sizeof(JournalRecordHeader));
+    WriteFile(torn, cut);
+    CHECK(ReadJournal(torn, verified, damaged).size() == 2 && verified == 2 && damaged);
+
+    // A record whose body never reached the disk
+    Bytes zeroed = contents;
+    std::fill(zeroed.begin() + offsets[1] + sizeof(JournalRecordHeader), zeroed.begin() + offsets[2], 0);
+    WriteFile(torn, zeroed);
+    CHECK(ReadJournal(torn, verified, damaged).size() == 3 && verified == 2);
+
+    remove(torn.c_str());
+    remove(segments[0].c_str());
+}
+
+// A reader record numbered past the readers seen so far is damage, not a
+// reason to grow the name table to whatever the file says
+void TestTraceReaderNumbers() {
+    const std::string path = "CardActionTests.trace";
+    TraceWriter writer;
+    std::string error;
+    if (!CHECK(writer.Open(path, error))) {
+        fprintf(stderr, "  %s\n", error.c_str());
+        return;
+    }
+    writer.ReaderAttached("Reader A");
+    writer.ReaderAttached("Reader B");
+    writer.Close();
+    Bytes contents = ReadFile(path);
+
+    TraceFile trace;
+    TraceRecord record;
+    size_t records = 0;
+    CHECK(trace.Open(path, error));
+    while (trace.Next(record)) {
+        records++;
+    }
+    CHECK(records == 4 && !trace.Truncated() && trace.ReaderName(1) == "Reader B");
+    trace.Close();
+
+    // Size, TRACE_READER, time, duration, reader 0xFFFFFFFF, result, value,
+    // a one byte name and an empty second string
+    Bytes bad = contents;
+    Bytes wrapping = Hex("0D01" "0000" "FFFFFFFF0F" "0000" "0158" "00");
+    bad.insert(bad.end(), wrapping.begin(), wrapping.end());
+    WriteFile(path, bad);
+    records = 0;
+    CHECK(trace.Open(path, error));
+    while (trace.Next(record)) {
+        records++;
+    }
+    CHECK(records == 4 && trace.Truncated() && trace.ReaderName(0) == "Reader A");
+    trace.Close();
+
+    // One number past the next is rejected just the same
+    bad = contents;
+    Bytes skipping = Hex("0901" "0000" "03" "0000" "0158" "00");
+    bad.insert(bad.end(), skipping.begin(), skipping.end());
+    WriteFile(path, bad);
+    records = 0;
+    CHECK(trace.Open(path, error));
+    while (trace.Next(record)) {
+        records++;
+    }
+    CHECK(records == 4 && trace.Truncated() && trace.ReaderName(3).empty());
+    trace.Close();
+    remove(path.c_str());
+}
+
+// Run script against a card that answers from responses, 6D00 otherwise.
+// Returns the indexes of the APDUs sent; responses gets every slot.
+std::vector<size_t> RunScript(const ApduScript& script, const std::map<Bytes, Bytes>& card,
+                              std::vector<Bytes>& responses) {
+    std::vector<size_t> sent;
+    std::vector<ByteSpan> slots(script.Slots(), ByteSpan{ NULL, 0 });
+    responses.assign(script.Slots() + script.Count(), Bytes());
+    script.Run([&](size_t i, ByteSpan& response) {
+        sent.push_back(i);
+        auto it = card.find(Bytes(script.Command(i), script.Command(i) + script.Length(i)));
+        responses[script.Slots() + i] = it != card.end() ? it->second : Hex("6D00");
+        response.data = responses[script.Slots() + i].data();
+        response.length = responses[script.Slots() + i].size();
+    }, slots.data());
+    for (size_t i = 0; i < slots.size(); i++) {
+        responses[i] = ToBytes(slots[i]);
+    }
+    responses.resize(script.Slots());
+    return sent;
+}
+
+// expect, else, labels, as and if pick the APDUs sent and set variables
+void TestApduScriptBranches() {
+    std::map<Bytes, Bytes> card;
+    card[Hex("00A4040002AAAA")] = Hex("6A82");
+    card[Hex("00A4040002BBBB")] = Hex("9000");
+    card[Hex("80CA000000")] = Hex("01029000");
+
+    ApduScript script;
+    std::string error;
+    CHECK(script.Compile("00A4040002AAAA expect 9000 else other, 80CA000000 as first, exit, "
+                         "other: 00A4040002BBBB expect 9000|61xx, 80CA000000 as second", error));
+    CHECK(!script.Plain() && script.Count() == 4);
+    if (CHECK(script.Variables().size() == 2)) {
+        CHECK(script.Variables()[0] == "first" && script.Variables()[1] == "second");
+    }
+    std::vector<Bytes> responses;
+    std::vector<size_t> sent = RunScript(script, card, responses);
+    CHECK(sent == std::vector<size_t>({ 0, 2, 3 }));
+    CHECK(responses[1].empty() && responses[3] == Hex("01029000"));
+    CHECK(responses[4].empty() && responses[5] == Hex("01029000"));
+
+    // A failed expect without else ends the script
+    CHECK(script.Compile("00A4040002AAAA expect 9000, 80CA000000", error));
+    CHECK(RunScript(script, card, responses) == std::vector<size_t>({ 0 }));
+
+    // if compares response bytes
+    CHECK(script.Compile("80CA000000, if 1:0..2 = 0102 goto done, 00A4040002AAAA, done: 00A4040002BBBB", error));
+    CHECK(RunScript(script, card, responses) == std::vector<size_t>({ 0, 2 }));
+    CHECK(script.Compile("80CA000000 as v, if v:sw != 9000 exit, 00A4040002BBBB", error));
+    CHECK(RunScript(script, card, responses) == std::vector<size_t>({ 0, 1 }));
+
+    // A plain list sends everything, whatever the status words
+    CHECK(script.Compile("00A4040002AAAA, 80CA000000", error));
+    CHECK(script.Plain() && RunScript(script, card, responses) == std::vector<size_t>({ 0, 1 }));
+
+    // Jumps only go forward, and labels and variables must exist
+    CHECK(!script.Compile("back: 80CA000000, goto back", error) && !error.empty());
+    CHECK(!script.Compile("80CA000000, goto nowhere", error));
+    CHECK(!script.Compile("80CA000000, if missing:sw = 9000 exit", error));
+    CHECK(script.Empty());
+}
+
+// Keeps what the actions of a rule receive
+class RecordingAction : public Action {
+public:
+    const char* Name() const override { return "recording"; }
+
+    void Run(const CardActionEvent& event, EventArena&) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_responses.clear();
+        m_variables.clear();
+        for (size_t i = 0; i < event.responseCount; i++) {
+            m_responses.push_back(ToBytes(event.responses[i]));
+        }
+        if (CARDACTION_HAS_FIELD(&event, CardActionEvent, variableCount)) {
+            for (size_t i = 0; i < event.variableCount; i++) {
+                m_variables.push_back(ToBytes(event.variables[i]));
+            }
+        }
+        m_events++;
+    }
+
+    size_t Events() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_events;
+    }
+
+    std::vector<Bytes> Responses() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_responses;
+    }
+
+    std::vector<Bytes> Variables() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_variables;
+    }
+
+private:
+    std::mutex m_mutex;
+    size_t m_events = 0;
+    std::vector<Bytes> m_responses;
+    std::vector<Bytes> m_variables;
+};
+
+// Actions get one response per APDU and the script's variables apart, and
+// command templates find both
+void TestEngineEventVariables() {
+    SimulatedBackend backend;
+    SimulatedCard card = TestCard();
+    card.responses[Hex("00A4040002AAAA")] = Hex("9000");
+    card.responses[Hex("80CA000000")] = Hex("01029000");
+
+    std::string error;
+    std::shared_ptr<EventRule> rule = std::make_shared<EventRule>();
+    rule->name = "Test";
+    CHECK(rule->insertAPDUs.Compile("00A4040002AAAA expect 9000, 80CA000000 as cplc", error));
+    rule->cacheableAPDUs.assign(rule->insertAPDUs.Count(), false);
+    std::shared_ptr<RecordingAction> action = std::make_shared<RecordingAction>();
+    rule->insertActions.push_back(action);
+    std::shared_ptr<RuleSet> rules = std::make_shared<RuleSet>();
+    rules->defaultRule = rule;
+
+    LatencyMetrics latency;
+    CardEngine::Sinks sinks;
+    sinks.readers = [](const ReaderList&, const ReaderList&) {};
+    sinks.state = [](ReaderId, bool) {};
+    CardEngine engine(backend, EngineOptions(), rules, NULL, latency, sinks);
+    CHECK(engine.Start() == CARD_S_SUCCESS);
+    backend.AddReader("Reader A");
+    CHECK(WaitFor([&] { return engine.ReaderCount() == 1; }));
+    backend.InsertCard("Reader A", card);
+    CHECK(WaitFor([&] { return action->Events() == 1; }));
+    engine.Stop();
+
+    std::vector<Bytes> responses = action->Responses();
+    std::vector<Bytes> variables = action->Variables();
+    CHECK(responses == std::vector<Bytes>({ Hex("9000"), Hex("01029000") }));
+    if (!CHECK(variables == std::vector<Bytes>({ Hex("01029000") }))) {
+        return;
+    }
+
+    ByteSpan responseSpans[] = { { responses[0].data(), 2 }, { responses[1].data(), 4 } };
+    ByteSpan variableSpans[] = { { variables[0].data(), 4 } };
+    TemplateValues values = {};
+    values.responses = responseSpans;
+    values.responseCount = 2;
+    values.variables = variableSpans;
+    values.variableCount = 1;
+    CommandString reader = Native("Reader A");
+    values.reader = reader.c_str();
+    CommandTemplate command;
+    std::vector<std::string> names(1, "cplc");
+    CHECK(command.Compile(Native("{1:sw} {cplc:data} {2}"), 2, error, HEX_LOWER, &names));
+    CommandString expanded;
+    command.Expand(values, expanded);
+    CHECK(expanded == Native("9000 0102 01029000"));
+}
+
+// A reload keeps the response cache while its settings and the cached APDUs
+// stay the same; a new cache continues the counts
+void TestServiceReloadKeepsCache() {
+    const char* path = "CardActionTests.ini";
+    auto write = [path](const char* extra) {
+        FILE* file = fopen(path, "w");
+        if (file) {
+            fprintf(file, "[Backend]\nType=simulated\n[OnInsert]\nAPDUs=00A4040000,FFCA000000\n%s\n"
+                          "[Cache]\nAPDUs=2\n", extra);
+            fclose(file);
+        }
+    };
+    write("");
+    CardService service;
+    CardEngine::Sinks sinks;
+    sinks.readers = [](const ReaderList&, const ReaderList&) {};
+    sinks.state = [](ReaderId, bool) {};
+    std::string error;
+    if (!CHECK(service.Start(path, sinks, error))) {
+        fprintf(stderr, "  %s\n", error.c_str());
+        remove(path);
+        return;
+    }
+    std::shared_ptr<ResponseCache> cache = service.Config()->responseCache;
+    if (!CHECK(cache != NULL)) {
+        service.Stop();
+        remove(path);
+        return;
+    }
+    ResponseCache::Responses responses;
+    CHECK(!cache->Lookup("card", responses));
+    cache->Store("card", ResponseCache::Responses(2));
+    CHECK(cache->Lookup("card", responses));
+
+    std::string message;
+    write("Command=true");
+    CHECK(service.Reload(message));
+    CHECK(service.Config()->responseCache == cache && cache->Size() == 1);
+
+    write("Command=true\n[Rule:Other]\nATR=3B\nAPDUs=FFCA000000");
+    CHECK(service.Reload(message));
+    CHECK(service.Config()->responseCache == cache);
+
+    write("Command=true\n[Rule:Other]\nATR=3B\nAPDUs=FFCA000000\nCache=1");
+    CHECK(service.Reload(message));
+    std::shared_ptr<ResponseCache> replaced = service.Config()->responseCache;
+    if (CHECK(replaced && replaced != cache)) {
+        CHECK(replaced->Size() == 0 && replaced->Hits() == 1 && replaced->Misses() == 1);
+    }
+    service.Stop();
+    remove(path);
+}
+
+// A reload shares the instance of a plugin whose section did not change
+// and loads a plugin whose options did
+void TestServiceReloadKeepsPlugins() {
+    const char* path = "CardActionTests.ini";
+    auto write = [path](const char* options) {
+        FILE* file = fopen(path, "w");
+        if (file) {
+            fprintf(file, "[Backend]\nType=simulated\n[OnInsert]\nPlugins=Log\n"
+                          "[Plugin:Log]\nPath=%s\nOptions=%s\n", CARDLOG_PLUGIN, options);
+            fclose(file);
+        }
+    };
+    write("CardActionTests-1.log");
+    CardService service;
+    CardEngine::Sinks sinks;
+    sinks.readers = [](const ReaderList&, const ReaderList&) {};
+    sinks.state = [](ReaderId, bool) {};
+    std::string error;
+    if (!CHECK(service.Start(path, sinks, error))) {
+        fprintf(stderr, "  %s\n", error.c_str());
+        remove(path);
+        return;
+    }
+    std::shared_ptr<Action> plugin = service.Config()->defaultRule->insertActions.at(0);
+
+    std::string message;
+    CHECK(service.Reload(message));
+    CHECK(service.Config()->defaultRule->insertActions.at(0) == plugin);
+
+    write("CardActionTests-2.log");
+    CHECK(service.Reload(message));
+    CHECK(service.Config()->defaultRule->insertActions.at(0) != plugin);
+    plugin.reset();
+    service.Stop();
+    remove(path);
+    remove("CardActionTests-1.log");
+    remove("CardActionTests-2.log");
+}
+
+// A card reset by another application makes the session reconnect once,
+// and the event still gets its response
+void TestSessionReconnectsAfterReset() {
+    const uint8_t select[] = { 0x00, 0xA4, 0x04, 0x00, 0x00 };
+    SimulatedBackend backend;
+    SimulatedCard card = TestCard();
+    card.responses[std::vector<uint8_t>(select, select + sizeof(select))] = { 0x90, 0x00 };
+    backend.AddReader("Reader A", &card);
+    SessionManager sessions(backend);
+    LatencyMetrics latency;
+    std::string reader = "Reader A";
+    auto exchange = [&]() {
+        CardTransaction transaction(sessions, reader, latency);
+        ByteSpan response;
+        return transaction.Transmit(select, sizeof(select), response) == CARD_S_SUCCESS && response.length == 2;
+    };
+    CHECK(exchange());
+    CHECK(exchange());
+    CHECK(sessions.Connects() == 1 && sessions.Reuses() == 1);
+
+    CardContext context = 0;
+    CardHandle handle = 0;
+    uint32_t protocol = 0;
+    CHECK(backend.EstablishContext(&context) == CARD_S_SUCCESS);
+    CHECK(backend.Connect(context, "Reader A", CARD_SHARE_SHARED, CARD_PROTOCOL_T1, &handle, &protocol) ==
+          CARD_S_SUCCESS);
+    CHECK(backend.BeginTransaction(handle) == CARD_S_SUCCESS);
+    CHECK(backend.EndTransaction(handle, CARD_RESET_CARD) == CARD_S_SUCCESS);
+    uint8_t buffer[258];
+    size_t length = sizeof(buffer);
+    CHECK(backend.Transmit(handle, protocol, select, sizeof(select), buffer, &length) == CARD_S_SUCCESS);
+    backend.Disconnect(handle, CARD_LEAVE_CARD);
+    backend.ReleaseContext(context);
+
+    CHECK(exchange());
+    CHECK(sessions.Connects() == 2);
+    sessions.ReleaseAll();
+}
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+const TestCase TESTS[] = {
+    { "monitor_events", TestMonitorEvents },
+    { "monitor_card_swap", TestMonitorCardSwap },
+    { "monitor_initial_state", TestMonitorInitialState },
+    { "monitor_steady_state_allocations", TestMonitorSteadyStateAllocations },
+    { "monitor_rebalance_while_flapping", TestMonitorRebalanceWhileFlapping },
+    { "hex_kernels", TestHexKernels },
+    { "template_expansion", TestTemplateExpansion },
+    { "apdu_parse", TestApduParse },
+    { "transport_chaining", TestTransportChaining },
+    { "apdu_script_branches", TestApduScriptBranches },
+    { "engine_event_variables", TestEngineEventVariables },
+    { "session_reconnects_after_reset", TestSessionReconnectsAfterReset },
+    { "service_reload_keeps_cache", TestServiceReloadKeepsCache },
+    { "service_reload_keeps_plugins", TestServiceReloadKeepsPlugins },
+    { "journal_records", TestJournalRecords },
+    { "trace_reader_numbers", TestTraceReaderNumbers },
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    // The main thread drives the simulated backend: what is counted is the
+    // threads of the code under test
+    SetAllocationsCounted(false);
+    size_t run = 0;
+    for (const TestCase& test : TESTS) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            selected = selected || strcmp(argv[i], test.name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        int failures = g_failures;
+        test.run();
+        printf("%s %s\n", g_failures == failures ? "ok    " : "FAILED", test.name);
+        run++;
+    }
+    if (run == 0) {
+        fprintf(stderr, "no such test\n");
+        return 2;
+    }
+    return g_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,22 @@
+#include "CardBackend.h"
+
+const char* const CARD_PNP_NOTIFICATION = "\\\\?PnP?\\Notification";
+
+std::unique_ptr<CardBackend> CreateCardBackend(const std::string& type) {
+    if (type.empty() || type == "pcsc") {
+        return CreatePcscBackend();
+    }
+    if (type == "simulated") {
+        return CreateSimulatedBackend();
+    }
+    if (type == "replay") {
+        return CreateReplayBackend();
+    }
+
+    // Allow naming the platform PC/SC stack explicitly
+    std::unique_ptr<CardBackend> backend = CreatePcscBackend();
+    if (backend && type == backend->Name()) {
+        return backend;
+    }
+    return std::unique_ptr<CardBackend>();
+}
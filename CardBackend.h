@@ -0,0 +1,116 @@
+#ifndef CARDBACKEND_H
+#define CARDBACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Result codes. These use the PC/SC values, which are the same for WinSCard
+// and pcsc-lite, so a backend can pass real results straight through.
+typedef int32_t CardResult;
+
+const CardResult CARD_S_SUCCESS              = 0;
+const CardResult CARD_E_CANCELLED            = (CardResult)0x80100002;
+const CardResult CARD_E_INVALID_HANDLE       = (CardResult)0x80100003;
+const CardResult CARD_E_INVALID_PARAMETER    = (CardResult)0x80100004;
+const CardResult CARD_E_INSUFFICIENT_BUFFER  = (CardResult)0x80100008;
+const CardResult CARD_E_UNKNOWN_READER       = (CardResult)0x80100009;
+const CardResult CARD_E_TIMEOUT              = (CardResult)0x8010000A;
+const CardResult CARD_E_SHARING_VIOLATION    = (CardResult)0x8010000B;
+const CardResult CARD_E_NO_SMARTCARD         = (CardResult)0x8010000C;
+const CardResult CARD_E_NOT_TRANSACTED       = (CardResult)0x80100016;
+const CardResult CARD_E_READER_UNAVAILABLE   = (CardResult)0x80100017;
+const CardResult CARD_E_NO_SERVICE           = (CardResult)0x8010001D;
+const CardResult CARD_E_SERVICE_STOPPED      = (CardResult)0x8010001E;
+const CardResult CARD_E_NO_READERS_AVAILABLE = (CardResult)0x8010002E;
+const CardResult CARD_W_RESET_CARD           = (CardResult)0x80100068;
+const CardResult CARD_W_REMOVED_CARD         = (CardResult)0x80100069;
+
+// Reader state flags (SCARD_STATE_*)
+const uint32_t CARD_STATE_UNAWARE     = 0x0000;
+const uint32_t CARD_STATE_IGNORE      = 0x0001;
+const uint32_t CARD_STATE_CHANGED     = 0x0002;
+const uint32_t CARD_STATE_UNKNOWN     = 0x0004;
+const uint32_t CARD_STATE_UNAVAILABLE = 0x0008;
+const uint32_t CARD_STATE_EMPTY       = 0x0010;
+const uint32_t CARD_STATE_PRESENT     = 0x0020;
+const uint32_t CARD_STATE_EXCLUSIVE   = 0x0080;
+const uint32_t CARD_STATE_INUSE       = 0x0100;
+const uint32_t CARD_STATE_MUTE        = 0x0200;
+
+// Share modes, protocols and dispositions (SCARD_SHARE_*, SCARD_PROTOCOL_*, SCARD_*_CARD)
+const uint32_t CARD_SHARE_EXCLUSIVE = 1;
+const uint32_t CARD_SHARE_SHARED    = 2;
+const uint32_t CARD_PROTOCOL_T0     = 0x0001;
+const uint32_t CARD_PROTOCOL_T1     = 0x0002;
+const uint32_t CARD_PROTOCOL_RAW    = 0x0004;
+const uint32_t CARD_LEAVE_CARD      = 0;
+const uint32_t CARD_RESET_CARD      = 1;
+const uint32_t CARD_UNPOWER_CARD    = 2;
+
+const uint32_t CARD_INFINITE = 0xFFFFFFFF;
+const size_t CARD_MAX_ATR_SIZE = 36;
+
+// Pseudo reader that reports reader arrival and removal
+extern const char* const CARD_PNP_NOTIFICATION;
+
+typedef uintptr_t CardContext;
+typedef uintptr_t CardHandle;
+
+// Portable counterpart of SCARD_READERSTATE. The reader name is not owned;
+// the caller keeps it alive for as long as the state is in use.
+struct CardReaderState {
+    const char* reader;
+    uint32_t currentState;
+    uint32_t eventState;
+    uint32_t atrLength;
+    uint8_t atr[CARD_MAX_ATR_SIZE];
+};
+
+// The subset of PC/SC used by the monitor and the APDU exchange. Contexts
+// follow PC/SC rules: a context is used by one thread at a time, and Cancel
+// may be called from any thread to abort a blocking GetStatusChange.
+class CardBackend {
+public:
+    virtual ~CardBackend() {}
+
+    virtual const char* Name() const = 0;
+
+    virtual CardResult EstablishContext(CardContext* context) = 0;
+    virtual CardResult ReleaseContext(CardContext context) = 0;
+    virtual CardResult Cancel(CardContext context) = 0;
+
+    // Fill readers with a double-null terminated list of reader names
+    virtual CardResult ListReaders(CardContext context, std::vector<char>& readers) = 0;
+    // Largest number of states one GetStatusChange call accepts
+    virtual size_t MaxReaderStates() const = 0;
+    virtual CardResult GetStatusChange(CardContext context, uint32_t timeoutMs,
+                                       CardReaderState* states, size_t count) = 0;
+
+    virtual CardResult Connect(CardContext context, const char* reader, uint32_t shareMode,
+                               uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) = 0;
+    virtual CardResult Disconnect(CardHandle card, uint32_t disposition) = 0;
+
+    // Lock the card against other connections for a series of exchanges
+    virtual CardResult BeginTransaction(CardHandle card) = 0;
+    virtual CardResult EndTransaction(CardHandle card, uint32_t disposition) = 0;
+
+    // On entry *recvLength is the size of recv, on return the response length
+    virtual CardResult Transmit(CardHandle card, uint32_t protocol,
+                                const uint8_t* send, size_t sendLength,
+                                uint8_t* recv, size_t* recvLength) = 0;
+};
+
+// Backend factories. CreatePcscBackend talks to WinSCard on Windows and to
+// pcsc-lite elsewhere; it returns NULL when built without PC/SC support.
+std::unique_ptr<CardBackend> CreatePcscBackend();
+std::unique_ptr<CardBackend> CreateSimulatedBackend();
+std::unique_ptr<CardBackend> CreateReplayBackend();
+
+// Create a backend by configuration name ("pcsc", "winscard", "pcsclite",
+// "simulated" or "replay"). Returns NULL for unknown or unavailable backends.
+std::unique_ptr<CardBackend> CreateCardBackend(const std::string& type);
+
+#endif // CARDBACKEND_H
@@ -0,0 +1,273 @@
+#include "CardEngine.h"
+#include <string.h>
+#include <chrono>
+
+namespace {
+
+bool Succeeded(const ByteSpan& response) {
+    return response.length >= 2 && response.data[response.length - 2] == 0x90 &&
+           response.data[response.length - 1] == 0x00;
+}
+
+// Scratch memory of the calling worker, reset after each event it handles
+EventArena& WorkerArena() {
+    static thread_local EventArena arena;
+    return arena;
+}
+
+// CardActionEvent::transmit: an APDU from a plugin, sent in the event's
+// transaction
+int32_t CARDACTION_CALL PluginTransmit(const CardActionEvent* event, const uint8_t* command, size_t length,
+                                       uint8_t* response, size_t* responseLength) {
+    if (!event || !event->session || !command || !responseLength || (!response && *responseLength > 0)) {
+        return CARD_E_INVALID_PARAMETER;
+    }
+    ByteSpan received;
+    CardResult result = ((CardTransaction*)event->session)->Transmit(command, length, received);
+    if (result != CARD_S_SUCCESS) {
+        *responseLength = 0;
+        return result;
+    }
+    if (received.length > *responseLength) {
+        *responseLength = received.length;
+        return CARD_E_INSUFFICIENT_BUFFER;
+    }
+    if (received.length > 0) {
+        memcpy(response, received.data, received.length);
+    }
+    *responseLength = received.length;
+    return CARD_S_SUCCESS;
+}
+
+} // namespace
+
+CardEngine::CardEngine(CardBackend& backend, const EngineOptions& options, std::shared_ptr<const RuleSet> rules,
+                       EventServer* events, LatencyMetrics& latency, const Sinks& sinks)
+    : m_backend(backend), m_events(events), m_latency(latency), m_sinks(sinks), m_rules(rules),
+      m_sessions(backend), m_workers(options.workerThreads),
+      m_monitor(backend, options.readersPerMonitor, options.debounceMs, options.debounceWindows,
+                CardMonitor::Sinks{
+                    [this](const DebouncedEvent& event, ReaderId reader) { Dispatch(event, reader); },
+                    [this](const ReaderList& added, const ReaderList& removed) { ReportReaders(added, removed); },
+                    sinks.state, sinks.ready }) {
+}
+
+CardEngine::~CardEngine() {
+    Stop();
+}
+
+CardResult CardEngine::Start() {
+    return m_monitor.Start();
+}
+
+void CardEngine::Stop() {
+    m_monitor.Stop();
+    m_workers.Stop();
+    m_sessions.ReleaseAll();
+}
+
+void CardEngine::SetRules(std::shared_ptr<const RuleSet> rules) {
+    std::atomic_store(&m_rules, rules);
+}
+
+std::shared_ptr<const RuleSet> CardEngine::Rules() const {
+    return std::atomic_load(&m_rules);
+}
+
+// Queue a debounced card event on the workers, in order per reader
+void CardEngine::Dispatch(const DebouncedEvent& event, ReaderId reader) {
+    uint64_t queued = LatencyNow();
+    m_latency.Record(STAGE_DETECT, event.detected);
+    m_workers.Submit(event.reader, [this, event, reader, queued]() {
+        m_latency.Record(STAGE_QUEUE, queued);
+        if (event.inserted) {
+            HandleInserted(event, reader);
+        } else {
+            HandleRemoved(event, reader);
+        }
+    });
+}
+
+// Tell subscribers and the sink about attached and detached readers. A
+// detached reader's session is closed on its strand, after its last event.
+void CardEngine::ReportReaders(const ReaderList& added, const ReaderList& removed) {
+    for (const auto& reader : removed) {
+        std::string name = reader->name;
+        m_workers.Submit(name, [this, name]() {
+            m_sessions.Release(name);
+            std::lock_guard<std::mutex> lock(m_insertedMutex);
+            m_insertedRules.erase(name);
+        });
+    }
+    if (m_events) {
+        uint64_t timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        for (const auto& reader : added) {
+            m_events->PublishReaderChange(reader->name.c_str(), true, timestamp);
+        }
+        for (const auto& reader : removed) {
+            m_events->PublishReaderChange(reader->name.c_str(), false, timestamp);
+        }
+    }
+    m_sinks.readers(added, removed);
+}
+
+// Card inserted: pick the rule for the reader and ATR, send its APDUs and run
+// its insert actions with the responses
+void CardEngine::HandleInserted(const DebouncedEvent& event, ReaderId reader) {
+    std::shared_ptr<const RuleSet> rules = Rules();
+    int match = rules->ruleIndex.Match(event.reader.c_str(), event.atr.data(), event.atr.size());
+    std::shared_ptr<const EventRule> rule = match >= 0 ? rules->rules[match] : rules->defaultRule;
+    {
+        std::lock_guard<std::mutex> lock(m_insertedMutex);
+        m_insertedRules[event.reader] = rule;
+    }
+
+    EventArena& arena = WorkerArena();
+    {
+        CardTransaction transaction(m_sessions, event.reader, m_latency);
+        ByteSpan* responses = NULL;
+        size_t count = SendAPDUs(*rules, event, *rule, transaction, arena, responses);
+        size_t variableCount = count > 0 ? rule->insertAPDUs.Variables().size() : 0;
+        RunActions(rule->insertActions, event, responses, count, responses + count, variableCount,
+                   &transaction, arena);
+    }
+    arena.Reset();
+    m_latency.Record(STAGE_TOTAL, event.detected);
+    m_sinks.state(reader, true);
+}
+
+// Card removed: run the remove actions of the rule the card was inserted with
+void CardEngine::HandleRemoved(const DebouncedEvent& event, ReaderId reader) {
+    std::shared_ptr<const EventRule> rule = Rules()->defaultRule;
+    {
+        std::lock_guard<std::mutex> lock(m_insertedMutex);
+        // The entry stays until the reader is detached, so the next
+        // insertion reuses it
+        auto it = m_insertedRules.find(event.reader);
+        if (it != m_insertedRules.end() && it->second) {
+            rule = std::move(it->second);
+            it->second.reset();
+        }
+    }
+
+    m_sessions.Disconnect(event.reader);
+    EventArena& arena = WorkerArena();
+    RunActions(rule->removeActions, event, NULL, 0, NULL, 0, NULL, arena);
+    arena.Reset();
+    m_latency.Record(STAGE_TOTAL, event.detected);
+    m_sinks.state(reader, false);
+}
+
+// Run the rule's APDU script on the card and set responses to the raw
+// responses, one per APDU, followed in the same block by the script's
+// variables, all held in arena. Returns the number of APDU responses, 0 if
+// there are none or the card could not be reached. With a response cache,
+// cacheable APDUs are answered from the cache when the card has been seen
+// before, and the card is only reached if something must be sent.
+size_t CardEngine::SendAPDUs(const RuleSet& rules, const DebouncedEvent& event, const EventRule& rule,
+                             CardTransaction& transaction, EventArena& arena, ByteSpan*& responses) {
+    const ApduScript& script = rule.insertAPDUs;
+    if (script.Empty()) {
+        return 0;
+    }
+
+    // Responses are copied out of the transport, which reuses its buffer
+    auto transmit = [&](const uint8_t* command, size_t length, ByteSpan& response) {
+        ByteSpan received;
+        transaction.Transmit(command, length, received);
+        response = arena.Copy(received.data, received.length);
+    };
+
+    responses = arena.Allocate<ByteSpan>(script.Slots());
+    for (size_t i = 0; i < script.Slots(); i++) {
+        responses[i].data = NULL;
+        responses[i].length = 0;
+    }
+
+    // Identify the card and look it up. A card whose identifying APDU fails
+    // is neither looked up nor stored.
+    ResponseCache* cache = rules.responseCache.get();
+    std::string cacheKey;
+    ResponseCache::Responses cached;
+    if (cache) {
+        ByteSpan identity = { NULL, 0 };
+        if (!rules.cacheIdentity.Empty()) {
+            transmit(rules.cacheIdentity.Command(0), rules.cacheIdentity.Length(0), identity);
+            if (!Succeeded(identity)) {
+                cache = NULL;
+            }
+        }
+        if (cache) {
+            // Rules send different APDUs, so each has its own entries
+            cacheKey = rule.name + '\0' + ResponseCache::MakeKey(event.atr.data(), event.atr.size(),
+                                                                  identity.data, identity.length);
+            if (cache->Lookup(cacheKey, cached)) {
+                for (size_t i = 0; i < cached.size() && i < script.Count(); i++) {
+                    responses[i] = arena.Copy(cached[i].data(), cached[i].size());
+                }
+            }
+        }
+    }
+
+    // Run the script, sending each APDU it reaches that was not answered
+    // from the cache
+    bool store = false;
+    script.Run([&](size_t i, ByteSpan& response) {
+        if (cache && rule.cacheableAPDUs[i] && response.length > 0) {
+            return;
+        }
+        transmit(script.Command(i), script.Length(i), response);
+        store = store || (cache && rule.cacheableAPDUs[i] && Succeeded(response));
+    }, responses);
+
+    if (transaction.Status() != CARD_S_SUCCESS) {
+        // The card could not be reached at all
+        return 0;
+    }
+
+    // Remember the successful responses of cacheable APDUs
+    if (store) {
+        cached.assign(script.Count(), std::vector<uint8_t>());
+        for (size_t i = 0; i < script.Count(); i++) {
+            if (rule.cacheableAPDUs[i] && Succeeded(responses[i])) {
+                cached[i].assign(responses[i].data, responses[i].data + responses[i].length);
+            }
+        }
+        cache->Store(cacheKey, cached);
+    }
+
+    return script.Count();
+}
+
+// Publish the event to subscribers, then run the actions in order
+void CardEngine::RunActions(const std::vector<std::shared_ptr<Action>>& actions, const DebouncedEvent& event,
+                            const ByteSpan* responses, size_t responseCount, const ByteSpan* variables,
+                            size_t variableCount, CardTransaction* transaction, EventArena& arena) {
+    CardActionEvent actionEvent = {};
+    actionEvent.size = sizeof(actionEvent);
+    actionEvent.type = event.inserted ? CARDACTION_EVENT_INSERTED : CARDACTION_EVENT_REMOVED;
+    actionEvent.reader = event.reader.c_str();
+    actionEvent.atr.data = event.atr.data();
+    actionEvent.atr.length = event.atr.size();
+    actionEvent.responses = responses;
+    actionEvent.responseCount = responseCount;
+    actionEvent.timestamp = event.timestamp;
+    actionEvent.sequence = event.sequence;
+    actionEvent.dispatchTime = event.dispatchTime;
+    actionEvent.suppressed = event.suppressed;
+    actionEvent.transmit = transaction ? PluginTransmit : NULL;
+    actionEvent.session = transaction;
+    actionEvent.variables = variables;
+    actionEvent.variableCount = variableCount;
+
+    if (m_events) {
+        m_events->PublishCardEvent(actionEvent);
+    }
+    if (m_sinks.card) {
+        m_sinks.card(actionEvent);
+    }
+    for (const auto& action : actions) {
+        action->Run(actionEvent, arena);
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef CARDENGINE_H
+#define CARDENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Action.h"
+#include "ApduScript.h"
+#include "ApduTransport.h"
+#include "CardBackend.h"
+#include "CardMonitor.h"
+#include "EventArena.h"
+#include "EventServer.h"
+#include "LatencyMetrics.h"
+#include "ResponseCache.h"
+#include "RuleIndex.h"
+#include "SessionManager.h"
+#include "WorkerPool.h"
+
+// How the cards matched by one rule are handled
+struct EventRule {
+    std::string name;                   // Section the rule comes from
+    ApduScript insertAPDUs;
+    std::vector<bool> cacheableAPDUs;   // By position in insertAPDUs
+    std::vector<std::shared_ptr<Action>> insertActions;
+    std::vector<std::shared_ptr<Action>> removeActions;
+};
+
+// The rules cards are handled by. A RuleSet is immutable once the engine has
+// it; changing the rules means handing the engine a new one.
+struct RuleSet {
+    std::vector<std::shared_ptr<const EventRule>> rules;   // In priority order
+    RuleIndex ruleIndex;                                    // Selects from rules by reader and ATR
+    std::shared_ptr<const EventRule> defaultRule;           // For cards no rule matches
+    ApduScript cacheIdentity;           // At most one APDU identifying the card
+    std::shared_ptr<ResponseCache> responseCache;  // NULL unless some APDU is cacheable
+};
+
+// Settings fixed for the lifetime of an engine
+struct EngineOptions {
+    unsigned workerThreads = 4;
+    unsigned readersPerMonitor = 0;     // 0 for the backend's limit
+    uint32_t debounceMs = 0;
+    std::map<std::string, uint32_t> debounceWindows;   // Per-reader overrides
+};
+
+// The card event engine: monitors the readers, picks the rule for each card,
+// sends its APDUs and runs its actions on a pool of workers. Events for the
+// same reader run in order; different readers are handled in parallel. Each
+// present card keeps one connection, and an insert event's APDUs, including
+// those sent by plugins, share one transaction on it. Responses, command
+// lines and other per-event data live in the worker's EventArena, which is
+// reset after each event, so handling an event allocates little.
+//
+// The sinks are called from the monitor and worker threads and must return
+// quickly.
+class CardEngine {
+public:
+    typedef std::function<void(const CardActionEvent& event)> CardSink;
+
+    struct Sinks {
+        CardMonitor::ReaderSink readers;    // Readers attached and detached
+        CardMonitor::StateSink state;       // Card presence, initially and after each event's actions
+        CardSink card;                      // Optional: each card event, before its actions
+        CardMonitor::ReadySink ready;       // Optional: every reader attached at startup is watched
+    };
+
+    // events, if not NULL, receives every card and reader event. latency
+    // records the stages of each event.
+    CardEngine(CardBackend& backend, const EngineOptions& options, std::shared_ptr<const RuleSet> rules,
+               EventServer* events, LatencyMetrics& latency, const Sinks& sinks);
+    ~CardEngine();
+
+    // Start the workers and the reader monitor
+    CardResult Start();
+
+    // Stop monitoring and wait for the events in progress
+    void Stop();
+
+    // Rules for new events. Events in progress finish with the rules they
+    // started with, and a removal runs the rule its card was inserted with.
+    // Each event loads the rules once, with std::atomic_load: a lock from
+    // the standard library's pool, held for the pointer copy only. Caching
+    // the rules per worker would avoid it, but would keep replaced rules
+    // and their plugin instances alive on idle workers.
+    void SetRules(std::shared_ptr<const RuleSet> rules);
+    std::shared_ptr<const RuleSet> Rules() const;
+
+    const EventDebouncer& Debouncer() const { return m_monitor.Debouncer(); }
+    size_t ReaderCount() { return m_monitor.ReaderCount(); }
+    size_t ShardCount() { return m_monitor.ShardCount(); }
+    const SessionManager& Sessions() const { return m_sessions; }
+
+private:
+    void Dispatch(const DebouncedEvent& event, ReaderId reader);
+    void ReportReaders(const ReaderList& added, const ReaderList& removed);
+    void HandleInserted(const DebouncedEvent& event, ReaderId reader);
+    void HandleRemoved(const DebouncedEvent& event, ReaderId reader);
+    size_t SendAPDUs(const RuleSet& rules, const DebouncedEvent& event, const EventRule& rule,
+                     CardTransaction& transaction, EventArena& arena, ByteSpan*& responses);
+    void RunActions(const std::vector<std::shared_ptr<Action>>& actions, const DebouncedEvent& event,
+                    const ByteSpan* responses, size_t responseCount, const ByteSpan* variables,
+                    size_t variableCount, CardTransaction* transaction, EventArena& arena);
+
+    CardBackend& m_backend;
+    EventServer* m_events;
+    LatencyMetrics& m_latency;
+    Sinks m_sinks;
+    std::shared_ptr<const RuleSet> m_rules;     // Access with std::atomic_load/store
+    SessionManager m_sessions;                  // Outlives the workers using it
+    WorkerPool m_workers;
+    CardMonitor m_monitor;
+
+    // Rule applied to the card in each reader, NULL while it is empty
+    std::mutex m_insertedMutex;
+    std::map<std::string, std::shared_ptr<const EventRule>> m_insertedRules;
+};
+
+#endif // CARDENGINE_H
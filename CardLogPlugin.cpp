@@ -0,0 +1,83 @@
+// Example action plugin: appends one line per card event to a log file, the
+// in-process equivalent of the default "cmd.exe /c echo" commands.
+//
+//   [Plugin:Log]
+//   Path=CardLogPlugin.dll
+//   Options=C:\ProgramData\CardAction\events.log
+//
+// Each line holds the event, the reader, the ATR and the APDU responses in hex.
+#include "CardActionPlugin.h"
+#include <stdio.h>
+#include <mutex>
+#include <string>
+
+namespace {
+
+struct CardLog {
+    FILE* file;
+    std::mutex mutex;   // Events for different readers arrive concurrently
+};
+
+void AppendHex(std::string& line, const CardActionBytes& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < bytes.length; i++) {
+        line += digits[bytes.data[i] >> 4];
+        line += digits[bytes.data[i] & 0x0F];
+    }
+}
+
+int CARDACTION_CALL Create(const char* options, void** instance) {
+    if (!options || !*options) {
+        return 1;
+    }
+    FILE* file = fopen(options, "a");
+    if (!file) {
+        return 2;
+    }
+    CardLog* log = new CardLog();
+    log->file = file;
+    *instance = log;
+    return 0;
+}
+
+int CARDACTION_CALL HandleEvent(void* instance, const CardActionEvent* event) {
+    CardLog* log = (CardLog*)instance;
+
+    std::string line = std::to_string(event->timestamp);
+    line += event->type == CARDACTION_EVENT_INSERTED ? " inserted \"" : " removed \"";
+    line += event->reader;
+    line += "\" ";
+    AppendHex(line, event->atr);
+    for (size_t i = 0; i < event->responseCount; i++) {
+        line += ' ';
+        AppendHex(line, event->responses[i]);
+    }
+    line += '\n';
+
+    std::lock_guard<std::mutex> lock(log->mutex);
+    if (fwrite(line.data(), 1, line.size(), log->file) != line.size() || fflush(log->file) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+void CARDACTION_CALL Destroy(void* instance) {
+    CardLog* log = (CardLog*)instance;
+    fclose(log->file);
+    delete log;
+}
+
+const CardActionPlugin g_plugin = {
+    sizeof(CardActionPlugin),
+    CARDACTION_PLUGIN_API_VERSION,
+    "log",
+    Create,
+    HandleEvent,
+    Destroy
+};
+
+} // namespace
+
+extern "C" CARDACTION_PLUGIN_EXPORT const CardActionPlugin* CARDACTION_CALL CardActionGetPlugin(uint32_t hostApiVersion) {
+    return hostApiVersion == CARDACTION_PLUGIN_API_VERSION ? &g_plugin : NULL;
+}
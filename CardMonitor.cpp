@@ -0,0 +1,416 @@
+#include "CardMonitor.h"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+uint64_t NowMilliseconds() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+CardMonitor::CardMonitor(CardBackend& backend, size_t readersPerShard, uint32_t debounceMs,
+                         const std::map<std::string, uint32_t>& debounceWindows, const Sinks& sinks)
+    : m_backend(backend),
+      m_readersPerShard(std::max<size_t>(1, readersPerShard > 0 ? std::min(readersPerShard, backend.MaxReaderStates())
+                                                                 : backend.MaxReaderStates())),
+      m_sinks(sinks),
+      m_debouncer(debounceMs, debounceWindows, [this](const DebouncedEvent& event) {
+          m_sinks.event(event, m_registry.Find(event.reader));
+      }) {
+}
+
+CardMonitor::~CardMonitor() {
+    Stop();
+}
+
+CardResult CardMonitor::Start() {
+    CardResult status = m_backend.EstablishContext(&m_context);
+    if (status != CARD_S_SUCCESS) {
+        return status;
+    }
+    m_coordinator = std::thread(&CardMonitor::CoordinatorLoop, this);
+    return CARD_S_SUCCESS;
+}
+
+void CardMonitor::Stop() {
+    if (!m_coordinator.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    // The coordinator retires the shards on its way out
+    CancelUntil(m_context, m_coordinatorExited);
+    m_coordinator.join();
+    m_backend.ReleaseContext(m_context);
+}
+
+size_t CardMonitor::ShardCount() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_shards.size();
+}
+
+size_t CardMonitor::ReaderCount() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_registry.Count();
+}
+
+// The caller holds m_mutex
+bool CardMonitor::Stopping(const Shard* shard) const {
+    return m_stopping || (shard && shard->stopping);
+}
+
+void CardMonitor::ThreadExited(bool& exited) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        exited = true;
+    }
+    m_wake.notify_all();
+}
+
+// Cancel the waits on context until the thread using it has exited. Cancel
+// only aborts a wait in progress, so keep cancelling in case the thread was
+// between waits. A shard's context may still be being established.
+void CardMonitor::CancelUntil(const CardContext& context, const bool& exited) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!exited) {
+        if (context) {
+            m_backend.Cancel(context);
+        }
+        m_wake.wait_for(lock, std::chrono::milliseconds(100), [&exited] { return exited; });
+    }
+}
+
+void CardMonitor::Retire(std::unique_ptr<Shard> shard) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        shard->stopping = true;
+    }
+    CancelUntil(shard->context, shard->exited);
+    shard->thread.join();
+    if (shard->context) {
+        m_backend.ReleaseContext(shard->context);
+    }
+}
+
+// Coordinator thread: waits on the PnP notification alone and updates the
+// shards whenever readers come or go
+void CardMonitor::CoordinatorLoop() {
+    CardReaderState pnp = {};
+    pnp.reader = CARD_PNP_NOTIFICATION;
+    pnp.currentState = CARD_STATE_UNAWARE;
+    bool rebuild = true;
+    std::vector<std::unique_ptr<Shard>> retired;
+
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stopping) {
+                break;
+            }
+        }
+
+        if (rebuild) {
+            CardResult status = UpdateReaders(retired);
+            for (auto& shard : retired) {
+                Retire(std::move(shard));
+            }
+            retired.clear();
+            if (status != CARD_S_SUCCESS) {
+                // Wait and retry
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait_for(lock, std::chrono::seconds(1), [this] { return m_stopping; });
+                continue;
+            }
+            rebuild = false;
+        }
+
+        CardResult status = m_backend.GetStatusChange(m_context, CARD_INFINITE, &pnp, 1);
+        if (status == CARD_E_CANCELLED || status == CARD_E_TIMEOUT) {
+            continue;
+        }
+        if (status != CARD_S_SUCCESS) {
+            // The service restarted under us
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            rebuild = true;
+            continue;
+        }
+        if (pnp.eventState & CARD_STATE_CHANGED) {
+            rebuild = true;
+        }
+        pnp.currentState = pnp.eventState & ~CARD_STATE_CHANGED;
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        shards.swap(m_shards);
+        m_assignment.clear();
+    }
+    for (auto& shard : shards) {
+        Retire(std::move(shard));
+    }
+    ThreadExited(m_coordinatorExited);
+}
+
+// List the readers, bring the registry up to date and reassign the shards.
+// Shards that are no longer needed are moved to retired, for the caller to
+// stop without holding the lock.
+CardResult CardMonitor::UpdateReaders(std::vector<std::unique_ptr<Shard>>& retired) {
+    CardResult status = m_backend.ListReaders(m_context, m_readerList);
+    if (status == CARD_E_NO_READERS_AVAILABLE) {
+        m_readerList.assign(1, '\0');
+        status = CARD_S_SUCCESS;
+    }
+    if (status != CARD_S_SUCCESS) {
+        return status;
+    }
+
+    ReaderList readers;
+    ReaderList added;
+    ReaderList removed;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_registry.Update(m_readerList.data(), readers, added, removed);
+    for (const auto& reader : removed) {
+        m_debouncer.Forget(reader->name);
+        m_lastStates.erase(reader->id);
+    }
+    if (!added.empty() || !removed.empty()) {
+        m_sinks.readers(added, removed);
+    }
+
+    // Readers of the first listing are waited for to report ready; a reader
+    // detached before it reported never will
+    if (!m_listed) {
+        for (const auto& reader : readers) {
+            m_unlearned.insert(reader->id);
+        }
+        m_listed = true;
+    }
+    for (const auto& reader : removed) {
+        m_unlearned.erase(reader->id);
+    }
+    Rebalance(readers, retired);
+    CheckReady();
+    return CARD_S_SUCCESS;
+}
+
+// Report ready once every reader of the first listing has reported its
+// state. The caller holds m_mutex.
+void CardMonitor::CheckReady() {
+    if (m_ready || !m_listed || !m_unlearned.empty()) {
+        return;
+    }
+    m_ready = true;
+    if (m_sinks.ready) {
+        m_sinks.ready();
+    }
+}
+
+// Spread the readers over as few shards as the per-shard limit allows, as
+// evenly as possible. Readers stay on their shard unless it has more than its
+// share, so a hot-plug moves only the readers needed to even the shards out.
+// The caller holds m_mutex.
+void CardMonitor::Rebalance(const ReaderList& readers, std::vector<std::unique_ptr<Shard>>& retired) {
+    size_t shardCount = (readers.size() + m_readersPerShard - 1) / m_readersPerShard;
+    size_t share = shardCount > 0 ? (readers.size() + shardCount - 1) / shardCount : 0;
+
+    // Keep the fullest shards, which moves the fewest readers
+    std::stable_sort(m_shards.begin(), m_shards.end(),
+                     [](const std::unique_ptr<Shard>& a, const std::unique_ptr<Shard>& b) {
+                         return a->assigned.size() > b->assigned.size();
+                     });
+    while (m_shards.size() > shardCount) {
+        retired.push_back(std::move(m_shards.back()));
+        m_shards.pop_back();
+    }
+    while (m_shards.size() < shardCount) {
+        std::unique_ptr<Shard> shard(new Shard());
+        shard->thread = std::thread(&CardMonitor::ShardLoop, this, std::ref(*shard));
+        m_shards.push_back(std::move(shard));
+    }
+
+    // Readers that can stay where they are, then the rest on the emptiest shards
+    std::vector<ReaderList> lists(shardCount);
+    ReaderList unplaced;
+    for (const auto& reader : readers) {
+        auto it = m_assignment.find(reader->id);
+        size_t slot = shardCount;
+        if (it != m_assignment.end()) {
+            for (size_t i = 0; i < shardCount; i++) {
+                if (m_shards[i].get() == it->second) {
+                    slot = i;
+                    break;
+                }
+            }
+        }
+        if (slot < shardCount && lists[slot].size() < share) {
+            lists[slot].push_back(reader);
+        } else {
+            unplaced.push_back(reader);
+        }
+    }
+    for (const auto& reader : unplaced) {
+        size_t slot = 0;
+        for (size_t i = 1; i < shardCount; i++) {
+            if (lists[i].size() < lists[slot].size()) {
+                slot = i;
+            }
+        }
+        lists[slot].push_back(reader);
+    }
+
+    // Hand the new lists to the shards that changed and wake them
+    m_assignment.clear();
+    for (size_t i = 0; i < shardCount; i++) {
+        Shard& shard = *m_shards[i];
+        for (const auto& reader : lists[i]) {
+            m_assignment[reader->id] = &shard;
+        }
+        if (lists[i] != shard.assigned) {
+            shard.assigned.swap(lists[i]);
+            shard.reassigned = true;
+            if (shard.context) {
+                m_backend.Cancel(shard.context);
+            }
+        }
+    }
+    m_wake.notify_all();
+}
+
+// Shard thread: waits on its readers and feeds their transitions to the
+// debouncer. Steady-state iterations do not allocate.
+void CardMonitor::ShardLoop(Shard& shard) {
+    // Establish the context here rather than in Rebalance, so new shards do
+    // it in parallel and without the lock. Retry while the resource manager
+    // is unavailable, as the coordinator does.
+    for (;;) {
+        CardContext context = 0;
+        CardResult status = m_backend.EstablishContext(&context);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (status == CARD_S_SUCCESS) {
+            shard.context = context;
+            break;
+        }
+        if (m_wake.wait_for(lock, std::chrono::seconds(1), [this, &shard] { return Stopping(&shard); })) {
+            break;
+        }
+    }
+
+    for (;;) {
+        uint32_t timeout;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (shard.reassigned) {
+                TakeAssignment(shard);
+            }
+            if (shard.states.empty()) {
+                m_wake.wait(lock, [this, &shard] { return Stopping(&shard) || shard.reassigned; });
+            }
+            if (Stopping(&shard)) {
+                break;
+            }
+            if (shard.reassigned) {
+                continue;
+            }
+
+            // Report readers whose debounce window has closed
+            m_debouncer.Flush();
+            timeout = m_debouncer.NextTimeout();
+        }
+
+        // Block until something changes, the next window closes or the
+        // coordinator cancels the wait
+        CardResult status = m_backend.GetStatusChange(shard.context, timeout, shard.states.data(),
+                                                      shard.states.size());
+        if (status == CARD_E_CANCELLED || status == CARD_E_TIMEOUT) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (status != CARD_S_SUCCESS) {
+            // A reader disappeared under us; the coordinator reassigns it
+            m_wake.wait_for(lock, std::chrono::milliseconds(100),
+                            [this, &shard] { return Stopping(&shard) || shard.reassigned; });
+            continue;
+        }
+        ReportStates(shard);
+    }
+    ThreadExited(shard.exited);
+}
+
+// Rebuild the shard's state table from its assignment. Readers keep their
+// last known state, even when it was seen by another shard. The caller holds
+// m_mutex.
+void CardMonitor::TakeAssignment(Shard& shard) {
+    shard.readers = shard.assigned;
+    shard.reassigned = false;
+    shard.states.assign(shard.readers.size(), CardReaderState());
+    for (size_t i = 0; i < shard.readers.size(); i++) {
+        auto last = m_lastStates.find(shard.readers[i]->id);
+        shard.states[i].reader = shard.readers[i]->name.c_str();
+        shard.states[i].currentState = last != m_lastStates.end() ? last->second : CARD_STATE_UNAWARE;
+    }
+}
+
+// Pass the changes from the last wait to the debouncer. The caller holds
+// m_mutex.
+void CardMonitor::ReportStates(Shard& shard) {
+    for (size_t i = 0; i < shard.states.size(); i++) {
+        CardReaderState& state = shard.states[i];
+        if (!(state.eventState & CARD_STATE_CHANGED)) {
+            continue;
+        }
+
+        // Skip readers detached or moved to another shard since the wait
+        // began. A moved reader's new shard reports the change from the last
+        // state seen, so reporting it here too would repeat it or, after
+        // the new shard has reported a later one, go back in time.
+        const RegisteredReader& reader = *shard.readers[i];
+        auto owner = m_assignment.find(reader.id);
+        if (owner == m_assignment.end() || owner->second != &shard) {
+            continue;
+        }
+        uint32_t previous = state.currentState;
+        uint32_t current = state.eventState & ~CARD_STATE_CHANGED;
+        state.currentState = current;
+        m_lastStates[reader.id] = current;
+
+        // The first report for a reader only teaches us its state
+        bool isPresent = (current & CARD_STATE_PRESENT) != 0;
+        if (previous == CARD_STATE_UNAWARE) {
+            m_debouncer.Learn(reader.name, isPresent, state.atr, state.atrLength);
+            m_sinks.state(reader.id, isPresent);
+            if (m_unlearned.erase(reader.id)) {
+                CheckReady();
+            }
+            continue;
+        }
+
+        // Raw transitions go through the debouncer, which dispatches events
+        bool wasPresent = (previous & CARD_STATE_PRESENT) != 0;
+        if (wasPresent && isPresent && (previous >> 16) != (current >> 16)) {
+            // The reader's event counter, in the high word, moved while a
+            // card stayed present: it was swapped for another between two
+            // waits, so report the old card's removal and the new one's
+            // insertion
+            uint64_t now = NowMilliseconds();
+            m_debouncer.Transition(reader.name, false, state.atr, 0, now);
+            m_debouncer.Transition(reader.name, true, state.atr, state.atrLength, now);
+        }
+        else if (!wasPresent && isPresent) {
+            // Card inserted
+            m_debouncer.Transition(reader.name, true, state.atr, state.atrLength, NowMilliseconds());
+        }
+        else if (wasPresent && ((current & CARD_STATE_EMPTY) || (current & CARD_STATE_UNAVAILABLE))) {
+            // Card removed
+            m_debouncer.Transition(reader.name, false, state.atr, 0, NowMilliseconds());
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef CARDMONITOR_H
+#define CARDMONITOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "CardBackend.h"
+#include "Debouncer.h"
+#include "ReaderRegistry.h"
+
+// Watches every reader of a backend and reports debounced card events.
+//
+// A single GetStatusChange call accepts a limited number of readers, so the
+// readers are split into shards. Each shard is a thread with its own context
+// that waits on at most readersPerShard readers. A coordinator thread waits
+// on the PnP notification, keeps the reader registry and spreads the readers
+// evenly over as few shards as the limit allows. Each shard establishes its
+// own context, so the shards of a large reader farm come up in parallel.
+// When readers come and go, readers only move between shards to keep them
+// even, and a moved reader keeps its last known state so no transition is
+// lost or reported twice.
+//
+// No reader is connected to: a reader's first wait returns its state and
+// the ATR of its card straight away, so monitoring is armed as soon as each
+// shard has waited once.
+//
+// The sinks are called from the monitor threads with the monitor's lock
+// held. They must return quickly and must not call back into the monitor.
+class CardMonitor {
+public:
+    // A debounced event, with the ID of its reader (NO_READER if the reader
+    // has been detached in the meantime)
+    typedef std::function<void(const DebouncedEvent& event, ReaderId reader)> EventSink;
+    // Readers attached and detached since the last call
+    typedef std::function<void(const ReaderList& added, const ReaderList& removed)> ReaderSink;
+    // Card presence of a reader seen for the first time
+    typedef std::function<void(ReaderId reader, bool present)> StateSink;
+    // Every reader attached at startup has reported its state, so every card
+    // event from now on is seen
+    typedef std::function<void()> ReadySink;
+
+    struct Sinks {
+        EventSink event;
+        ReaderSink readers;
+        StateSink state;
+        ReadySink ready;                // Optional
+    };
+
+    // readersPerShard of 0 uses the backend's limit. debounceWindows
+    // overrides debounceMs for individual readers.
+    CardMonitor(CardBackend& backend, size_t readersPerShard, uint32_t debounceMs,
+                const std::map<std::string, uint32_t>& debounceWindows, const Sinks& sinks);
+    ~CardMonitor();
+
+    // Establish the coordinator's context and start watching
+    CardResult Start();
+
+    // Stop every monitor thread and release their contexts
+    void Stop();
+
+    const EventDebouncer& Debouncer() const { return m_debouncer; }
+    size_t ShardCount();
+    size_t ReaderCount();
+
+private:
+    struct Shard {
+        CardContext context = 0;        // Set by the shard thread once established
+        std::thread thread;
+        bool exited = false;
+        bool stopping = false;
+
+        // Written by the coordinator, taken over by the shard thread
+        ReaderList assigned;
+        bool reassigned = true;
+
+        // Owned by the shard thread
+        ReaderList readers;                     // Backing storage for reader
+        std::vector<CardReaderState> states;
+    };
+
+    void CoordinatorLoop();
+    CardResult UpdateReaders(std::vector<std::unique_ptr<Shard>>& retired);
+    void Rebalance(const ReaderList& readers, std::vector<std::unique_ptr<Shard>>& retired);
+    void CheckReady();
+    void ShardLoop(Shard& shard);
+    void TakeAssignment(Shard& shard);
+    void ReportStates(Shard& shard);
+    void Retire(std::unique_ptr<Shard> shard);
+    void ThreadExited(bool& exited);
+    bool Stopping(const Shard* shard) const;
+    void CancelUntil(const CardContext& context, const bool& exited);
+
+    CardBackend& m_backend;
+    size_t m_readersPerShard;
+    Sinks m_sinks;
+
+    // m_mutex guards everything shared between the monitor threads
+    std::mutex m_mutex;
+    std::condition_variable m_wake;                 // Thread exits, reassignments and Stop
+    EventDebouncer m_debouncer;
+    ReaderRegistry m_registry;
+    std::unordered_map<ReaderId, uint32_t> m_lastStates;   // Last state seen by any shard
+    std::unordered_map<ReaderId, Shard*> m_assignment;     // Shard watching each reader
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::unordered_set<ReaderId> m_unlearned;       // Readers of the first listing yet to report
+    bool m_listed = false;                          // The first listing is in m_unlearned
+    bool m_ready = false;
+    bool m_stopping = false;
+
+    // Owned by the coordinator thread
+    CardContext m_context = 0;
+    std::thread m_coordinator;
+    bool m_coordinatorExited = false;
+    std::vector<char> m_readerList;                 // Reused ListReaders buffer
+};
+
+#endif // CARDMONITOR_H
@@ -0,0 +1,620 @@
+#include "CardService.h"
+#include "Action.h"
+#include "ApduScript.h"
+#include "CommandTemplate.h"
+#include "RecordingBackend.h"
+#include "ReplayBackend.h"
+#include "ResponseCache.h"
+#include "RuleIndex.h"
+#include "SimulatedBackend.h"
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace {
+
+#ifdef _WIN32
+const char DEFAULT_INSERT_COMMAND[] = "cmd.exe /c echo Card inserted > %TEMP%\\card_inserted.txt";
+const char DEFAULT_REMOVE_COMMAND[] = "cmd.exe /c echo Card removed > %TEMP%\\card_removed.txt";
+
+std::wstring Utf8ToWide(const std::string& utf8) {
+    int length = MultiByteToWideChar(CP_UTF8, 0, utf8.data(), (int)utf8.size(), NULL, 0);
+    std::wstring wide(length, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, utf8.data(), (int)utf8.size(), &wide[0], length);
+    return wide;
+}
+
+// Settings read as UTF-8, for the interfaces that take the ANSI code page:
+// file names, PC/SC reader names and plugin options
+std::string Native(const std::string& utf8) {
+    std::wstring wide = Utf8ToWide(utf8);
+    int length = WideCharToMultiByte(CP_ACP, 0, wide.data(), (int)wide.size(), NULL, 0, NULL, NULL);
+    std::string ansi(length, '\0');
+    WideCharToMultiByte(CP_ACP, 0, wide.data(), (int)wide.size(), &ansi[0], length, NULL, NULL);
+    return ansi;
+}
+
+CommandString Command(const std::string& utf8) {
+    return Utf8ToWide(utf8);
+}
+
+// A file name in the ANSI code page, such as the INI directory, for the
+// interfaces that take a CommandString
+CommandString NativeCommand(const std::string& native) {
+    int length = MultiByteToWideChar(CP_ACP, 0, native.data(), (int)native.size(), NULL, 0);
+    std::wstring wide(length, L'\0');
+    MultiByteToWideChar(CP_ACP, 0, native.data(), (int)native.size(), &wide[0], length);
+    return wide;
+}
+#else
+const char DEFAULT_INSERT_COMMAND[] = "echo Card inserted > \"${TMPDIR:-/tmp}/card_inserted.txt\"";
+const char DEFAULT_REMOVE_COMMAND[] = "echo Card removed > \"${TMPDIR:-/tmp}/card_removed.txt\"";
+
+std::string Native(const std::string& utf8) {
+    return utf8;
+}
+
+CommandString Command(const std::string& utf8) {
+    return utf8;
+}
+
+CommandString NativeCommand(const std::string& native) {
+    return native;
+}
+#endif
+
+// Load an APDU list from key in section
+bool LoadApduScript(const IniFile& ini, const char* section, const char* key, ApduScript& script,
+                    std::string& error) {
+    if (!script.Compile(ini.Get(section, key), error)) {
+        error = "[" + std::string(section) + "] " + key + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+// Load a list of 1-based APDU positions from key in section into flags
+bool LoadApduPositions(const IniFile& ini, const char* section, const char* key, size_t count,
+                       std::vector<bool>& flags, std::string& error) {
+    std::string list = ini.Get(section, key);
+    flags.assign(count, false);
+    for (const char* position = list.c_str(); *position != '\0';) {
+        char* end;
+        unsigned long index = strtoul(position, &end, 10);
+        if (end == position || index == 0 || index > count) {
+            error = "[" + std::string(section) + "] " + key + ": expected positions between 1 and " +
+                    std::to_string(count);
+            return false;
+        }
+        flags[index - 1] = true;
+        position = end;
+        while (*position == ',' || *position == ' ') {
+            position++;
+        }
+    }
+    return true;
+}
+
+// Everything the actions of an event are loaded with
+struct ActionContext {
+    const IniFile& ini;
+    const std::string& directory;       // Plugin paths are relative to it
+    HexCase hexCase;
+    uint32_t defaultTimeoutMs;
+    CommandExecutor& executor;
+    LatencyMetrics* latency;
+    const ServiceConfig* previous;      // Plugins to reuse, if not NULL
+    std::map<std::string, ServiceConfig::LoadedPlugin>& plugins;    // Loaded so far, by name
+};
+
+// Load the actions of an event: the command in commandKey, if any, followed
+// by the plugins listed in pluginsKey. Each [Plugin:<name>] section is loaded
+// once and shared between events, or taken from the previous snapshot
+// when its path and options are the same. defaultCommand, if given, is
+// used when neither is set. apdus is the script run before the actions, if
+// any. The command is killed after the milliseconds in commandKey +
+// "Timeout", or the default timeout if that is not set.
+bool LoadEventActions(ActionContext& context, const char* section, const char* commandKey,
+                      const char* pluginsKey, const ApduScript* apdus, const char* defaultCommand,
+                      std::vector<std::shared_ptr<Action>>& actions, std::string& error) {
+    const IniFile& ini = context.ini;
+    std::string prefix = "[" + std::string(section) + "] ";
+    std::string command = ini.Get(section, commandKey);
+    std::string pluginList = ini.Get(section, pluginsKey);
+    if (command.empty() && pluginList.empty() && defaultCommand) {
+        command = defaultCommand;
+    }
+
+    // Response placeholders are checked against the APDU script and its variables
+    if (!command.empty()) {
+        CommandTemplate compiled;
+        if (!compiled.Compile(Command(command), apdus ? apdus->Count() : 0, error, context.hexCase,
+                              apdus ? &apdus->Variables() : NULL)) {
+            error = prefix + commandKey + ": " + error;
+            return false;
+        }
+        std::string timeoutKey = std::string(commandKey) + "Timeout";
+        uint32_t timeoutMs = ini.GetInt(section, timeoutKey.c_str(), context.defaultTimeoutMs);
+        actions.push_back(CreateCommandAction(compiled, timeoutMs, context.executor, context.latency));
+    }
+
+    size_t position = 0;
+    while (position <= pluginList.size()) {
+        size_t comma = pluginList.find(',', position);
+        if (comma == std::string::npos) {
+            comma = pluginList.size();
+        }
+        std::string name = pluginList.substr(position, comma - position);
+        position = comma + 1;
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name.empty()) {
+            continue;
+        }
+
+        ServiceConfig::LoadedPlugin& plugin = context.plugins[name];
+        if (!plugin.action) {
+            std::string pluginSection = "Plugin:" + name;
+            std::string path = ini.Get(pluginSection.c_str(), "Path");
+            plugin.options = ini.Get(pluginSection.c_str(), "Options");
+            if (path.empty()) {
+                error = prefix + pluginsKey + ": [Plugin:" + name + "] has no Path";
+                return false;
+            }
+
+            bool absolute = path[0] == '\\' || path[0] == '/' || (path.size() > 1 && path[1] == ':');
+            plugin.path = absolute ? Native(path) : context.directory + Native(path);
+            if (context.previous) {
+                auto loaded = context.previous->plugins.find(name);
+                if (loaded != context.previous->plugins.end() && loaded->second.path == plugin.path &&
+                    loaded->second.options == plugin.options) {
+                    plugin.action = loaded->second.action;
+                }
+            }
+            if (!plugin.action) {
+                plugin.action = LoadPluginAction(NativeCommand(plugin.path), Native(plugin.options), error);
+            }
+            if (!plugin.action) {
+                error = prefix + pluginsKey + ": " + path + ": " + error;
+                return false;
+            }
+        }
+        actions.push_back(plugin.action);
+    }
+
+    return true;
+}
+
+std::string Hex(const ApduScript& script, size_t index) {
+    std::string hex(script.Length(index) * 2, '\0');
+    HexEncode(script.Command(index), script.Length(index), &hex[0]);
+    return hex;
+}
+
+// Append the positions and bytes of the APDUs rule caches to out, if any
+void DescribeCached(const EventRule& rule, std::string& out) {
+    std::string cached;
+    for (size_t i = 0; i < rule.cacheableAPDUs.size(); i++) {
+        if (rule.cacheableAPDUs[i]) {
+            cached += ' ' + std::to_string(i) + ':' + Hex(rule.insertAPDUs, i);
+        }
+    }
+    if (!cached.empty()) {
+        out += rule.name + cached + '\n';
+    }
+}
+
+} // namespace
+
+bool LoadServiceConfig(const IniFile& ini, const std::string& directory, CommandExecutor& executor,
+                       LatencyMetrics* latency, const ServiceConfig* previous, ServiceConfig& config,
+                       std::string& error) {
+    // Load engine settings
+    unsigned defaultWorkers = std::thread::hardware_concurrency();
+    config.workerThreads = ini.GetInt("Engine", "Workers", defaultWorkers ? defaultWorkers : 4);
+    config.readersPerMonitor = ini.GetInt("Engine", "ReadersPerMonitor", 0);
+    config.hexCase = EqualsIgnoreCase(ini.Get("Engine", "HexCase", "lower"), "upper") ? HEX_UPPER : HEX_LOWER;
+
+    // Load command execution settings
+    config.commands.maxConcurrent = ini.GetInt("Commands", "MaxConcurrent", defaultWorkers ? defaultWorkers : 4);
+    config.commands.queueLimit = ini.GetInt("Commands", "QueueLimit", 64);
+    std::string overflow = ini.Get("Commands", "Overflow", "drop-newest");
+    if (EqualsIgnoreCase(overflow, "drop-newest")) {
+        config.commands.overflow = OVERFLOW_DROP_NEWEST;
+    } else if (EqualsIgnoreCase(overflow, "drop-oldest")) {
+        config.commands.overflow = OVERFLOW_DROP_OLDEST;
+    } else if (EqualsIgnoreCase(overflow, "block")) {
+        config.commands.overflow = OVERFLOW_BLOCK;
+    } else {
+        error = "[Commands] Overflow: expected drop-newest, drop-oldest or block";
+        return false;
+    }
+    config.commands.captureOutput = ini.GetInt("Commands", "CaptureOutput", 0) != 0;
+    config.commandTimeoutMs = ini.GetInt("Commands", "Timeout", 60000);
+
+    // Load the default rule from [OnInsert] and [OnRemove]. [Cache] APDUs
+    // marks its cacheable APDUs.
+    config.plugins.clear();
+    ActionContext context = { ini, directory, config.hexCase, config.commandTimeoutMs, executor, latency,
+                              previous, config.plugins };
+    std::shared_ptr<EventRule> defaultRule = std::make_shared<EventRule>();
+    defaultRule->name = "OnInsert";
+    if (!LoadApduScript(ini, "OnInsert", "APDUs", defaultRule->insertAPDUs, error) ||
+        !LoadApduPositions(ini, "Cache", "APDUs", defaultRule->insertAPDUs.Count(),
+                           defaultRule->cacheableAPDUs, error) ||
+        !LoadEventActions(context, "OnInsert", "Command", "Plugins", &defaultRule->insertAPDUs,
+                          DEFAULT_INSERT_COMMAND, defaultRule->insertActions, error) ||
+        !LoadEventActions(context, "OnRemove", "Command", "Plugins", NULL,
+                          DEFAULT_REMOVE_COMMAND, defaultRule->removeActions, error)) {
+        return false;
+    }
+    config.defaultRule = defaultRule;
+    bool cacheable = false;
+    for (bool flag : defaultRule->cacheableAPDUs) {
+        cacheable = cacheable || flag;
+    }
+
+    // Load [Rule:<name>] sections in file order; the first match wins
+    config.rules.clear();
+    config.ruleIndex = RuleIndex();
+    for (const std::string& section : ini.SectionNames()) {
+        if (section.size() < 5 || !EqualsIgnoreCase(section.substr(0, 5), "Rule:")) {
+            continue;
+        }
+        const char* name = section.c_str();
+        std::string prefix = "[" + section + "] ";
+        std::shared_ptr<EventRule> rule = std::make_shared<EventRule>();
+        rule->name = Native(section);
+
+        AtrPattern pattern;
+        if (!ParseAtrPattern(ini.Get(name, "ATR"), ini.Get(name, "ATRMask"), pattern, error)) {
+            error = prefix + "ATR: " + error;
+            return false;
+        }
+
+        if (!LoadApduScript(ini, name, "APDUs", rule->insertAPDUs, error) ||
+            !LoadApduPositions(ini, name, "Cache", rule->insertAPDUs.Count(), rule->cacheableAPDUs, error) ||
+            !LoadEventActions(context, name, "Command", "Plugins", &rule->insertAPDUs, NULL,
+                              rule->insertActions, error) ||
+            !LoadEventActions(context, name, "RemoveCommand", "RemovePlugins", NULL, NULL,
+                              rule->removeActions, error)) {
+            return false;
+        }
+        for (bool flag : rule->cacheableAPDUs) {
+            cacheable = cacheable || flag;
+        }
+
+        config.ruleIndex.Add(pattern, Native(ini.Get(name, "Reader", "*")));
+        config.rules.push_back(rule);
+    }
+
+    // Load the response cache, shared by all rules
+    if (!config.cacheIdentity.Compile(ini.Get("Cache", "Identity"), error)) {
+        error = "[Cache] Identity: " + error;
+        return false;
+    }
+    if (config.cacheIdentity.Count() > 1 || !config.cacheIdentity.Plain()) {
+        error = "[Cache] Identity: expected a single APDU";
+        return false;
+    }
+    config.responseCache.reset();
+    config.cacheSettings.clear();
+    if (cacheable) {
+        unsigned size = ini.GetInt("Cache", "Size", 1024);
+        unsigned ttl = ini.GetInt("Cache", "TTL", 3600);
+        config.responseCache = std::make_shared<ResponseCache>(size, ttl);
+        config.cacheSettings = std::to_string(size) + ' ' + std::to_string(ttl) + ' ' +
+                               (config.cacheIdentity.Empty() ? "" : Hex(config.cacheIdentity, 0)) + '\n';
+        DescribeCached(*config.defaultRule, config.cacheSettings);
+        for (const auto& rule : config.rules) {
+            DescribeCached(*rule, config.cacheSettings);
+        }
+    }
+
+    // Load debounce windows. [Debounce] maps reader names to their own window.
+    config.debounceMs = ini.GetInt("Engine", "Debounce", 0);
+    config.debounceWindows.clear();
+    if (const IniFile::Entries* windows = ini.Section("Debounce")) {
+        for (const auto& entry : *windows) {
+            config.debounceWindows[Native(entry.first)] = (uint32_t)strtoul(entry.second.c_str(), NULL, 10);
+        }
+    }
+
+    // Load event stream settings
+    config.eventEndpoint = Command(ini.Get("EventServer", "Endpoint"));
+    config.eventQueueLimit = ini.GetInt("EventServer", "QueueLimit", 256);
+
+    // Load the metrics endpoint
+    config.metricsPort = ini.GetInt("Metrics", "Port", 0);
+    if (config.metricsPort > 65535) {
+        error = "[Metrics] Port: expected a port number";
+        return false;
+    }
+
+    // Load the audit journal
+    config.journalPath = Native(ini.Get("Journal", "Path"));
+    config.journal.segmentSize = (uint64_t)ini.GetInt("Journal", "SegmentMB", 64) << 20;
+    config.journal.keepSegments = ini.GetInt("Journal", "Segments", 16);
+    config.journal.recordLimit = ini.GetInt("Journal", "RecordLimit", 4096);
+    if (config.journal.segmentSize == 0) {
+        error = "[Journal] SegmentMB: expected at least 1";
+        return false;
+    }
+    if (config.journal.recordLimit > 65536) {
+        error = "[Journal] RecordLimit: expected at most 65536 bytes";
+        return false;
+    }
+
+    // Load backend selection
+    config.backend = ini.Get("Backend", "Type", "pcsc");
+    config.simulatorScript = Native(ini.Get("Backend", "Script"));
+    config.replayTrace = Native(ini.Get("Backend", "Trace"));
+    config.replaySpeed = ini.GetInt("Backend", "Speed", 100);
+    config.recordTrace = Native(ini.Get("Backend", "Record"));
+
+    return true;
+}
+
+CardService::CardService() {
+}
+
+CardService::~CardService() {
+    Stop();
+}
+
+bool CardService::Start(const std::string& iniPath, const CardEngine::Sinks& sinks, std::string& error) {
+    m_startup.Begin();
+    m_iniPath = iniPath;
+    IniFile ini;
+    std::shared_ptr<ServiceConfig> config = std::make_shared<ServiceConfig>();
+    std::string directory = iniPath.substr(0, iniPath.find_last_of("\\/") + 1);
+    if (!ini.Load(iniPath, error) ||
+        !LoadServiceConfig(ini, directory, m_executor, &m_latency, NULL, *config, error)) {
+        return false;
+    }
+    std::atomic_store(&m_config, std::shared_ptr<const ServiceConfig>(config));
+    m_startup.Mark(STARTUP_CONFIGURED);
+
+    // Create the smart card backend
+    m_backend = CreateCardBackend(config->backend);
+    if (!m_backend) {
+        error = "[Backend] Type: unknown smart card backend " + config->backend;
+        return false;
+    }
+    if (!config->simulatorScript.empty()) {
+        SimulatedBackend* simulated = dynamic_cast<SimulatedBackend*>(m_backend.get());
+        if (simulated && !simulated->LoadScript(config->simulatorScript, error)) {
+            error = "[Backend] Script: " + error;
+            return false;
+        }
+    }
+    if (!config->replayTrace.empty()) {
+        ReplayBackend* replay = dynamic_cast<ReplayBackend*>(m_backend.get());
+        ReplayOptions replayOptions;
+        replayOptions.speed = config->replaySpeed / 100.0;
+        if (replay && !replay->Load(config->replayTrace, replayOptions, error)) {
+            error = "[Backend] Trace: " + error;
+            return false;
+        }
+    }
+    if (!config->recordTrace.empty()) {
+        m_backend = CreateRecordingBackend(std::move(m_backend), config->recordTrace, error);
+        if (!m_backend) {
+            error = "[Backend] Record: " + error;
+            return false;
+        }
+    }
+
+    // Start the event stream and the journal before any event can reach them
+    m_started = true;
+    if (!config->eventEndpoint.empty() && !m_events.Start(config->eventEndpoint, config->eventQueueLimit, error)) {
+        error = "[EventServer] Endpoint: " + error;
+        Stop();
+        return false;
+    }
+    if (!config->journalPath.empty() && !m_journal.Start(config->journalPath, config->journal, error)) {
+        error = "[Journal] Path: " + error;
+        Stop();
+        return false;
+    }
+
+    // Start the command slots before any event can queue a command
+    m_executor.Start(config->commands, &m_latency);
+
+    // Start the card event engine
+    EngineOptions options;
+    options.workerThreads = config->workerThreads;
+    options.readersPerMonitor = config->readersPerMonitor;
+    options.debounceMs = config->debounceMs;
+    options.debounceWindows = config->debounceWindows;
+    CardEngine::Sinks engineSinks = sinks;
+    bool journal = !config->journalPath.empty();
+    engineSinks.card = [this, journal](const CardActionEvent& event) {
+        m_startup.Mark(STARTUP_FIRST_EVENT);
+        if (journal) {
+            m_journal.Append(event);
+        }
+    };
+    CardMonitor::ReadySink ready = sinks.ready;
+    engineSinks.ready = [this, ready]() {
+        m_startup.Mark(STARTUP_READY);
+        if (ready) {
+            ready();
+        }
+    };
+    m_engine.reset(new CardEngine(*m_backend, options, config, config->eventEndpoint.empty() ? NULL : &m_events,
+                                  m_latency, engineSinks));
+    m_startup.Mark(STARTUP_MONITORING);
+    if (m_engine->Start() != CARD_S_SUCCESS) {
+        error = "Failed to establish smart card context";
+        Stop();
+        return false;
+    }
+    return true;
+}
+
+bool CardService::StartMetrics(std::string& error) {
+    // Serve metrics once the engine they read exists
+    std::shared_ptr<const ServiceConfig> config = Config();
+    if (!m_engine || config->metricsPort == 0) {
+        return true;
+    }
+    if (!m_metricsServer.Start((uint16_t)config->metricsPort, [this]() { return RenderMetrics(); }, error)) {
+        error = "[Metrics] Port: " + error;
+        return false;
+    }
+    return true;
+}
+
+void CardService::Stop() {
+    if (!m_started) {
+        return;
+    }
+    m_started = false;
+    m_metricsServer.Stop();
+    if (m_engine) {
+        m_engine->Stop();
+    }
+    m_executor.Stop();
+    m_journal.Stop();
+    m_events.Stop();
+
+    // Unload plugins now that no worker can call them
+    m_engine.reset();
+    std::atomic_store(&m_config, std::shared_ptr<const ServiceConfig>());
+    m_backend.reset();
+}
+
+bool CardService::Reload(std::string& message) {
+    IniFile ini;
+    std::shared_ptr<ServiceConfig> config = std::make_shared<ServiceConfig>();
+    std::string directory = m_iniPath.substr(0, m_iniPath.find_last_of("\\/") + 1);
+    std::shared_ptr<const ServiceConfig> current = Config();
+    if (!ini.Load(m_iniPath, message) ||
+        !LoadServiceConfig(ini, directory, m_executor, &m_latency, current.get(), *config, message)) {
+        return false;
+    }
+
+    // Report the startup settings that will only change on restart
+    std::string restart;
+    auto keep = [&restart](bool changed, const char* setting) {
+        if (changed) {
+            restart += (restart.empty() ? "" : ", ") + std::string(setting);
+        }
+    };
+    keep(config->backend != current->backend || config->simulatorScript != current->simulatorScript ||
+         config->replayTrace != current->replayTrace || config->replaySpeed != current->replaySpeed ||
+         config->recordTrace != current->recordTrace, "[Backend]");
+    keep(config->workerThreads != current->workerThreads, "[Engine] Workers");
+    keep(config->readersPerMonitor != current->readersPerMonitor, "[Engine] ReadersPerMonitor");
+    keep(config->debounceMs != current->debounceMs || config->debounceWindows != current->debounceWindows,
+         "[Engine] Debounce");
+    keep(config->eventEndpoint != current->eventEndpoint || config->eventQueueLimit != current->eventQueueLimit,
+         "[EventServer]");
+    keep(config->metricsPort != current->metricsPort, "[Metrics]");
+    keep(config->journalPath != current->journalPath ||
+         config->journal.segmentSize != current->journal.segmentSize ||
+         config->journal.keepSegments != current->journal.keepSegments ||
+         config->journal.recordLimit != current->journal.recordLimit, "[Journal]");
+    keep(config->commands.maxConcurrent != current->commands.maxConcurrent ||
+         config->commands.queueLimit != current->commands.queueLimit ||
+         config->commands.overflow != current->commands.overflow ||
+         config->commands.captureOutput != current->commands.captureOutput, "[Commands]");
+    config->backend = current->backend;
+    config->simulatorScript = current->simulatorScript;
+    config->replayTrace = current->replayTrace;
+    config->replaySpeed = current->replaySpeed;
+    config->recordTrace = current->recordTrace;
+    config->workerThreads = current->workerThreads;
+    config->readersPerMonitor = current->readersPerMonitor;
+    config->debounceMs = current->debounceMs;
+    config->debounceWindows = current->debounceWindows;
+    config->eventEndpoint = current->eventEndpoint;
+    config->eventQueueLimit = current->eventQueueLimit;
+    config->metricsPort = current->metricsPort;
+    config->journalPath = current->journalPath;
+    config->journal = current->journal;
+    config->commands = current->commands;
+
+    // Keep the response cache, and the cards it knows, unless what it holds
+    // has changed. A new cache continues the counts of the old one.
+    if (config->responseCache && current->responseCache) {
+        if (config->cacheSettings == current->cacheSettings) {
+            config->responseCache = current->responseCache;
+        } else {
+            config->responseCache->TakeCounts(*current->responseCache);
+        }
+    }
+
+    std::atomic_store(&m_config, std::shared_ptr<const ServiceConfig>(config));
+    m_engine->SetRules(config);
+    message = restart.empty() ? "New card events use the updated settings." :
+                                "Restart to apply changes to " + restart + ".";
+    return true;
+}
+
+std::shared_ptr<const ServiceConfig> CardService::Config() const {
+    return std::atomic_load(&m_config);
+}
+
+std::string CardService::RenderMetrics() const {
+    std::string out;
+    m_latency.WritePrometheus(out);
+    m_startup.WritePrometheus(out);
+
+    const EventDebouncer& debouncer = m_engine->Debouncer();
+    out += "# HELP cardaction_events_total Card events reported after debouncing.\n"
+           "# TYPE cardaction_events_total counter\n"
+           "cardaction_events_total " + std::to_string(debouncer.EmittedEvents()) + "\n";
+    out += "# HELP cardaction_suppressed_transitions_total Raw transitions folded into other events.\n"
+           "# TYPE cardaction_suppressed_transitions_total counter\n"
+           "cardaction_suppressed_transitions_total " + std::to_string(debouncer.SuppressedTransitions()) + "\n";
+    out += "# HELP cardaction_readers Readers being watched.\n"
+           "# TYPE cardaction_readers gauge\n"
+           "cardaction_readers " + std::to_string(m_engine->ReaderCount()) + "\n";
+    const SessionManager& sessions = m_engine->Sessions();
+    out += "# HELP cardaction_card_sessions_total Card transactions by whether they needed a new connection.\n"
+           "# TYPE cardaction_card_sessions_total counter\n"
+           "cardaction_card_sessions_total{result=\"connect\"} " + std::to_string(sessions.Connects()) + "\n"
+           "cardaction_card_sessions_total{result=\"reuse\"} " + std::to_string(sessions.Reuses()) + "\n";
+
+    out += "# HELP cardaction_commands_total Commands by outcome.\n"
+           "# TYPE cardaction_commands_total counter\n"
+           "cardaction_commands_total{result=\"ok\"} " + std::to_string(m_executor.Succeeded()) + "\n"
+           "cardaction_commands_total{result=\"failed\"} " + std::to_string(m_executor.Failed()) + "\n"
+           "cardaction_commands_total{result=\"timeout\"} " + std::to_string(m_executor.TimedOut()) + "\n"
+           "cardaction_commands_total{result=\"dropped\"} " + std::to_string(m_executor.Dropped()) + "\n";
+    out += "# HELP cardaction_commands_running Commands running.\n"
+           "# TYPE cardaction_commands_running gauge\n"
+           "cardaction_commands_running " + std::to_string(m_executor.Running()) + "\n";
+    out += "# HELP cardaction_command_queue_depth Commands waiting for a slot.\n"
+           "# TYPE cardaction_command_queue_depth gauge\n"
+           "cardaction_command_queue_depth " + std::to_string(m_executor.QueueDepth()) + "\n";
+    out += "# HELP cardaction_command_queue_peak Most commands ever waiting for a slot at once.\n"
+           "# TYPE cardaction_command_queue_peak gauge\n"
+           "cardaction_command_queue_peak " + std::to_string(m_executor.PeakQueueDepth()) + "\n";
+
+    std::shared_ptr<const ServiceConfig> config = Config();
+    if (config->responseCache) {
+        out += "# HELP cardaction_cache_requests_total Cacheable APDUs by cache outcome.\n"
+               "# TYPE cardaction_cache_requests_total counter\n"
+               "cardaction_cache_requests_total{result=\"hit\"} " +
+               std::to_string(config->responseCache->Hits()) + "\n"
+               "cardaction_cache_requests_total{result=\"miss\"} " +
+               std::to_string(config->responseCache->Misses()) + "\n";
+    }
+    if (!config->journalPath.empty()) {
+        out += "# HELP cardaction_journal_records_total Records written to the audit journal.\n"
+               "# TYPE cardaction_journal_records_total counter\n"
+               "cardaction_journal_records_total " + std::to_string(m_journal.Records()) + "\n";
+        out += "# HELP cardaction_journal_dropped_total Card events left out of the audit journal.\n"
+               "# TYPE cardaction_journal_dropped_total counter\n"
+               "cardaction_journal_dropped_total " + std::to_string(m_journal.Dropped()) + "\n";
+    }
+    return out;
+}
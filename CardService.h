@@ -0,0 +1,128 @@
+#ifndef CARDSERVICE_H
+#define CARDSERVICE_H
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include "AuditJournal.h"
+#include "CardBackend.h"
+#include "CardEngine.h"
+#include "CommandExecutor.h"
+#include "EventServer.h"
+#include "HexCodec.h"
+#include "IniFile.h"
+#include "LatencyMetrics.h"
+#include "MetricsServer.h"
+#include "StartupTrace.h"
+
+// Configuration settings. A loaded ServiceConfig is an immutable snapshot;
+// reloads publish a new one instead of changing it. The rules are
+// [Rule:<name>] sections in file order, the default rule is [OnInsert] and
+// [OnRemove] and the cache identity is [Cache] Identity.
+struct ServiceConfig : RuleSet {
+    // Startup settings: a reload keeps the values the engine was started with
+    std::string backend;            // [Backend] Type
+    std::string simulatorScript;    // [Backend] Script, for the simulated backend
+    std::string replayTrace;        // [Backend] Trace, for the replay backend
+    unsigned replaySpeed;           // [Backend] Speed, percent of real time, 0 as fast as possible
+    std::string recordTrace;        // [Backend] Record, empty to disable
+    unsigned workerThreads;         // [Engine] Workers
+    unsigned readersPerMonitor;     // [Engine] ReadersPerMonitor, 0 for the backend's limit
+    CommandString eventEndpoint;    // [EventServer] Endpoint, empty to disable
+    unsigned eventQueueLimit;       // [EventServer] QueueLimit, records per subscriber
+    unsigned metricsPort;           // [Metrics] Port, 0 to disable
+    std::string journalPath;        // [Journal] Path, empty to disable
+    JournalOptions journal;         // [Journal] SegmentMB, Segments, RecordLimit
+    uint32_t debounceMs;            // [Engine] Debounce
+    std::map<std::string, uint32_t> debounceWindows;   // [Debounce] per-reader overrides
+    ExecutorOptions commands;       // [Commands] MaxConcurrent, QueueLimit, Overflow, CaptureOutput
+
+    // Reloaded settings: new events use the values of the latest snapshot
+    HexCase hexCase;                // [Engine] HexCase
+    uint32_t commandTimeoutMs;      // [Commands] Timeout, for actions without their own
+    std::string cacheSettings;      // [Cache] Size, TTL and Identity and the APDUs each rule
+                                    // caches; a reload keeps the cache while they are the same
+
+    // A [Plugin:<name>] section the rules use, with the full path and the
+    // options it was loaded with
+    struct LoadedPlugin {
+        std::string path;
+        std::string options;
+        std::shared_ptr<Action> action;
+    };
+    std::map<std::string, LoadedPlugin> plugins;    // By name
+};
+
+// Load the configuration in ini into config. Command actions run on
+// executor and record into latency. Plugin paths are relative to
+// directory, which is in the ANSI code page on Windows like the INI path.
+// A plugin whose section has the same name, path and options as in
+// previous, if given, shares its instance instead of being loaded again.
+// Returns false with a description of the first invalid setting.
+bool LoadServiceConfig(const IniFile& ini, const std::string& directory, CommandExecutor& executor,
+                       LatencyMetrics* latency, const ServiceConfig* previous, ServiceConfig& config,
+                       std::string& error);
+
+// CardAction without a user interface: the backend, the card event engine
+// and everything it feeds, configured from CardAction.ini. The tray
+// application and CardActionDaemon both host one; the tray only adds the
+// icon and menu, fed by the reader and state sinks.
+class CardService {
+public:
+    CardService();
+    ~CardService();
+
+    // Load the configuration at iniPath, create the backend and start the
+    // event stream, the audit journal, the command slots and the engine, in
+    // that order. The sinks' readers, state and ready are called as the
+    // engine calls them; card is set by the service. Startup() times each
+    // step from here. Returns false with a message for the user if any of
+    // them fails.
+    bool Start(const std::string& iniPath, const CardEngine::Sinks& sinks, std::string& error);
+
+    // Serve the metrics if [Metrics] Port is set. Separate from Start, so a
+    // busy port does not stop card handling.
+    bool StartMetrics(std::string& error);
+
+    // Stop everything Start started, after the events in progress
+    void Stop();
+
+    // Load the INI file into a new snapshot and publish it. Startup
+    // settings keep their running values, and plugins whose section is
+    // unchanged keep their instance; a plugin rebuilt in place needs a
+    // restart. On failure the current snapshot stays in use. Either way
+    // message describes the outcome for the user.
+    bool Reload(std::string& message);
+
+    // Current configuration snapshot. Callers hold on to the snapshot for as
+    // long as they use it, so an event that started before a reload finishes
+    // with the settings it started with. The load is std::atomic_load,
+    // which the standard libraries implement with a lock from a small pool,
+    // held only while the pointer is copied; it never waits for a reload.
+    std::shared_ptr<const ServiceConfig> Config() const;
+
+    // Metrics for Prometheus: the stage latencies and the counters
+    std::string RenderMetrics() const;
+
+    const std::string& IniPath() const { return m_iniPath; }
+    const CardEngine& Engine() const { return *m_engine; }
+    const CommandExecutor& Executor() const { return m_executor; }
+    const LatencyMetrics& Latency() const { return m_latency; }
+    const StartupTrace& Startup() const { return m_startup; }
+
+private:
+    std::string m_iniPath;
+    std::shared_ptr<const ServiceConfig> m_config;  // Access with std::atomic_load/store
+    std::unique_ptr<CardBackend> m_backend;
+    EventServer m_events;                   // Streams events to subscribers when enabled
+    AuditJournal m_journal;                 // Keeps every card event on disk when enabled
+    CommandExecutor m_executor;             // Runs the command actions of every configuration
+    LatencyMetrics m_latency;               // Time spent in each stage of a card event
+    StartupTrace m_startup;                 // Time to ready and to the first card event
+    std::unique_ptr<CardEngine> m_engine;
+    MetricsServer m_metricsServer;          // Serves the metrics to Prometheus when enabled
+    bool m_started = false;
+};
+
+#endif // CARDSERVICE_H
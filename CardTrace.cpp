@@ -0,0 +1,338 @@
+#include "CardTrace.h"
+#include "LatencyMetrics.h"
+#include <string.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const uint8_t TRACE_MAGIC[8] = { 'C', 'A', 'T', 'R', 'A', 'C', 'E', 0 };
+const uint32_t TRACE_VERSION = 1;
+const size_t HEADER_SIZE = 24;
+const size_t FLUSH_SIZE = 64 * 1024;
+
+void PutVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+void PutFixed(uint8_t* out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+uint64_t GetFixed(const uint8_t* in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+// Decode a varint from [p, end). Returns false if it runs past end.
+bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool GetBytes(const uint8_t*& p, const uint8_t* end, TraceBytes& bytes) {
+    uint64_t length;
+    if (!GetVarint(p, end, length) || length > (uint64_t)(end - p)) {
+        return false;
+    }
+    bytes.data = p;
+    bytes.length = (size_t)length;
+    p += length;
+    return true;
+}
+
+uint64_t Microseconds(uint64_t nanoseconds) {
+    return nanoseconds / 1000;
+}
+
+} // namespace
+
+TraceWriter::TraceWriter() : m_file(NULL), m_origin(0) {
+}
+
+TraceWriter::~TraceWriter() {
+    Close();
+}
+
+bool TraceWriter::Open(const std::string& path, std::string& error) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_file = fopen(path.c_str(), "wb");
+    if (!m_file) {
+        error = "cannot create " + path;
+        return false;
+    }
+    uint8_t header[HEADER_SIZE] = {};
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    PutFixed(header + 8, TRACE_VERSION, 4);
+    PutFixed(header + 16, (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count(), 8);
+    m_origin = LatencyNow();
+    m_buffer.assign(header, header + HEADER_SIZE);
+    m_buffer.reserve(FLUSH_SIZE + 1024);
+    m_readers.clear();
+    return true;
+}
+
+void TraceWriter::Close() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_file) {
+        Flush();
+        fclose(m_file);
+        m_file = NULL;
+    }
+}
+
+void TraceWriter::ReaderAttached(const char* reader) {
+    uint64_t now = LatencyNow();
+    Append(TRACE_ATTACH, reader, now, now, CARD_S_SUCCESS, 0, NULL, 0, NULL, 0);
+}
+
+void TraceWriter::ReaderDetached(const char* reader) {
+    uint64_t now = LatencyNow();
+    Append(TRACE_DETACH, reader, now, now, CARD_S_SUCCESS, 0, NULL, 0, NULL, 0);
+}
+
+void TraceWriter::StateChanged(const char* reader, uint32_t state, const uint8_t* atr, size_t atrLength) {
+    uint64_t now = LatencyNow();
+    Append(TRACE_STATE, reader, now, now, CARD_S_SUCCESS, state, atr, atrLength, NULL, 0);
+}
+
+void TraceWriter::Connected(const char* reader, uint64_t start, CardResult result, uint32_t protocol) {
+    Append(TRACE_CONNECT, reader, start, LatencyNow(), result, protocol, NULL, 0, NULL, 0);
+}
+
+void TraceWriter::Disconnected(const char* reader, uint64_t start, CardResult result) {
+    Append(TRACE_DISCONNECT, reader, start, LatencyNow(), result, 0, NULL, 0, NULL, 0);
+}
+
+void TraceWriter::Transmitted(const char* reader, uint64_t start, CardResult result, const uint8_t* command,
+                              size_t commandLength, const uint8_t* response, size_t responseLength) {
+    Append(TRACE_TRANSMIT, reader, start, LatencyNow(), result, 0, command, commandLength,
+           response, responseLength);
+}
+
+void TraceWriter::Append(uint32_t type, const char* reader, uint64_t start, uint64_t end, CardResult result,
+                         uint32_t value, const uint8_t* first, size_t firstLength,
+                         const uint8_t* second, size_t secondLength) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_file) {
+        return;
+    }
+    uint64_t time = start > m_origin ? Microseconds(start - m_origin) : 0;
+    uint32_t number = ReaderNumber(reader, time);
+
+    m_record.clear();
+    m_record.push_back((uint8_t)type);
+    PutVarint(m_record, time);
+    PutVarint(m_record, end > start ? Microseconds(end - start) : 0);
+    PutVarint(m_record, number);
+    PutVarint(m_record, (uint32_t)result);
+    PutVarint(m_record, value);
+    PutVarint(m_record, firstLength);
+    m_record.insert(m_record.end(), first, first + firstLength);
+    PutVarint(m_record, secondLength);
+    m_record.insert(m_record.end(), second, second + secondLength);
+
+    PutVarint(m_buffer, m_record.size());
+    m_buffer.insert(m_buffer.end(), m_record.begin(), m_record.end());
+    if (m_buffer.size() >= FLUSH_SIZE || type == TRACE_ATTACH || type == TRACE_DETACH || type == TRACE_STATE) {
+        Flush();
+    }
+}
+
+// Number a reader, naming it in the trace the first time; m_mutex is held
+uint32_t TraceWriter::ReaderNumber(const char* reader, uint64_t time) {
+    m_lookup.assign(reader);
+    auto it = m_readers.find(m_lookup);
+    if (it != m_readers.end()) {
+        return it->second;
+    }
+    uint32_t number = (uint32_t)m_readers.size();
+    m_readers[m_lookup] = number;
+
+    m_record.clear();
+    m_record.push_back((uint8_t)TRACE_READER);
+    PutVarint(m_record, time);
+    PutVarint(m_record, 0);
+    PutVarint(m_record, number);
+    PutVarint(m_record, 0);
+    PutVarint(m_record, 0);
+    PutVarint(m_record, m_lookup.size());
+    m_record.insert(m_record.end(), m_lookup.begin(), m_lookup.end());
+    PutVarint(m_record, 0);
+    PutVarint(m_buffer, m_record.size());
+    m_buffer.insert(m_buffer.end(), m_record.begin(), m_record.end());
+    return number;
+}
+
+// Write out the buffer; m_mutex is held. A failed write ends the recording.
+void TraceWriter::Flush() {
+    if (m_buffer.empty()) {
+        return;
+    }
+    if (fwrite(m_buffer.data(), 1, m_buffer.size(), m_file) != m_buffer.size() || fflush(m_file) != 0) {
+        fclose(m_file);
+        m_file = NULL;
+    }
+    m_buffer.clear();
+}
+
+TraceFile::TraceFile() : m_data(NULL), m_size(0), m_position(0), m_startTime(0), m_truncated(false) {
+}
+
+TraceFile::~TraceFile() {
+    Close();
+}
+
+bool TraceFile::Open(const std::string& path, std::string& error) {
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = "cannot open " + path;
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)HEADER_SIZE) {
+        CloseHandle(file);
+        error = path + " is not a trace";
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        error = "cannot map " + path;
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        error = "cannot map " + path;
+        return false;
+    }
+    m_data = (const uint8_t*)view;
+    m_size = (size_t)size.QuadPart;
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        error = "cannot open " + path;
+        return false;
+    }
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size < (off_t)HEADER_SIZE) {
+        close(file);
+        error = path + " is not a trace";
+        return false;
+    }
+    void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (view == MAP_FAILED) {
+        error = "cannot map " + path;
+        return false;
+    }
+    madvise(view, (size_t)info.st_size, MADV_SEQUENTIAL);
+    m_data = (const uint8_t*)view;
+    m_size = (size_t)info.st_size;
+#endif
+
+    if (memcmp(m_data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || GetFixed(m_data + 8, 4) != TRACE_VERSION) {
+        Close();
+        error = path + " is not a trace";
+        return false;
+    }
+    m_startTime = GetFixed(m_data + 16, 8);
+    Rewind();
+    return true;
+}
+
+void TraceFile::Close() {
+    if (m_data) {
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        munmap((void*)m_data, m_size);
+#endif
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_position = 0;
+    m_readerNames.clear();
+}
+
+void TraceFile::Rewind() {
+    m_position = HEADER_SIZE;
+    m_truncated = false;
+    m_readerNames.clear();
+}
+
+bool TraceFile::Next(TraceRecord& record) {
+    if (!m_data || m_position >= m_size) {
+        return false;
+    }
+    const uint8_t* p = m_data + m_position;
+    const uint8_t* end = m_data + m_size;
+    uint64_t size;
+    if (!GetVarint(p, end, size) || size == 0 || size > (uint64_t)(end - p)) {
+        m_truncated = true;
+        return false;
+    }
+    end = p + size;
+
+    uint64_t reader, result, value;
+    record.type = *p++;
+    if (!GetVarint(p, end, record.timeUs) || !GetVarint(p, end, record.durationUs) ||
+        !GetVarint(p, end, reader) || !GetVarint(p, end, result) || !GetVarint(p, end, value) ||
+        !GetBytes(p, end, record.first) || !GetBytes(p, end, record.second)) {
+        m_truncated = true;
+        return false;
+    }
+    record.reader = (uint32_t)reader;
+    record.result = (CardResult)(uint32_t)result;
+    record.value = (uint32_t)value;
+
+    if (record.type == TRACE_READER) {
+        // The writer numbers readers in order, so a new reader is always
+        // the next number; anything past that is a damaged record, and
+        // growing the table to fit it could take all the memory there is
+        if (reader > m_readerNames.size()) {
+            m_truncated = true;
+            return false;
+        }
+        if (reader == m_readerNames.size()) {
+            m_readerNames.emplace_back();
+        }
+        m_readerNames[record.reader].assign((const char*)record.first.data, record.first.length);
+    }
+    m_position = end - m_data;
+    return true;
+}
+
+const std::string& TraceFile::ReaderName(uint32_t reader) const {
+    static const std::string unknown;
+    return reader < m_readerNames.size() ? m_readerNames[reader] : unknown;
+}
@@ -0,0 +1,116 @@
+#ifndef CARDTRACE_H
+#define CARDTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CardBackend.h"
+
+// Trace of the PC/SC traffic of a run, for replaying it offline. A trace is
+// a 24 byte header (magic, version, start time in milliseconds since the Unix
+// epoch) followed by records. Each record is its size as a varint, then the
+// type byte, then time, duration, reader, result and value as varints, then
+// two byte strings, each a varint length and the bytes. Unused fields are
+// zero, so they take a single byte.
+//
+// Readers are numbered in the trace: the first record about a reader is a
+// TRACE_READER record that names its number.
+enum TraceRecordType {
+    TRACE_READER = 1,       // first: reader name
+    TRACE_ATTACH,           // Reader appeared
+    TRACE_DETACH,           // Reader went away
+    TRACE_STATE,            // value: state flags; first: ATR
+    TRACE_CONNECT,          // value: protocol
+    TRACE_DISCONNECT,
+    TRACE_TRANSMIT          // first: command; second: response
+};
+
+struct TraceBytes {
+    const uint8_t* data;
+    size_t length;
+};
+
+struct TraceRecord {
+    uint32_t type;          // TRACE_*; skip types you do not know
+    uint64_t timeUs;        // Start of the call, microseconds since the trace started
+    uint64_t durationUs;    // Time the call took
+    uint32_t reader;
+    CardResult result;
+    uint32_t value;
+    TraceBytes first;
+    TraceBytes second;
+};
+
+// Appends records to a trace file. Records are encoded into a buffer that is
+// written out when it fills up, after each reader or card change and on
+// Close, so APDU exchanges cost no system call and a crash loses at most the
+// exchanges of the current event. Safe to call from any thread.
+class TraceWriter {
+public:
+    TraceWriter();
+    ~TraceWriter();
+
+    bool Open(const std::string& path, std::string& error);
+    void Close();
+
+    // start is LatencyNow() when the call began; the duration runs to now
+    void ReaderAttached(const char* reader);
+    void ReaderDetached(const char* reader);
+    void StateChanged(const char* reader, uint32_t state, const uint8_t* atr, size_t atrLength);
+    void Connected(const char* reader, uint64_t start, CardResult result, uint32_t protocol);
+    void Disconnected(const char* reader, uint64_t start, CardResult result);
+    void Transmitted(const char* reader, uint64_t start, CardResult result, const uint8_t* command,
+                     size_t commandLength, const uint8_t* response, size_t responseLength);
+
+private:
+    void Append(uint32_t type, const char* reader, uint64_t start, uint64_t end, CardResult result,
+                uint32_t value, const uint8_t* first, size_t firstLength,
+                const uint8_t* second, size_t secondLength);
+    uint32_t ReaderNumber(const char* reader, uint64_t time);
+    void Flush();
+
+    std::mutex m_mutex;
+    FILE* m_file;
+    uint64_t m_origin;                                  // LatencyNow() at Open
+    std::vector<uint8_t> m_buffer;
+    std::vector<uint8_t> m_record;                      // Record being encoded
+    std::unordered_map<std::string, uint32_t> m_readers;
+    std::string m_lookup;                               // Reused key for lookups by C string
+};
+
+// A trace file mapped into memory. Records are decoded in place: their byte
+// strings point into the mapping, which stays valid until Close.
+class TraceFile {
+public:
+    TraceFile();
+    ~TraceFile();
+
+    bool Open(const std::string& path, std::string& error);
+    void Close();
+
+    uint64_t StartTime() const { return m_startTime; }
+
+    // Decode the next record. Returns false at the end of the trace, or at
+    // a record that was cut short, e.g. by a crash while recording, or that
+    // is damaged.
+    bool Next(TraceRecord& record);
+    void Rewind();
+    bool Truncated() const { return m_truncated; }
+
+    // Name of a reader number from the records read so far
+    const std::string& ReaderName(uint32_t reader) const;
+
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_position;
+    uint64_t m_startTime;
+    bool m_truncated;
+    std::vector<std::string> m_readerNames;
+};
+
+#endif // CARDTRACE_H
@@ -0,0 +1,439 @@
+#include "CommandExecutor.h"
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
+
+namespace {
+
+const size_t MAX_OUTPUT = 4096;         // Captured bytes kept per command
+const uint32_t POLL_MS = 10;            // Output polling, and exit polling without pidfd
+
+// Milliseconds left until deadline, or INFINITE_WAIT for no deadline
+const uint32_t INFINITE_WAIT = 0xFFFFFFFF;
+
+uint32_t Remaining(uint32_t timeoutMs, uint64_t started) {
+    if (timeoutMs == 0) {
+        return INFINITE_WAIT;
+    }
+    uint64_t elapsedMs = (LatencyNow() - started) / 1000000;
+    return elapsedMs >= timeoutMs ? 0 : (uint32_t)(timeoutMs - elapsedMs);
+}
+
+void KeepOutput(std::string& output, const char* data, size_t length) {
+    if (output.size() < MAX_OUTPUT) {
+        output.append(data, std::min(length, MAX_OUTPUT - output.size()));
+    }
+}
+
+#ifdef _WIN32
+// Handles must only be inherited by the child they are meant for, so
+// commands that capture output are started one at a time
+std::mutex g_inheritMutex;
+#endif
+
+} // namespace
+
+CommandExecutor::CommandExecutor()
+    : m_peakDepth(0), m_running(0), m_succeeded(0), m_failed(0), m_timedOut(0), m_dropped(0) {
+}
+
+CommandExecutor::~CommandExecutor() {
+    Stop();
+}
+
+void CommandExecutor::Start(const ExecutorOptions& options, LatencyMetrics* metrics) {
+    m_options = options;
+    m_options.maxConcurrent = std::max(options.maxConcurrent, 1u);
+    m_metrics = metrics;
+    m_stopping = false;
+    for (unsigned i = 0; i < m_options.maxConcurrent; i++) {
+        m_threads.push_back(std::thread(&CommandExecutor::Run, this));
+    }
+}
+
+void CommandExecutor::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_queue.clear();
+        for (const Child& child : m_children) {
+#ifdef _WIN32
+            if (child.job) {
+                TerminateJobObject((HANDLE)child.handle, 1);
+            } else {
+                TerminateProcess((HANDLE)child.handle, 1);
+            }
+#else
+            kill(-(pid_t)child.handle, SIGKILL);
+#endif
+        }
+    }
+    m_wake.notify_all();
+    m_room.notify_all();
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+    m_threads.clear();
+}
+
+bool CommandExecutor::Submit(const CommandChar* commandLine, size_t length, uint32_t timeoutMs) {
+    uint64_t queued = LatencyNow();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_options.overflow == OVERFLOW_BLOCK) {
+            m_room.wait(lock, [this]() { return m_stopping || m_queue.size() < m_options.queueLimit; });
+        }
+        if (m_stopping) {
+            return false;
+        }
+        if (m_queue.size() >= m_options.queueLimit) {
+            m_dropped++;
+            if (m_options.overflow != OVERFLOW_DROP_OLDEST || m_queue.empty()) {
+                return false;
+            }
+            m_spare.push_back(std::move(m_queue.front().commandLine));
+            m_queue.pop_front();
+        }
+        Job job = { CommandString(), timeoutMs, queued };
+        if (!m_spare.empty()) {
+            job.commandLine.swap(m_spare.back());
+            m_spare.pop_back();
+        }
+        job.commandLine.assign(commandLine, length);
+        m_queue.push_back(std::move(job));
+        if (m_queue.size() > m_peakDepth) {
+            m_peakDepth = m_queue.size();
+        }
+    }
+    m_wake.notify_one();
+    return true;
+}
+
+size_t CommandExecutor::QueueDepth() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.size();
+}
+
+bool CommandExecutor::LastFailure(CommandFailure& failure) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_hasFailure) {
+        failure = m_lastFailure;
+    }
+    return m_hasFailure;
+}
+
+// A slot: run queued commands one at a time until Stop
+void CommandExecutor::Run() {
+    CommandString commandLine;      // Writable copy for launching, reused
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+        if (m_stopping) {
+            break;
+        }
+        Job job = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_running++;
+        m_room.notify_one();
+        lock.unlock();
+
+        Execute(job, commandLine);
+        m_running--;
+
+        lock.lock();
+        m_spare.push_back(std::move(job.commandLine));
+    }
+}
+
+// Track a started command so Stop can kill it. Returns false, having killed
+// it, if Stop has already been called.
+bool CommandExecutor::Register(const Child& child) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_stopping) {
+#ifdef _WIN32
+        if (child.job) {
+            TerminateJobObject((HANDLE)child.handle, 1);
+        } else {
+            TerminateProcess((HANDLE)child.handle, 1);
+        }
+#else
+        kill(-(pid_t)child.handle, SIGKILL);
+#endif
+        return false;
+    }
+    m_children.push_back(child);
+    return true;
+}
+
+void CommandExecutor::Unregister(const Child& child) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_children.begin(); it != m_children.end(); ++it) {
+        if (it->handle == child.handle) {
+            m_children.erase(it);
+            break;
+        }
+    }
+}
+
+void CommandExecutor::RecordFailure(const Job& job, bool timedOut, int exitCode, const std::string& output) {
+    (timedOut ? m_timedOut : m_failed)++;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_hasFailure = true;
+    m_lastFailure.commandLine = job.commandLine;
+    m_lastFailure.timedOut = timedOut;
+    m_lastFailure.exitCode = exitCode;
+    m_lastFailure.output = output;
+}
+
+#ifdef _WIN32
+void CommandExecutor::Execute(const Job& job, CommandString& commandLine) {
+    if (m_metrics) {
+        m_metrics->Record(STAGE_COMMAND_QUEUE, job.queued);
+    }
+    uint64_t start = LatencyNow();
+
+    // The job lets a timeout end the command's children too
+    HANDLE jobObject = CreateJobObject(NULL, NULL);
+    STARTUPINFO si = {};
+    PROCESS_INFORMATION pi = {};
+    si.cb = sizeof(si);
+    HANDLE readPipe = NULL;
+    HANDLE writePipe = NULL;
+    commandLine = job.commandLine;
+    BOOL created;
+    if (m_options.captureOutput) {
+        SECURITY_ATTRIBUTES inherit = { sizeof(inherit), NULL, TRUE };
+        std::lock_guard<std::mutex> lock(g_inheritMutex);
+        if (!CreatePipe(&readPipe, &writePipe, &inherit, 0)) {
+            readPipe = writePipe = NULL;
+        } else {
+            SetHandleInformation(readPipe, HANDLE_FLAG_INHERIT, 0);
+            si.dwFlags = STARTF_USESTDHANDLES;
+            si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+            si.hStdOutput = writePipe;
+            si.hStdError = writePipe;
+        }
+        // CreateProcess may modify the command line in place
+        created = CreateProcess(NULL, &commandLine[0], NULL, NULL, writePipe != NULL,
+                                CREATE_SUSPENDED | CREATE_NO_WINDOW, NULL, NULL, &si, &pi);
+        if (writePipe) {
+            CloseHandle(writePipe);
+        }
+    } else {
+        created = CreateProcess(NULL, &commandLine[0], NULL, NULL, FALSE, CREATE_SUSPENDED,
+                                NULL, NULL, &si, &pi);
+    }
+    if (!created) {
+        if (readPipe) {
+            CloseHandle(readPipe);
+        }
+        if (jobObject) {
+            CloseHandle(jobObject);
+        }
+        RecordFailure(job, false, -1, std::string());
+        return;
+    }
+
+    Child child;
+    child.job = jobObject && AssignProcessToJobObject(jobObject, pi.hProcess);
+    child.handle = (intptr_t)(child.job ? jobObject : pi.hProcess);
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+    if (m_metrics) {
+        m_metrics->Record(STAGE_LAUNCH, start);
+    }
+    bool registered = Register(child);
+
+    // Wait for the command, collecting its output as it goes
+    std::string output;
+    bool timedOut = false;
+    for (;;) {
+        uint32_t remaining = Remaining(job.timeoutMs, start);
+        DWORD wait = WaitForSingleObject(pi.hProcess, readPipe ? std::min(remaining, POLL_MS) : remaining);
+        DWORD available = 0;
+        while (readPipe && PeekNamedPipe(readPipe, NULL, 0, NULL, &available, NULL) && available > 0) {
+            char buffer[1024];
+            DWORD read = 0;
+            if (!ReadFile(readPipe, buffer, std::min<DWORD>(available, sizeof(buffer)), &read, NULL) || read == 0) {
+                break;
+            }
+            KeepOutput(output, buffer, read);
+        }
+        if (wait == WAIT_OBJECT_0) {
+            break;
+        }
+        if (Remaining(job.timeoutMs, start) == 0) {
+            timedOut = true;
+            if (child.job) {
+                TerminateJobObject(jobObject, 1);
+            } else {
+                TerminateProcess(pi.hProcess, 1);
+            }
+            WaitForSingleObject(pi.hProcess, INFINITE);
+            break;
+        }
+    }
+    if (registered) {
+        Unregister(child);
+    }
+    if (m_metrics) {
+        m_metrics->Record(STAGE_COMMAND, start);
+    }
+
+    DWORD exitCode = 0;
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+    if (timedOut || exitCode != 0) {
+        RecordFailure(job, timedOut, (int)exitCode, output);
+    } else {
+        m_succeeded++;
+    }
+
+    // Children still running on their own keep running
+    CloseHandle(pi.hProcess);
+    if (readPipe) {
+        CloseHandle(readPipe);
+    }
+    if (jobObject) {
+        CloseHandle(jobObject);
+    }
+}
+#else
+void CommandExecutor::Execute(const Job& job, CommandString& commandLine) {
+    if (m_metrics) {
+        m_metrics->Record(STAGE_COMMAND_QUEUE, job.queued);
+    }
+    uint64_t start = LatencyNow();
+
+    // The process group lets a timeout end the command's children too
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    int pipeFds[2] = { -1, -1 };
+    if (m_options.captureOutput && pipe2(pipeFds, O_CLOEXEC) == 0) {
+        posix_spawn_file_actions_adddup2(&actions, pipeFds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, pipeFds[1], STDERR_FILENO);
+    }
+
+    char shell[] = "/bin/sh";
+    char option[] = "-c";
+    commandLine = job.commandLine;
+    char* argv[] = { shell, option, &commandLine[0], NULL };
+    pid_t pid;
+    int spawned = posix_spawn(&pid, shell, &actions, &attributes, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (pipeFds[1] != -1) {
+        close(pipeFds[1]);
+    }
+    if (spawned != 0) {
+        if (pipeFds[0] != -1) {
+            close(pipeFds[0]);
+        }
+        RecordFailure(job, false, -1, std::string());
+        return;
+    }
+    if (m_metrics) {
+        m_metrics->Record(STAGE_LAUNCH, start);
+    }
+    Child child;
+    child.handle = pid;
+    child.job = false;
+    bool registered = Register(child);
+
+    // Wait for the command, collecting its output as it goes. A pidfd makes
+    // the exit pollable; without one, exits are noticed within POLL_MS.
+    int exitFd = -1;
+#ifdef SYS_pidfd_open
+    exitFd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+    int outputFd = pipeFds[0];
+    if (outputFd != -1) {
+        fcntl(outputFd, F_SETFL, fcntl(outputFd, F_GETFL) | O_NONBLOCK);
+    }
+    std::string output;
+    bool timedOut = false;
+    for (;;) {
+        pollfd fds[2] = {};
+        nfds_t count = 0;
+        if (exitFd != -1) {
+            fds[count].fd = exitFd;
+            fds[count++].events = POLLIN;
+        }
+        if (outputFd != -1) {
+            fds[count].fd = outputFd;
+            fds[count++].events = POLLIN;
+        }
+        uint32_t remaining = Remaining(job.timeoutMs, start);
+        uint32_t wait = exitFd != -1 ? remaining : std::min(remaining, POLL_MS);
+        if (poll(fds, count, wait == INFINITE_WAIT ? -1 : (int)wait) < 0 && errno != EINTR) {
+            break;
+        }
+
+        // Read what is there; at end of file, stop watching the output
+        char buffer[1024];
+        ssize_t received = -1;
+        while (outputFd != -1 && (received = read(outputFd, buffer, sizeof(buffer))) != 0) {
+            if (received < 0) {
+                if (errno != EINTR) {
+                    break;
+                }
+                continue;
+            }
+            KeepOutput(output, buffer, (size_t)received);
+        }
+        if (outputFd != -1 && received == 0) {
+            close(outputFd);
+            outputFd = -1;
+        }
+
+        // Check for an exit without reaping, so the group stays ours until
+        // it is unregistered
+        siginfo_t info = {};
+        if (waitid(P_PID, (id_t)pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid) {
+            break;
+        }
+        if (Remaining(job.timeoutMs, start) == 0) {
+            timedOut = true;
+            kill(-pid, SIGKILL);
+            break;
+        }
+    }
+    if (registered) {
+        Unregister(child);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (m_metrics) {
+        m_metrics->Record(STAGE_COMMAND, start);
+    }
+    if (exitFd != -1) {
+        close(exitFd);
+    }
+    if (outputFd != -1) {
+        close(outputFd);
+    }
+
+    int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (timedOut || exitCode != 0) {
+        RecordFailure(job, timedOut, exitCode, output);
+    } else {
+        m_succeeded++;
+    }
+}
+#endif
@@ -0,0 +1,118 @@
+#ifndef COMMANDEXECUTOR_H
+#define COMMANDEXECUTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CommandTemplate.h"
+#include "LatencyMetrics.h"
+
+// What to do with a command when the queue is full
+enum OverflowPolicy {
+    OVERFLOW_DROP_NEWEST,   // Discard the new command
+    OVERFLOW_DROP_OLDEST,   // Discard the longest-waiting command
+    OVERFLOW_BLOCK          // Make the caller wait for room
+};
+
+struct ExecutorOptions {
+    unsigned maxConcurrent = 4;     // Commands running at once
+    size_t queueLimit = 64;         // Commands waiting for a slot
+    OverflowPolicy overflow = OVERFLOW_DROP_NEWEST;
+    bool captureOutput = false;     // Keep the start of each command's output
+};
+
+// Outcome of the most recent failed command
+struct CommandFailure {
+    CommandString commandLine;
+    bool timedOut = false;
+    int exitCode = 0;               // -1 if the command could not be started
+    std::string output;             // Start of stdout and stderr, if captured
+};
+
+// Runs command lines with a bounded number of child processes. Commands
+// wait in a bounded queue for one of maxConcurrent slots; each slot starts a
+// command, waits for it and kills its whole process tree when it runs past
+// its timeout. On Windows every command runs in its own job object,
+// elsewhere in its own process group.
+class CommandExecutor {
+public:
+    CommandExecutor();
+    ~CommandExecutor();
+
+    // Start the slots. metrics, if not NULL, records how long commands wait,
+    // start and run.
+    void Start(const ExecutorOptions& options, LatencyMetrics* metrics);
+
+    // Discard queued commands and kill the running ones
+    void Stop();
+
+    // Queue commandLine, length characters, to be killed after timeoutMs (0
+    // for no limit). Returns false if the command was dropped. The line is
+    // copied into a string recycled from an earlier command, so queueing
+    // does not allocate once the queue has seen its longest command.
+    bool Submit(const CommandChar* commandLine, size_t length, uint32_t timeoutMs);
+    bool Submit(const CommandString& commandLine, uint32_t timeoutMs) {
+        return Submit(commandLine.data(), commandLine.size(), timeoutMs);
+    }
+
+    // Statistics, readable from any thread
+    size_t QueueDepth() const;
+    size_t PeakQueueDepth() const { return m_peakDepth; }
+    size_t Running() const { return m_running; }
+    uint64_t Succeeded() const { return m_succeeded; }
+    uint64_t Failed() const { return m_failed; }        // Non-zero exit or not started
+    uint64_t TimedOut() const { return m_timedOut; }
+    uint64_t Dropped() const { return m_dropped; }
+
+    // The most recent failure; returns false if nothing has failed
+    bool LastFailure(CommandFailure& failure) const;
+
+private:
+    struct Job {
+        CommandString commandLine;
+        uint32_t timeoutMs;
+        uint64_t queued;            // LatencyNow() at Submit
+    };
+
+    // A running command's job object (or process if it has none) on Windows,
+    // its process group elsewhere
+    struct Child {
+        intptr_t handle;
+        bool job;
+    };
+
+    void Run();
+    void Execute(const Job& job, CommandString& commandLine);
+    bool Register(const Child& child);
+    void Unregister(const Child& child);
+    void RecordFailure(const Job& job, bool timedOut, int exitCode, const std::string& output);
+
+    ExecutorOptions m_options;
+    LatencyMetrics* m_metrics = NULL;
+    std::vector<std::thread> m_threads;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;             // Jobs queued and Stop
+    std::condition_variable m_room;             // Room in the queue, for OVERFLOW_BLOCK
+    std::deque<Job> m_queue;
+    std::vector<CommandString> m_spare;         // Command lines of finished jobs, for reuse
+    bool m_stopping = false;
+    bool m_hasFailure = false;
+    CommandFailure m_lastFailure;
+    std::vector<Child> m_children;              // Running commands, killed by Stop
+
+    std::atomic<size_t> m_peakDepth;
+    std::atomic<size_t> m_running;
+    std::atomic<uint64_t> m_succeeded;
+    std::atomic<uint64_t> m_failed;
+    std::atomic<uint64_t> m_timedOut;
+    std::atomic<uint64_t> m_dropped;
+};
+
+#endif // COMMANDEXECUTOR_H
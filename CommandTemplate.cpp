@@ -0,0 +1,327 @@
+#include "CommandTemplate.h"
+#include <string.h>
+#include <sstream>
+
+namespace {
+
+const size_t TIMESTAMP_LENGTH = 24;     // 2024-01-31T12:00:00.000Z
+const size_t SEQUENCE_LENGTH = 20;      // Enough for any uint64_t
+const uint32_t SLICE_OPEN = 0xFFFFFFFF;
+
+bool Equals(const CommandChar* text, size_t length, const char* ascii) {
+    size_t asciiLength = strlen(ascii);
+    if (length != asciiLength) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] != (CommandChar)ascii[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parse an unsigned decimal prefix; returns the number of digits consumed
+size_t ParseNumber(const CommandChar* text, size_t length, uint32_t& value) {
+    size_t i = 0;
+    uint64_t number = 0;
+    while (i < length && text[i] >= '0' && text[i] <= '9' && number <= 0xFFFFFFF) {
+        number = number * 10 + (uint32_t)(text[i] - '0');
+        i++;
+    }
+    value = (uint32_t)number;
+    return i;
+}
+
+std::string Narrow(const CommandChar* text, size_t length) {
+    std::string narrow;
+    for (size_t i = 0; i < length; i++) {
+        // 1 to 0x7F, whether CommandChar is signed or not
+        narrow += (uint32_t)text[i] - 1 < 0x7F ? (char)text[i] : '?';
+    }
+    return narrow;
+}
+
+void WriteDigits(CommandChar* out, uint32_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        out[i] = (CommandChar)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// Format milliseconds since the Unix epoch as ISO 8601 UTC. Uses the civil
+// from days algorithm so it needs neither gmtime nor a locale.
+void WriteTimestamp(uint64_t timestamp, CommandChar* out) {
+    uint64_t seconds = timestamp / 1000;
+    int64_t days = (int64_t)(seconds / 86400);
+    uint32_t secondOfDay = (uint32_t)(seconds % 86400);
+
+    days += 719468;
+    int64_t era = days / 146097;
+    uint32_t dayOfEra = (uint32_t)(days - era * 146097);
+    uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    uint32_t monthIndex = (5 * dayOfYear + 2) / 153;
+    uint32_t day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    uint32_t month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    uint32_t year = (uint32_t)(yearOfEra + era * 400 + (month <= 2 ? 1 : 0));
+
+    WriteDigits(out, year, 4);
+    out[4] = '-';
+    WriteDigits(out + 5, month, 2);
+    out[7] = '-';
+    WriteDigits(out + 8, day, 2);
+    out[10] = 'T';
+    WriteDigits(out + 11, secondOfDay / 3600, 2);
+    out[13] = ':';
+    WriteDigits(out + 14, secondOfDay / 60 % 60, 2);
+    out[16] = ':';
+    WriteDigits(out + 17, secondOfDay % 60, 2);
+    out[19] = '.';
+    WriteDigits(out + 20, (uint32_t)(timestamp % 1000), 3);
+    out[23] = 'Z';
+}
+
+// Write value in decimal and return the number of characters
+size_t WriteDecimal(uint64_t value, CommandChar* out) {
+    CommandChar digits[SEQUENCE_LENGTH];
+    size_t count = 0;
+    do {
+        digits[count++] = (CommandChar)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = 0; i < count; i++) {
+        out[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+size_t Length(const CommandChar* text) {
+    size_t length = 0;
+    while (text && text[length]) {
+        length++;
+    }
+    return length;
+}
+
+} // namespace
+
+bool CommandTemplate::Compile(const CommandString& command, size_t apduCount, std::string& error,
+                              HexCase hexCase, const std::vector<std::string>* variables) {
+    m_text.clear();
+    m_segments.clear();
+    m_hexCase = hexCase;
+
+    // Append literal text, merging with a preceding literal segment
+    auto literal = [this](const CommandChar* text, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (m_segments.empty() || m_segments.back().type != SEGMENT_LITERAL) {
+            Segment segment = {};
+            segment.type = SEGMENT_LITERAL;
+            segment.offset = (uint32_t)m_text.size();
+            m_segments.push_back(segment);
+        }
+        m_text.append(text, length);
+        m_segments.back().length += (uint32_t)length;
+    };
+
+    const CommandChar* text = command.c_str();
+    size_t position = 0;
+    while (position < command.size()) {
+        size_t open = command.find((CommandChar)'{', position);
+        size_t close = open == CommandString::npos ? open : command.find((CommandChar)'}', open + 1);
+        if (close == CommandString::npos) {
+            literal(text + position, command.size() - position);
+            break;
+        }
+
+        literal(text + position, open - position);
+        const CommandChar* inner = text + open + 1;
+        size_t innerLength = close - open - 1;
+
+        Segment segment = {};
+        bool placeholder = true;
+        uint32_t number;
+        size_t digits = ParseNumber(inner, innerLength, number);
+
+        // A variable name stands in for the response number
+        size_t nameLength = 0;
+        while (nameLength < innerLength && inner[nameLength] != ':') {
+            nameLength++;
+        }
+        std::string name = Narrow(inner, nameLength);
+        size_t variable = 0;
+        while (digits == 0 && variables && variable < variables->size() && (*variables)[variable] != name) {
+            variable++;
+        }
+        bool named = digits == 0 && variables && variable < variables->size();
+
+        if (digits > 0 || named) {
+            // Response placeholder: n, n:sw, n:data or n:a..b
+            if (named) {
+                segment.index = (uint32_t)variable;
+                segment.variable = true;
+                digits = nameLength;
+            } else if (number == 0 || number > apduCount) {
+                std::ostringstream message;
+                message << "placeholder {" << Narrow(inner, innerLength) << "} refers to response "
+                        << number << " but " << apduCount << " APDU(s) are configured";
+                error = message.str();
+                return false;
+            } else {
+                segment.index = number - 1;
+            }
+
+            const CommandChar* spec = inner + digits;
+            size_t specLength = innerLength - digits;
+            if (specLength == 0) {
+                segment.type = SEGMENT_RESPONSE;
+            } else if (spec[0] != ':') {
+                placeholder = false;
+            } else if (Equals(spec + 1, specLength - 1, "sw")) {
+                segment.type = SEGMENT_STATUS_WORD;
+            } else if (Equals(spec + 1, specLength - 1, "data")) {
+                segment.type = SEGMENT_DATA;
+            } else {
+                // Slice a..b with optional bounds
+                size_t i = 1;
+                uint32_t bound;
+                size_t used = ParseNumber(spec + i, specLength - i, bound);
+                segment.begin = used > 0 ? bound : 0;
+                i += used;
+                bool dots = i + 2 <= specLength && spec[i] == '.' && spec[i + 1] == '.';
+                i += 2;
+                used = dots ? ParseNumber(spec + i, specLength - i, bound) : 0;
+                segment.end = used > 0 ? bound : SLICE_OPEN;
+                i += used;
+                if (!dots || i != specLength || segment.end < segment.begin) {
+                    error = "invalid placeholder {" + Narrow(inner, innerLength) + "}";
+                    return false;
+                }
+                segment.type = SEGMENT_SLICE;
+            }
+        } else if (Equals(inner, innerLength, "atr")) {
+            segment.type = SEGMENT_ATR;
+        } else if (Equals(inner, innerLength, "reader")) {
+            segment.type = SEGMENT_READER;
+        } else if (Equals(inner, innerLength, "timestamp")) {
+            segment.type = SEGMENT_TIMESTAMP;
+        } else if (Equals(inner, innerLength, "sequence")) {
+            segment.type = SEGMENT_SEQUENCE;
+        } else {
+            placeholder = false;
+        }
+
+        if (placeholder) {
+            m_segments.push_back(segment);
+            position = close + 1;
+        } else {
+            // Not ours: keep the brace and look for a placeholder after it
+            literal(text + open, 1);
+            position = open + 1;
+        }
+    }
+
+    return true;
+}
+
+ByteSpan CommandTemplate::Select(const Segment& segment, const TemplateValues& values) const {
+    ByteSpan empty = { NULL, 0 };
+    if (segment.type == SEGMENT_ATR) {
+        return values.atr;
+    }
+    const ByteSpan* responses = segment.variable ? values.variables : values.responses;
+    size_t count = segment.variable ? values.variableCount : values.responseCount;
+    if (segment.index >= count) {
+        return empty;
+    }
+
+    ByteSpan response = responses[segment.index];
+    switch (segment.type) {
+        case SEGMENT_STATUS_WORD:
+            if (response.length < 2) {
+                return empty;
+            }
+            response.data += response.length - 2;
+            response.length = 2;
+            return response;
+        case SEGMENT_DATA:
+            response.length = response.length < 2 ? 0 : response.length - 2;
+            return response;
+        case SEGMENT_SLICE: {
+            size_t begin = segment.begin < response.length ? segment.begin : response.length;
+            size_t end = segment.end < response.length ? segment.end : response.length;
+            response.data += begin;
+            response.length = end - begin;
+            return response;
+        }
+        default:
+            return response;
+    }
+}
+
+void CommandTemplate::Expand(const TemplateValues& values, CommandString& out) const {
+    // Measure first so the output is written in one pass
+    size_t readerLength = Length(values.reader);
+    out.resize(Measure(values, readerLength));
+    out.resize(Write(values, readerLength, &out[0]));
+}
+
+const CommandChar* CommandTemplate::Expand(const TemplateValues& values, EventArena& arena, size_t& length) const {
+    size_t readerLength = Length(values.reader);
+    CommandChar* out = arena.Allocate<CommandChar>(Measure(values, readerLength) + 1);
+    length = Write(values, readerLength, out);
+    out[length] = 0;
+    return out;
+}
+
+// Longest expansion of the template with values
+size_t CommandTemplate::Measure(const TemplateValues& values, size_t readerLength) const {
+    size_t total = 0;
+    for (const auto& segment : m_segments) {
+        switch (segment.type) {
+            case SEGMENT_LITERAL: total += segment.length; break;
+            case SEGMENT_READER: total += readerLength; break;
+            case SEGMENT_TIMESTAMP: total += TIMESTAMP_LENGTH; break;
+            case SEGMENT_SEQUENCE: total += SEQUENCE_LENGTH; break;
+            default: total += Select(segment, values).length * 2; break;
+        }
+    }
+    return total;
+}
+
+// Write the expansion to out, which has room for Measure() characters, and
+// return its length. The sequence number is measured at its longest.
+size_t CommandTemplate::Write(const TemplateValues& values, size_t readerLength, CommandChar* out) const {
+    CommandChar* write = out;
+    for (const auto& segment : m_segments) {
+        switch (segment.type) {
+            case SEGMENT_LITERAL:
+                memcpy(write, m_text.data() + segment.offset, segment.length * sizeof(CommandChar));
+                write += segment.length;
+                break;
+            case SEGMENT_READER:
+                if (readerLength > 0) {
+                    memcpy(write, values.reader, readerLength * sizeof(CommandChar));
+                    write += readerLength;
+                }
+                break;
+            case SEGMENT_TIMESTAMP:
+                WriteTimestamp(values.timestamp, write);
+                write += TIMESTAMP_LENGTH;
+                break;
+            case SEGMENT_SEQUENCE:
+                write += WriteDecimal(values.sequence, write);
+                break;
+            default: {
+                ByteSpan bytes = Select(segment, values);
+                HexEncode(bytes.data, bytes.length, write, m_hexCase);
+                write += bytes.length * 2;
+                break;
+            }
+        }
+    }
+    return write - out;
+}
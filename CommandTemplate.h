@@ -0,0 +1,96 @@
+#ifndef COMMANDTEMPLATE_H
+#define COMMANDTEMPLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "EventArena.h"
+#include "HexCodec.h"
+
+// Commands are launched with the platform's native character type
+#ifdef _WIN32
+typedef wchar_t CommandChar;
+#else
+typedef char CommandChar;
+#endif
+typedef std::basic_string<CommandChar> CommandString;
+
+// Values available to placeholders when a template is expanded
+struct TemplateValues {
+    const ByteSpan* responses;      // Raw APDU responses, including SW1 SW2
+    size_t responseCount;
+    const ByteSpan* variables;      // Responses kept in APDU script variables
+    size_t variableCount;
+    ByteSpan atr;
+    const CommandChar* reader;
+    uint64_t timestamp;             // Event time, milliseconds since the Unix epoch
+    uint64_t sequence;              // Event number
+};
+
+// A command line parsed once into literal text and placeholder references.
+//
+//   {n}        hex of the n-th APDU response (1-based)
+//   {n:sw}     status word of the response
+//   {n:data}   response without the status word
+//   {n:a..b}   bytes a (inclusive) to b (exclusive) of the response;
+//              either bound may be omitted
+//   {name}     a response kept in an APDU script variable, with the same
+//              :sw, :data and :a..b forms
+//   {atr}      hex of the card ATR
+//   {reader}   reader name
+//   {timestamp} event time as ISO 8601 UTC, e.g. 2024-01-31T12:00:00.000Z
+//   {sequence} event number in decimal
+//
+// Braces that do not form a placeholder are kept as literal text.
+class CommandTemplate {
+public:
+    // Parse command. Response placeholders must refer to one of the
+    // apduCount APDUs sent before the command runs, or to one of variables,
+    // the names of the script's variables in order. Hex placeholders are
+    // written in hexCase.
+    bool Compile(const CommandString& command, size_t apduCount, std::string& error,
+                 HexCase hexCase = HEX_LOWER, const std::vector<std::string>* variables = NULL);
+
+    bool Empty() const { return m_segments.empty(); }
+
+    // Expand into out, sizing it once up front
+    void Expand(const TemplateValues& values, CommandString& out) const;
+
+    // Expand into arena; returns the command line, NUL terminated, and sets
+    // length to its length
+    const CommandChar* Expand(const TemplateValues& values, EventArena& arena, size_t& length) const;
+
+private:
+    enum SegmentType {
+        SEGMENT_LITERAL,
+        SEGMENT_RESPONSE,
+        SEGMENT_STATUS_WORD,
+        SEGMENT_DATA,
+        SEGMENT_SLICE,
+        SEGMENT_ATR,
+        SEGMENT_READER,
+        SEGMENT_TIMESTAMP,
+        SEGMENT_SEQUENCE
+    };
+
+    struct Segment {
+        SegmentType type;
+        uint32_t offset;    // Literal: position in m_text
+        uint32_t length;    // Literal: number of characters
+        uint32_t index;     // Response or variable number, 0-based
+        bool variable;      // index is a variable
+        uint32_t begin;     // Slice bounds in bytes
+        uint32_t end;
+    };
+
+    ByteSpan Select(const Segment& segment, const TemplateValues& values) const;
+    size_t Measure(const TemplateValues& values, size_t readerLength) const;
+    size_t Write(const TemplateValues& values, size_t readerLength, CommandChar* out) const;
+
+    CommandString m_text;
+    std::vector<Segment> m_segments;
+    HexCase m_hexCase = HEX_LOWER;
+};
+
+#endif // COMMANDTEMPLATE_H
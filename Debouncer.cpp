@@ -0,0 +1,128 @@
+#include "Debouncer.h"
+#include "LatencyMetrics.h"
+
+namespace {
+
+uint64_t NowMilliseconds() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+EventDebouncer::EventDebouncer(uint32_t defaultWindowMs, const std::map<std::string, uint32_t>& windows,
+                               Sink sink)
+    : m_defaultWindowMs(defaultWindowMs), m_windows(windows), m_sink(sink),
+      m_raw(0), m_emitted(0), m_suppressed(0) {
+}
+
+EventDebouncer::ReaderState& EventDebouncer::Reader(const std::string& name) {
+    auto it = m_readers.find(name);
+    if (it == m_readers.end()) {
+        it = m_readers.insert(std::make_pair(name, ReaderState())).first;
+        auto window = m_windows.find(name);
+        it->second.windowMs = window != m_windows.end() ? window->second : m_defaultWindowMs;
+    }
+    return it->second;
+}
+
+void EventDebouncer::Learn(const std::string& reader, bool present, const uint8_t* atr, size_t atrLength) {
+    ReaderState& state = Reader(reader);
+    state.reportedPresent = present;
+    state.reportedAtr.assign(atr, atr + (present ? atrLength : 0));
+    state.pending = false;
+    state.transitions = 0;
+}
+
+void EventDebouncer::Transition(const std::string& reader, bool present, const uint8_t* atr,
+                                size_t atrLength, uint64_t timestamp) {
+    m_raw++;
+    ReaderState& state = Reader(reader);
+    state.pending = true;
+    state.present = present;
+    state.atr.assign(atr, atr + (present ? atrLength : 0));
+    state.timestamp = timestamp;
+    state.detected = LatencyNow();
+    state.transitions++;
+    state.deadline = Clock::now() + std::chrono::milliseconds(state.windowMs);
+
+    if (state.windowMs == 0) {
+        Emit(reader, state);
+    }
+}
+
+void EventDebouncer::Forget(const std::string& reader) {
+    auto it = m_readers.find(reader);
+    if (it == m_readers.end()) {
+        return;
+    }
+    if (it->second.pending) {
+        Emit(reader, it->second);
+    }
+    m_readers.erase(it);
+}
+
+void EventDebouncer::Flush() {
+    Clock::time_point now = Clock::now();
+    for (auto& reader : m_readers) {
+        if (reader.second.pending && reader.second.deadline <= now) {
+            Emit(reader.first, reader.second);
+        }
+    }
+}
+
+uint32_t EventDebouncer::NextTimeout() const {
+    Clock::time_point now = Clock::now();
+    uint32_t timeout = 0xFFFFFFFF;
+    for (const auto& reader : m_readers) {
+        if (!reader.second.pending) {
+            continue;
+        }
+        if (reader.second.deadline <= now) {
+            return 0;
+        }
+        // Round up so the wait does not end just before the deadline
+        uint64_t remaining = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            reader.second.deadline - now + std::chrono::milliseconds(1) - Clock::duration(1)).count();
+        if (remaining < timeout) {
+            timeout = (uint32_t)remaining;
+        }
+    }
+    return timeout;
+}
+
+// Report the difference between the final and the last reported state
+void EventDebouncer::Emit(const std::string& name, ReaderState& reader) {
+    bool removed = reader.reportedPresent && (!reader.present || reader.atr != reader.reportedAtr);
+    bool inserted = reader.present && (!reader.reportedPresent || reader.atr != reader.reportedAtr);
+    uint32_t emitted = (removed ? 1 : 0) + (inserted ? 1 : 0);
+    uint32_t suppressed = reader.transitions > emitted ? reader.transitions - emitted : 0;
+
+    reader.pending = false;
+    reader.transitions = 0;
+    reader.reportedPresent = reader.present;
+    reader.reportedAtr = reader.atr;
+    m_emitted += emitted;
+    m_suppressed += suppressed;
+
+    DebouncedEvent event;
+    event.reader = name;
+    event.timestamp = reader.timestamp;
+    event.dispatchTime = NowMilliseconds();
+    event.detected = reader.detected;
+    event.suppressed = 0;
+    if (removed) {
+        // A different card behind a removal counts as remove + insert
+        event.inserted = false;
+        event.sequence = ++m_sequence;
+        event.suppressed = inserted ? 0 : suppressed;
+        m_sink(event);
+    }
+    if (inserted) {
+        event.inserted = true;
+        event.atr = reader.atr;
+        event.sequence = ++m_sequence;
+        event.suppressed = suppressed;
+        m_sink(event);
+    }
+}
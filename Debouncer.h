@@ -0,0 +1,90 @@
+#ifndef DEBOUNCER_H
+#define DEBOUNCER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// A card event after debouncing
+struct DebouncedEvent {
+    bool inserted;
+    std::string reader;
+    std::vector<uint8_t> atr;
+    uint64_t sequence;          // Monotonic across all readers, starting at 1
+    uint64_t timestamp;         // Time of the raw transition, milliseconds since the Unix epoch
+    uint64_t dispatchTime;      // Time the debounce window closed, same clock
+    uint32_t suppressed;        // Raw transitions folded into this event
+    uint64_t detected;          // LatencyNow() at the raw transition
+};
+
+// Collapses bursts of insert/remove transitions from flapping readers. A
+// transition starts (or restarts) the reader's debounce window; when the
+// window closes without further transitions, the final state is compared
+// with the last reported one and at most a removal and an insertion are
+// emitted. A window of zero reports every transition at once.
+//
+// Not thread-safe: the monitor's coordinator and shard threads share one
+// debouncer, and callers must hold the monitor lock (CardMonitor::m_mutex)
+// for every call. The counters may be read from any thread.
+class EventDebouncer {
+public:
+    typedef std::function<void(const DebouncedEvent&)> Sink;
+
+    // windows overrides defaultWindowMs for individual readers
+    EventDebouncer(uint32_t defaultWindowMs, const std::map<std::string, uint32_t>& windows, Sink sink);
+
+    // Record the state of a reader seen for the first time, without an event
+    void Learn(const std::string& reader, bool present, const uint8_t* atr, size_t atrLength);
+
+    // Record a raw insert (present) or remove transition
+    void Transition(const std::string& reader, bool present, const uint8_t* atr, size_t atrLength,
+                    uint64_t timestamp);
+
+    // Report a pending change right away and drop the reader
+    void Forget(const std::string& reader);
+
+    // Emit the events of every reader whose window has closed
+    void Flush();
+
+    // Milliseconds until the next window closes, or 0xFFFFFFFF if none is open
+    uint32_t NextTimeout() const;
+
+    uint64_t RawTransitions() const { return m_raw; }
+    uint64_t EmittedEvents() const { return m_emitted; }
+    uint64_t SuppressedTransitions() const { return m_suppressed; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct ReaderState {
+        uint32_t windowMs = 0;
+        bool reportedPresent = false;
+        std::vector<uint8_t> reportedAtr;
+        bool pending = false;
+        bool present = false;
+        std::vector<uint8_t> atr;
+        uint64_t timestamp = 0;
+        uint64_t detected = 0;
+        uint32_t transitions = 0;   // Raw transitions since the last report
+        Clock::time_point deadline;
+    };
+
+    ReaderState& Reader(const std::string& name);
+    void Emit(const std::string& name, ReaderState& reader);
+
+    uint32_t m_defaultWindowMs;
+    std::map<std::string, uint32_t> m_windows;
+    Sink m_sink;
+    std::map<std::string, ReaderState> m_readers;
+    uint64_t m_sequence = 0;
+    std::atomic<uint64_t> m_raw;
+    std::atomic<uint64_t> m_emitted;
+    std::atomic<uint64_t> m_suppressed;
+};
+
+#endif // DEBOUNCER_H
@@ -0,0 +1,399 @@
+// Benchmark of the card event engine against a synthetic reader farm. A
+// driver thread toggles cards in N simulated readers at M events per second
+// (round robin, open loop), with simulated APDU latencies, and the time from
+// each simulated insert or removal to its action is measured. Reports
+// throughput, event-to-action percentiles, CPU time and heap allocations per
+// event, and the engine's own stage latencies.
+//
+// Usage: EngineBench [--readers N] [--rate M] [--seconds S] [--apdus K]
+//                    [--workers W] [--connect-us U] [--transmit-us U]
+//                    [--spawn] [--journal PATH] [--max-allocations A] [--json]
+//
+// --spawn runs a real process per event through the command action and
+// the command executor, with one slot per worker, instead of only expanding
+// the command. --journal writes every event to an audit journal at PATH, as
+// [Journal] Path does. Allocations are counted once every reader has had a card
+// inserted and removed, so first-use setup is left out. They include the
+// driver's and the copies that hand each event from the monitor to a
+// worker, so the count is small but not zero. --max-allocations makes the
+// exit status 1 if events average more than A of them, or if no event was
+// handled while measuring; ctest runs it with a fixed bound. --json prints a single JSON object.
+#include "AllocationCounter.h"
+#include "AuditJournal.h"
+#include "CardEngine.h"
+#include "SimulatedBackend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    size_t readers = 16;
+    double rate = 1000;             // Events per second across all readers
+    double seconds = 5;
+    size_t apdus = 2;
+    unsigned workers = 4;
+    SimulatedLatency latency;
+    bool spawn = false;
+    std::string journal;            // Path of the audit journal; empty for none
+    double maxAllocations = -1;     // Per event; negative for no limit
+    bool json = false;
+};
+
+// Per-reader state shared between the driver and the actions
+struct ReaderSlot {
+    std::atomic<uint64_t> issued;   // LatencyNow() of the pending toggle
+    std::atomic<bool> pending;      // Toggled and its action not yet run
+    bool present = false;           // Driver's view
+};
+
+std::vector<ReaderSlot>* g_slots;
+std::atomic<bool> g_measuring(false);
+
+std::string ReaderName(size_t index) {
+    return "Bench Reader " + std::to_string(index);
+}
+
+size_t ReaderIndex(const char* reader) {
+    return (size_t)atoi(strrchr(reader, ' ') + 1);
+}
+
+// Last action of every event: expands a command like the command action
+// does, then records the time since the driver's toggle
+class BenchAction : public Action {
+public:
+    BenchAction(const CommandTemplate& command, LatencyMetrics& stages, LatencyHistogram& latency,
+                std::atomic<uint64_t>& events)
+        : m_command(command), m_stages(stages), m_latency(latency), m_events(events) {}
+
+    const char* Name() const override { return "bench"; }
+
+    void Run(const CardActionEvent& event, EventArena& arena) override {
+        if (!m_command.Empty()) {
+            uint64_t start = LatencyNow();
+            size_t readerLength = strlen(event.reader);
+            CommandChar* reader = arena.Allocate<CommandChar>(readerLength + 1);
+            for (size_t i = 0; i <= readerLength; i++) {
+                reader[i] = (CommandChar)event.reader[i];
+            }
+            TemplateValues values;
+            values.responses = event.responses;
+            values.responseCount = event.responseCount;
+            values.variables = event.variables;
+            values.variableCount = event.variableCount;
+            values.atr.data = event.atr.data;
+            values.atr.length = event.atr.length;
+            values.reader = reader;
+            values.timestamp = event.timestamp;
+            values.sequence = event.sequence;
+            size_t length;
+            m_command.Expand(values, arena, length);
+            m_stages.Record(STAGE_EXPAND, start);
+        }
+
+        ReaderSlot& slot = (*g_slots)[ReaderIndex(event.reader)];
+        uint64_t issued = slot.issued.load(std::memory_order_acquire);
+        if (g_measuring.load(std::memory_order_relaxed)) {
+            uint64_t now = LatencyNow();
+            m_latency.Record(now > issued ? now - issued : 0);
+            m_events.fetch_add(1, std::memory_order_relaxed);
+        }
+        slot.pending.store(false, std::memory_order_release);
+    }
+
+private:
+    CommandTemplate m_command;
+    LatencyMetrics& m_stages;
+    LatencyHistogram& m_latency;
+    std::atomic<uint64_t>& m_events;
+};
+
+double CpuSeconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+    auto seconds = [](const FILETIME& time) {
+        return (double)(((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) / 1e7;
+    };
+    return seconds(kernel) + seconds(user);
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+           (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg == "--spawn") {
+            options.spawn = true;
+        } else if (arg == "--json") {
+            options.json = true;
+        } else if (!value) {
+            return false;
+        } else if (arg == "--readers") {
+            options.readers = (size_t)atoi(argv[++i]);
+        } else if (arg == "--rate") {
+            options.rate = atof(argv[++i]);
+        } else if (arg == "--seconds") {
+            options.seconds = atof(argv[++i]);
+        } else if (arg == "--apdus") {
+            options.apdus = (size_t)atoi(argv[++i]);
+        } else if (arg == "--workers") {
+            options.workers = (unsigned)atoi(argv[++i]);
+        } else if (arg == "--connect-us") {
+            options.latency.connectUs = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--transmit-us") {
+            options.latency.transmitUs = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--journal") {
+            options.journal = argv[++i];
+        } else if (arg == "--max-allocations") {
+            options.maxAllocations = atof(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return options.readers > 0 && options.rate > 0 && options.seconds > 0 && options.workers > 0;
+}
+
+double Microseconds(uint64_t nanoseconds) {
+    return (double)nanoseconds / 1e3;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: EngineBench [--readers N] [--rate M] [--seconds S] [--apdus K] [--workers W]\n"
+                        "                   [--connect-us U] [--transmit-us U] [--spawn] [--journal PATH]\n"
+                        "                   [--max-allocations A] [--json]\n");
+        return 2;
+    }
+
+    SimulatedBackend backend;
+    backend.SetLatency(options.latency);
+    SimulatedCard card;
+    card.atr = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00, 0x03, 0x06 };
+    card.defaultResponse = { 0x01, 0x02, 0x03, 0x04, 0x90, 0x00 };
+
+    // One rule: APDUs on insert, the same actions on insert and removal
+    std::string error;
+    std::string apdus;
+    for (size_t i = 0; i < options.apdus; i++) {
+        apdus += (i ? "," : "") + std::string("00B0000004");
+    }
+    CommandString command;
+    for (const char* c = options.apdus ? "notify {reader} {atr} {1:data}" : "notify {reader} {atr}"; *c; c++) {
+        command += (CommandChar)*c;
+    }
+    CommandTemplate compiled;
+    if (!compiled.Compile(command, options.apdus, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    LatencyHistogram eventLatency;
+    std::atomic<uint64_t> events(0);
+    LatencyMetrics stages;
+    CommandExecutor executor;
+    std::vector<std::shared_ptr<Action>> actions;
+    if (options.spawn) {
+        ExecutorOptions executorOptions;
+        executorOptions.maxConcurrent = options.workers;
+        executorOptions.queueLimit = 4096;
+        executor.Start(executorOptions, &stages);
+        CommandString spawned;
+        for (const char* c = "true {reader}"; *c; c++) {
+            spawned += (CommandChar)*c;
+        }
+        CommandTemplate spawnCommand;
+        spawnCommand.Compile(spawned, 0, error);
+        actions.push_back(CreateCommandAction(spawnCommand, 0, executor, &stages));
+        actions.push_back(std::make_shared<BenchAction>(CommandTemplate(), stages, eventLatency, events));
+    } else {
+        actions.push_back(std::make_shared<BenchAction>(compiled, stages, eventLatency, events));
+    }
+
+    std::shared_ptr<EventRule> rule = std::make_shared<EventRule>();
+    rule->name = "Bench";
+    if (!rule->insertAPDUs.Compile(apdus, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    rule->cacheableAPDUs.assign(options.apdus, false);
+    rule->insertActions = actions;
+    rule->removeActions = actions;
+    std::shared_ptr<RuleSet> rules = std::make_shared<RuleSet>();
+    rules->defaultRule = rule;
+
+    std::vector<ReaderSlot> slots(options.readers);
+    for (auto& slot : slots) {
+        slot.issued = 0;
+        slot.pending = false;
+    }
+    g_slots = &slots;
+
+    // Attach the readers and wait until the engine watches them all
+    EngineOptions engineOptions;
+    engineOptions.workerThreads = options.workers;
+    CardEngine::Sinks sinks;
+    sinks.readers = [](const ReaderList&, const ReaderList&) {};
+    sinks.state = [](ReaderId, bool) {};
+    AuditJournal journal;
+    if (!options.journal.empty()) {
+        if (!journal.Start(options.journal, JournalOptions(), error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        sinks.card = [&journal](const CardActionEvent& event) { journal.Append(event); };
+    }
+    CardEngine engine(backend, engineOptions, rules, NULL, stages, sinks);
+    if (engine.Start() != CARD_S_SUCCESS) {
+        fprintf(stderr, "cannot start the engine\n");
+        return 1;
+    }
+    for (size_t i = 0; i < options.readers; i++) {
+        backend.AddReader(ReaderName(i));
+    }
+    Clock::time_point attachDeadline = Clock::now() + std::chrono::seconds(10);
+    while (engine.ReaderCount() < options.readers && Clock::now() < attachDeadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Drive the readers round robin on a fixed schedule. A reader whose last
+    // toggle has not reached its action yet is skipped, so every measured
+    // event is a single transition.
+    std::vector<std::string> names;
+    for (size_t i = 0; i < options.readers; i++) {
+        names.push_back(ReaderName(i));
+    }
+    uint64_t total = (uint64_t)(options.rate * options.seconds);
+    Clock::duration interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / options.rate));
+    uint64_t skipped = 0;
+    uint64_t warmup = (uint64_t)options.readers * 2;
+    uint64_t allocationsBefore = AllocationCount();
+    uint64_t eventsBefore = 0;
+    double cpuBefore = CpuSeconds();
+    Clock::time_point start = Clock::now();
+    g_measuring = true;
+    for (uint64_t i = 0; i < total; i++) {
+        std::this_thread::sleep_until(start + interval * (Clock::rep)i);
+        if (i == warmup) {
+            allocationsBefore = AllocationCount();
+            eventsBefore = events.load();
+        }
+        size_t index = (size_t)(i % options.readers);
+        ReaderSlot& slot = slots[index];
+        if (slot.pending.load(std::memory_order_acquire)) {
+            skipped++;
+            continue;
+        }
+        slot.pending.store(true, std::memory_order_relaxed);
+        slot.issued.store(LatencyNow(), std::memory_order_release);
+        slot.present = !slot.present;
+        if (slot.present) {
+            backend.InsertCard(names[index], card);
+        } else {
+            backend.RemoveCard(names[index]);
+        }
+    }
+
+    // Let the last events finish
+    Clock::time_point drainDeadline = Clock::now() + std::chrono::seconds(5);
+    for (size_t i = 0; i < options.readers && Clock::now() < drainDeadline; i++) {
+        while (slots[i].pending.load() && Clock::now() < drainDeadline) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    g_measuring = false;
+    double cpu = CpuSeconds() - cpuBefore;
+    uint64_t allocations = AllocationCount() - allocationsBefore;
+    uint64_t handled = events.load();
+    double allocationsPerEvent = handled > eventsBefore ? (double)allocations / (double)(handled - eventsBefore) : 0;
+    // With a limit set, an engine that handled nothing fails too: zero
+    // allocations per event would say nothing about the code measured
+    bool stalled = handled <= eventsBefore;
+    bool overLimit = allocationsPerEvent > options.maxAllocations;
+    int status = options.maxAllocations >= 0 && (stalled || overLimit) ? 1 : 0;
+    size_t shards = engine.ShardCount();
+    engine.Stop();
+    while ((executor.QueueDepth() > 0 || executor.Running() > 0) && Clock::now() < drainDeadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    executor.Stop();
+    journal.Stop();
+    uint64_t commands = executor.Succeeded() + executor.Failed() + executor.TimedOut();
+
+    double perEvent = handled ? 1.0 / (double)handled : 0;
+    if (options.json) {
+        printf("{\"readers\":%zu,\"rate\":%.0f,\"seconds\":%.3f,\"apdus\":%zu,\"workers\":%u,"
+               "\"connect_us\":%u,\"transmit_us\":%u,\"spawn\":%s,\"shards\":%zu,"
+               "\"events\":%llu,\"skipped\":%llu,\"commands\":%llu,\"commands_dropped\":%llu,"
+               "\"journal_records\":%llu,\"journal_dropped\":%llu,\"throughput\":%.1f,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+               "\"cpu_us_per_event\":%.2f,\"allocations_per_event\":%.2f,\"stages\":{",
+               options.readers, options.rate, elapsed, options.apdus, options.workers,
+               options.latency.connectUs, options.latency.transmitUs, options.spawn ? "true" : "false", shards,
+               (unsigned long long)handled, (unsigned long long)skipped,
+               (unsigned long long)commands, (unsigned long long)executor.Dropped(),
+               (unsigned long long)journal.Records(), (unsigned long long)journal.Dropped(), (double)handled / elapsed,
+               Microseconds(eventLatency.Percentile(0.5)), Microseconds(eventLatency.Percentile(0.99)),
+               Microseconds(eventLatency.Percentile(0.999)),
+               cpu * 1e6 * perEvent, allocationsPerEvent);
+        for (unsigned i = 0; i < STAGE_COUNT; i++) {
+            const LatencyHistogram& stage = stages.Stage((LatencyStage)i);
+            printf("%s\"%s\":{\"count\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f}", i ? "," : "",
+                   LatencyStageName((LatencyStage)i), (unsigned long long)stage.Count(),
+                   Microseconds(stage.Percentile(0.5)), Microseconds(stage.Percentile(0.99)));
+        }
+        printf("}}\n");
+        return status;
+    }
+
+    printf("%zu readers on %zu monitor threads, %u workers, %.0f events/s for %.1f s\n",
+           options.readers, shards, options.workers, options.rate, elapsed);
+    printf("events        %llu (%llu skipped while pending)\n", (unsigned long long)handled,
+           (unsigned long long)skipped);
+    if (options.spawn) {
+        printf("commands      %llu finished, %llu dropped\n", (unsigned long long)commands,
+               (unsigned long long)executor.Dropped());
+    }
+    if (!options.journal.empty()) {
+        printf("journal       %llu records, %llu events dropped\n", (unsigned long long)journal.Records(),
+               (unsigned long long)journal.Dropped());
+    }
+    printf("throughput    %.1f events/s\n", (double)handled / elapsed);
+    printf("latency       p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+           Microseconds(eventLatency.Percentile(0.5)), Microseconds(eventLatency.Percentile(0.99)),
+           Microseconds(eventLatency.Percentile(0.999)));
+    printf("cpu           %.2f us per event\n", cpu * 1e6 * perEvent);
+    printf("allocations   %.2f per event%s\n", allocationsPerEvent,
+           !status ? "" : stalled ? ", no events were measured" : ", over the limit");
+    printf("\n%-14s %10s %10s %10s\n", "stage", "count", "p50 us", "p99 us");
+    for (unsigned i = 0; i < STAGE_COUNT; i++) {
+        const LatencyHistogram& stage = stages.Stage((LatencyStage)i);
+        printf("%-14s %10llu %10.1f %10.1f\n", LatencyStageName((LatencyStage)i),
+               (unsigned long long)stage.Count(), Microseconds(stage.Percentile(0.5)),
+               Microseconds(stage.Percentile(0.99)));
+    }
+    return status;
+}
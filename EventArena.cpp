@@ -0,0 +1,43 @@
+#include "EventArena.h"
+#include <string.h>
+
+EventArena::EventArena(size_t blockSize)
+    : m_block(new uint8_t[blockSize ? blockSize : 1]), m_size(blockSize ? blockSize : 1) {
+}
+
+void* EventArena::Allocate(size_t size, size_t alignment) {
+    // The block comes from operator new, so its start is aligned for any type
+    size_t offset = (m_used + alignment - 1) & ~(alignment - 1);
+    if (offset <= m_size && size <= m_size - offset) {
+        m_used = offset + size;
+        return m_block.get() + offset;
+    }
+
+    size_t needed = size + alignment;
+    m_overflow.push_back(std::unique_ptr<uint8_t[]>(new uint8_t[needed]));
+    m_overflowBytes += needed;
+    uintptr_t address = (uintptr_t)m_overflow.back().get();
+    return (void*)((address + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+ByteSpan EventArena::Copy(const uint8_t* data, size_t length) {
+    uint8_t* copy = (uint8_t*)Allocate(length, 1);
+    if (length > 0) {
+        memcpy(copy, data, length);
+    }
+    ByteSpan span = { copy, length };
+    return span;
+}
+
+void EventArena::Reset() {
+    if (!m_overflow.empty()) {
+        // Grow to fit the whole event next time, with room to spare
+        size_t size = m_size + m_overflowBytes;
+        size += size / 2;
+        m_block.reset(new uint8_t[size]);
+        m_size = size;
+        m_overflow.clear();
+        m_overflowBytes = 0;
+    }
+    m_used = 0;
+}
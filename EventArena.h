@@ -0,0 +1,52 @@
+#ifndef EVENTARENA_H
+#define EVENTARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "CardActionPlugin.h"
+
+// Bytes held elsewhere, usually in an EventArena. It has the layout of the
+// plugin interface's spans, so APDU responses reach plugins and command
+// templates without being copied or converted.
+typedef CardActionBytes ByteSpan;
+
+// Scratch memory for handling one card event: responses, converted strings
+// and expanded command lines. Allocating moves a pointer through one block,
+// and Reset releases everything at once. An event that needs more than the
+// block holds gets overflow blocks from the heap, and Reset grows the block
+// to fit, so once the largest event has been seen, the arena takes nothing
+// more from the heap.
+//
+// Nothing allocated here is destroyed, so only use it for trivially
+// destructible types. Not thread safe; the engine keeps one per worker.
+class EventArena {
+public:
+    explicit EventArena(size_t blockSize = 4096);
+
+    // Uninitialized memory for size bytes, valid until Reset
+    void* Allocate(size_t size, size_t alignment = sizeof(void*));
+
+    template <typename T>
+    T* Allocate(size_t count) {
+        return (T*)Allocate(count * sizeof(T), alignof(T));
+    }
+
+    // Copy length bytes into the arena
+    ByteSpan Copy(const uint8_t* data, size_t length);
+
+    // Release everything allocated since the last Reset
+    void Reset();
+
+    size_t Capacity() const { return m_size; }
+
+private:
+    std::unique_ptr<uint8_t[]> m_block;
+    size_t m_size;
+    size_t m_used = 0;
+    std::vector<std::unique_ptr<uint8_t[]>> m_overflow;
+    size_t m_overflowBytes = 0;
+};
+
+#endif // EVENTARENA_H
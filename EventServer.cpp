@@ -0,0 +1,471 @@
+#include "EventServer.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const size_t FRAME_HEADER_SIZE = 8;     // length and dropped
+
+void PutU16(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back((uint8_t)value);
+    out.push_back((uint8_t)(value >> 8));
+}
+
+void PutU32(uint8_t* out, uint32_t value) {
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+void PutU32(std::vector<uint8_t>& out, uint32_t value) {
+    uint8_t bytes[4];
+    PutU32(bytes, value);
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+void PutU64(std::vector<uint8_t>& out, uint64_t value) {
+    PutU32(out, (uint32_t)value);
+    PutU32(out, (uint32_t)(value >> 32));
+}
+
+// Everything after the frame header up to and including the ATR
+std::vector<uint8_t> BeginRecord(uint8_t type, const char* reader, uint64_t timestamp,
+                                 const uint8_t* atr, size_t atrLength, size_t reserve) {
+    size_t readerLength = strlen(reader);
+    if (readerLength > 0xFFFF) {
+        readerLength = 0xFFFF;
+    }
+    if (atrLength > 0xFF) {
+        atrLength = 0xFF;
+    }
+
+    std::vector<uint8_t> record;
+    record.reserve(16 + readerLength + atrLength + reserve);
+    record.push_back(type);
+    record.push_back(EVENT_RECORD_VERSION);
+    PutU16(record, (uint32_t)readerLength);
+    PutU64(record, timestamp);
+    record.insert(record.end(), reader, reader + readerLength);
+    record.push_back((uint8_t)atrLength);
+    if (atrLength > 0) {
+        record.insert(record.end(), atr, atr + atrLength);
+    }
+    return record;
+}
+
+// Bytes PutResponses appends for count responses
+size_t ResponsesSize(const CardActionBytes* responses, size_t count) {
+    size_t size = 2;
+    for (size_t i = 0; i < count && i < 0xFFFF; i++) {
+        size += 4 + responses[i].length;
+    }
+    return size;
+}
+
+// Append a uint16 count, then each response's uint32 length and bytes
+void PutResponses(std::vector<uint8_t>& record, const CardActionBytes* responses, size_t count) {
+    if (count > 0xFFFF) {
+        count = 0xFFFF;
+    }
+    PutU16(record, (uint32_t)count);
+    for (size_t i = 0; i < count; i++) {
+        PutU32(record, (uint32_t)responses[i].length);
+        record.insert(record.end(), responses[i].data, responses[i].data + responses[i].length);
+    }
+}
+
+#ifdef _WIN32
+HANDLE CreatePipeInstance(const CommandString& endpoint, bool first) {
+    // Outbound only; subscribers never send anything
+    return CreateNamedPipe(endpoint.c_str(),
+                           PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                           PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                           PIPE_UNLIMITED_INSTANCES, 64 * 1024, 0, 0, NULL);
+}
+
+// Write the whole buffer, giving up when the stop event is set
+bool WriteAll(HANDLE pipe, HANDLE ioEvent, HANDLE stopEvent, const uint8_t* data, size_t length) {
+    while (length > 0) {
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = ioEvent;
+        DWORD chunk = length > 0x10000000 ? 0x10000000 : (DWORD)length;
+        DWORD written = 0;
+        if (!WriteFile(pipe, data, chunk, NULL, &overlapped)) {
+            if (GetLastError() != ERROR_IO_PENDING) {
+                return false;
+            }
+            HANDLE handles[] = { ioEvent, stopEvent };
+            if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                CancelIo(pipe);
+                GetOverlappedResult(pipe, &overlapped, &written, TRUE);
+                return false;
+            }
+        }
+        if (!GetOverlappedResult(pipe, &overlapped, &written, FALSE) || written == 0) {
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+#else
+bool WriteAll(int socket, const uint8_t* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = send(socket, data, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+#endif
+
+} // namespace
+
+EventServer::EventServer() {
+    m_stopSignal[0] = -1;
+    m_stopSignal[1] = -1;
+}
+
+EventServer::~EventServer() {
+    Stop();
+}
+
+bool EventServer::Start(const CommandString& endpoint, size_t queueLimit, std::string& error) {
+    m_endpoint = endpoint;
+    m_queueLimit = queueLimit > 0 ? queueLimit : 1;
+    m_stopping = false;
+
+#ifdef _WIN32
+    // The first instance is created here so a name clash is reported at once
+    HANDLE pipe = CreatePipeInstance(endpoint, true);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        error = "cannot create pipe (error " + std::to_string(GetLastError()) + ")";
+        return false;
+    }
+    m_listener = (intptr_t)pipe;
+    m_stopSignal[0] = (intptr_t)CreateEvent(NULL, TRUE, FALSE, NULL);
+#else
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (endpoint.empty() || endpoint.size() >= sizeof(address.sun_path)) {
+        error = "invalid socket path";
+        return false;
+    }
+    memcpy(address.sun_path, endpoint.c_str(), endpoint.size() + 1);
+
+    // Replace a socket left behind by a previous run, but nothing else
+    struct stat status;
+    if (lstat(endpoint.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(endpoint.c_str());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+        chmod(endpoint.c_str(), 0660) != 0 || listen(listener, 16) != 0) {
+        error = std::string("cannot listen: ") + strerror(errno);
+        if (listener >= 0) {
+            close(listener);
+        }
+        return false;
+    }
+    int stopPipe[2];
+    if (pipe2(stopPipe, O_CLOEXEC) != 0) {
+        error = std::string("cannot create pipe: ") + strerror(errno);
+        close(listener);
+        unlink(endpoint.c_str());
+        return false;
+    }
+    m_listener = listener;
+    m_stopSignal[0] = stopPipe[0];
+    m_stopSignal[1] = stopPipe[1];
+#endif
+
+    m_acceptThread = std::thread(&EventServer::AcceptLoop, this);
+    return true;
+}
+
+void EventServer::Stop() {
+    if (!m_acceptThread.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_open = 0;
+        for (auto& subscriber : m_subscribers) {
+            subscriber->closed = true;
+            subscriber->wake.notify_one();
+#ifndef _WIN32
+            // Unblock a send to a consumer that stopped reading
+            shutdown((int)subscriber->connection, SHUT_RDWR);
+#endif
+        }
+    }
+
+    // Wake the accept loop and any pending pipe writes
+#ifdef _WIN32
+    SetEvent((HANDLE)m_stopSignal[0]);
+#else
+    char wake = 0;
+    while (write((int)m_stopSignal[1], &wake, 1) < 0 && errno == EINTR) {
+    }
+#endif
+    m_acceptThread.join();
+
+    // No new subscribers can arrive now
+    for (auto& subscriber : m_subscribers) {
+        subscriber->thread.join();
+#ifdef _WIN32
+        CloseHandle((HANDLE)subscriber->connection);
+#else
+        close((int)subscriber->connection);
+#endif
+    }
+    m_subscribers.clear();
+
+#ifdef _WIN32
+    CloseHandle((HANDLE)m_stopSignal[0]);
+#else
+    close((int)m_listener);
+    close((int)m_stopSignal[0]);
+    close((int)m_stopSignal[1]);
+    unlink(m_endpoint.c_str());
+#endif
+    m_listener = -1;
+    m_stopSignal[0] = -1;
+    m_stopSignal[1] = -1;
+}
+
+void EventServer::PublishCardEvent(const CardActionEvent& event) {
+    // Without subscribers there is no one to build the record for. One
+    // connecting right now misses this event, as it would a moment later.
+    if (m_open.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    size_t responseBytes = ResponsesSize(event.responses, event.responseCount) +
+                           ResponsesSize(event.variables, event.variableCount);
+
+    uint8_t type = event.type == CARDACTION_EVENT_INSERTED ? EVENT_RECORD_INSERTED : EVENT_RECORD_REMOVED;
+    std::vector<uint8_t> record = BeginRecord(type, event.reader, event.timestamp,
+                                              event.atr.data, event.atr.length, 20 + responseBytes);
+    PutResponses(record, event.responses, event.responseCount);
+    PutU64(record, event.sequence);
+    PutU64(record, event.dispatchTime);
+    PutU32(record, event.suppressed);
+    PutResponses(record, event.variables, event.variableCount);
+
+    Publish(std::make_shared<const std::vector<uint8_t>>(std::move(record)));
+}
+
+void EventServer::PublishReaderChange(const char* reader, bool added, uint64_t timestamp) {
+    if (m_open.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    std::vector<uint8_t> record = BeginRecord(added ? EVENT_RECORD_READER_ADDED : EVENT_RECORD_READER_REMOVED,
+                                              reader, timestamp, NULL, 0, 24);
+    PutU16(record, 0);
+    PutU64(record, 0);
+    PutU64(record, timestamp);
+    PutU32(record, 0);
+    PutU16(record, 0);
+
+    Publish(std::make_shared<const std::vector<uint8_t>>(std::move(record)));
+}
+
+size_t EventServer::SubscriberCount() {
+    return m_open.load();
+}
+
+// Queue a record for every subscriber. Records are shared, so this only
+// costs a reference per subscriber.
+void EventServer::Publish(Record record) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& subscriber : m_subscribers) {
+        if (subscriber->closed) {
+            continue;
+        }
+        if (subscriber->queue.size() >= m_queueLimit) {
+            subscriber->queue.pop_front();
+            subscriber->dropped++;
+        }
+        subscriber->queue.push_back(record);
+        subscriber->wake.notify_one();
+    }
+}
+
+// Wait for the next subscriber. Returns false once Stop has been called;
+// otherwise connection is the new subscriber, or -1 if the attempt failed.
+bool EventServer::WaitForConnection(intptr_t& connection) {
+    connection = -1;
+#ifdef _WIN32
+    HANDLE stopEvent = (HANDLE)m_stopSignal[0];
+    HANDLE pipe = (HANDLE)m_listener;
+    if (pipe == INVALID_HANDLE_VALUE) {
+        // Out of pipe instances or memory; try again shortly
+        m_listener = (intptr_t)CreatePipeInstance(m_endpoint, false);
+        return WaitForSingleObject(stopEvent, m_listener == -1 ? 1000 : 0) != WAIT_OBJECT_0;
+    }
+
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    bool connected = ConnectNamedPipe(pipe, &overlapped) != FALSE;
+    DWORD error = GetLastError();
+    bool stopping = false;
+    if (!connected && error == ERROR_PIPE_CONNECTED) {
+        connected = true;
+    } else if (!connected && error == ERROR_IO_PENDING) {
+        HANDLE handles[] = { overlapped.hEvent, stopEvent };
+        DWORD unused;
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+            connected = GetOverlappedResult(pipe, &overlapped, &unused, FALSE) != FALSE;
+        } else {
+            CancelIo(pipe);
+            GetOverlappedResult(pipe, &overlapped, &unused, TRUE);
+            stopping = true;
+        }
+    }
+    CloseHandle(overlapped.hEvent);
+
+    if (connected && !stopping) {
+        connection = (intptr_t)pipe;
+    } else {
+        CloseHandle(pipe);
+    }
+    m_listener = stopping ? -1 : (intptr_t)CreatePipeInstance(m_endpoint, false);
+    return !stopping;
+#else
+    pollfd fds[2] = {};
+    fds[0].fd = (int)m_listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = (int)m_stopSignal[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+        return errno == EINTR;
+    }
+    if (fds[1].revents) {
+        return false;
+    }
+    if (fds[0].revents & POLLIN) {
+        connection = accept4((int)m_listener, NULL, NULL, SOCK_CLOEXEC);
+    }
+    return true;
+#endif
+}
+
+void EventServer::AcceptLoop() {
+    intptr_t connection;
+    while (WaitForConnection(connection)) {
+        ReapSubscribers();
+        if (connection == -1) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stopping) {
+#ifdef _WIN32
+            CloseHandle((HANDLE)connection);
+#else
+            close((int)connection);
+#endif
+            break;
+        }
+        m_subscribers.push_back(std::unique_ptr<Subscriber>(new Subscriber()));
+        Subscriber* subscriber = m_subscribers.back().get();
+        subscriber->connection = connection;
+        subscriber->thread = std::thread(&EventServer::WriteLoop, this, subscriber);
+        m_open++;
+    }
+}
+
+void EventServer::WriteLoop(Subscriber* subscriber) {
+#ifdef _WIN32
+    HANDLE ioEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+#endif
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        subscriber->wake.wait(lock, [subscriber]() {
+            return subscriber->closed || !subscriber->queue.empty();
+        });
+        if (subscriber->closed) {
+            break;
+        }
+        Record record = std::move(subscriber->queue.front());
+        subscriber->queue.pop_front();
+        uint32_t dropped = subscriber->dropped;
+        subscriber->dropped = 0;
+        lock.unlock();
+
+        uint8_t header[FRAME_HEADER_SIZE];
+        PutU32(header, (uint32_t)(4 + record->size()));
+        PutU32(header + 4, dropped);
+#ifdef _WIN32
+        HANDLE pipe = (HANDLE)subscriber->connection;
+        HANDLE stopEvent = (HANDLE)m_stopSignal[0];
+        bool written = WriteAll(pipe, ioEvent, stopEvent, header, sizeof(header)) &&
+                       WriteAll(pipe, ioEvent, stopEvent, record->data(), record->size());
+#else
+        int socket = (int)subscriber->connection;
+        bool written = WriteAll(socket, header, sizeof(header)) &&
+                       WriteAll(socket, record->data(), record->size());
+#endif
+        record.reset();
+
+        lock.lock();
+        if (!written) {
+            // The subscriber went away; ReapSubscribers cleans up
+            if (!subscriber->closed) {
+                subscriber->closed = true;
+                m_open--;
+            }
+            subscriber->queue.clear();
+            break;
+        }
+    }
+    subscriber->finished = true;
+#ifdef _WIN32
+    CloseHandle(ioEvent);
+#endif
+}
+
+// Join and close subscribers whose writer thread has returned
+void EventServer::ReapSubscribers() {
+    std::list<std::unique_ptr<Subscriber>> finished;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_subscribers.begin(); it != m_subscribers.end();) {
+            auto next = std::next(it);
+            if ((*it)->finished) {
+                finished.splice(finished.end(), m_subscribers, it);
+            }
+            it = next;
+        }
+    }
+    for (auto& subscriber : finished) {
+        subscriber->thread.join();
+#ifdef _WIN32
+        CloseHandle((HANDLE)subscriber->connection);
+#else
+        close((int)subscriber->connection);
+#endif
+    }
+}
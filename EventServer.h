@@ -0,0 +1,96 @@
+#ifndef EVENTSERVER_H
+#define EVENTSERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CardActionPlugin.h"
+#include "CommandTemplate.h"
+
+// Record types sent to subscribers
+const uint8_t EVENT_RECORD_INSERTED       = 1;
+const uint8_t EVENT_RECORD_REMOVED        = 2;
+const uint8_t EVENT_RECORD_READER_ADDED   = 3;
+const uint8_t EVENT_RECORD_READER_REMOVED = 4;
+const uint8_t EVENT_RECORD_VERSION        = 3;
+
+// Pushes card and reader events to any number of local subscribers over a
+// named pipe (Windows) or a Unix domain socket. Each record is a frame of
+// little-endian fields:
+//
+//   uint32 length          number of bytes that follow
+//   uint32 dropped         records dropped for this subscriber before this one
+//   uint8  type            EVENT_RECORD_*
+//   uint8  version         EVENT_RECORD_VERSION
+//   uint16 readerLength
+//   uint64 timestamp       milliseconds since the Unix epoch
+//   reader                 readerLength bytes, not terminated
+//   uint8  atrLength, then the ATR
+//   uint16 responseCount, then for each response uint32 length and the bytes
+//   uint64 sequence        event number, 0 for reader records (version 2)
+//   uint64 dispatchTime    end of the debounce window (version 2)
+//   uint32 suppressed      raw transitions folded into the event (version 2)
+//   uint16 variableCount, then for each APDU script variable uint32 length
+//                          and the bytes, in order of first use (version 3)
+//
+// Fields are only ever added at the end, so readers skip what they do not
+// know using the length.
+//
+// Publishing never blocks on a subscriber. Every subscriber has its own
+// bounded queue and writer thread; when a queue is full the oldest record is
+// dropped and counted in the next frame.
+class EventServer {
+public:
+    EventServer();
+    ~EventServer();
+
+    // Listen on endpoint, e.g. \\.\pipe\CardAction or /run/cardaction.sock
+    bool Start(const CommandString& endpoint, size_t queueLimit, std::string& error);
+
+    // Disconnect all subscribers and stop listening
+    void Stop();
+
+    void PublishCardEvent(const CardActionEvent& event);
+    void PublishReaderChange(const char* reader, bool added, uint64_t timestamp);
+
+    size_t SubscriberCount();
+
+private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> Record;
+
+    struct Subscriber {
+        intptr_t connection;            // Pipe HANDLE or socket descriptor
+        std::deque<Record> queue;
+        uint32_t dropped = 0;
+        bool closed = false;            // Set on disconnect or Stop
+        bool finished = false;          // Writer thread has returned
+        std::condition_variable wake;
+        std::thread thread;
+    };
+
+    void Publish(Record record);
+    bool WaitForConnection(intptr_t& connection);
+    void AcceptLoop();
+    void WriteLoop(Subscriber* subscriber);
+    void ReapSubscribers();
+
+    std::mutex m_mutex;
+    std::list<std::unique_ptr<Subscriber>> m_subscribers;
+    std::atomic<size_t> m_open{0};     // Subscribers not closed; changed under m_mutex
+    size_t m_queueLimit = 0;
+    bool m_stopping = false;
+    std::thread m_acceptThread;
+    CommandString m_endpoint;
+    intptr_t m_listener = -1;           // Listening socket, or the next pipe instance
+    intptr_t m_stopSignal[2];           // Windows stop event, or a self-pipe
+};
+
+#endif // EVENTSERVER_H
@@ -0,0 +1,314 @@
+#include "HexCodec.h"
+#include <string.h>
+#include <atomic>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HEX_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HEX_TARGET_SSE2
+#define HEX_TARGET_AVX2
+#else
+#define HEX_TARGET_SSE2 __attribute__((target("sse2")))
+#define HEX_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+
+typedef void (*EncodeKernel)(const uint8_t* bytes, size_t length, char* out, HexCase hexCase);
+
+// Returns the offset of the first invalid character, or length on success.
+// length is always even.
+typedef size_t (*DecodeKernel)(const char* hex, size_t length, uint8_t* out);
+
+struct Kernel {
+    const char* name;
+    EncodeKernel encode;
+    DecodeKernel decode;
+};
+
+// Lookup tables for the scalar kernel and the SIMD tails
+struct Tables {
+    char lower[256][2];
+    char upper[256][2];
+    int8_t nibble[256];     // -1 for non-hex characters
+
+    Tables() {
+        static const char lowerDigits[] = "0123456789abcdef";
+        static const char upperDigits[] = "0123456789ABCDEF";
+        for (int i = 0; i < 256; i++) {
+            lower[i][0] = lowerDigits[i >> 4];
+            lower[i][1] = lowerDigits[i & 0x0F];
+            upper[i][0] = upperDigits[i >> 4];
+            upper[i][1] = upperDigits[i & 0x0F];
+            nibble[i] = -1;
+        }
+        for (int i = 0; i < 16; i++) {
+            nibble[(uint8_t)lowerDigits[i]] = (int8_t)i;
+            nibble[(uint8_t)upperDigits[i]] = (int8_t)i;
+        }
+    }
+};
+
+const Tables g_tables;
+
+void EncodeScalar(const uint8_t* bytes, size_t length, char* out, HexCase hexCase) {
+    const char (*table)[2] = hexCase == HEX_UPPER ? g_tables.upper : g_tables.lower;
+    for (size_t i = 0; i < length; i++) {
+        memcpy(out + 2 * i, table[bytes[i]], 2);
+    }
+}
+
+size_t DecodeScalar(const char* hex, size_t length, uint8_t* out) {
+    for (size_t i = 0; i < length; i += 2) {
+        int high = g_tables.nibble[(uint8_t)hex[i]];
+        int low = g_tables.nibble[(uint8_t)hex[i + 1]];
+        if ((high | low) < 0) {
+            return high < 0 ? i : i + 1;
+        }
+        out[i / 2] = (uint8_t)((high << 4) | low);
+    }
+    return length;
+}
+
+#ifdef HEX_X86
+
+// Nibble (0-15) to ASCII: add '0', plus the gap to the letters above 9
+HEX_TARGET_SSE2 inline __m128i NibbleToAscii(__m128i nibble, __m128i letterGap) {
+    __m128i ascii = _mm_add_epi8(nibble, _mm_set1_epi8('0'));
+    __m128i letters = _mm_cmpgt_epi8(nibble, _mm_set1_epi8(9));
+    return _mm_add_epi8(ascii, _mm_and_si128(letters, letterGap));
+}
+
+// ASCII to nibble; valid is set to all ones for hex digits
+HEX_TARGET_SSE2 inline __m128i AsciiToNibble(__m128i c, __m128i& valid) {
+    __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                    _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+    __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                     _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), folded));
+    __m128i digit = _mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+    __m128i letter = _mm_and_si128(isLetter, _mm_sub_epi8(folded, _mm_set1_epi8('a' - 10)));
+    valid = _mm_or_si128(isDigit, isLetter);
+    return _mm_or_si128(digit, letter);
+}
+
+HEX_TARGET_SSE2 void EncodeSse2(const uint8_t* bytes, size_t length, char* out, HexCase hexCase) {
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i letterGap = _mm_set1_epi8(hexCase == HEX_UPPER ? 'A' - '0' - 10 : 'a' - '0' - 10);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bytes + i));
+        __m128i high = NibbleToAscii(_mm_and_si128(_mm_srli_epi16(v, 4), mask), letterGap);
+        __m128i low = NibbleToAscii(_mm_and_si128(v, mask), letterGap);
+        _mm_storeu_si128((__m128i*)(out + 2 * i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*)(out + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+    }
+    EncodeScalar(bytes + i, length - i, out + 2 * i, hexCase);
+}
+
+HEX_TARGET_SSE2 size_t DecodeSse2(const char* hex, size_t length, uint8_t* out) {
+    const __m128i lowByte = _mm_set1_epi16(0x00FF);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m128i validA, validB;
+        __m128i a = AsciiToNibble(_mm_loadu_si128((const __m128i*)(hex + i)), validA);
+        __m128i b = AsciiToNibble(_mm_loadu_si128((const __m128i*)(hex + i + 16)), validB);
+        if (_mm_movemask_epi8(_mm_and_si128(validA, validB)) != 0xFFFF) {
+            break;  // Let the scalar tail locate the bad character
+        }
+        // Each 16-bit lane holds (high nibble, low nibble) in memory order
+        a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, lowByte), 4), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, lowByte), 4), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i*)(out + i / 2), _mm_packus_epi16(a, b));
+    }
+    size_t tail = DecodeScalar(hex + i, length - i, out + i / 2);
+    return i + tail;
+}
+
+HEX_TARGET_AVX2 inline __m256i NibbleToAscii256(__m256i nibble, __m256i letterGap) {
+    __m256i ascii = _mm256_add_epi8(nibble, _mm256_set1_epi8('0'));
+    __m256i letters = _mm256_cmpgt_epi8(nibble, _mm256_set1_epi8(9));
+    return _mm256_add_epi8(ascii, _mm256_and_si256(letters, letterGap));
+}
+
+HEX_TARGET_AVX2 inline __m256i AsciiToNibble256(__m256i c, __m256i& valid) {
+    __m256i isDigit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i folded = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i isLetter = _mm256_and_si256(_mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), folded));
+    __m256i digit = _mm256_and_si256(isDigit, _mm256_sub_epi8(c, _mm256_set1_epi8('0')));
+    __m256i letter = _mm256_and_si256(isLetter, _mm256_sub_epi8(folded, _mm256_set1_epi8('a' - 10)));
+    valid = _mm256_or_si256(isDigit, isLetter);
+    return _mm256_or_si256(digit, letter);
+}
+
+HEX_TARGET_AVX2 void EncodeAvx2(const uint8_t* bytes, size_t length, char* out, HexCase hexCase) {
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i letterGap = _mm256_set1_epi8(hexCase == HEX_UPPER ? 'A' - '0' - 10 : 'a' - '0' - 10);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(bytes + i));
+        __m256i high = NibbleToAscii256(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask), letterGap);
+        __m256i low = NibbleToAscii256(_mm256_and_si256(v, mask), letterGap);
+        // Unpacking works within 128-bit lanes; put the halves back in order
+        __m256i first = _mm256_unpacklo_epi8(high, low);
+        __m256i second = _mm256_unpackhi_epi8(high, low);
+        _mm256_storeu_si256((__m256i*)(out + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    // Clear the upper halves before running legacy SSE code for the tail
+    _mm256_zeroupper();
+    EncodeSse2(bytes + i, length - i, out + 2 * i, hexCase);
+}
+
+HEX_TARGET_AVX2 size_t DecodeAvx2(const char* hex, size_t length, uint8_t* out) {
+    // maddubs computes high * 16 + low for each pair of nibbles
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m256i validA, validB;
+        __m256i a = AsciiToNibble256(_mm256_loadu_si256((const __m256i*)(hex + i)), validA);
+        __m256i b = AsciiToNibble256(_mm256_loadu_si256((const __m256i*)(hex + i + 32)), validB);
+        if (_mm256_movemask_epi8(_mm256_and_si256(validA, validB)) != -1) {
+            break;  // Let the narrower kernels locate the bad character
+        }
+        __m256i packed = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights),
+                                             _mm256_maddubs_epi16(b, weights));
+        _mm256_storeu_si256((__m256i*)(out + i / 2), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    _mm256_zeroupper();
+    size_t tail = DecodeSse2(hex + i, length - i, out + i / 2);
+    return i + tail;
+}
+
+bool CpuHasSse2() {
+#if defined(_M_X64) || defined(__x86_64__)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool CpuHasAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // HEX_X86
+
+const Kernel g_scalarKernel = { "scalar", EncodeScalar, DecodeScalar };
+#ifdef HEX_X86
+const Kernel g_sse2Kernel = { "sse2", EncodeSse2, DecodeSse2 };
+const Kernel g_avx2Kernel = { "avx2", EncodeAvx2, DecodeAvx2 };
+#endif
+
+const Kernel* DetectKernel() {
+#ifdef HEX_X86
+    if (CpuHasAvx2()) {
+        return &g_avx2Kernel;
+    }
+    if (CpuHasSse2()) {
+        return &g_sse2Kernel;
+    }
+#endif
+    return &g_scalarKernel;
+}
+
+std::atomic<const Kernel*> g_kernel(NULL);
+
+const Kernel* ActiveKernel() {
+    const Kernel* kernel = g_kernel.load(std::memory_order_acquire);
+    if (!kernel) {
+        kernel = DetectKernel();
+        g_kernel.store(kernel, std::memory_order_release);
+    }
+    return kernel;
+}
+
+} // namespace
+
+void HexEncode(const uint8_t* bytes, size_t length, char* out, HexCase hexCase) {
+    ActiveKernel()->encode(bytes, length, out, hexCase);
+}
+
+void HexEncode(const uint8_t* bytes, size_t length, wchar_t* out, HexCase hexCase) {
+    // Encode in chunks through a narrow buffer and widen
+    const size_t CHUNK = 256;
+    char buffer[2 * CHUNK];
+    EncodeKernel encode = ActiveKernel()->encode;
+    while (length > 0) {
+        size_t count = length < CHUNK ? length : CHUNK;
+        encode(bytes, count, buffer, hexCase);
+        for (size_t i = 0; i < 2 * count; i++) {
+            out[i] = (wchar_t)buffer[i];
+        }
+        bytes += count;
+        out += 2 * count;
+        length -= count;
+    }
+}
+
+bool HexDecode(const char* hex, size_t length, uint8_t* out, size_t* errorOffset) {
+    size_t even = length & ~(size_t)1;
+    size_t result = ActiveKernel()->decode(hex, even, out);
+    if (result != even) {
+        if (errorOffset) {
+            *errorOffset = result;
+        }
+        return false;
+    }
+    if (even != length) {
+        if (errorOffset) {
+            *errorOffset = length;
+        }
+        return false;
+    }
+    return true;
+}
+
+const char* HexKernelName() {
+    return ActiveKernel()->name;
+}
+
+bool HexSelectKernel(const char* name) {
+    const Kernel* kernel = NULL;
+    if (strcmp(name, "scalar") == 0) {
+        kernel = &g_scalarKernel;
+    }
+#ifdef HEX_X86
+    else if (strcmp(name, "sse2") == 0 && CpuHasSse2()) {
+        kernel = &g_sse2Kernel;
+    } else if (strcmp(name, "avx2") == 0 && CpuHasAvx2()) {
+        kernel = &g_avx2Kernel;
+    }
+#endif
+    if (!kernel) {
+        return false;
+    }
+    g_kernel.store(kernel, std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,31 @@
+#ifndef HEXCODEC_H
+#define HEXCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hex encoding and decoding for APDUs and responses. The kernel (AVX2, SSE2
+// or table-driven scalar) is picked once at runtime from the CPU features.
+
+enum HexCase {
+    HEX_LOWER,
+    HEX_UPPER
+};
+
+// Write 2 * length characters to out. No terminator is written.
+void HexEncode(const uint8_t* bytes, size_t length, char* out, HexCase hexCase = HEX_LOWER);
+void HexEncode(const uint8_t* bytes, size_t length, wchar_t* out, HexCase hexCase = HEX_LOWER);
+
+// Decode length hex characters (either case) into length / 2 bytes. Fails
+// on an odd length or any non-hex character; errorOffset then receives the
+// position of the offending character (length for an odd length).
+bool HexDecode(const char* hex, size_t length, uint8_t* out, size_t* errorOffset = NULL);
+
+// Name of the kernel in use: "avx2", "sse2" or "scalar"
+const char* HexKernelName();
+
+// Force a kernel by name, for benchmarking. Returns false if the CPU does
+// not support it.
+bool HexSelectKernel(const char* name);
+
+#endif // HEXCODEC_H
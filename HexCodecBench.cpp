@@ -0,0 +1,159 @@
+// Microbenchmark for HexCodec against the stringstream/strtol conversions it
+// replaced. Usage: HexCodecBench [--json] [milliseconds per measurement]
+//
+// --json prints a single JSON object instead of the tables.
+#include "HexCodec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The original CardAction conversions
+std::string LegacyBytesToHexString(const uint8_t* bytes, size_t length) {
+    std::stringstream ss;
+    ss << std::hex << std::setfill('0');
+    for (size_t i = 0; i < length; i++) {
+        ss << std::setw(2) << static_cast<int>(bytes[i]);
+    }
+    return ss.str();
+}
+
+std::vector<uint8_t> LegacyHexStringToBytes(const std::string& hex) {
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i < hex.length(); i += 2) {
+        if (i + 1 < hex.length()) {
+            std::string byteString = hex.substr(i, 2);
+            uint8_t byte = (uint8_t)strtol(byteString.c_str(), NULL, 16);
+            bytes.push_back(byte);
+        }
+    }
+    return bytes;
+}
+
+volatile uint8_t g_sink;
+bool g_json = false;
+bool g_firstResult = true;     // No JSON array element printed yet
+
+// Run body repeatedly for about budgetMs and return nanoseconds per call
+template <typename Body>
+double Measure(double budgetMs, Body body) {
+    typedef std::chrono::steady_clock Clock;
+    size_t iterations = 1;
+    for (;;) {
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            body();
+        }
+        double elapsedNs = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        if (elapsedNs >= budgetMs * 1e6 || iterations >= ((size_t)1 << 30)) {
+            return elapsedNs / (double)iterations;
+        }
+        iterations *= 2;
+    }
+}
+
+// Print a measurement as a table row, or as the next element of the JSON
+// array being printed
+void Report(const char* name, size_t size, double ns) {
+    if (g_json) {
+        printf("%s{\"kernel\":\"%s\",\"bytes\":%zu,\"ns_per_op\":%.1f,\"mb_per_s\":%.1f}",
+               g_firstResult ? "" : ",", name, size, ns, (double)size / ns * 1e3);
+        g_firstResult = false;
+        return;
+    }
+    printf("%-10s %8zu %12.1f %10.1f\n", name, size, ns, (double)size / ns * 1e3);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    double budgetMs = 50.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            g_json = true;
+        } else {
+            budgetMs = atof(argv[i]);
+        }
+    }
+    static const size_t sizes[] = { 2, 16, 64, 256, 1024, 4096, 16384, 65536 };
+    static const char* const kernels[] = { "scalar", "sse2", "avx2" };
+
+    const std::string detected = HexKernelName();
+
+    // Check every kernel against the legacy output before timing anything
+    std::vector<uint8_t> bytes(65536);
+    for (size_t i = 0; i < bytes.size(); i++) {
+        bytes[i] = (uint8_t)(i * 131 + 7);
+    }
+    std::string expected = LegacyBytesToHexString(bytes.data(), bytes.size());
+    for (const char* kernel : kernels) {
+        if (!HexSelectKernel(kernel)) {
+            continue;
+        }
+        for (size_t size : sizes) {
+            std::string encoded(2 * size, '\0');
+            std::vector<uint8_t> decoded(size);
+            HexEncode(bytes.data(), size, &encoded[0]);
+            if (encoded.compare(0, encoded.size(), expected, 0, 2 * size) != 0 ||
+                !HexDecode(encoded.data(), encoded.size(), decoded.data()) ||
+                memcmp(decoded.data(), bytes.data(), size) != 0) {
+                fprintf(stderr, "%s kernel is wrong for %zu bytes\n", kernel, size);
+                return 1;
+            }
+        }
+    }
+
+    if (g_json) {
+        printf("{\"detected_kernel\":\"%s\",\"encode\":[", detected.c_str());
+    } else {
+        printf("detected kernel: %s\n\n", detected.c_str());
+        printf("%-10s %8s %12s %10s\n", "encode", "bytes", "ns/op", "MB/s");
+    }
+    for (size_t size : sizes) {
+        Report("legacy", size, Measure(budgetMs, [&]() {
+            g_sink = (uint8_t)LegacyBytesToHexString(bytes.data(), size)[0];
+        }));
+        std::string out(2 * size, '\0');
+        for (const char* kernel : kernels) {
+            if (HexSelectKernel(kernel)) {
+                Report(kernel, size, Measure(budgetMs, [&]() {
+                    HexEncode(bytes.data(), size, &out[0]);
+                    g_sink = (uint8_t)out[0];
+                }));
+            }
+        }
+    }
+
+    if (g_json) {
+        printf("],\"decode\":[");
+        g_firstResult = true;
+    } else {
+        printf("\n%-10s %8s %12s %10s\n", "decode", "bytes", "ns/op", "MB/s");
+    }
+    for (size_t size : sizes) {
+        std::string hex = expected.substr(0, 2 * size);
+        Report("legacy", size, Measure(budgetMs, [&]() {
+            g_sink = LegacyHexStringToBytes(hex)[0];
+        }));
+        std::vector<uint8_t> out(size);
+        for (const char* kernel : kernels) {
+            if (HexSelectKernel(kernel)) {
+                Report(kernel, size, Measure(budgetMs, [&]() {
+                    HexDecode(hex.data(), hex.size(), out.data());
+                    g_sink = out[0];
+                }));
+            }
+        }
+    }
+    if (g_json) {
+        printf("]}\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include "IniFile.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace {
+
+void AppendUtf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+        out += (char)code;
+    } else if (code < 0x800) {
+        out += (char)(0xC0 | (code >> 6));
+        out += (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out += (char)(0xE0 | (code >> 12));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    } else {
+        out += (char)(0xF0 | (code >> 18));
+        out += (char)(0x80 | ((code >> 12) & 0x3F));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+}
+
+// UTF-16 text after its byte order mark to UTF-8
+std::string Utf16ToUtf8(const std::string& bytes, bool bigEndian) {
+    std::string out;
+    out.reserve(bytes.size() / 2);
+    for (size_t i = 2; i + 1 < bytes.size(); i += 2) {
+        uint8_t first = (uint8_t)bytes[i + (bigEndian ? 0 : 1)];
+        uint8_t second = (uint8_t)bytes[i + (bigEndian ? 1 : 0)];
+        uint32_t unit = ((uint32_t)first << 8) | second;
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 3 < bytes.size()) {
+            uint8_t lowFirst = (uint8_t)bytes[i + (bigEndian ? 2 : 3)];
+            uint8_t lowSecond = (uint8_t)bytes[i + (bigEndian ? 3 : 2)];
+            uint32_t low = ((uint32_t)lowFirst << 8) | lowSecond;
+            if (low >= 0xDC00 && low < 0xE000) {
+                unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        AppendUtf8(out, unit);
+    }
+    return out;
+}
+
+#ifdef _WIN32
+bool ValidUtf8(const std::string& text) {
+    for (size_t i = 0; i < text.size();) {
+        uint8_t c = (uint8_t)text[i];
+        size_t length = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0;
+        if (length == 0 || i + length > text.size()) {
+            return false;
+        }
+        for (size_t j = 1; j < length; ++j) {
+            if (((uint8_t)text[i + j] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+        i += length;
+    }
+    return true;
+}
+#endif
+
+std::string Trim(const std::string& text) {
+    size_t start = text.find_first_not_of(" \t\r");
+    if (start == std::string::npos) {
+        return "";
+    }
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(start, end - start + 1);
+}
+
+} // namespace
+
+bool EqualsIgnoreCase(const std::string& a, const char* b) {
+    size_t length = strlen(b);
+    if (a.size() != length) {
+        return false;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IniFile::Load(const std::string& path, std::string& error) {
+    m_sections.clear();
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::string text;
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, read);
+    }
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed) {
+        error = "cannot read " + path;
+        return false;
+    }
+
+    // Bring the text to UTF-8
+    if (text.size() >= 2 && (uint8_t)text[0] == 0xFF && (uint8_t)text[1] == 0xFE) {
+        text = Utf16ToUtf8(text, false);
+    } else if (text.size() >= 2 && (uint8_t)text[0] == 0xFE && (uint8_t)text[1] == 0xFF) {
+        text = Utf16ToUtf8(text, true);
+    } else if (text.size() >= 3 && text.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+        text.erase(0, 3);
+    }
+#ifdef _WIN32
+    else if (!ValidUtf8(text)) {
+        int length = MultiByteToWideChar(CP_ACP, 0, text.data(), (int)text.size(), NULL, 0);
+        std::wstring wide(length, L'\0');
+        MultiByteToWideChar(CP_ACP, 0, text.data(), (int)text.size(), &wide[0], length);
+        length = WideCharToMultiByte(CP_UTF8, 0, wide.data(), (int)wide.size(), NULL, 0, NULL, NULL);
+        text.assign(length, '\0');
+        WideCharToMultiByte(CP_UTF8, 0, wide.data(), (int)wide.size(), &text[0], length, NULL, NULL);
+    }
+#endif
+
+    SectionData* section = NULL;
+    size_t position = 0;
+    while (position < text.size()) {
+        size_t end = text.find('\n', position);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string line = Trim(text.substr(position, end - position));
+        position = end + 1;
+        if (line.empty() || line[0] == ';' || line[0] == '#') {
+            continue;
+        }
+
+        if (line[0] == '[') {
+            size_t close = line.find(']');
+            std::string name = Trim(line.substr(1, close == std::string::npos ? std::string::npos : close - 1));
+            section = NULL;
+            for (auto& existing : m_sections) {
+                if (EqualsIgnoreCase(existing.name, name.c_str())) {
+                    section = &existing;
+                    break;
+                }
+            }
+            if (!section) {
+                m_sections.push_back(SectionData());
+                section = &m_sections.back();
+                section->name = name;
+            }
+            continue;
+        }
+
+        // Lines before the first section and lines without "=" are ignored
+        size_t equals = line.find('=');
+        if (!section || equals == std::string::npos) {
+            continue;
+        }
+        std::string key = Trim(line.substr(0, equals));
+        std::string value = Trim(line.substr(equals + 1));
+        if (value.size() >= 2 && (value[0] == '"' || value[0] == '\'') && value.back() == value[0]) {
+            value = value.substr(1, value.size() - 2);
+        }
+        section->entries.push_back(std::make_pair(key, value));
+    }
+    return true;
+}
+
+std::string IniFile::Get(const char* section, const char* key, const char* defaultValue) const {
+    const Entries* entries = Section(section);
+    if (entries) {
+        for (const auto& entry : *entries) {
+            if (EqualsIgnoreCase(entry.first, key)) {
+                return entry.second;
+            }
+        }
+    }
+    return defaultValue;
+}
+
+unsigned IniFile::GetInt(const char* section, const char* key, unsigned defaultValue) const {
+    const Entries* entries = Section(section);
+    if (entries) {
+        for (const auto& entry : *entries) {
+            if (EqualsIgnoreCase(entry.first, key)) {
+                return (unsigned)strtol(entry.second.c_str(), NULL, 10);
+            }
+        }
+    }
+    return defaultValue;
+}
+
+std::vector<std::string> IniFile::SectionNames() const {
+    std::vector<std::string> names;
+    for (const auto& section : m_sections) {
+        names.push_back(section.name);
+    }
+    return names;
+}
+
+const IniFile::Entries* IniFile::Section(const char* name) const {
+    for (const auto& section : m_sections) {
+        if (EqualsIgnoreCase(section.name, name)) {
+            return &section.entries;
+        }
+    }
+    return NULL;
+}
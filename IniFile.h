@@ -0,0 +1,51 @@
+#ifndef INIFILE_H
+#define INIFILE_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// An INI file read the way GetPrivateProfileString reads one, so the same
+// CardAction.ini works on every platform: section and key names ignore
+// ASCII case, a repeated section continues the first one, the first of a
+// repeated key wins, lines starting with ";" or "#" are comments, and a
+// value in matching quotes loses them.
+//
+// Text is kept as UTF-8. Files starting with a UTF-16 byte order mark are
+// converted; on Windows, a file that is not valid UTF-8 is read in the ANSI
+// code page, as Notepad used to save it.
+class IniFile {
+public:
+    typedef std::vector<std::pair<std::string, std::string>> Entries;
+
+    // Read the file at path. Returns false and sets error if it cannot be
+    // read; an empty file is fine.
+    bool Load(const std::string& path, std::string& error);
+
+    // The value of key in section, or defaultValue if it is not set
+    std::string Get(const char* section, const char* key, const char* defaultValue = "") const;
+
+    // The number at the start of the value, 0 if there is none, or
+    // defaultValue if the key is not set. Negative numbers wrap, as they do
+    // with GetPrivateProfileInt.
+    unsigned GetInt(const char* section, const char* key, unsigned defaultValue) const;
+
+    // Section names in file order
+    std::vector<std::string> SectionNames() const;
+
+    // Keys and values of a section in file order, or NULL if it does not exist
+    const Entries* Section(const char* name) const;
+
+private:
+    struct SectionData {
+        std::string name;
+        Entries entries;
+    };
+
+    std::vector<SectionData> m_sections;
+};
+
+// Compare two names ignoring ASCII case
+bool EqualsIgnoreCase(const std::string& a, const char* b);
+
+#endif // INIFILE_H
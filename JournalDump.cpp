@@ -0,0 +1,314 @@
+// Prints the records of the audit journal written with [Journal] Path.
+//
+// Usage: JournalDump <path> [--reader PATTERN] [--from TIME] [--to TIME]
+//                    [--type insert|remove|gap] [--json] [--count]
+//
+// <path> is the journal's Path setting, or a single segment file. --reader
+// takes a pattern with "*" and "?" as in [Rule] Readers. TIME is UTC, as
+// 2024-05-01, 2024-05-01T08:30:00 or 2024-05-01T08:30:00.250Z, or in
+// milliseconds since the Unix epoch; --from is inclusive and --to is not.
+// Segments outside the range are skipped without reading their records,
+// and only the records that match are checksummed. --json prints one object
+// per line; --count prints only the number of records that match.
+//
+// The exit status is 1 if a record was damaged, e.g. by a crash while it
+// was written, and 2 for bad arguments.
+#include "AuditJournal.h"
+#include "HexCodec.h"
+#include "RuleIndex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+    std::string path;
+    std::string reader;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    uint8_t type = 0;               // 0 for any
+    bool json = false;
+    bool count = false;
+};
+
+// Days from 1970-01-01 to a date in the proleptic Gregorian calendar
+int64_t DaysFromCivil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yearOfEra = (unsigned)(year - era * 400);
+    unsigned dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + (int64_t)dayOfEra - 719468;
+}
+
+void CivilFromDays(int64_t days, int& year, unsigned& month, unsigned& day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned dayOfEra = (unsigned)(days - era * 146097);
+    unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    unsigned shifted = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * shifted + 2) / 5 + 1;
+    month = shifted < 10 ? shifted + 3 : shifted - 9;
+    year = (int)(yearOfEra + era * 400 + (month <= 2));
+}
+
+// Milliseconds since the epoch as 2024-05-01T08:30:00.250Z
+std::string FormatTime(uint64_t milliseconds) {
+    int64_t seconds = (int64_t)(milliseconds / 1000);
+    int year;
+    unsigned month, day;
+    CivilFromDays(seconds / 86400, year, month, day);
+    unsigned secondOfDay = (unsigned)(seconds % 86400);
+    char text[48];
+    snprintf(text, sizeof(text), "%04d-%02u-%02uT%02u:%02u:%02u.%03uZ", year, month, day, secondOfDay / 3600,
+             secondOfDay / 60 % 60, secondOfDay % 60, (unsigned)(milliseconds % 1000));
+    return text;
+}
+
+bool ParseTime(const char* text, uint64_t& milliseconds) {
+    size_t length = strlen(text);
+    if (length > 0 && strspn(text, "0123456789") == length) {
+        milliseconds = strtoull(text, NULL, 10);
+        return true;
+    }
+
+    int year;
+    unsigned month, day, hour = 0, minute = 0, second = 0, fraction = 0;
+    int consumed = 0;
+    if (sscanf(text, "%4d-%2u-%2u%n", &year, &month, &day, &consumed) != 3 || consumed != 10) {
+        return false;
+    }
+    const char* p = text + consumed;
+    if (*p == 'T' || *p == ' ') {
+        if (sscanf(p + 1, "%2u:%2u:%2u%n", &hour, &minute, &second, &consumed) != 3 || consumed != 8) {
+            return false;
+        }
+        p += 1 + consumed;
+        if (*p == '.') {
+            // Milliseconds from the first three digits of the fraction
+            unsigned scale = 100;
+            for (++p; *p >= '0' && *p <= '9'; ++p, scale /= 10) {
+                fraction += (unsigned)(*p - '0') * scale;
+            }
+        }
+        if (*p == 'Z') {
+            ++p;
+        }
+    }
+    if (*p || year < 1970 || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 ||
+        second > 60) {
+        return false;
+    }
+    int64_t seconds = DaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    milliseconds = (uint64_t)seconds * 1000 + fraction;
+    return true;
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--count") {
+            options.count = true;
+        } else if (arg.compare(0, 2, "--") != 0 && options.path.empty()) {
+            options.path = arg;
+        } else if (!value) {
+            return false;
+        } else if (arg == "--reader") {
+            options.reader = argv[++i];
+        } else if (arg == "--from") {
+            if (!ParseTime(argv[++i], options.from)) {
+                return false;
+            }
+        } else if (arg == "--to") {
+            if (!ParseTime(argv[++i], options.to)) {
+                return false;
+            }
+        } else if (arg == "--type") {
+            std::string type = argv[++i];
+            if (type == "insert") {
+                options.type = JOURNAL_INSERTED;
+            } else if (type == "remove") {
+                options.type = JOURNAL_REMOVED;
+            } else if (type == "gap") {
+                options.type = JOURNAL_GAP;
+            } else {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return !options.path.empty() && options.from <= options.to;
+}
+
+const char* TypeName(uint8_t type) {
+    switch (type) {
+        case JOURNAL_INSERTED:
+            return "insert";
+        case JOURNAL_REMOVED:
+            return "remove";
+        case JOURNAL_GAP:
+            return "gap";
+        default:
+            return "unknown";
+    }
+}
+
+void AppendHex(std::string& out, const uint8_t* data, size_t length) {
+    size_t start = out.size();
+    out.resize(start + length * 2);
+    HexEncode(data, length, &out[start], HEX_UPPER);
+}
+
+void AppendJsonString(std::string& out, const char* text, size_t length) {
+    out += '"';
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += (char)c;
+        }
+    }
+    out += '"';
+}
+
+void Print(const JournalEntry& entry, bool json, std::string& line) {
+    const JournalRecordHeader& header = *entry.header;
+    line.clear();
+    if (json) {
+        char fields[256];
+        snprintf(fields, sizeof(fields),
+                 "{\"time\":\"%s\",\"timestamp\":%llu,\"type\":\"%s\",\"sequence\":%llu,"
+                 "\"dispatch_time\":%llu,\"suppressed\":%u,\"truncated\":%s,\"reader\":",
+                 FormatTime(header.timestamp).c_str(), (unsigned long long)header.timestamp,
+                 TypeName(header.type), (unsigned long long)header.sequence,
+                 (unsigned long long)header.dispatchTime, header.suppressed,
+                 header.flags & JOURNAL_TRUNCATED ? "true" : "false");
+        line += fields;
+        AppendJsonString(line, entry.reader, header.readerLength);
+        line += ",\"atr\":\"";
+        AppendHex(line, entry.atr.data, entry.atr.length);
+        line += "\",\"responses\":[";
+        const uint8_t* response = entry.responses;
+        for (uint16_t i = 0; i < header.responseCount; ++i) {
+            line += i ? ",\"" : "\"";
+            AppendHex(line, response, entry.responseLengths[i]);
+            line += '"';
+            response += entry.responseLengths[i];
+        }
+        line += "]}";
+    } else if (header.type == JOURNAL_GAP) {
+        char fields[128];
+        snprintf(fields, sizeof(fields), "%s  gap     %u events lost", FormatTime(header.timestamp).c_str(),
+                 header.suppressed);
+        line += fields;
+    } else {
+        char fields[128];
+        snprintf(fields, sizeof(fields), "%s  %-6s  #%llu  \"", FormatTime(header.timestamp).c_str(),
+                 TypeName(header.type), (unsigned long long)header.sequence);
+        line += fields;
+        line.append(entry.reader, header.readerLength);
+        line += '"';
+        if (entry.atr.length) {
+            line += "  ";
+            AppendHex(line, entry.atr.data, entry.atr.length);
+        }
+        const uint8_t* response = entry.responses;
+        for (uint16_t i = 0; i < header.responseCount; ++i) {
+            line += i ? " " : "  ->  ";
+            AppendHex(line, response, entry.responseLengths[i]);
+            response += entry.responseLengths[i];
+        }
+        if (header.flags & JOURNAL_TRUNCATED) {
+            line += "  (truncated)";
+        }
+    }
+    line += '\n';
+    fwrite(line.data(), 1, line.size(), stdout);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: JournalDump <path> [--reader PATTERN] [--from TIME] [--to TIME]\n"
+                        "                   [--type insert|remove|gap] [--json] [--count]\n");
+        return 2;
+    }
+
+    std::vector<std::string> segments = ListJournalSegments(options.path);
+    if (segments.empty()) {
+        segments.push_back(options.path);
+    }
+
+    uint64_t matched = 0;
+    uint64_t damaged = 0;
+    std::string reader;
+    std::string line;
+    JournalReader segment;
+    for (const auto& path : segments) {
+        std::string error;
+        if (!segment.Open(path, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            damaged++;
+            continue;
+        }
+
+        // Skip the whole segment if its records are all outside the range
+        const JournalSegmentHeader& header = segment.Header();
+        if (header.maxTimestamp == 0 || header.maxTimestamp < options.from || header.minTimestamp >= options.to) {
+            continue;
+        }
+
+        JournalEntry entry;
+        while (segment.Next(entry)) {
+            const JournalRecordHeader& record = *entry.header;
+            if (record.timestamp < options.from || record.timestamp >= options.to ||
+                (options.type && record.type != options.type)) {
+                continue;
+            }
+            if (!options.reader.empty()) {
+                if (record.type == JOURNAL_GAP) {
+                    continue;
+                }
+                reader.assign(entry.reader, record.readerLength);
+                if (!MatchReaderPattern(options.reader.c_str(), reader.c_str())) {
+                    continue;
+                }
+            }
+            if (!segment.Verify(entry)) {
+                fprintf(stderr, "%s: damaged record at offset %llu\n", path.c_str(),
+                        (unsigned long long)entry.offset);
+                damaged++;
+                continue;
+            }
+            matched++;
+            if (!options.count) {
+                Print(entry, options.json, line);
+            }
+        }
+        if (segment.Damaged()) {
+            fprintf(stderr, "%s: records end at a damaged record\n", path.c_str());
+            damaged++;
+        }
+    }
+
+    if (options.count) {
+        printf("%llu\n", (unsigned long long)matched);
+    }
+    return damaged ? 1 : 0;
+}
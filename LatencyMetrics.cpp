@@ -0,0 +1,130 @@
+#include "LatencyMetrics.h"
+#include <stdio.h>
+
+namespace {
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {
+    "detect", "queue", "connect", "transmit", "expand", "command_queue", "launch", "command", "total"
+};
+
+// Index of the highest set bit of a non-zero value
+unsigned HighestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - (unsigned)__builtin_clzll(value);
+#else
+    unsigned bit = 0;
+    for (unsigned shift = 32; shift > 0; shift /= 2) {
+        if (value >> shift) {
+            value >>= shift;
+            bit += shift;
+        }
+    }
+    return bit;
+#endif
+}
+
+void AppendSeconds(std::string& out, uint64_t nanoseconds) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", (double)nanoseconds / 1e9);
+    out += text;
+}
+
+} // namespace
+
+const char* LatencyStageName(LatencyStage stage) {
+    return stage < STAGE_COUNT ? STAGE_NAMES[stage] : "unknown";
+}
+
+LatencyHistogram::LatencyHistogram() : m_count(0), m_sum(0) {
+    for (auto& bucket : m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+// Bucket 0 holds durations under 1 us and the last bucket those of 2^34 ns
+// or more. In between, bucket 1 + 4 * octave + quarter holds durations of
+// 2^(octave + 10) * (4 + quarter) / 4 ns up to the next quarter.
+unsigned LatencyHistogram::Bucket(uint64_t nanoseconds) {
+    if (nanoseconds < ((uint64_t)1 << MIN_SHIFT)) {
+        return 0;
+    }
+    unsigned bit = HighestBit(nanoseconds);
+    if (bit >= MIN_SHIFT + OCTAVES) {
+        return BUCKETS - 1;
+    }
+    unsigned quarter = (unsigned)(nanoseconds >> (bit - 2)) & (SUB_BUCKETS - 1);
+    return 1 + (bit - MIN_SHIFT) * SUB_BUCKETS + quarter;
+}
+
+uint64_t LatencyHistogram::UpperBound(unsigned bucket) {
+    if (bucket == 0) {
+        return (uint64_t)1 << MIN_SHIFT;
+    }
+    if (bucket >= BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+    unsigned octave = (bucket - 1) / SUB_BUCKETS;
+    unsigned quarter = (bucket - 1) % SUB_BUCKETS;
+    return (uint64_t)(SUB_BUCKETS + 1 + quarter) << (MIN_SHIFT + octave - 2);
+}
+
+void LatencyHistogram::Record(uint64_t nanoseconds) {
+    m_buckets[Bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Percentile(double fraction) const {
+    uint64_t counts[BUCKETS];
+    uint64_t total = 0;
+    for (unsigned i = 0; i < BUCKETS; i++) {
+        counts[i] = BucketCount(i);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    // Interpolate within the bucket that holds the rank
+    double rank = fraction * (double)total;
+    uint64_t below = 0;
+    for (unsigned i = 0; i < BUCKETS; i++) {
+        if (counts[i] == 0 || (double)(below + counts[i]) < rank) {
+            below += counts[i];
+            continue;
+        }
+        uint64_t lower = i == 0 ? 0 : UpperBound(i - 1);
+        if (i == BUCKETS - 1) {
+            return lower;
+        }
+        double within = (rank - (double)below) / (double)counts[i];
+        return lower + (uint64_t)(within * (double)(UpperBound(i) - lower));
+    }
+    return UpperBound(BUCKETS - 2);
+}
+
+void LatencyMetrics::WritePrometheus(std::string& out) const {
+    out += "# HELP cardaction_stage_latency_seconds Time spent in each stage of a card event.\n";
+    out += "# TYPE cardaction_stage_latency_seconds histogram\n";
+    for (unsigned stage = 0; stage < STAGE_COUNT; stage++) {
+        const LatencyHistogram& histogram = m_stages[stage];
+        std::string labels = std::string("stage=\"") + STAGE_NAMES[stage] + "\"";
+
+        // Export powers of two only; the quarter buckets are for percentiles
+        uint64_t cumulative = 0;
+        for (unsigned i = 0; i < LatencyHistogram::BUCKETS - 1; i++) {
+            cumulative += histogram.BucketCount(i);
+            if (i % LatencyHistogram::SUB_BUCKETS == 0) {
+                out += "cardaction_stage_latency_seconds_bucket{" + labels + ",le=\"";
+                AppendSeconds(out, LatencyHistogram::UpperBound(i));
+                out += "\"} " + std::to_string(cumulative) + "\n";
+            }
+        }
+        cumulative += histogram.BucketCount(LatencyHistogram::BUCKETS - 1);
+        out += "cardaction_stage_latency_seconds_bucket{" + labels + ",le=\"+Inf\"} " +
+               std::to_string(cumulative) + "\n";
+        out += "cardaction_stage_latency_seconds_sum{" + labels + "} ";
+        AppendSeconds(out, histogram.Sum());
+        out += "\ncardaction_stage_latency_seconds_count{" + labels + "} " + std::to_string(cumulative) + "\n";
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef LATENCYMETRICS_H
+#define LATENCYMETRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Stages of a card event, from the raw transition to its actions
+enum LatencyStage {
+    STAGE_DETECT,         // Raw transition seen to event dispatched, including the debounce window
+    STAGE_QUEUE,          // Event dispatched to a worker picking it up
+    STAGE_CONNECT,        // Connecting to the card
+    STAGE_TRANSMIT,       // Each APDU exchange
+    STAGE_EXPAND,         // Expanding a command template
+    STAGE_COMMAND_QUEUE,  // Command waiting for an executor slot
+    STAGE_LAUNCH,         // Starting a command's process
+    STAGE_COMMAND,        // Command running, until it exits or is killed
+    STAGE_TOTAL,          // Raw transition seen to every action run or queued
+    STAGE_COUNT
+};
+
+// Name of a stage in exported metrics
+const char* LatencyStageName(LatencyStage stage);
+
+// Monotonic timestamp in nanoseconds, the clock of every latency recorded
+inline uint64_t LatencyNow() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Histogram of durations that can be recorded from any thread without a
+// lock. Buckets are log-linear: each power of two from 1 us to 17 s is split
+// into four, so estimates are within about 19% across the whole range.
+class LatencyHistogram {
+public:
+    static const unsigned SUB_BUCKETS = 4;          // Per power of two
+    static const unsigned MIN_SHIFT = 10;           // First bound: 1024 ns
+    static const unsigned OCTAVES = 24;             // Up to 2^34 ns
+    static const unsigned BUCKETS = OCTAVES * SUB_BUCKETS + 2;  // Plus underflow and overflow
+
+    LatencyHistogram();
+
+    void Record(uint64_t nanoseconds);
+
+    // Upper bound of bucket in nanoseconds; the overflow bucket has none
+    static uint64_t UpperBound(unsigned bucket);
+
+    // Counts are read one at a time while recording goes on, so a reading
+    // may be off by the few events recorded in the meantime
+    uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t Sum() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t BucketCount(unsigned bucket) const { return m_buckets[bucket].load(std::memory_order_relaxed); }
+
+    // Estimated duration in nanoseconds below which fraction of the recorded
+    // durations fall, or 0 if nothing has been recorded
+    uint64_t Percentile(double fraction) const;
+
+private:
+    static unsigned Bucket(uint64_t nanoseconds);
+
+    std::atomic<uint64_t> m_buckets[BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+};
+
+// A latency histogram per stage. Recording costs a clock read and three
+// relaxed atomic increments, so it stays on in production.
+class LatencyMetrics {
+public:
+    // Record the time from start, a LatencyNow() timestamp, until now
+    void Record(LatencyStage stage, uint64_t start) {
+        uint64_t now = LatencyNow();
+        m_stages[stage].Record(now > start ? now - start : 0);
+    }
+
+    const LatencyHistogram& Stage(LatencyStage stage) const { return m_stages[stage]; }
+
+    // Append the histograms in the Prometheus text exposition format
+    void WritePrometheus(std::string& out) const;
+
+private:
+    LatencyHistogram m_stages[STAGE_COUNT];
+};
+
+#endif // LATENCYMETRICS_H
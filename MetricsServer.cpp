@@ -0,0 +1,254 @@
+#include "MetricsServer.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const size_t MAX_REQUEST = 8192;
+const unsigned IO_TIMEOUT_MS = 1000;    // A scrape that stalls longer is dropped
+
+#ifdef _WIN32
+void CloseSocket(intptr_t socket) {
+    closesocket((SOCKET)socket);
+}
+
+std::string SocketError(const char* what) {
+    return std::string(what) + " (error " + std::to_string(WSAGetLastError()) + ")";
+}
+#else
+void CloseSocket(intptr_t socket) {
+    close((int)socket);
+}
+
+std::string SocketError(const char* what) {
+    return std::string(what) + ": " + strerror(errno);
+}
+#endif
+
+void SetTimeouts(intptr_t socket) {
+#ifdef _WIN32
+    DWORD timeout = IO_TIMEOUT_MS;
+#else
+    timeval timeout = {};
+    timeout.tv_sec = IO_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (IO_TIMEOUT_MS % 1000) * 1000;
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+bool SendAll(intptr_t socket, const char* data, size_t length) {
+    while (length > 0) {
+        int chunk = length > 0x10000 ? 0x10000 : (int)length;
+#ifdef _WIN32
+        int sent = send((SOCKET)socket, data, chunk, 0);
+#else
+        ssize_t sent = send((int)socket, data, (size_t)chunk, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+} // namespace
+
+MetricsServer::MetricsServer() {
+    m_stopSignal[0] = -1;
+    m_stopSignal[1] = -1;
+}
+
+MetricsServer::~MetricsServer() {
+    Stop();
+}
+
+bool MetricsServer::Start(uint16_t port, RenderFn render, std::string& error) {
+    m_render = render;
+
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+        error = "cannot initialize Winsock";
+        return false;
+    }
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+#else
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    if (listener >= 0) {
+        // Allow a restart while the previous run's connections linger
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+#endif
+
+    // Loopback only: the metrics are for this machine
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((intptr_t)listener == -1 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 16) != 0) {
+        error = SocketError("cannot listen");
+        if ((intptr_t)listener != -1) {
+            CloseSocket((intptr_t)listener);
+        }
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return false;
+    }
+
+#ifdef _WIN32
+    WSAEVENT acceptEvent = WSACreateEvent();
+    WSAEventSelect(listener, acceptEvent, FD_ACCEPT);
+    m_stopSignal[0] = (intptr_t)CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_stopSignal[1] = (intptr_t)acceptEvent;
+#else
+    int stopPipe[2];
+    if (pipe2(stopPipe, O_CLOEXEC) != 0) {
+        error = SocketError("cannot create pipe");
+        close(listener);
+        return false;
+    }
+    m_stopSignal[0] = stopPipe[0];
+    m_stopSignal[1] = stopPipe[1];
+#endif
+    m_listener = (intptr_t)listener;
+
+    m_acceptThread = std::thread(&MetricsServer::AcceptLoop, this);
+    return true;
+}
+
+void MetricsServer::Stop() {
+    if (!m_acceptThread.joinable()) {
+        return;
+    }
+
+#ifdef _WIN32
+    SetEvent((HANDLE)m_stopSignal[0]);
+#else
+    char wake = 0;
+    while (write((int)m_stopSignal[1], &wake, 1) < 0 && errno == EINTR) {
+    }
+#endif
+    m_acceptThread.join();
+
+    CloseSocket(m_listener);
+#ifdef _WIN32
+    CloseHandle((HANDLE)m_stopSignal[0]);
+    WSACloseEvent((WSAEVENT)m_stopSignal[1]);
+    WSACleanup();
+#else
+    close((int)m_stopSignal[0]);
+    close((int)m_stopSignal[1]);
+#endif
+    m_listener = -1;
+    m_stopSignal[0] = -1;
+    m_stopSignal[1] = -1;
+}
+
+void MetricsServer::AcceptLoop() {
+    for (;;) {
+        intptr_t connection = -1;
+#ifdef _WIN32
+        HANDLE handles[] = { (HANDLE)m_stopSignal[0], (HANDLE)m_stopSignal[1] };
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+        WSAResetEvent((WSAEVENT)m_stopSignal[1]);
+        SOCKET accepted = accept((SOCKET)m_listener, NULL, NULL);
+        if (accepted != INVALID_SOCKET) {
+            // Accepted sockets inherit the listener's non-blocking event mode
+            u_long blocking = 0;
+            WSAEventSelect(accepted, NULL, 0);
+            ioctlsocket(accepted, FIONBIO, &blocking);
+            connection = (intptr_t)accepted;
+        }
+#else
+        pollfd fds[2] = {};
+        fds[0].fd = (int)m_listener;
+        fds[0].events = POLLIN;
+        fds[1].fd = (int)m_stopSignal[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            connection = accept4((int)m_listener, NULL, NULL, SOCK_CLOEXEC);
+        }
+#endif
+        if (connection != -1) {
+            Serve(connection);
+            CloseSocket(connection);
+        }
+    }
+}
+
+// Answer a single request and close the connection
+void MetricsServer::Serve(intptr_t connection) {
+    SetTimeouts(connection);
+
+    // Only the request line matters, but read the headers so the client
+    // does not see a reset before the response
+    std::string request;
+    char buffer[1024];
+    while (request.size() < MAX_REQUEST && request.find("\r\n\r\n") == std::string::npos) {
+#ifdef _WIN32
+        int received = recv((SOCKET)connection, buffer, sizeof(buffer), 0);
+#else
+        ssize_t received = recv((int)connection, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (received <= 0) {
+            return;
+        }
+        request.append(buffer, (size_t)received);
+    }
+
+    std::string status = "404 Not Found";
+    std::string body = "Not found\n";
+    size_t pathEnd = request.find_first_of(" ?\r\n", 4);
+    if (request.compare(0, 4, "GET ") == 0 && request.compare(4, pathEnd - 4, "/metrics") == 0) {
+        status = "200 OK";
+        body = m_render();
+    }
+
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+                           "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n";
+    if (SendAll(connection, response.data(), response.size())) {
+        SendAll(connection, body.data(), body.size());
+    }
+#ifdef _WIN32
+    shutdown((SOCKET)connection, SD_SEND);
+#else
+    shutdown((int)connection, SHUT_WR);
+#endif
+}
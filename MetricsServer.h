@@ -0,0 +1,36 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Serves metrics in the Prometheus text exposition format over HTTP on the
+// loopback interface, for a local Prometheus or node exporter to scrape.
+// GET /metrics answers with the text the render function returns; anything
+// else gets a 404. Requests are answered one at a time on a single thread.
+class MetricsServer {
+public:
+    typedef std::function<std::string()> RenderFn;
+
+    MetricsServer();
+    ~MetricsServer();
+
+    // Listen on 127.0.0.1:port
+    bool Start(uint16_t port, RenderFn render, std::string& error);
+
+    // Stop listening and wait for a request in progress
+    void Stop();
+
+private:
+    void AcceptLoop();
+    void Serve(intptr_t connection);
+
+    RenderFn m_render;
+    std::thread m_acceptThread;
+    intptr_t m_listener = -1;           // Listening socket
+    intptr_t m_stopSignal[2];           // Windows stop and accept events, or a self-pipe
+};
+
+#endif // METRICSSERVER_H
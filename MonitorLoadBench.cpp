@@ -0,0 +1,261 @@
+// Load test for CardMonitor against a simulated reader farm. Readers are
+// hot-plugged in steps up to 64; at each step every reader gets a card
+// inserted and removed in a burst, and the time from the simulated change to
+// the debounced event is measured. The same steps run once with shards of the
+// WinSCard size and once with every reader on a single monitor thread.
+// Each run starts with the time from starting the monitor on a full farm,
+// with slow contexts, until every reader is watched.
+// Usage: MonitorLoadBench [--json] [rounds per step]
+//
+// --json prints a single JSON object instead of the tables.
+#include "CardMonitor.h"
+#include "SimulatedBackend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const size_t MAX_READERS = 64;
+const size_t SHARD_SIZE = 10;   // MAXIMUM_SMARTCARD_READERS
+const size_t STEPS[] = { 8, 16, 32, 48, 64 };
+const uint32_t CONTEXT_US = 5000;   // A busy resource manager
+
+bool g_json = false;
+
+std::string ReaderName(size_t index) {
+    return "Virtual Reader " + std::to_string(index);
+}
+
+// Collects event arrival times from the monitor threads
+class EventRecorder {
+public:
+    EventRecorder() : m_arrivals(MAX_READERS), m_events(0), m_learned(0) {}
+
+    void OnEvent(const DebouncedEvent& event) {
+        size_t index = (size_t)atoi(event.reader.c_str() + event.reader.rfind(' ') + 1);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_arrivals[index] = Clock::now();
+        m_events++;
+        m_changed.notify_all();
+    }
+
+    void OnState() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_learned++;
+        m_changed.notify_all();
+    }
+
+    // Wait until count events in total have arrived
+    bool WaitForEvents(size_t count) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_changed.wait_for(lock, std::chrono::seconds(10), [this, count] { return m_events >= count; });
+    }
+
+    // Wait until the monitor has seen count readers
+    bool WaitForLearned(size_t count) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_changed.wait_for(lock, std::chrono::seconds(10), [this, count] { return m_learned >= count; });
+    }
+
+    Clock::time_point Arrival(size_t index) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_arrivals[index];
+    }
+
+    size_t Events() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_events;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::vector<Clock::time_point> m_arrivals;
+    size_t m_events;
+    size_t m_learned;
+};
+
+double Percentile(std::vector<double>& values, double fraction) {
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(fraction * (double)(values.size() - 1) + 0.5);
+    return values[index];
+}
+
+// Time from starting the monitor on MAX_READERS readers, half of them with
+// a card, until it reports ready
+bool MeasureStartup(size_t readersPerShard) {
+    SimulatedBackend backend;
+    if (readersPerShard == 0) {
+        backend.SetMaxReaderStates(MAX_READERS);
+        readersPerShard = MAX_READERS;
+    }
+    SimulatedLatency latency;
+    latency.contextUs = CONTEXT_US;
+    backend.SetLatency(latency);
+
+    SimulatedCard card;
+    card.atr = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00, 0x03, 0x06 };
+    for (size_t i = 0; i < MAX_READERS; i++) {
+        backend.AddReader(ReaderName(i), i % 2 ? &card : NULL);
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool ready = false;
+    CardMonitor::Sinks sinks;
+    sinks.event = [](const DebouncedEvent&, ReaderId) {};
+    sinks.readers = [](const ReaderList&, const ReaderList&) {};
+    sinks.state = [](ReaderId, bool) {};
+    sinks.ready = [&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready = true;
+        changed.notify_all();
+    };
+    CardMonitor monitor(backend, readersPerShard, 0, std::map<std::string, uint32_t>(), sinks);
+    Clock::time_point start = Clock::now();
+    if (monitor.Start() != CARD_S_SUCCESS) {
+        fprintf(stderr, "cannot start the monitor\n");
+        return false;
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!changed.wait_for(lock, std::chrono::seconds(10), [&ready] { return ready; })) {
+            fprintf(stderr, "the monitor did not get ready\n");
+            return false;
+        }
+    }
+    double elapsed = (double)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count() / 1e3;
+    if (g_json) {
+        printf("\"startup\":{\"readers\":%zu,\"shards\":%zu,\"context_us\":%u,\"ready_ms\":%.1f},",
+               MAX_READERS, monitor.ShardCount(), CONTEXT_US, elapsed);
+    } else {
+        printf("startup: %zu readers on %zu shards, %u us per context, ready in %.1f ms\n", MAX_READERS,
+               monitor.ShardCount(), CONTEXT_US, elapsed);
+    }
+    monitor.Stop();
+    return true;
+}
+
+// Run every step with the given shard size; 0 puts all readers on one shard
+bool RunSteps(size_t readersPerShard, size_t rounds) {
+    SimulatedBackend backend;
+    if (readersPerShard == 0) {
+        backend.SetMaxReaderStates(MAX_READERS);
+        readersPerShard = MAX_READERS;
+    }
+
+    SimulatedCard card;
+    card.atr = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x4F, 0x0C, 0xA0, 0x00, 0x00, 0x03, 0x06 };
+
+    EventRecorder recorder;
+    CardMonitor::Sinks sinks;
+    sinks.event = [&recorder](const DebouncedEvent& event, ReaderId) { recorder.OnEvent(event); };
+    sinks.readers = [](const ReaderList&, const ReaderList&) {};
+    sinks.state = [&recorder](ReaderId, bool) { recorder.OnState(); };
+    CardMonitor monitor(backend, readersPerShard, 0, std::map<std::string, uint32_t>(), sinks);
+    if (monitor.Start() != CARD_S_SUCCESS) {
+        fprintf(stderr, "cannot start the monitor\n");
+        return false;
+    }
+
+    if (g_json) {
+        printf("\"steps\":[");
+    } else {
+        printf("%8s %7s %8s %10s %10s %10s\n", "readers", "shards", "events", "p50 us", "p99 us", "max us");
+    }
+    size_t readers = 0;
+    size_t expected = 0;
+    for (size_t step : STEPS) {
+        // Hot-plug the next readers and wait until they are all watched
+        while (readers < step) {
+            backend.AddReader(ReaderName(readers++));
+        }
+        if (!recorder.WaitForLearned(readers)) {
+            fprintf(stderr, "readers were not picked up\n");
+            return false;
+        }
+
+        // Toggle readers one at a time, so each latency is that of a single
+        // event with every reader attached
+        std::vector<double> latencies;
+        for (size_t round = 0; round < rounds; round++) {
+            for (size_t i = 0; i < 2 * readers; i++) {
+                size_t index = (i * 7) % readers;
+                bool insert = i < readers;
+                Clock::time_point start = Clock::now();
+                if (insert) {
+                    backend.InsertCard(ReaderName(index), card);
+                } else {
+                    backend.RemoveCard(ReaderName(index));
+                }
+                if (!recorder.WaitForEvents(++expected)) {
+                    fprintf(stderr, "missing events: %zu of %zu\n", recorder.Events(), expected);
+                    return false;
+                }
+                latencies.push_back((double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    recorder.Arrival(index) - start).count() / 1e3);
+            }
+        }
+
+        size_t events = latencies.size();
+        double p50 = Percentile(latencies, 0.5);
+        double p99 = Percentile(latencies, 0.99);
+        if (g_json) {
+            printf("%s{\"readers\":%zu,\"shards\":%zu,\"events\":%zu,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+                   "\"max_us\":%.1f}", step == STEPS[0] ? "" : ",", readers, monitor.ShardCount(), events,
+                   p50, p99, latencies.back());
+        } else {
+            printf("%8zu %7zu %8zu %10.1f %10.1f %10.1f\n", readers, monitor.ShardCount(), events,
+                   p50, p99, latencies.back());
+        }
+    }
+    if (g_json) {
+        printf("]");
+    }
+
+    monitor.Stop();
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t rounds = 50;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            g_json = true;
+        } else {
+            rounds = (size_t)atoi(argv[i]);
+        }
+    }
+
+    if (g_json) {
+        printf("{\"sharded\":{\"readers_per_shard\":%zu,", SHARD_SIZE);
+    } else {
+        printf("sharded, %zu readers per monitor thread\n", SHARD_SIZE);
+    }
+    if (!MeasureStartup(SHARD_SIZE) || !RunSteps(SHARD_SIZE, rounds)) {
+        return 1;
+    }
+    if (g_json) {
+        printf("},\"single\":{\"readers_per_shard\":%zu,", MAX_READERS);
+    } else {
+        printf("\nsingle monitor thread\n");
+    }
+    if (!MeasureStartup(0) || !RunSteps(0, rounds)) {
+        return 1;
+    }
+    if (g_json) {
+        printf("}}\n");
+    }
+    return 0;
+}
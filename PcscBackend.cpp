@@ -0,0 +1,174 @@
+// PC/SC backend. WinSCard and pcsc-lite expose the same API apart from
+// naming and integer widths, so one implementation serves both.
+#include "CardBackend.h"
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <winscard.h>
+#define CARDACTION_HAVE_PCSC 1
+typedef SCARD_READERSTATEA PcscReaderState;
+#define PcscListReaders SCardListReadersA
+#define PcscGetStatusChange SCardGetStatusChangeA
+#define PcscConnect SCardConnectA
+#define PCSC_MAX_READER_STATES MAXIMUM_SMARTCARD_READERS
+#elif defined(CARDACTION_HAVE_PCSC)
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+typedef SCARD_READERSTATE PcscReaderState;
+#define PcscListReaders SCardListReaders
+#define PcscGetStatusChange SCardGetStatusChange
+#define PcscConnect SCardConnect
+#define PCSC_MAX_READER_STATES PCSCLITE_MAX_READERS_CONTEXTS
+#endif
+
+#ifdef CARDACTION_HAVE_PCSC
+
+namespace {
+
+// Map our protocol bits onto the native ones; RAW differs between platforms
+DWORD ToNativeProtocols(uint32_t protocols) {
+    DWORD native = 0;
+    if (protocols & CARD_PROTOCOL_T0) native |= SCARD_PROTOCOL_T0;
+    if (protocols & CARD_PROTOCOL_T1) native |= SCARD_PROTOCOL_T1;
+    if (protocols & CARD_PROTOCOL_RAW) native |= SCARD_PROTOCOL_RAW;
+    return native;
+}
+
+uint32_t FromNativeProtocol(DWORD protocol) {
+    switch (protocol) {
+        case SCARD_PROTOCOL_T0: return CARD_PROTOCOL_T0;
+        case SCARD_PROTOCOL_T1: return CARD_PROTOCOL_T1;
+        default: return CARD_PROTOCOL_RAW;
+    }
+}
+
+class PcscBackend : public CardBackend {
+public:
+    const char* Name() const override {
+#ifdef _WIN32
+        return "winscard";
+#else
+        return "pcsclite";
+#endif
+    }
+
+    CardResult EstablishContext(CardContext* context) override {
+        SCARDCONTEXT hContext = 0;
+        LONG status = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &hContext);
+        *context = (CardContext)hContext;
+        return (CardResult)status;
+    }
+
+    CardResult ReleaseContext(CardContext context) override {
+        return (CardResult)SCardReleaseContext((SCARDCONTEXT)context);
+    }
+
+    CardResult Cancel(CardContext context) override {
+        return (CardResult)SCardCancel((SCARDCONTEXT)context);
+    }
+
+    CardResult ListReaders(CardContext context, std::vector<char>& readers) override {
+        DWORD cchReaders = 0;
+        LONG status = PcscListReaders((SCARDCONTEXT)context, NULL, NULL, &cchReaders);
+        if (status == SCARD_S_SUCCESS) {
+            readers.resize(cchReaders);
+            status = PcscListReaders((SCARDCONTEXT)context, NULL, readers.data(), &cchReaders);
+        }
+        return (CardResult)status;
+    }
+
+    size_t MaxReaderStates() const override {
+        return PCSC_MAX_READER_STATES;
+    }
+
+    CardResult GetStatusChange(CardContext context, uint32_t timeoutMs,
+                               CardReaderState* states, size_t count) override {
+        // The native array is per thread and only grows, so a steady-state
+        // wait does not allocate
+        static thread_local std::vector<PcscReaderState> native;
+        if (native.size() < count) {
+            native.resize(count);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            memset(&native[i], 0, sizeof(PcscReaderState));
+            native[i].szReader = states[i].reader;
+            native[i].dwCurrentState = states[i].currentState;
+        }
+
+        LONG status = PcscGetStatusChange((SCARDCONTEXT)context,
+                                          timeoutMs == CARD_INFINITE ? INFINITE : (DWORD)timeoutMs,
+                                          native.data(), (DWORD)count);
+
+        for (size_t i = 0; i < count; i++) {
+            states[i].eventState = (uint32_t)native[i].dwEventState;
+            states[i].atrLength = (uint32_t)native[i].cbAtr;
+            if (states[i].atrLength > CARD_MAX_ATR_SIZE) {
+                states[i].atrLength = CARD_MAX_ATR_SIZE;
+            }
+            memcpy(states[i].atr, native[i].rgbAtr, states[i].atrLength);
+        }
+        return (CardResult)status;
+    }
+
+    CardResult Connect(CardContext context, const char* reader, uint32_t shareMode,
+                       uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) override {
+        SCARDHANDLE hCard = 0;
+        DWORD dwActiveProtocol = 0;
+        LONG status = PcscConnect((SCARDCONTEXT)context, reader, (DWORD)shareMode,
+                                  ToNativeProtocols(preferredProtocols), &hCard, &dwActiveProtocol);
+        *card = (CardHandle)hCard;
+        *activeProtocol = FromNativeProtocol(dwActiveProtocol);
+        return (CardResult)status;
+    }
+
+    CardResult Disconnect(CardHandle card, uint32_t disposition) override {
+        return (CardResult)SCardDisconnect((SCARDHANDLE)card, (DWORD)disposition);
+    }
+
+    CardResult BeginTransaction(CardHandle card) override {
+        return (CardResult)SCardBeginTransaction((SCARDHANDLE)card);
+    }
+
+    CardResult EndTransaction(CardHandle card, uint32_t disposition) override {
+        return (CardResult)SCardEndTransaction((SCARDHANDLE)card, (DWORD)disposition);
+    }
+
+    CardResult Transmit(CardHandle card, uint32_t protocol,
+                        const uint8_t* send, size_t sendLength,
+                        uint8_t* recv, size_t* recvLength) override {
+        LPCSCARD_IO_REQUEST pioSendPci;
+        switch (protocol) {
+            case CARD_PROTOCOL_T0:
+                pioSendPci = SCARD_PCI_T0;
+                break;
+            case CARD_PROTOCOL_T1:
+                pioSendPci = SCARD_PCI_T1;
+                break;
+            default:
+                pioSendPci = SCARD_PCI_RAW;
+                break;
+        }
+
+        DWORD length = (DWORD)*recvLength;
+        LONG status = SCardTransmit((SCARDHANDLE)card, pioSendPci, send, (DWORD)sendLength,
+                                    NULL, recv, &length);
+        *recvLength = status == SCARD_S_SUCCESS ? (size_t)length : 0;
+        return (CardResult)status;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<CardBackend> CreatePcscBackend() {
+    return std::unique_ptr<CardBackend>(new PcscBackend());
+}
+
+#else
+
+std::unique_ptr<CardBackend> CreatePcscBackend() {
+    return std::unique_ptr<CardBackend>();
+}
+
+#endif // CARDACTION_HAVE_PCSC
@@ -0,0 +1,70 @@
+#include "ReaderRegistry.h"
+#include <string.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace {
+
+// Convert a reader name from the system code page
+std::wstring Widen(const std::string& name) {
+#ifdef _WIN32
+    int length = MultiByteToWideChar(CP_ACP, 0, name.c_str(), -1, NULL, 0);
+    std::wstring wide(length, 0);
+    MultiByteToWideChar(CP_ACP, 0, name.c_str(), -1, &wide[0], length);
+    wide.resize(length - 1);  // Remove null terminator
+    return wide;
+#else
+    size_t length = mbstowcs(NULL, name.c_str(), 0);
+    if (length == (size_t)-1) {
+        return std::wstring(name.begin(), name.end());
+    }
+    std::wstring wide(length, 0);
+    mbstowcs(&wide[0], name.c_str(), length);
+    return wide;
+#endif
+}
+
+} // namespace
+
+void ReaderRegistry::Update(const char* readerList, ReaderList& readers, ReaderList& added,
+                            ReaderList& removed) {
+    m_generation++;
+    readers.clear();
+    added.clear();
+    removed.clear();
+
+    for (const char* name = readerList; *name != '\0'; name += strlen(name) + 1) {
+        auto it = m_readers.find(name);
+        if (it == m_readers.end()) {
+            std::shared_ptr<RegisteredReader> reader = std::make_shared<RegisteredReader>();
+            reader->id = m_nextId++;
+            reader->name = name;
+            reader->wideName = Widen(reader->name);
+            Entry entry = { reader, 0 };
+            it = m_readers.insert(std::make_pair(reader->name, entry)).first;
+            added.push_back(reader);
+        }
+        it->second.generation = m_generation;
+        readers.push_back(it->second.reader);
+    }
+
+    // Whatever this list did not mention has been detached
+    if (readers.size() == m_readers.size()) {
+        return;
+    }
+    for (auto it = m_readers.begin(); it != m_readers.end();) {
+        if (it->second.generation != m_generation) {
+            removed.push_back(it->second.reader);
+            it = m_readers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+ReaderId ReaderRegistry::Find(const std::string& name) const {
+    auto it = m_readers.find(name);
+    return it != m_readers.end() ? it->second.reader->id : NO_READER;
+}
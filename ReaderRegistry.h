@@ -0,0 +1,55 @@
+#ifndef READERREGISTRY_H
+#define READERREGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Identifies a reader for as long as it stays attached. IDs are never reused,
+// so a message that names a reader that has since gone cannot reach another.
+typedef uint32_t ReaderId;
+
+const ReaderId NO_READER = 0;
+
+// A reader known to the registry. Names are stored once and shared, so
+// messages and tables can refer to a reader without copying its names.
+struct RegisteredReader {
+    ReaderId id;
+    std::string name;           // As reported by the backend
+    std::wstring wideName;      // For display
+};
+
+typedef std::vector<std::shared_ptr<const RegisteredReader>> ReaderList;
+
+// Keeps the attached readers under stable IDs and reports what changed when
+// the reader list is listed again. A reader that is detached and attached
+// again gets a new ID.
+//
+// Used only by the monitor thread.
+class ReaderRegistry {
+public:
+    // Bring the registry in line with a reader list of NUL-terminated names
+    // ending with an empty name. readers receives every attached reader in
+    // list order; added and removed receive the difference to the last list.
+    void Update(const char* readerList, ReaderList& readers, ReaderList& added, ReaderList& removed);
+
+    // ID of an attached reader, or NO_READER
+    ReaderId Find(const std::string& name) const;
+
+    size_t Count() const { return m_readers.size(); }
+
+private:
+    struct Entry {
+        std::shared_ptr<const RegisteredReader> reader;
+        uint64_t generation;    // Last Update that listed the reader
+    };
+
+    std::unordered_map<std::string, Entry> m_readers;
+    ReaderId m_nextId = 1;
+    uint64_t m_generation = 0;
+};
+
+#endif // READERREGISTRY_H
@@ -0,0 +1,153 @@
+#include "RecordingBackend.h"
+#include "LatencyMetrics.h"
+#include <string.h>
+
+namespace {
+
+// The parts of a reader's state that replay reproduces; the event counter
+// and the in-use flags change without the card changing
+const uint32_t RECORDED_STATE = CARD_STATE_EMPTY | CARD_STATE_PRESENT | CARD_STATE_MUTE |
+                                CARD_STATE_UNAVAILABLE | CARD_STATE_UNKNOWN;
+
+} // namespace
+
+RecordingBackend::RecordingBackend(std::unique_ptr<CardBackend> backend, std::unique_ptr<TraceWriter> trace)
+    : m_backend(std::move(backend)), m_trace(std::move(trace)) {
+}
+
+CardResult RecordingBackend::EstablishContext(CardContext* context) {
+    return m_backend->EstablishContext(context);
+}
+
+CardResult RecordingBackend::ReleaseContext(CardContext context) {
+    return m_backend->ReleaseContext(context);
+}
+
+CardResult RecordingBackend::Cancel(CardContext context) {
+    return m_backend->Cancel(context);
+}
+
+size_t RecordingBackend::MaxReaderStates() const {
+    return m_backend->MaxReaderStates();
+}
+
+// Record the readers that appeared or went away since the last listing
+CardResult RecordingBackend::ListReaders(CardContext context, std::vector<char>& readers) {
+    CardResult status = m_backend->ListReaders(context, readers);
+    if (status != CARD_S_SUCCESS && status != CARD_E_NO_READERS_AVAILABLE) {
+        return status;
+    }
+
+    std::set<std::string> current;
+    if (status == CARD_S_SUCCESS) {
+        for (const char* name = readers.data(); *name; name += strlen(name) + 1) {
+            current.insert(name);
+        }
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& name : current) {
+        if (!m_readers.count(name)) {
+            m_trace->ReaderAttached(name.c_str());
+        }
+    }
+    for (const auto& name : m_readers) {
+        if (!current.count(name)) {
+            m_trace->ReaderDetached(name.c_str());
+            m_states.erase(name);
+        }
+    }
+    m_readers.swap(current);
+    return status;
+}
+
+CardResult RecordingBackend::GetStatusChange(CardContext context, uint32_t timeoutMs,
+                                             CardReaderState* states, size_t count) {
+    CardResult status = m_backend->GetStatusChange(context, timeoutMs, states, count);
+    if (status != CARD_S_SUCCESS) {
+        return status;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < count; i++) {
+        const CardReaderState& state = states[i];
+        if (!(state.eventState & CARD_STATE_CHANGED) || strcmp(state.reader, CARD_PNP_NOTIFICATION) == 0) {
+            continue;
+        }
+        uint32_t flags = state.eventState & RECORDED_STATE;
+        auto it = m_states.find(state.reader);
+        if (it != m_states.end() && it->second.flags == flags && it->second.atr.size() == state.atrLength &&
+            memcmp(it->second.atr.data(), state.atr, state.atrLength) == 0) {
+            continue;
+        }
+        ReaderState& last = m_states[state.reader];
+        last.flags = flags;
+        last.atr.assign(state.atr, state.atr + state.atrLength);
+        m_trace->StateChanged(state.reader, state.eventState, state.atr, state.atrLength);
+    }
+    return status;
+}
+
+CardResult RecordingBackend::Connect(CardContext context, const char* reader, uint32_t shareMode,
+                                     uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) {
+    uint64_t start = LatencyNow();
+    CardResult status = m_backend->Connect(context, reader, shareMode, preferredProtocols, card, activeProtocol);
+    m_trace->Connected(reader, start, status, status == CARD_S_SUCCESS ? *activeProtocol : 0);
+    if (status == CARD_S_SUCCESS) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cards[*card] = reader;
+    }
+    return status;
+}
+
+CardResult RecordingBackend::Disconnect(CardHandle card, uint32_t disposition) {
+    uint64_t start = LatencyNow();
+    CardResult status = m_backend->Disconnect(card, disposition);
+    std::string reader;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_cards.find(card);
+        if (it == m_cards.end()) {
+            return status;
+        }
+        reader.swap(it->second);
+        m_cards.erase(it);
+    }
+    m_trace->Disconnected(reader.c_str(), start, status);
+    return status;
+}
+
+CardResult RecordingBackend::BeginTransaction(CardHandle card) {
+    return m_backend->BeginTransaction(card);
+}
+
+CardResult RecordingBackend::EndTransaction(CardHandle card, uint32_t disposition) {
+    return m_backend->EndTransaction(card, disposition);
+}
+
+CardResult RecordingBackend::Transmit(CardHandle card, uint32_t protocol,
+                                      const uint8_t* send, size_t sendLength,
+                                      uint8_t* recv, size_t* recvLength) {
+    uint64_t start = LatencyNow();
+    CardResult status = m_backend->Transmit(card, protocol, send, sendLength, recv, recvLength);
+    std::string reader;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_cards.find(card);
+        if (it == m_cards.end()) {
+            return status;
+        }
+        reader = it->second;
+    }
+    m_trace->Transmitted(reader.c_str(), start, status, send, sendLength,
+                         recv, status == CARD_S_SUCCESS ? *recvLength : 0);
+    return status;
+}
+
+std::unique_ptr<CardBackend> CreateRecordingBackend(std::unique_ptr<CardBackend> backend,
+                                                    const std::string& path, std::string& error) {
+    std::unique_ptr<TraceWriter> trace(new TraceWriter());
+    if (!trace->Open(path, error)) {
+        return std::unique_ptr<CardBackend>();
+    }
+    return std::unique_ptr<CardBackend>(new RecordingBackend(std::move(backend), std::move(trace)));
+}
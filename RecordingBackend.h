@@ -0,0 +1,60 @@
+#ifndef RECORDINGBACKEND_H
+#define RECORDINGBACKEND_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "CardBackend.h"
+#include "CardTrace.h"
+
+// Passes every call to another backend and records what it sees in a trace:
+// readers appearing and going away, card state changes with their ATRs,
+// connects, disconnects and APDU exchanges with their timings. Replay the
+// trace with ReplayBackend.
+//
+// Several monitor threads may report the same change; a reader's state is
+// only recorded when it differs from the last one recorded.
+class RecordingBackend : public CardBackend {
+public:
+    RecordingBackend(std::unique_ptr<CardBackend> backend, std::unique_ptr<TraceWriter> trace);
+
+    const char* Name() const override { return m_backend->Name(); }
+    CardResult EstablishContext(CardContext* context) override;
+    CardResult ReleaseContext(CardContext context) override;
+    CardResult Cancel(CardContext context) override;
+    CardResult ListReaders(CardContext context, std::vector<char>& readers) override;
+    size_t MaxReaderStates() const override;
+    CardResult GetStatusChange(CardContext context, uint32_t timeoutMs,
+                               CardReaderState* states, size_t count) override;
+    CardResult Connect(CardContext context, const char* reader, uint32_t shareMode,
+                       uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) override;
+    CardResult Disconnect(CardHandle card, uint32_t disposition) override;
+    CardResult BeginTransaction(CardHandle card) override;
+    CardResult EndTransaction(CardHandle card, uint32_t disposition) override;
+    CardResult Transmit(CardHandle card, uint32_t protocol,
+                        const uint8_t* send, size_t sendLength,
+                        uint8_t* recv, size_t* recvLength) override;
+
+private:
+    struct ReaderState {
+        uint32_t flags;
+        std::vector<uint8_t> atr;
+    };
+
+    std::unique_ptr<CardBackend> m_backend;
+    std::unique_ptr<TraceWriter> m_trace;
+    std::mutex m_mutex;
+    std::set<std::string> m_readers;                // Last reader list
+    std::map<std::string, ReaderState> m_states;    // Last recorded state per reader
+    std::map<CardHandle, std::string> m_cards;      // Connection -> reader
+};
+
+// Wrap backend so that its traffic is recorded to path. Returns NULL and
+// sets error if the trace cannot be created.
+std::unique_ptr<CardBackend> CreateRecordingBackend(std::unique_ptr<CardBackend> backend,
+                                                    const std::string& path, std::string& error);
+
+#endif // RECORDINGBACKEND_H
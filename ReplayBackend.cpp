@@ -0,0 +1,402 @@
+#include "ReplayBackend.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+ReplayBackend::ReplayBackend() {
+}
+
+ReplayBackend::~ReplayBackend() {
+    {
+        std::lock_guard<std::mutex> lock(m_replayMutex);
+        m_stopPlayer = true;
+    }
+    m_settled.notify_all();
+    if (m_player.joinable()) {
+        m_player.join();
+    }
+}
+
+// Split the trace into reader and card changes, and each card's exchanges
+bool ReplayBackend::Load(const std::string& path, const ReplayOptions& options, std::string& error) {
+    if (m_player.joinable()) {
+        error = "a trace is already playing";
+        return false;
+    }
+    if (!m_trace.Open(path, error)) {
+        return false;
+    }
+    m_options = options;
+
+    // A reader's first state is the one the engine learns without an event,
+    // so a card already in it is played as part of its attach
+    std::map<uint32_t, size_t> current;     // Reader number -> card in it
+    std::map<uint32_t, size_t> attached;    // Reader number -> attach with no state yet
+    TraceRecord record;
+    while (m_trace.Next(record)) {
+        Change change;
+        change.timeUs = record.timeUs;
+        change.reader = m_trace.ReaderName(record.reader);
+        change.insertion = NO_INSERTION;
+        auto card = current.find(record.reader);
+        switch (record.type) {
+            case TRACE_ATTACH:
+            case TRACE_DETACH:
+                change.type = record.type == TRACE_ATTACH ? CHANGE_ATTACH : CHANGE_DETACH;
+                current.erase(record.reader);
+                attached.erase(record.reader);
+                if (change.type == CHANGE_ATTACH) {
+                    attached[record.reader] = m_changes.size();
+                }
+                m_changes.push_back(change);
+                break;
+            case TRACE_STATE: {
+                current.erase(record.reader);
+                auto attach = attached.find(record.reader);
+                if (record.value & CARD_STATE_PRESENT) {
+                    Insertion insertion;
+                    insertion.card.atr.assign(record.first.data, record.first.data +
+                                              std::min(record.first.length, CARD_MAX_ATR_SIZE));
+                    current[record.reader] = m_insertions.size();
+                    if (attach != attached.end()) {
+                        m_changes[attach->second].insertion = m_insertions.size();
+                    } else {
+                        change.type = CHANGE_INSERT;
+                        change.insertion = m_insertions.size();
+                        m_changes.push_back(change);
+                    }
+                    m_insertions.push_back(insertion);
+                } else if (attach == attached.end()) {
+                    change.type = CHANGE_REMOVE;
+                    m_changes.push_back(change);
+                }
+                if (attach != attached.end()) {
+                    attached.erase(attach);
+                }
+                break;
+            }
+            case TRACE_CONNECT:
+                if (card != current.end() && record.result == CARD_S_SUCCESS &&
+                    m_insertions[card->second].connectUs == 0) {
+                    m_insertions[card->second].connectUs = record.durationUs;
+                }
+                break;
+            case TRACE_TRANSMIT:
+                if (card != current.end()) {
+                    Insertion& insertion = m_insertions[card->second];
+                    Exchange exchange;
+                    exchange.command = record.first;
+                    exchange.response = record.second;
+                    exchange.result = record.result;
+                    exchange.durationUs = record.durationUs;
+                    exchange.sent = false;
+                    insertion.exchanges.push_back(exchange);
+                    insertion.unsent++;
+
+                    // The fallback for repeated commands
+                    std::vector<uint8_t> command(record.first.data, record.first.data + record.first.length);
+                    if (record.result == CARD_S_SUCCESS && !insertion.card.responses.count(command)) {
+                        insertion.card.responses[command].assign(record.second.data,
+                                                                 record.second.data + record.second.length);
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    m_player = std::thread(&ReplayBackend::Play, this);
+    return true;
+}
+
+void ReplayBackend::Play() {
+    auto start = std::chrono::steady_clock::now();
+    auto settle = std::chrono::milliseconds(m_options.settleMs);
+    for (const Change& change : m_changes) {
+        {
+            std::unique_lock<std::mutex> lock(m_replayMutex);
+            Reader& reader = m_playback[change.reader];
+            if (m_options.speed > 0) {
+                auto due = start + std::chrono::microseconds((uint64_t)((double)change.timeUs / m_options.speed));
+                m_settled.wait_until(lock, due, [this] { return m_stopPlayer; });
+            } else if (!m_settled.wait_for(lock, settle, [&] { return m_stopPlayer || Settled(reader); })) {
+                m_stats.stalls++;
+            }
+            if (m_stopPlayer) {
+                return;
+            }
+
+            // Skip changes that change nothing, such as a card reported
+            // mute and then removed
+            bool present = reader.insertion != NO_INSERTION;
+            if ((change.type == CHANGE_ATTACH && reader.attached) ||
+                (change.type == CHANGE_DETACH && !reader.attached) ||
+                (change.type == CHANGE_INSERT && !reader.attached) ||
+                (change.type == CHANGE_REMOVE && !present)) {
+                continue;
+            }
+            if (!reader.seen) {
+                m_unseen--;
+            }
+            reader.last = change.type;
+            reader.seen = false;
+            reader.handled = true;
+            m_unseen++;
+            switch (change.type) {
+                case CHANGE_ATTACH:
+                    reader.attached = true;
+                    if (change.insertion != NO_INSERTION) {
+                        reader.insertion = change.insertion;
+                        reader.generation++;
+                    }
+                    break;
+                case CHANGE_DETACH:
+                    reader.attached = false;
+                    reader.insertion = NO_INSERTION;
+                    break;
+                case CHANGE_INSERT:
+                    reader.insertion = change.insertion;
+                    reader.generation++;
+                    reader.inserts++;
+                    reader.handled = m_insertions[change.insertion].exchanges.empty();
+                    break;
+                case CHANGE_REMOVE:
+                    reader.insertion = NO_INSERTION;
+                    break;
+            }
+            m_stats.changes++;
+        }
+
+        switch (change.type) {
+            case CHANGE_ATTACH:
+                AddReader(change.reader, change.insertion != NO_INSERTION ?
+                                         &m_insertions[change.insertion].card : NULL);
+                break;
+            case CHANGE_DETACH:
+                RemoveReader(change.reader);
+                break;
+            case CHANGE_INSERT:
+                InsertCard(change.reader, m_insertions[change.insertion].card);
+                break;
+            case CHANGE_REMOVE:
+                RemoveCard(change.reader);
+                break;
+        }
+    }
+
+    // As fast as possible, wait for the engine to handle the last changes
+    std::unique_lock<std::mutex> lock(m_replayMutex);
+    if (m_options.speed <= 0) {
+        auto deadline = std::chrono::steady_clock::now() + settle;
+        for (const auto& entry : m_playback) {
+            const Reader& reader = entry.second;
+            if (!m_settled.wait_until(lock, deadline, [&] { return m_stopPlayer || Settled(reader); })) {
+                m_stats.stalls++;
+            }
+        }
+    }
+    m_finished = true;
+}
+
+bool ReplayBackend::Finished() {
+    std::lock_guard<std::mutex> lock(m_replayMutex);
+    return m_finished;
+}
+
+void ReplayBackend::EventHandled(const std::string& reader) {
+    std::lock_guard<std::mutex> lock(m_replayMutex);
+    auto it = m_playback.find(reader);
+    if (it == m_playback.end()) {
+        return;
+    }
+    Reader& playback = it->second;
+    playback.insertEvents++;
+    if (playback.insertEvents >= playback.inserts && !playback.handled) {
+        playback.handled = true;
+        m_settled.notify_all();
+    }
+}
+
+ReplayStats ReplayBackend::Stats() {
+    std::lock_guard<std::mutex> lock(m_replayMutex);
+    ReplayStats stats = m_stats;
+    for (const auto& insertion : m_insertions) {
+        stats.unused += insertion.unsent;
+    }
+    return stats;
+}
+
+void ReplayBackend::Sleep(uint64_t durationUs) {
+    if (m_options.speed > 0 && durationUs > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)((double)durationUs / m_options.speed)));
+    }
+}
+
+// A listing without a reader shows the monitors have let it go
+CardResult ReplayBackend::ListReaders(CardContext context, std::vector<char>& readers) {
+    CardResult status = SimulatedBackend::ListReaders(context, readers);
+    if (status != CARD_S_SUCCESS && status != CARD_E_NO_READERS_AVAILABLE) {
+        return status;
+    }
+
+    std::lock_guard<std::mutex> lock(m_replayMutex);
+    bool settled = false;
+    for (auto& entry : m_playback) {
+        Reader& reader = entry.second;
+        if (reader.seen || reader.last != CHANGE_DETACH) {
+            continue;
+        }
+        bool listed = false;
+        for (const char* name = status == CARD_S_SUCCESS ? readers.data() : ""; *name; name += strlen(name) + 1) {
+            listed = listed || entry.first == name;
+        }
+        if (!listed) {
+            reader.seen = true;
+            m_unseen--;
+            settled = true;
+        }
+    }
+    if (settled) {
+        m_settled.notify_all();
+    }
+    return status;
+}
+
+// A reported state shows a monitor has seen a reader appear, or a card come
+// or go. A new reader only counts once its first state is reported, since
+// that state is learned without an event.
+CardResult ReplayBackend::GetStatusChange(CardContext context, uint32_t timeoutMs,
+                                          CardReaderState* states, size_t count) {
+    CardResult status = SimulatedBackend::GetStatusChange(context, timeoutMs, states, count);
+    if (status != CARD_S_SUCCESS) {
+        return status;
+    }
+
+    std::lock_guard<std::mutex> lock(m_replayMutex);
+    if (m_unseen == 0) {
+        return status;
+    }
+    bool settled = false;
+    for (size_t i = 0; i < count; i++) {
+        m_lookup.assign(states[i].reader);
+        auto it = m_playback.find(m_lookup);
+        if (it == m_playback.end()) {
+            continue;
+        }
+        Reader& reader = it->second;
+        bool present = (states[i].eventState & CARD_STATE_PRESENT) != 0;
+        if (!reader.seen && (reader.last == CHANGE_ATTACH || (reader.last == CHANGE_INSERT && present) ||
+                             (reader.last == CHANGE_REMOVE && !present))) {
+            reader.seen = true;
+            m_unseen--;
+            settled = true;
+        }
+    }
+    if (settled) {
+        m_settled.notify_all();
+    }
+    return status;
+}
+
+CardResult ReplayBackend::Connect(CardContext context, const char* reader, uint32_t shareMode,
+                                  uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) {
+    uint64_t connectUs = 0;
+    uint32_t generation = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_replayMutex);
+        m_lookup.assign(reader);
+        auto it = m_playback.find(m_lookup);
+        if (it != m_playback.end()) {
+            generation = it->second.generation;
+            if (it->second.insertion != NO_INSERTION) {
+                connectUs = m_insertions[it->second.insertion].connectUs;
+            }
+        }
+    }
+    Sleep(connectUs);
+
+    CardResult status = SimulatedBackend::Connect(context, reader, shareMode, preferredProtocols, card,
+                                                  activeProtocol);
+    if (status == CARD_S_SUCCESS) {
+        std::lock_guard<std::mutex> lock(m_replayMutex);
+        Connection& connection = m_handles[*card];
+        connection.reader = reader;
+        connection.generation = generation;
+    }
+    return status;
+}
+
+CardResult ReplayBackend::Disconnect(CardHandle card, uint32_t disposition) {
+    CardResult status = SimulatedBackend::Disconnect(card, disposition);
+    std::lock_guard<std::mutex> lock(m_replayMutex);
+    m_handles.erase(card);
+    return status;
+}
+
+// The end of an event's transaction means the engine is done with the card
+CardResult ReplayBackend::EndTransaction(CardHandle card, uint32_t disposition) {
+    CardResult status = SimulatedBackend::EndTransaction(card, disposition);
+    std::lock_guard<std::mutex> lock(m_replayMutex);
+    auto connection = m_handles.find(card);
+    if (connection != m_handles.end()) {
+        Reader& reader = m_playback[connection->second.reader];
+        if (reader.generation == connection->second.generation && !reader.handled) {
+            reader.handled = true;
+            m_settled.notify_all();
+        }
+    }
+    return status;
+}
+
+CardResult ReplayBackend::Transmit(CardHandle card, uint32_t protocol,
+                                   const uint8_t* send, size_t sendLength,
+                                   uint8_t* recv, size_t* recvLength) {
+    const Exchange* exchange = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_replayMutex);
+        auto connection = m_handles.find(card);
+        if (connection != m_handles.end()) {
+            Reader& reader = m_playback[connection->second.reader];
+            if (reader.generation == connection->second.generation && reader.insertion != NO_INSERTION) {
+                Insertion& insertion = m_insertions[reader.insertion];
+                for (auto& recorded : insertion.exchanges) {
+                    if (!recorded.sent && recorded.command.length == sendLength &&
+                        memcmp(recorded.command.data, send, sendLength) == 0) {
+                        recorded.sent = true;
+                        insertion.unsent--;
+                        exchange = &recorded;
+                        break;
+                    }
+                }
+                if (exchange) {
+                    m_stats.matched++;
+                    if (insertion.unsent == 0 && !reader.handled) {
+                        reader.handled = true;
+                        m_settled.notify_all();
+                    }
+                } else {
+                    m_stats.unmatched++;
+                }
+            }
+        }
+    }
+    if (!exchange) {
+        return SimulatedBackend::Transmit(card, protocol, send, sendLength, recv, recvLength);
+    }
+
+    Sleep(exchange->durationUs);
+    if (exchange->result != CARD_S_SUCCESS) {
+        return exchange->result;
+    }
+    if (exchange->response.length > *recvLength) {
+        return CARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(recv, exchange->response.data, exchange->response.length);
+    *recvLength = exchange->response.length;
+    return CARD_S_SUCCESS;
+}
+
+std::unique_ptr<CardBackend> CreateReplayBackend() {
+    return std::unique_ptr<CardBackend>(new ReplayBackend());
+}
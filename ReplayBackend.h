@@ -0,0 +1,142 @@
+#ifndef REPLAYBACKEND_H
+#define REPLAYBACKEND_H
+
+#include "CardTrace.h"
+#include "SimulatedBackend.h"
+
+struct ReplayOptions {
+    double speed = 1;           // 1 plays the trace in real time, 2 twice as fast; 0 as fast as possible
+    uint32_t settleMs = 1000;   // As fast as possible: longest wait for the engine to handle a change
+};
+
+struct ReplayStats {
+    uint64_t changes = 0;       // Reader and card changes played
+    uint64_t matched = 0;       // APDUs answered from the trace
+    uint64_t unmatched = 0;     // APDUs with no exchange left to answer them
+    uint64_t unused = 0;        // APDUs in the trace not sent so far
+    uint64_t stalls = 0;        // Changes the engine had not finished with after settleMs
+};
+
+// Plays a trace written by RecordingBackend: readers appear and go away and
+// cards come and go as recorded, and each card answers the APDUs it was sent
+// with the recorded responses, results and timings.
+//
+// An APDU takes the first exchange recorded for the card with the same
+// command that has not been replayed yet, so a configuration that skips or
+// reorders APDUs still gets the right answers. Any other APDU counts as
+// unmatched and gets the card's first recorded response to it, or 6D00.
+//
+// In real time, changes happen at their recorded times (scaled by speed)
+// and APDUs take their recorded time. As fast as possible, idle time is
+// skipped: a reader's next change waits only until a monitor has seen the
+// last one and, after an insertion, until the event's transaction has
+// ended or every recorded APDU has been sent. Use no debounce window, or
+// the engine may fold changes that follow each other that closely. A reader
+// that goes away with a card in it raises a remove event only if a monitor
+// sees it become unavailable before the reader list is rebuilt, as with a
+// real reader, so such removals may or may not be counted.
+class ReplayBackend : public SimulatedBackend {
+public:
+    ReplayBackend();
+    ~ReplayBackend();
+
+    // Load a trace and start playing it on a background thread. Returns
+    // false and sets error if the trace cannot be read.
+    bool Load(const std::string& path, const ReplayOptions& options, std::string& error);
+
+    // Every change has been played and, as fast as possible, handled
+    bool Finished();
+
+    // Tell the player the engine has run the actions of an insert event on
+    // reader. As fast as possible, this lets a card whose recorded APDUs are
+    // not all sent by the configuration being tested be removed without
+    // waiting for settleMs. Events are counted, so a late call for an
+    // earlier card does not count for the current one.
+    void EventHandled(const std::string& reader);
+    ReplayStats Stats();
+
+    // CardBackend
+    const char* Name() const override { return "replay"; }
+    CardResult ListReaders(CardContext context, std::vector<char>& readers) override;
+    CardResult GetStatusChange(CardContext context, uint32_t timeoutMs,
+                               CardReaderState* states, size_t count) override;
+    CardResult Connect(CardContext context, const char* reader, uint32_t shareMode,
+                       uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) override;
+    CardResult Disconnect(CardHandle card, uint32_t disposition) override;
+    CardResult EndTransaction(CardHandle card, uint32_t disposition) override;
+    CardResult Transmit(CardHandle card, uint32_t protocol,
+                        const uint8_t* send, size_t sendLength,
+                        uint8_t* recv, size_t* recvLength) override;
+
+private:
+    static const size_t NO_INSERTION = (size_t)-1;
+
+    enum ChangeType {
+        CHANGE_ATTACH,
+        CHANGE_DETACH,
+        CHANGE_INSERT,
+        CHANGE_REMOVE
+    };
+
+    struct Exchange {
+        TraceBytes command;     // Into the trace mapping
+        TraceBytes response;
+        CardResult result;
+        uint64_t durationUs;
+        bool sent;
+    };
+
+    // One card in the trace, from its insertion to its removal
+    struct Insertion {
+        SimulatedCard card;
+        std::vector<Exchange> exchanges;
+        size_t unsent = 0;
+        uint64_t connectUs = 0;
+    };
+
+    struct Change {
+        uint64_t timeUs;
+        ChangeType type;
+        std::string reader;
+        size_t insertion;       // CHANGE_INSERT, or CHANGE_ATTACH with a card already in the reader
+    };
+
+    // Playback state of a reader
+    struct Reader {
+        bool attached = false;
+        size_t insertion = NO_INSERTION;    // Card in the reader
+        uint32_t generation = 0;            // Bumped on insertion, so old connections miss
+        uint64_t inserts = 0;               // Insertions played
+        uint64_t insertEvents = 0;          // ... and reported handled by EventHandled
+        ChangeType last = CHANGE_DETACH;
+        bool seen = true;                   // A monitor has seen the last change
+        bool handled = true;                // ... and the engine is done with it
+    };
+
+    struct Connection {
+        std::string reader;
+        uint32_t generation;
+    };
+
+    void Play();
+    bool Settled(const Reader& reader) const { return reader.seen && reader.handled; }
+    void Sleep(uint64_t durationUs);
+
+    TraceFile m_trace;
+    ReplayOptions m_options;
+    std::vector<Insertion> m_insertions;
+    std::vector<Change> m_changes;
+
+    std::mutex m_replayMutex;
+    std::condition_variable m_settled;              // Readers settling and shutdown
+    std::map<std::string, Reader> m_playback;
+    std::map<CardHandle, Connection> m_handles;
+    size_t m_unseen = 0;                            // Readers whose last change no monitor has seen
+    std::string m_lookup;                           // Reused key for lookups by C string
+    ReplayStats m_stats;
+    bool m_finished = false;
+    bool m_stopPlayer = false;
+    std::thread m_player;
+};
+
+#endif // REPLAYBACKEND_H
@@ -0,0 +1,69 @@
+#include "ResponseCache.h"
+
+ResponseCache::ResponseCache(size_t capacity, uint32_t ttlSeconds)
+    : m_capacity(capacity > 0 ? capacity : 1),
+      m_ttl(std::chrono::seconds(ttlSeconds)),
+      m_hits(0), m_misses(0) {
+}
+
+std::string ResponseCache::MakeKey(const uint8_t* atr, size_t atrLength,
+                                   const uint8_t* identity, size_t identityLength) {
+    // Length-prefix the ATR so ATR and identity bytes cannot run together
+    std::string key;
+    key.reserve(1 + atrLength + identityLength);
+    key += (char)atrLength;
+    key.append((const char*)atr, atrLength);
+    if (identity) {
+        key.append((const char*)identity, identityLength);
+    }
+    return key;
+}
+
+void ResponseCache::TakeCounts(const ResponseCache& previous) {
+    m_hits += previous.m_hits.load();
+    m_misses += previous.m_misses.load();
+}
+
+bool ResponseCache::Lookup(const std::string& key, Responses& responses) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(key);
+    if (it != m_index.end() && it->second->expires <= Clock::now()) {
+        m_entries.erase(it->second);
+        m_index.erase(it);
+        it = m_index.end();
+    }
+    if (it == m_index.end()) {
+        m_misses++;
+        return false;
+    }
+
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    responses = it->second->responses;
+    m_hits++;
+    return true;
+}
+
+void ResponseCache::Store(const std::string& key, const Responses& responses) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_entries.erase(it->second);
+        m_index.erase(it);
+    }
+    while (m_entries.size() >= m_capacity) {
+        m_index.erase(m_entries.back().key);
+        m_entries.pop_back();
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.responses = responses;
+    entry.expires = Clock::now() + m_ttl;
+    m_entries.push_front(std::move(entry));
+    m_index[key] = m_entries.begin();
+}
+
+size_t ResponseCache::Size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
@@ -0,0 +1,63 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// APDU responses remembered per card, so a card that comes back does not
+// need the read-only part of the script replayed. The key is a card
+// identity that does not depend on the reader: the ATR, plus the response to
+// an identifying APDU such as GET DATA for the UID when one is configured.
+//
+// Entries expire after the TTL and the least recently used entry is evicted
+// when the cache is full. Safe to use from several worker threads.
+class ResponseCache {
+public:
+    typedef std::vector<std::vector<uint8_t>> Responses;
+
+    ResponseCache(size_t capacity, uint32_t ttlSeconds);
+
+    // Build the key for a card. identity may be NULL.
+    static std::string MakeKey(const uint8_t* atr, size_t atrLength,
+                               const uint8_t* identity, size_t identityLength);
+
+    // Copy the cached responses for key; an empty response means the APDU at
+    // that position was not cached. Counts a hit or a miss.
+    bool Lookup(const std::string& key, Responses& responses);
+
+    void Store(const std::string& key, const Responses& responses);
+
+    uint64_t Hits() const { return m_hits; }
+    uint64_t Misses() const { return m_misses; }
+
+    // Continue the hit and miss counts of previous, which this cache replaces
+    void TakeCounts(const ResponseCache& previous);
+    size_t Size();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        std::string key;
+        Responses responses;
+        Clock::time_point expires;
+    };
+    typedef std::list<Entry> EntryList;
+
+    size_t m_capacity;
+    Clock::duration m_ttl;
+    std::mutex m_mutex;
+    EntryList m_entries;        // Most recently used first
+    std::unordered_map<std::string, EntryList::iterator> m_index;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+};
+
+#endif // RESPONSECACHE_H
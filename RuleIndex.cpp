@@ -0,0 +1,185 @@
+#include "RuleIndex.h"
+#include <ctype.h>
+#include <algorithm>
+#include "HexCodec.h"
+
+namespace {
+
+const uint32_t NO_RULE = 0xFFFFFFFF;
+
+// Strip whitespace so patterns can be grouped for readability
+std::string Compact(const std::string& text) {
+    std::string compact;
+    for (char c : text) {
+        if (!isspace((unsigned char)c)) {
+            compact += c;
+        }
+    }
+    return compact;
+}
+
+} // namespace
+
+bool ParseAtrPattern(const std::string& pattern, const std::string& mask, AtrPattern& atr,
+                     std::string& error) {
+    std::string text = Compact(pattern);
+    atr.value.clear();
+    atr.mask.clear();
+    atr.prefix = text.empty();
+    if (!text.empty() && text.back() == '*') {
+        atr.prefix = true;
+        text.pop_back();
+    }
+
+    if (text.size() % 2 != 0) {
+        error = "ATR pattern has an odd number of digits";
+        return false;
+    }
+    for (size_t i = 0; i < text.size(); i += 2) {
+        uint8_t byte = 0;
+        if (text[i] == '.' && text[i + 1] == '.') {
+            atr.value.push_back(0);
+            atr.mask.push_back(0);
+        } else if (HexDecode(&text[i], 2, &byte)) {
+            atr.value.push_back(byte);
+            atr.mask.push_back(0xFF);
+        } else {
+            error = "invalid ATR byte \"" + text.substr(i, 2) + "\"";
+            return false;
+        }
+    }
+
+    std::string maskText = Compact(mask);
+    if (!maskText.empty()) {
+        std::vector<uint8_t> bytes(maskText.size() / 2);
+        size_t errorOffset;
+        if (!HexDecode(maskText.data(), maskText.size(), bytes.data(), &errorOffset)) {
+            error = "invalid ATR mask";
+            return false;
+        }
+        if (bytes.size() != atr.value.size()) {
+            error = "ATR mask and pattern differ in length";
+            return false;
+        }
+        for (size_t i = 0; i < bytes.size(); i++) {
+            atr.mask[i] &= bytes[i];
+            atr.value[i] &= atr.mask[i];
+        }
+    }
+    return true;
+}
+
+bool MatchReaderPattern(const char* pattern, const char* reader) {
+    // Iterative glob match, backtracking to the last "*"
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*reader) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = reader;
+        } else if (*pattern == '?' || (*pattern && tolower((unsigned char)*pattern) == tolower((unsigned char)*reader))) {
+            pattern++;
+            reader++;
+        } else if (star) {
+            pattern = star + 1;
+            reader = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+RuleIndex::RuleIndex() : m_nodes(1) {
+}
+
+// Find or create the child of node for a pattern byte
+uint32_t RuleIndex::Child(uint32_t node, uint8_t value, uint8_t mask) {
+    if (mask == 0xFF) {
+        auto& exact = m_nodes[node].exact;
+        auto it = std::lower_bound(exact.begin(), exact.end(), std::make_pair(value, (uint32_t)0));
+        if (it != exact.end() && it->first == value) {
+            return it->second;
+        }
+        uint32_t child = (uint32_t)m_nodes.size();
+        m_nodes[node].exact.insert(it, std::make_pair(value, child));
+        m_nodes.push_back(Node());
+        return child;
+    }
+
+    for (const auto& edge : m_nodes[node].masked) {
+        if (edge.value == value && edge.mask == mask) {
+            return edge.child;
+        }
+    }
+    MaskedEdge edge = { value, mask, (uint32_t)m_nodes.size() };
+    m_nodes[node].masked.push_back(edge);
+    m_nodes.push_back(Node());
+    return edge.child;
+}
+
+size_t RuleIndex::Add(const AtrPattern& atr, const std::string& readerPattern) {
+    uint32_t rule = (uint32_t)m_readerPatterns.size();
+    m_readerPatterns.push_back(readerPattern.empty() ? "*" : readerPattern);
+
+    uint32_t node = 0;
+    for (size_t i = 0; i < atr.value.size(); i++) {
+        node = Child(node, atr.value[i], atr.mask[i]);
+    }
+    // Rules are added in order, so every list stays sorted
+    (atr.prefix ? m_nodes[node].prefixRules : m_nodes[node].endRules).push_back(rule);
+    return rule;
+}
+
+// Lower best to the first rule in rules that beats it and matches the reader
+void RuleIndex::Consider(const std::vector<uint32_t>& rules, const char* reader, uint32_t& best) const {
+    for (uint32_t rule : rules) {
+        if (rule >= best) {
+            return;
+        }
+        if (MatchReaderPattern(m_readerPatterns[rule].c_str(), reader)) {
+            best = rule;
+            return;
+        }
+    }
+}
+
+int RuleIndex::Match(const char* reader, const uint8_t* atr, size_t atrLength) const {
+    uint32_t best = NO_RULE;
+
+    // Depth-first walk of every branch the ATR can take
+    struct Visit {
+        uint32_t node;
+        uint32_t depth;
+    };
+    // Kept per thread so matching does not allocate once it has seen the
+    // widest walk
+    static thread_local std::vector<Visit> stack;
+    stack.clear();
+    stack.push_back({ 0, 0 });
+    while (!stack.empty()) {
+        Visit visit = stack.back();
+        stack.pop_back();
+        const Node& node = m_nodes[visit.node];
+        Consider(node.prefixRules, reader, best);
+        if (visit.depth == atrLength) {
+            Consider(node.endRules, reader, best);
+            continue;
+        }
+
+        uint8_t byte = atr[visit.depth];
+        auto it = std::lower_bound(node.exact.begin(), node.exact.end(), std::make_pair(byte, (uint32_t)0));
+        if (it != node.exact.end() && it->first == byte) {
+            stack.push_back({ it->second, visit.depth + 1 });
+        }
+        for (const auto& edge : node.masked) {
+            if ((byte & edge.mask) == edge.value) {
+                stack.push_back({ edge.child, visit.depth + 1 });
+            }
+        }
+    }
+    return best == NO_RULE ? -1 : (int)best;
+}
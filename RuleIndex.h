@@ -0,0 +1,67 @@
+#ifndef RULEINDEX_H
+#define RULEINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// ATR pattern of a rule. Each byte matches when (atr & mask) == value; a
+// prefix pattern also matches longer ATRs.
+struct AtrPattern {
+    std::vector<uint8_t> value;
+    std::vector<uint8_t> mask;
+    bool prefix = true;
+};
+
+// Parse an ATR pattern such as "3B8F8001..4F0C*": hex bytes, ".." for any
+// byte and a trailing "*" for any remaining bytes. Without "*" the ATR must
+// have exactly the pattern's length; an empty pattern matches every ATR.
+// mask, if not empty, is ANDed into the byte masks and must be as long as
+// the pattern.
+bool ParseAtrPattern(const std::string& pattern, const std::string& mask, AtrPattern& atr,
+                     std::string& error);
+
+// Match a reader name against a pattern with "*" and "?" wildcards,
+// ignoring ASCII case
+bool MatchReaderPattern(const char* pattern, const char* reader);
+
+// Selects the rule for a card. Rules are numbered in the order they are
+// added and the lowest-numbered match wins. ATR patterns are stored in a
+// trie over the ATR bytes, so a lookup follows only the branches the ATR can
+// match instead of testing every rule; reader patterns are checked for the
+// candidates the trie yields.
+class RuleIndex {
+public:
+    RuleIndex();
+
+    // Add the next rule and return its number
+    size_t Add(const AtrPattern& atr, const std::string& readerPattern);
+
+    // Number of the matching rule, or -1 if none matches
+    int Match(const char* reader, const uint8_t* atr, size_t atrLength) const;
+
+    size_t Count() const { return m_readerPatterns.size(); }
+
+private:
+    struct MaskedEdge {
+        uint8_t value;
+        uint8_t mask;
+        uint32_t child;
+    };
+
+    struct Node {
+        std::vector<std::pair<uint8_t, uint32_t>> exact;   // Sorted by byte
+        std::vector<MaskedEdge> masked;                     // Bytes with a partial mask
+        std::vector<uint32_t> endRules;     // Patterns ending here, ATR must end too
+        std::vector<uint32_t> prefixRules;  // Patterns ending here with "*"
+    };
+
+    uint32_t Child(uint32_t node, uint8_t value, uint8_t mask);
+    void Consider(const std::vector<uint32_t>& rules, const char* reader, uint32_t& best) const;
+
+    std::vector<Node> m_nodes;      // m_nodes[0] is the root
+    std::vector<std::string> m_readerPatterns;
+};
+
+#endif // RULEINDEX_H
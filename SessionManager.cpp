@@ -0,0 +1,171 @@
+#include "SessionManager.h"
+
+namespace {
+
+// Results that mean the connection no longer reaches the card it was made to
+bool Lost(CardResult result) {
+    return result == CARD_W_REMOVED_CARD || result == CARD_W_RESET_CARD || result == CARD_E_INVALID_HANDLE ||
+           result == CARD_E_NO_SMARTCARD;
+}
+
+// Results that mean the context itself is gone, e.g. after a service restart
+bool ContextLost(CardResult result) {
+    return result == CARD_E_INVALID_HANDLE || result == CARD_E_NO_SERVICE || result == CARD_E_SERVICE_STOPPED;
+}
+
+} // namespace
+
+CardResult CardSession::Transmit(const uint8_t* command, size_t length, ByteSpan& response) {
+    if (!m_connected) {
+        response.data = NULL;
+        response.length = 0;
+        return CARD_W_REMOVED_CARD;
+    }
+    CardResult result = m_transport.Transmit(m_backend, m_card, m_protocol, command, length, response);
+    if (Lost(result)) {
+        m_backend.Disconnect(m_card, CARD_LEAVE_CARD);
+        m_connected = false;
+    }
+    return result;
+}
+
+SessionManager::SessionManager(CardBackend& backend)
+    : m_backend(backend), m_connects(0), m_reuses(0) {
+}
+
+SessionManager::~SessionManager() {
+    ReleaseAll();
+}
+
+CardSession* SessionManager::Begin(const std::string& reader, CardResult& status) {
+    CardSession* session;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::unique_ptr<CardSession>& entry = m_sessions[reader];
+        if (!entry) {
+            entry.reset(new CardSession(m_backend));
+        }
+        session = entry.get();
+    }
+
+    // A connection that was reset or lost its card since the last event is
+    // replaced once
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!session->m_context) {
+            status = m_backend.EstablishContext(&session->m_context);
+            if (status != CARD_S_SUCCESS) {
+                session->m_context = 0;
+                return NULL;
+            }
+        }
+        bool reused = session->m_connected;
+        if (!session->m_connected) {
+            status = m_backend.Connect(session->m_context, reader.c_str(), CARD_SHARE_SHARED,
+                                       CARD_PROTOCOL_T0 | CARD_PROTOCOL_T1,
+                                       &session->m_card, &session->m_protocol);
+            if (status != CARD_S_SUCCESS) {
+                if (ContextLost(status)) {
+                    Close(*session, true);
+                    continue;
+                }
+                return NULL;
+            }
+            session->m_connected = true;
+            m_connects++;
+        }
+
+        status = m_backend.BeginTransaction(session->m_card);
+        if (status == CARD_S_SUCCESS) {
+            if (reused) {
+                m_reuses++;
+            }
+            return session;
+        }
+        if (!Lost(status)) {
+            return NULL;
+        }
+        Close(*session, false);
+    }
+    return NULL;
+}
+
+void SessionManager::End(CardSession* session) {
+    if (session->m_connected &&
+        Lost(m_backend.EndTransaction(session->m_card, CARD_LEAVE_CARD))) {
+        Close(*session, false);
+    }
+}
+
+void SessionManager::Disconnect(const std::string& reader) {
+    CardSession* session = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_sessions.find(reader);
+        if (it != m_sessions.end()) {
+            session = it->second.get();
+        }
+    }
+    if (session) {
+        Close(*session, false);
+    }
+}
+
+void SessionManager::Release(const std::string& reader) {
+    std::unique_ptr<CardSession> session;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_sessions.find(reader);
+        if (it == m_sessions.end()) {
+            return;
+        }
+        session = std::move(it->second);
+        m_sessions.erase(it);
+    }
+    Close(*session, true);
+}
+
+void SessionManager::ReleaseAll() {
+    std::map<std::string, std::unique_ptr<CardSession>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        sessions.swap(m_sessions);
+    }
+    for (auto& entry : sessions) {
+        Close(*entry.second, true);
+    }
+}
+
+void SessionManager::Close(CardSession& session, bool releaseContext) {
+    if (session.m_connected) {
+        m_backend.Disconnect(session.m_card, CARD_LEAVE_CARD);
+        session.m_connected = false;
+    }
+    if (releaseContext && session.m_context) {
+        m_backend.ReleaseContext(session.m_context);
+        session.m_context = 0;
+    }
+}
+
+CardTransaction::~CardTransaction() {
+    if (m_session) {
+        m_sessions.End(m_session);
+    }
+}
+
+CardResult CardTransaction::Transmit(const uint8_t* command, size_t length, ByteSpan& response) {
+    if (!m_begun) {
+        m_begun = true;
+        uint64_t start = LatencyNow();
+        m_session = m_sessions.Begin(m_reader, m_status);
+        m_latency.Record(STAGE_CONNECT, start);
+    }
+    if (!m_session) {
+        response.data = NULL;
+        response.length = 0;
+        return m_status;
+    }
+    uint64_t start = LatencyNow();
+    CardResult result = m_session->Transmit(command, length, response);
+    m_latency.Record(STAGE_TRANSMIT, start);
+    return result;
+}
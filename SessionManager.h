@@ -0,0 +1,100 @@
+#ifndef SESSIONMANAGER_H
+#define SESSIONMANAGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ApduTransport.h"
+#include "CardBackend.h"
+#include "LatencyMetrics.h"
+
+// A reader's connection to the card in it
+class CardSession {
+public:
+    explicit CardSession(CardBackend& backend) : m_backend(backend) {}
+
+    // Exchange an APDU within the current transaction. A card that was
+    // removed or reset drops the connection; the next Begin reconnects.
+    // response stays valid until the next Transmit.
+    CardResult Transmit(const uint8_t* command, size_t length, ByteSpan& response);
+
+private:
+    friend class SessionManager;
+
+    CardBackend& m_backend;
+    CardContext m_context = 0;      // The reader's own, kept until the reader is detached
+    CardHandle m_card = 0;
+    uint32_t m_protocol = 0;        // Negotiated once per card
+    bool m_connected = false;
+    ApduTransport m_transport;
+};
+
+// Keeps one shared-mode connection per present card, so the events of a
+// card and their actions reuse it instead of connecting and negotiating a
+// protocol each time. Each event's exchanges are grouped in a transaction.
+//
+// The engine only uses a reader's session from that reader's worker strand,
+// so a session is never used by two threads at once; the manager only
+// guards its map.
+class SessionManager {
+public:
+    explicit SessionManager(CardBackend& backend);
+    ~SessionManager();
+
+    // Connect if needed and begin a transaction. Returns NULL with status
+    // set if the card cannot be reached.
+    CardSession* Begin(const std::string& reader, CardResult& status);
+    void End(CardSession* session);
+
+    // Card removed: drop the connection, keep the reader's context
+    void Disconnect(const std::string& reader);
+
+    // Reader detached: drop the connection and the context
+    void Release(const std::string& reader);
+    void ReleaseAll();
+
+    uint64_t Connects() const { return m_connects; }
+    uint64_t Reuses() const { return m_reuses; }     // Transactions that needed no connect
+
+private:
+    void Close(CardSession& session, bool releaseContext);
+
+    CardBackend& m_backend;
+    std::mutex m_mutex;
+    std::map<std::string, std::unique_ptr<CardSession>> m_sessions;
+    std::atomic<uint64_t> m_connects;
+    std::atomic<uint64_t> m_reuses;
+};
+
+// One event's use of its reader's session. The transaction is begun on the
+// first Transmit, so events that send nothing never touch the card, and is
+// ended when this goes out of scope. latency records connecting and each
+// exchange.
+class CardTransaction {
+public:
+    CardTransaction(SessionManager& sessions, const std::string& reader, LatencyMetrics& latency)
+        : m_sessions(sessions), m_reader(reader), m_latency(latency) {}
+    ~CardTransaction();
+
+    // Exchange an APDU with the card. response stays valid until the next
+    // Transmit.
+    CardResult Transmit(const uint8_t* command, size_t length, ByteSpan& response);
+
+    // CARD_S_SUCCESS unless the card could not be reached
+    CardResult Status() const { return m_status; }
+
+private:
+    SessionManager& m_sessions;
+    const std::string& m_reader;
+    LatencyMetrics& m_latency;
+    CardSession* m_session = NULL;
+    CardResult m_status = CARD_S_SUCCESS;
+    bool m_begun = false;
+};
+
+#endif // SESSIONMANAGER_H
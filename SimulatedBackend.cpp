@@ -0,0 +1,595 @@
+#include "SimulatedBackend.h"
+#include "HexCodec.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+void SimulateLatency(uint32_t us) {
+    if (us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+}
+
+bool ParseHex(const std::string& hex, std::vector<uint8_t>& bytes) {
+    bytes.resize(hex.size() / 2);
+    return HexDecode(hex.data(), hex.size(), bytes.data());
+}
+
+// Split a script line into words, honouring double quotes
+std::vector<std::string> SplitWords(const std::string& line) {
+    std::vector<std::string> words;
+    size_t i = 0;
+    while (i < line.size()) {
+        while (i < line.size() && isspace((unsigned char)line[i])) i++;
+        if (i >= line.size() || line[i] == '#') break;
+        std::string word;
+        if (line[i] == '"') {
+            size_t end = line.find('"', i + 1);
+            if (end == std::string::npos) end = line.size();
+            word = line.substr(i + 1, end - i - 1);
+            i = end + 1;
+        } else {
+            size_t end = i;
+            while (end < line.size() && !isspace((unsigned char)line[end])) end++;
+            word = line.substr(i, end - i);
+            i = end;
+        }
+        words.push_back(word);
+    }
+    return words;
+}
+
+} // namespace
+
+SimulatedBackend::SimulatedBackend() : m_maxReaderStates(10) {
+}
+
+SimulatedBackend::~SimulatedBackend() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    Changed();
+    if (m_scriptThread.joinable()) {
+        m_scriptThread.join();
+    }
+}
+
+void SimulatedBackend::SetLatency(const SimulatedLatency& latency) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_latency = latency;
+}
+
+void SimulatedBackend::SetMaxReaderStates(size_t count) {
+    m_maxReaderStates = count;
+}
+
+size_t SimulatedBackend::MaxReaderStates() const {
+    return m_maxReaderStates;
+}
+
+bool SimulatedBackend::AddReader(const std::string& reader, const SimulatedCard* card) {
+    if (card && card->atr.size() > CARD_MAX_ATR_SIZE) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (FindReader(reader)) {
+            return false;
+        }
+        Reader info;
+        info.name = reader;
+        if (card) {
+            info.card = *card;
+            info.present = true;
+        }
+        m_readerIndex[reader] = m_readers.size();
+        m_readers.push_back(info);
+        m_readerEvents++;
+    }
+    Changed();
+    return true;
+}
+
+void SimulatedBackend::RemoveReader(const std::string& reader) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_readerIndex.find(reader);
+        if (it != m_readerIndex.end()) {
+            m_readers.erase(m_readers.begin() + it->second);
+            m_readerIndex.clear();
+            for (size_t i = 0; i < m_readers.size(); i++) {
+                m_readerIndex[m_readers[i].name] = i;
+            }
+            m_readerEvents++;
+        }
+    }
+    Changed();
+}
+
+bool SimulatedBackend::InsertCard(const std::string& reader, const SimulatedCard& card) {
+    if (card.atr.size() > CARD_MAX_ATR_SIZE) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Reader* info = FindReader(reader);
+        if (!info) {
+            return false;
+        }
+        info->card = card;
+        info->present = true;
+        info->insertion++;
+        info->transaction = 0;
+        info->events++;
+    }
+    ReaderChanged(reader);
+    return true;
+}
+
+bool SimulatedBackend::RemoveCard(const std::string& reader) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Reader* info = FindReader(reader);
+        if (!info || !info->present) {
+            return false;
+        }
+        info->present = false;
+        info->exclusive = 0;
+        info->shared = 0;
+        info->transaction = 0;
+        info->events++;
+    }
+    ReaderChanged(reader);
+    return true;
+}
+
+bool SimulatedBackend::LoadScript(const std::string& path, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    std::vector<std::string> readers;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        std::vector<std::string> words = SplitWords(line);
+        if (words.empty()) {
+            continue;
+        }
+
+        std::ostringstream where;
+        where << path << ":" << lineNumber << ": ";
+        const std::string& verb = words[0];
+
+        if (verb == "latency") {
+            SimulatedLatency latency = m_latency;
+            for (size_t i = 1; i < words.size(); i++) {
+                size_t eq = words[i].find('=');
+                std::string key = words[i].substr(0, eq);
+                uint32_t value = eq == std::string::npos ? 0 : (uint32_t)strtoul(words[i].c_str() + eq + 1, NULL, 10);
+                if (key == "context") latency.contextUs = value;
+                else if (key == "connect") latency.connectUs = value;
+                else if (key == "transmit") latency.transmitUs = value;
+                else if (key == "disconnect") latency.disconnectUs = value;
+                else {
+                    error = where.str() + "unknown latency '" + key + "'";
+                    return false;
+                }
+            }
+            SetLatency(latency);
+        } else if (verb == "card" && words.size() == 3) {
+            SimulatedCard& card = m_cards[words[1]];
+            if (!ParseHex(words[2], card.atr) || card.atr.size() > CARD_MAX_ATR_SIZE) {
+                error = where.str() + "invalid ATR";
+                return false;
+            }
+        } else if (verb == "response" && words.size() == 4) {
+            auto card = m_cards.find(words[1]);
+            std::vector<uint8_t> command, response;
+            if (card == m_cards.end()) {
+                error = where.str() + "unknown card '" + words[1] + "'";
+                return false;
+            }
+            if (!ParseHex(words[2], command) || !ParseHex(words[3], response) || response.size() < 2) {
+                error = where.str() + "invalid APDU";
+                return false;
+            }
+            card->second.responses[command] = response;
+        } else if (verb == "reader" && words.size() == 2) {
+            readers.push_back(words[1]);
+        } else if (verb == "at" && words.size() >= 4) {
+            Step step;
+            step.atMs = (uint32_t)strtoul(words[1].c_str(), NULL, 10);
+            step.insert = words[2] == "insert";
+            if (step.insert && words.size() == 5 && m_cards.count(words[3])) {
+                step.cardId = words[3];
+                step.reader = words[4];
+            } else if (!step.insert && words[2] == "remove" && words.size() == 4) {
+                step.reader = words[3];
+            } else {
+                error = where.str() + "invalid step";
+                return false;
+            }
+            m_steps.push_back(step);
+        } else {
+            error = where.str() + "unrecognized line";
+            return false;
+        }
+    }
+
+    for (const auto& reader : readers) {
+        AddReader(reader);
+    }
+    if (!m_steps.empty() && !m_scriptThread.joinable()) {
+        m_scriptThread = std::thread(&SimulatedBackend::PlayScript, this);
+    }
+    return true;
+}
+
+void SimulatedBackend::PlayScript() {
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& step : m_steps) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto due = start + std::chrono::milliseconds(step.atMs);
+            m_changed.wait_until(lock, due, [this] { return m_stopping; });
+            if (m_stopping) {
+                return;
+            }
+        }
+        if (step.insert) {
+            InsertCard(step.reader, m_cards[step.cardId]);
+        } else {
+            RemoveCard(step.reader);
+        }
+    }
+}
+
+SimulatedBackend::Reader* SimulatedBackend::FindReader(const std::string& name) {
+    auto it = m_readerIndex.find(name);
+    return it != m_readerIndex.end() ? &m_readers[it->second] : NULL;
+}
+
+// Compute the event state for one entry; the caller holds m_mutex
+uint32_t SimulatedBackend::CurrentState(const char* reader, CardReaderState& state) {
+    if (strcmp(reader, CARD_PNP_NOTIFICATION) == 0) {
+        state.atrLength = 0;
+        return (m_readerEvents & 0xFFFF) << 16;
+    }
+
+    // Every wait looks up each of its readers, so avoid a string per lookup
+    m_lookup.assign(reader);
+    Reader* info = FindReader(m_lookup);
+    if (!info) {
+        state.atrLength = 0;
+        return CARD_STATE_UNKNOWN | CARD_STATE_UNAVAILABLE;
+    }
+
+    uint32_t flags = (info->events & 0xFFFF) << 16;
+    if (info->present) {
+        flags |= CARD_STATE_PRESENT;
+        if (info->exclusive > 0) flags |= CARD_STATE_EXCLUSIVE;
+        if (info->exclusive > 0 || info->shared > 0) flags |= CARD_STATE_INUSE;
+        state.atrLength = (uint32_t)info->card.atr.size();
+        memcpy(state.atr, info->card.atr.data(), info->card.atr.size());
+    } else {
+        flags |= CARD_STATE_EMPTY;
+        state.atrLength = 0;
+    }
+    return flags;
+}
+
+// Wake every waiter, for changes that affect all of them
+void SimulatedBackend::Changed() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (Waiter* waiter : m_waiters) {
+        waiter->changed.notify_all();
+    }
+    m_changed.notify_all();
+}
+
+// Wake only the waiters watching reader, like a resource manager does, so
+// a farm of readers does not wake every monitor thread for each event
+void SimulatedBackend::ReaderChanged(const std::string& reader) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (Waiter* waiter : m_waiters) {
+        for (size_t i = 0; i < waiter->count; i++) {
+            if (reader == waiter->states[i].reader) {
+                waiter->changed.notify_all();
+                break;
+            }
+        }
+    }
+}
+
+CardResult SimulatedBackend::EstablishContext(CardContext* context) {
+    uint32_t latency;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        latency = m_latency.contextUs;
+    }
+    SimulateLatency(latency);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    *context = m_nextHandle++;
+    m_contexts[*context] = 0;
+    return CARD_S_SUCCESS;
+}
+
+CardResult SimulatedBackend::ReleaseContext(CardContext context) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_contexts.erase(context) ? CARD_S_SUCCESS : CARD_E_INVALID_HANDLE;
+}
+
+CardResult SimulatedBackend::Cancel(CardContext context) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_contexts.find(context);
+        if (it == m_contexts.end()) {
+            return CARD_E_INVALID_HANDLE;
+        }
+        it->second++;
+    }
+    Changed();
+    return CARD_S_SUCCESS;
+}
+
+CardResult SimulatedBackend::ListReaders(CardContext context, std::vector<char>& readers) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_contexts.count(context)) {
+        return CARD_E_INVALID_HANDLE;
+    }
+    if (m_readers.empty()) {
+        return CARD_E_NO_READERS_AVAILABLE;
+    }
+    readers.clear();
+    for (const auto& reader : m_readers) {
+        readers.insert(readers.end(), reader.name.begin(), reader.name.end());
+        readers.push_back('\0');
+    }
+    readers.push_back('\0');
+    return CARD_S_SUCCESS;
+}
+
+CardResult SimulatedBackend::GetStatusChange(CardContext context, uint32_t timeoutMs,
+                                             CardReaderState* states, size_t count) {
+    if (count > m_maxReaderStates) {
+        return CARD_E_INVALID_PARAMETER;
+    }
+
+    // Register the call so that changes to its readers wake it
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Waiter waiter;
+    waiter.states = states;
+    waiter.count = count;
+    m_waiters.push_back(&waiter);
+    CardResult status = WaitForChange(lock, context, timeoutMs, states, count, waiter);
+    m_waiters.erase(std::find(m_waiters.begin(), m_waiters.end(), &waiter));
+    return status;
+}
+
+// The body of GetStatusChange; the caller holds lock
+CardResult SimulatedBackend::WaitForChange(std::unique_lock<std::mutex>& lock, CardContext context,
+                                           uint32_t timeoutMs, CardReaderState* states, size_t count,
+                                           Waiter& waiter) {
+    auto ctx = m_contexts.find(context);
+    if (ctx == m_contexts.end()) {
+        return CARD_E_INVALID_HANDLE;
+    }
+    uint32_t cancelGeneration = ctx->second;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    for (;;) {
+        bool changed = false;
+        for (size_t i = 0; i < count; i++) {
+            CardReaderState& state = states[i];
+            if (state.currentState & CARD_STATE_IGNORE) {
+                state.eventState = CARD_STATE_IGNORE;
+                continue;
+            }
+            uint32_t current = CurrentState(state.reader, state);
+            if (current != (state.currentState & ~CARD_STATE_CHANGED)) {
+                current |= CARD_STATE_CHANGED;
+                changed = true;
+            }
+            state.eventState = current;
+        }
+        if (changed) {
+            return CARD_S_SUCCESS;
+        }
+
+        if (m_stopping) {
+            return CARD_E_SERVICE_STOPPED;
+        }
+        if (timeoutMs == CARD_INFINITE) {
+            waiter.changed.wait(lock);
+        } else if (waiter.changed.wait_until(lock, deadline) == std::cv_status::timeout) {
+            return CARD_E_TIMEOUT;
+        }
+
+        ctx = m_contexts.find(context);
+        if (ctx == m_contexts.end()) {
+            return CARD_E_INVALID_HANDLE;
+        }
+        if (ctx->second != cancelGeneration) {
+            return CARD_E_CANCELLED;
+        }
+    }
+}
+
+CardResult SimulatedBackend::Connect(CardContext context, const char* reader, uint32_t shareMode,
+                                     uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) {
+    uint32_t latency;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        latency = m_latency.connectUs;
+    }
+    SimulateLatency(latency);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_contexts.count(context)) {
+            return CARD_E_INVALID_HANDLE;
+        }
+        Reader* info = FindReader(reader);
+        if (!info) {
+            return CARD_E_UNKNOWN_READER;
+        }
+        if (!info->present) {
+            return CARD_E_NO_SMARTCARD;
+        }
+        if (info->exclusive > 0 || (shareMode == CARD_SHARE_EXCLUSIVE && info->shared > 0)) {
+            return CARD_E_SHARING_VIOLATION;
+        }
+        if (shareMode == CARD_SHARE_EXCLUSIVE) {
+            info->exclusive++;
+        } else {
+            info->shared++;
+        }
+
+        Connection connection;
+        connection.reader = info->name;
+        connection.insertion = info->insertion;
+        connection.resets = info->resets;
+        connection.shareMode = shareMode;
+        *card = m_nextHandle++;
+        m_connections[*card] = connection;
+        *activeProtocol = (preferredProtocols & CARD_PROTOCOL_T1) ? CARD_PROTOCOL_T1 : CARD_PROTOCOL_T0;
+    }
+    ReaderChanged(reader);
+    return CARD_S_SUCCESS;
+}
+
+CardResult SimulatedBackend::Disconnect(CardHandle card, uint32_t) {
+    uint32_t latency;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        latency = m_latency.disconnectUs;
+    }
+    SimulateLatency(latency);
+
+    std::string reader;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_connections.find(card);
+        if (it == m_connections.end()) {
+            return CARD_E_INVALID_HANDLE;
+        }
+        reader = it->second.reader;
+        Reader* info = FindReader(it->second.reader);
+        if (info && info->present && info->insertion == it->second.insertion) {
+            if (info->transaction == card) {
+                info->transaction = 0;
+            }
+            if (it->second.shareMode == CARD_SHARE_EXCLUSIVE) {
+                info->exclusive--;
+            } else {
+                info->shared--;
+            }
+        }
+        m_connections.erase(it);
+    }
+    ReaderChanged(reader);
+    return CARD_S_SUCCESS;
+}
+
+// Transactions do not wait: a card locked by another connection fails with
+// a sharing violation instead of blocking
+CardResult SimulatedBackend::BeginTransaction(CardHandle card) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_connections.find(card);
+    if (it == m_connections.end()) {
+        return CARD_E_INVALID_HANDLE;
+    }
+    Reader* info = FindReader(it->second.reader);
+    if (!info || !info->present || info->insertion != it->second.insertion) {
+        return CARD_W_REMOVED_CARD;
+    }
+    if (info->resets != it->second.resets) {
+        return CARD_W_RESET_CARD;
+    }
+    if (info->transaction != 0 && info->transaction != card) {
+        return CARD_E_SHARING_VIOLATION;
+    }
+    info->transaction = card;
+    return CARD_S_SUCCESS;
+}
+
+// Ending a transaction with a reset resets the card for every other
+// connection: they get CARD_W_RESET_CARD until they reconnect, as with
+// PC/SC. The connection that reset it carries on.
+CardResult SimulatedBackend::EndTransaction(CardHandle card, uint32_t disposition) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_connections.find(card);
+    if (it == m_connections.end()) {
+        return CARD_E_INVALID_HANDLE;
+    }
+    Reader* info = FindReader(it->second.reader);
+    if (!info || !info->present || info->insertion != it->second.insertion) {
+        return CARD_W_REMOVED_CARD;
+    }
+    if (info->resets != it->second.resets) {
+        return CARD_W_RESET_CARD;
+    }
+    if (info->transaction != card) {
+        return CARD_E_NOT_TRANSACTED;
+    }
+    info->transaction = 0;
+    if (disposition == CARD_RESET_CARD || disposition == CARD_UNPOWER_CARD) {
+        info->resets++;
+        it->second.resets = info->resets;
+    }
+    return CARD_S_SUCCESS;
+}
+
+CardResult SimulatedBackend::Transmit(CardHandle card, uint32_t,
+                                      const uint8_t* send, size_t sendLength,
+                                      uint8_t* recv, size_t* recvLength) {
+    uint32_t latency;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        latency = m_latency.transmitUs;
+    }
+    SimulateLatency(latency);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_connections.find(card);
+    if (it == m_connections.end()) {
+        return CARD_E_INVALID_HANDLE;
+    }
+    Reader* info = FindReader(it->second.reader);
+    if (!info || !info->present || info->insertion != it->second.insertion) {
+        return CARD_W_REMOVED_CARD;
+    }
+    if (info->resets != it->second.resets) {
+        return CARD_W_RESET_CARD;
+    }
+
+    const std::vector<uint8_t>* response = &info->card.defaultResponse;
+    for (const auto& entry : info->card.responses) {
+        if (entry.first.size() == sendLength && memcmp(entry.first.data(), send, sendLength) == 0) {
+            response = &entry.second;
+            break;
+        }
+    }
+    if (response->size() > *recvLength) {
+        return CARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(recv, response->data(), response->size());
+    *recvLength = response->size();
+    return CARD_S_SUCCESS;
+}
+
+std::unique_ptr<CardBackend> CreateSimulatedBackend() {
+    return std::unique_ptr<CardBackend>(new SimulatedBackend());
+}
@@ -0,0 +1,142 @@
+#ifndef SIMULATEDBACKEND_H
+#define SIMULATEDBACKEND_H
+
+#include "CardBackend.h"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// A virtual card and the responses it gives. Commands are matched exactly;
+// anything else gets defaultResponse.
+struct SimulatedCard {
+    std::vector<uint8_t> atr;       // At most CARD_MAX_ATR_SIZE bytes
+    std::map<std::vector<uint8_t>, std::vector<uint8_t>> responses;
+    std::vector<uint8_t> defaultResponse;
+
+    SimulatedCard() : defaultResponse{0x6D, 0x00} {}
+};
+
+// Simulated latencies in microseconds
+struct SimulatedLatency {
+    uint32_t contextUs = 0;         // Establishing a context
+    uint32_t connectUs = 0;
+    uint32_t transmitUs = 0;
+    uint32_t disconnectUs = 0;
+};
+
+// In-process PC/SC stand-in. Readers and cards are scripted through the
+// public methods (or a script file) and every context sees the changes
+// exactly as it would see them from a real resource manager.
+class SimulatedBackend : public CardBackend {
+public:
+    SimulatedBackend();
+    ~SimulatedBackend();
+
+    // Scripting
+    void SetLatency(const SimulatedLatency& latency);
+    // Limit the states per GetStatusChange call, like WinSCard's
+    // MAXIMUM_SMARTCARD_READERS
+    void SetMaxReaderStates(size_t count);
+    // A reader added with a card is first seen with the card in it. Adding
+    // a reader that exists, or a card whose ATR is longer than
+    // CARD_MAX_ATR_SIZE, changes nothing and returns false.
+    bool AddReader(const std::string& reader, const SimulatedCard* card = NULL);
+    void RemoveReader(const std::string& reader);
+    bool InsertCard(const std::string& reader, const SimulatedCard& card);
+    bool RemoveCard(const std::string& reader);
+
+    // Load a script file and play its timed steps on a background thread.
+    // Returns false and sets error on a syntax error.
+    //
+    //   latency context=<us> connect=<us> transmit=<us> disconnect=<us>
+    //   card <id> <atr hex>
+    //   response <id> <command hex> <response hex>
+    //   reader <name>
+    //   at <ms> insert <id> <reader>
+    //   at <ms> remove <reader>
+    //
+    // Reader names may be quoted to include spaces.
+    bool LoadScript(const std::string& path, std::string& error);
+
+    // CardBackend
+    const char* Name() const override { return "simulated"; }
+    CardResult EstablishContext(CardContext* context) override;
+    CardResult ReleaseContext(CardContext context) override;
+    CardResult Cancel(CardContext context) override;
+    CardResult ListReaders(CardContext context, std::vector<char>& readers) override;
+    size_t MaxReaderStates() const override;
+    CardResult GetStatusChange(CardContext context, uint32_t timeoutMs,
+                               CardReaderState* states, size_t count) override;
+    CardResult Connect(CardContext context, const char* reader, uint32_t shareMode,
+                       uint32_t preferredProtocols, CardHandle* card, uint32_t* activeProtocol) override;
+    CardResult Disconnect(CardHandle card, uint32_t disposition) override;
+    CardResult BeginTransaction(CardHandle card) override;
+    CardResult EndTransaction(CardHandle card, uint32_t disposition) override;
+    CardResult Transmit(CardHandle card, uint32_t protocol,
+                        const uint8_t* send, size_t sendLength,
+                        uint8_t* recv, size_t* recvLength) override;
+
+private:
+    struct Reader {
+        std::string name;
+        bool present = false;
+        SimulatedCard card;
+        uint32_t insertion = 0;   // Bumped on every insert, invalidates old handles
+        uint32_t events = 0;      // Event counter reported in the high word
+        int exclusive = 0;        // Exclusive connections
+        int shared = 0;           // Shared connections
+        CardHandle transaction = 0;   // Connection holding the transaction, if any
+        uint32_t resets = 0;      // Bumped when a connection resets the card
+    };
+
+    struct Connection {
+        std::string reader;
+        uint32_t insertion;
+        uint32_t resets;          // The card's resets when this connection last used it
+        uint32_t shareMode;
+    };
+
+    struct Step {
+        uint32_t atMs;
+        bool insert;
+        std::string reader;
+        std::string cardId;
+    };
+
+    // A GetStatusChange call in progress
+    struct Waiter {
+        const CardReaderState* states;
+        size_t count;
+        std::condition_variable changed;
+    };
+
+    Reader* FindReader(const std::string& name);
+    uint32_t CurrentState(const char* reader, CardReaderState& state);
+    CardResult WaitForChange(std::unique_lock<std::mutex>& lock, CardContext context, uint32_t timeoutMs,
+                             CardReaderState* states, size_t count, Waiter& waiter);
+    void Changed();
+    void ReaderChanged(const std::string& reader);
+    void PlayScript();
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;              // Script steps and shutdown
+    std::vector<Waiter*> m_waiters;
+    std::vector<Reader> m_readers;
+    std::unordered_map<std::string, size_t> m_readerIndex;  // Name -> position in m_readers
+    std::string m_lookup;                            // Reused key for lookups by C string
+    std::map<CardContext, uint32_t> m_contexts;     // Context -> cancel generation
+    std::map<CardHandle, Connection> m_connections;
+    std::map<std::string, SimulatedCard> m_cards;   // Script card definitions
+    std::vector<Step> m_steps;
+    SimulatedLatency m_latency;
+    uint32_t m_readerEvents = 0;                     // PnP event counter
+    std::atomic<size_t> m_maxReaderStates;
+    uintptr_t m_nextHandle = 1;
+    bool m_stopping = false;
+    std::thread m_scriptThread;
+};
+
+#endif // SIMULATEDBACKEND_H
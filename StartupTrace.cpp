@@ -0,0 +1,76 @@
+#include "StartupTrace.h"
+#include "LatencyMetrics.h"
+#include <stdio.h>
+
+namespace {
+
+const char* const PHASE_NAMES[STARTUP_PHASE_COUNT] = {
+    "configured", "monitoring", "ready", "first_event"
+};
+
+} // namespace
+
+const char* StartupPhaseName(StartupPhase phase) {
+    return phase < STARTUP_PHASE_COUNT ? PHASE_NAMES[phase] : "unknown";
+}
+
+StartupTrace::StartupTrace() : m_begin(LatencyNow()) {
+    for (auto& reached : m_reached) {
+        reached.store(0, std::memory_order_relaxed);
+    }
+}
+
+void StartupTrace::Begin() {
+    for (auto& reached : m_reached) {
+        reached.store(0, std::memory_order_relaxed);
+    }
+    m_begin.store(LatencyNow(), std::memory_order_release);
+}
+
+void StartupTrace::Mark(StartupPhase phase) {
+    if (m_reached[phase].load(std::memory_order_relaxed) != 0) {
+        return;
+    }
+    uint64_t expected = 0;
+    m_reached[phase].compare_exchange_strong(expected, LatencyNow(), std::memory_order_acq_rel);
+}
+
+bool StartupTrace::Elapsed(StartupPhase phase, uint64_t& nanoseconds) const {
+    uint64_t reached = m_reached[phase].load(std::memory_order_acquire);
+    if (reached == 0) {
+        return false;
+    }
+    uint64_t begin = m_begin.load(std::memory_order_acquire);
+    nanoseconds = reached > begin ? reached - begin : 0;
+    return true;
+}
+
+std::string StartupTrace::Describe() const {
+    std::string out;
+    for (unsigned phase = 0; phase < STARTUP_PHASE_COUNT; phase++) {
+        uint64_t nanoseconds;
+        if (!Elapsed((StartupPhase)phase, nanoseconds)) {
+            continue;
+        }
+        char text[64];
+        snprintf(text, sizeof(text), "%s%s %.1f ms", out.empty() ? "" : ", ", PHASE_NAMES[phase],
+                 (double)nanoseconds / 1e6);
+        out += text;
+    }
+    return out;
+}
+
+void StartupTrace::WritePrometheus(std::string& out) const {
+    out += "# HELP cardaction_startup_seconds Time from the start of startup to each phase reached.\n";
+    out += "# TYPE cardaction_startup_seconds gauge\n";
+    for (unsigned phase = 0; phase < STARTUP_PHASE_COUNT; phase++) {
+        uint64_t nanoseconds;
+        if (!Elapsed((StartupPhase)phase, nanoseconds)) {
+            continue;
+        }
+        char text[96];
+        snprintf(text, sizeof(text), "cardaction_startup_seconds{phase=\"%s\"} %.9g\n", PHASE_NAMES[phase],
+                 (double)nanoseconds / 1e9);
+        out += text;
+    }
+}
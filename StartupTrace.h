@@ -0,0 +1,47 @@
+#ifndef STARTUPTRACE_H
+#define STARTUPTRACE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Milestones of startup, in the order they are normally reached
+enum StartupPhase {
+    STARTUP_CONFIGURED,   // Configuration loaded, with its plugins
+    STARTUP_MONITORING,   // Backend, event stream and journal started; the monitor starts listing readers
+    STARTUP_READY,        // Every reader attached at startup is watched
+    STARTUP_FIRST_EVENT,  // The first card event reached its actions
+    STARTUP_PHASE_COUNT
+};
+
+// Name of a phase in exported metrics and logs
+const char* StartupPhaseName(StartupPhase phase);
+
+// When each startup phase was reached, relative to the start of startup.
+// Marking costs an atomic load once a phase is reached, so it can stay on
+// the event path.
+class StartupTrace {
+public:
+    StartupTrace();
+
+    // Start timing from now and forget the phases reached
+    void Begin();
+
+    // Record that phase was reached now. Only the first mark counts.
+    void Mark(StartupPhase phase);
+
+    // Nanoseconds from Begin to phase; returns false if it was not reached
+    bool Elapsed(StartupPhase phase, uint64_t& nanoseconds) const;
+
+    // The phases reached so far, e.g. "configured 3 ms, monitoring 5 ms, ready 41 ms"
+    std::string Describe() const;
+
+    // Append the phases reached in the Prometheus text exposition format
+    void WritePrometheus(std::string& out) const;
+
+private:
+    std::atomic<uint64_t> m_begin;
+    std::atomic<uint64_t> m_reached[STARTUP_PHASE_COUNT];  // LatencyNow() timestamps, 0 until reached
+};
+
+#endif // STARTUPTRACE_H
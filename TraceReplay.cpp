@@ -0,0 +1,229 @@
+// Replays a trace recorded with [Backend] Record through the card event
+// engine, or prints it. A replay reports the events handled, the engine's
+// stage latencies and how well the APDUs sent matched the recorded ones, so
+// a production trace can serve as a latency and correctness regression test.
+//
+// Usage: TraceReplay <trace> [--dump] [--speed X] [--apdus LIST]
+//                    [--workers W] [--debounce MS] [--json]
+//
+// --speed 0, the default, replays as fast as the engine goes; 1 replays in
+// real time. --apdus is the APDU script sent on each insertion, as in
+// [OnInsert] APDUs. --dump prints the records instead of replaying them.
+// The exit status is 1 if an APDU had no recorded exchange to answer it.
+#include "CardEngine.h"
+#include "HexCodec.h"
+#include "ReplayBackend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+namespace {
+
+struct Options {
+    std::string trace;
+    bool dump = false;
+    double speed = 0;
+    std::string apdus;
+    unsigned workers = 4;
+    uint32_t debounceMs = 0;
+    bool json = false;
+};
+
+// Counts the events that reached their actions and lets the replay move on
+class CountAction : public Action {
+public:
+    CountAction(ReplayBackend& backend, std::atomic<uint64_t>& events) : m_backend(backend), m_events(events) {}
+
+    const char* Name() const override { return "count"; }
+
+    void Run(const CardActionEvent& event, EventArena&) override {
+        m_events.fetch_add(1, std::memory_order_relaxed);
+        if (event.type == CARDACTION_EVENT_INSERTED) {
+            m_backend.EventHandled(event.reader);
+        }
+    }
+
+private:
+    ReplayBackend& m_backend;
+    std::atomic<uint64_t>& m_events;
+};
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg == "--dump") {
+            options.dump = true;
+        } else if (arg == "--json") {
+            options.json = true;
+        } else if (arg.compare(0, 2, "--") != 0 && options.trace.empty()) {
+            options.trace = arg;
+        } else if (!value) {
+            return false;
+        } else if (arg == "--speed") {
+            options.speed = atof(argv[++i]);
+        } else if (arg == "--apdus") {
+            options.apdus = argv[++i];
+        } else if (arg == "--workers") {
+            options.workers = (unsigned)atoi(argv[++i]);
+        } else if (arg == "--debounce") {
+            options.debounceMs = (uint32_t)atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return !options.trace.empty() && options.speed >= 0 && options.workers > 0;
+}
+
+std::string Hex(const TraceBytes& bytes) {
+    std::string hex(bytes.length * 2, '\0');
+    HexEncode(bytes.data, bytes.length, &hex[0], HEX_UPPER);
+    return hex;
+}
+
+int Dump(const std::string& path) {
+    TraceFile trace;
+    std::string error;
+    if (!trace.Open(path, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    TraceRecord record;
+    while (trace.Next(record)) {
+        const char* reader = trace.ReaderName(record.reader).c_str();
+        double time = (double)record.timeUs / 1e6;
+        switch (record.type) {
+            case TRACE_ATTACH:
+                printf("%12.6f  attach      \"%s\"\n", time, reader);
+                break;
+            case TRACE_DETACH:
+                printf("%12.6f  detach      \"%s\"\n", time, reader);
+                break;
+            case TRACE_STATE:
+                printf("%12.6f  state       \"%s\" %08X %s\n", time, reader, record.value, Hex(record.first).c_str());
+                break;
+            case TRACE_CONNECT:
+                printf("%12.6f  connect     \"%s\" %08X T=%d %llu us\n", time, reader, (uint32_t)record.result,
+                       record.value == CARD_PROTOCOL_T1 ? 1 : 0, (unsigned long long)record.durationUs);
+                break;
+            case TRACE_DISCONNECT:
+                printf("%12.6f  disconnect  \"%s\" %08X %llu us\n", time, reader, (uint32_t)record.result,
+                       (unsigned long long)record.durationUs);
+                break;
+            case TRACE_TRANSMIT:
+                printf("%12.6f  transmit    \"%s\" %08X %llu us %s -> %s\n", time, reader, (uint32_t)record.result,
+                       (unsigned long long)record.durationUs, Hex(record.first).c_str(),
+                       Hex(record.second).c_str());
+                break;
+            default:
+                break;
+        }
+    }
+    if (trace.Truncated()) {
+        printf("trace cut short\n");
+    }
+    return 0;
+}
+
+double Microseconds(uint64_t nanoseconds) {
+    return (double)nanoseconds / 1e3;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        fprintf(stderr, "usage: TraceReplay <trace> [--dump] [--speed X] [--apdus LIST]\n"
+                        "                   [--workers W] [--debounce MS] [--json]\n");
+        return 2;
+    }
+    if (options.dump) {
+        return Dump(options.trace);
+    }
+
+    ReplayBackend backend;
+    std::atomic<uint64_t> events(0);
+    std::shared_ptr<EventRule> rule = std::make_shared<EventRule>();
+    rule->name = "Replay";
+    std::string error;
+    if (!options.apdus.empty() && !rule->insertAPDUs.Compile(options.apdus, error)) {
+        fprintf(stderr, "--apdus: %s\n", error.c_str());
+        return 2;
+    }
+    rule->cacheableAPDUs.assign(rule->insertAPDUs.Count(), false);
+    rule->insertActions.push_back(std::make_shared<CountAction>(backend, events));
+    rule->removeActions = rule->insertActions;
+    std::shared_ptr<RuleSet> rules = std::make_shared<RuleSet>();
+    rules->defaultRule = rule;
+
+    LatencyMetrics stages;
+    EngineOptions engineOptions;
+    engineOptions.workerThreads = options.workers;
+    engineOptions.debounceMs = options.debounceMs;
+    CardEngine::Sinks sinks;
+    sinks.readers = [](const ReaderList&, const ReaderList&) {};
+    sinks.state = [](ReaderId, bool) {};
+    CardEngine engine(backend, engineOptions, rules, NULL, stages, sinks);
+    if (engine.Start() != CARD_S_SUCCESS) {
+        fprintf(stderr, "cannot start the engine\n");
+        return 1;
+    }
+
+    ReplayOptions replayOptions;
+    replayOptions.speed = options.speed;
+    auto start = std::chrono::steady_clock::now();
+    if (!backend.Load(options.trace, replayOptions, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    while (!backend.Finished()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    engine.Stop();
+    ReplayStats stats = backend.Stats();
+    const LatencyHistogram& total = stages.Stage(STAGE_TOTAL);
+
+    if (options.json) {
+        printf("{\"speed\":%.2f,\"seconds\":%.3f,\"changes\":%llu,\"events\":%llu,"
+               "\"apdus_matched\":%llu,\"apdus_unmatched\":%llu,\"apdus_unused\":%llu,\"stalls\":%llu,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"stages\":{",
+               options.speed, elapsed, (unsigned long long)stats.changes, (unsigned long long)events.load(),
+               (unsigned long long)stats.matched, (unsigned long long)stats.unmatched,
+               (unsigned long long)stats.unused, (unsigned long long)stats.stalls,
+               Microseconds(total.Percentile(0.5)), Microseconds(total.Percentile(0.99)));
+        for (unsigned i = 0; i < STAGE_COUNT; i++) {
+            const LatencyHistogram& stage = stages.Stage((LatencyStage)i);
+            printf("%s\"%s\":{\"count\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f}", i ? "," : "",
+                   LatencyStageName((LatencyStage)i), (unsigned long long)stage.Count(),
+                   Microseconds(stage.Percentile(0.5)), Microseconds(stage.Percentile(0.99)));
+        }
+        printf("}}\n");
+        return stats.unmatched ? 1 : 0;
+    }
+
+    printf("%llu changes replayed in %.3f s, %llu events\n", (unsigned long long)stats.changes, elapsed,
+           (unsigned long long)events.load());
+    printf("apdus         %llu matched, %llu unmatched, %llu recorded but not sent\n",
+           (unsigned long long)stats.matched, (unsigned long long)stats.unmatched,
+           (unsigned long long)stats.unused);
+    if (stats.stalls) {
+        printf("stalls        %llu changes not handled within %u ms\n", (unsigned long long)stats.stalls,
+               replayOptions.settleMs);
+    }
+    printf("latency       p50 %.1f us, p99 %.1f us\n", Microseconds(total.Percentile(0.5)),
+           Microseconds(total.Percentile(0.99)));
+    printf("\n%-14s %10s %10s %10s\n", "stage", "count", "p50 us", "p99 us");
+    for (unsigned i = 0; i < STAGE_COUNT; i++) {
+        const LatencyHistogram& stage = stages.Stage((LatencyStage)i);
+        printf("%-14s %10llu %10.1f %10.1f\n", LatencyStageName((LatencyStage)i),
+               (unsigned long long)stage.Count(), Microseconds(stage.Percentile(0.5)),
+               Microseconds(stage.Percentile(0.99)));
+    }
+    return stats.unmatched ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        m_threads.push_back(std::thread(&WorkerPool::Run, this));
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    Stop();
+}
+
+void WorkerPool::Submit(const std::string& key, Task task) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stopping) {
+            return;
+        }
+        Strand& strand = m_strands[key];
+        strand.tasks.push_back(std::move(task));
+        if (strand.active) {
+            // A worker already owns this key and will get to it in order
+            return;
+        }
+        strand.active = true;
+        m_ready.push_back(&strand);
+    }
+    m_wake.notify_one();
+}
+
+void WorkerPool::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_ready.clear();
+        m_strands.clear();
+    }
+    m_wake.notify_all();
+    for (auto& thread : m_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    m_threads.clear();
+}
+
+void WorkerPool::Run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this] { return m_stopping || !m_ready.empty(); });
+        if (m_stopping) {
+            return;
+        }
+
+        Strand* strand = m_ready.front();
+        m_ready.pop_front();
+        Task task = std::move(strand->tasks.front());
+        strand->tasks.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+
+        if (m_stopping) {
+            return;
+        }
+
+        // Requeue the strand behind the others so one busy reader cannot
+        // starve the rest, or idle it once it has drained
+        if (strand->tasks.empty()) {
+            strand->active = false;
+        } else {
+            m_ready.push_back(strand);
+            m_wake.notify_one();
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fixed-size thread pool with per-key ordering. Tasks submitted under the
+// same key (a reader) run one at a time in submission order; tasks under
+// different keys run in parallel on whichever worker is free. A key's strand
+// is kept once it has drained, so a steady stream of tasks for known keys
+// only allocates for the tasks themselves.
+class WorkerPool {
+public:
+    typedef std::function<void()> Task;
+
+    explicit WorkerPool(size_t threads);
+    ~WorkerPool();
+
+    void Submit(const std::string& key, Task task);
+
+    // Wait for running tasks to finish and discard queued ones
+    void Stop();
+
+private:
+    struct Strand {
+        std::deque<Task> tasks;
+        bool active = false;    // Listed in m_ready or being run by a worker
+    };
+
+    void Run();
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::map<std::string, Strand> m_strands;
+    std::deque<Strand*> m_ready;        // Strands with work and no worker
+    std::vector<std::thread> m_threads;
+    bool m_stopping = false;
+};
+
+#endif // WORKERPOOL_H
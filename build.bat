@@ -50,9 +50,24 @@ if /i "%ARCH%"=="x86" (
 REM Compile resource file
 rc /nologo /fo "build\%ARCH%\%CONFIG%\CardAction.res" CardAction.rc
 
+REM Source files
+set CORE_SOURCES=Action.cpp CardBackend.cpp CardEngine.cpp CardMonitor.cpp CardService.cpp CardTrace.cpp PcscBackend.cpp ReaderRegistry.cpp RecordingBackend.cpp ReplayBackend.cpp SimulatedBackend.cpp StartupTrace.cpp WorkerPool.cpp ApduScript.cpp ApduTransport.cpp AuditJournal.cpp CommandExecutor.cpp CommandTemplate.cpp Debouncer.cpp EventArena.cpp EventServer.cpp HexCodec.cpp IniFile.cpp LatencyMetrics.cpp MetricsServer.cpp ResponseCache.cpp RuleIndex.cpp SessionManager.cpp
+set SOURCES=CardAction.cpp %CORE_SOURCES%
+
 REM Compile and link
-cl %COMMON_FLAGS% %CONFIG_FLAGS% %ARCH_FLAGS% CardAction.cpp /Fo"build\%ARCH%\%CONFIG%\CardAction.obj" /Fe"build\%ARCH%\%CONFIG%\CardAction.exe" /link %LINK_FLAGS% winscard.lib comctl32.lib shell32.lib user32.lib ole32.lib /SUBSYSTEM:WINDOWS "build\%ARCH%\%CONFIG%\CardAction.res"
+cl %COMMON_FLAGS% %CONFIG_FLAGS% %ARCH_FLAGS% %SOURCES% /Fobuild\%ARCH%\%CONFIG%\ /Fe"build\%ARCH%\%CONFIG%\CardAction.exe" /link %LINK_FLAGS% winscard.lib ws2_32.lib comctl32.lib shell32.lib user32.lib ole32.lib /SUBSYSTEM:WINDOWS "build\%ARCH%\%CONFIG%\CardAction.res"
+
+if %ERRORLEVEL% NEQ 0 goto build_failed
+
+REM Example action plugin
+cl %COMMON_FLAGS% %CONFIG_FLAGS% %ARCH_FLAGS% /LD CardLogPlugin.cpp /Fobuild\%ARCH%\%CONFIG%\ /Fe"build\%ARCH%\%CONFIG%\CardLogPlugin.dll" /link %LINK_FLAGS%
+
+if %ERRORLEVEL% NEQ 0 goto build_failed
+
+REM Headless daemon and Windows service
+cl %COMMON_FLAGS% %CONFIG_FLAGS% %ARCH_FLAGS% CardActionDaemon.cpp %CORE_SOURCES% /Fobuild\%ARCH%\%CONFIG%\ /Fe"build\%ARCH%\%CONFIG%\CardActionDaemon.exe" /link %LINK_FLAGS% winscard.lib ws2_32.lib advapi32.lib /SUBSYSTEM:CONSOLE
 
+:build_failed
 REM Check if build succeeded
 if %ERRORLEVEL% == 0 (
     echo Build successful.